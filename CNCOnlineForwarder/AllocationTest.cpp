@@ -0,0 +1,221 @@
+#include "precompiled.h"
+#include "AllocationTest.h"
+#include <thread>
+#include "AllocationTracker.h"
+#include "GameConnection.h"
+#include "IOManager.hpp"
+#include "Logging.h"
+#include "RelayRateLimiter.h"
+#include "SessionBudget.h"
+
+#ifdef __linux__
+#include <poll.h>
+#endif
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct AllocationTest
+        {
+            static constexpr auto description = "AllocationTest";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<AllocationTest>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        // Round trips before counting, so buffers sizes, caches and pools settle
+        constexpr auto warmUpRoundTrips = 2000;
+        // Frames of each call site's stack trace shown
+        constexpr auto shownFrames = std::size_t{ 16 };
+
+        // Allocations made by every thread except the calling one
+        std::uint64_t getOtherThreadAllocations()
+        {
+            return AllocationTracker::getTotalCounts().allocations - AllocationTracker::getThreadCounts().allocations;
+        }
+
+        UDP::socket openLoopbackSocket(boost::asio::io_context& context)
+        {
+            return UDP::socket{ context, UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 0 } };
+        }
+
+#ifdef __linux__
+        bool waitReadable(UDP::socket& socket, const std::chrono::milliseconds timeout)
+        {
+            auto descriptor = ::pollfd{ socket.native_handle(), POLLIN, 0 };
+            return ::poll(&descriptor, 1, static_cast<int>(timeout.count())) > 0;
+        }
+#else
+        bool waitReadable(UDP::socket&, const std::chrono::milliseconds)
+        {
+            return true;
+        }
+#endif
+
+        // Client and remote player of a GameConnection restored from their sockets
+        class Relay
+        {
+        public:
+            Relay(const std::shared_ptr<IOManager>& ioManager) :
+                budget{ NatNeg::SessionBudget::create(SessionBudgetOptions{ 0, 0 }) },
+                client{ openLoopbackSocket(this->context) },
+                remotePlayer{ openLoopbackSocket(this->context) }
+            {
+                auto publicSocketForClient = openLoopbackSocket(this->context);
+                auto fakeRemotePlayerSocket = openLoopbackSocket(this->context);
+                this->publicAddress = publicSocketForClient.local_endpoint();
+                this->fakeRemotePlayerAddress = fakeRemotePlayerSocket.local_endpoint();
+
+                auto state = NatNeg::GameConnection::State{};
+                state.id = NatNeg::NatNegPlayerID{ 0x12345678, 0 };
+                state.server = UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 9 };
+                state.clientPublicAddress = this->client.local_endpoint();
+                state.clientRealAddress = this->client.local_endpoint();
+                state.remotePlayer = this->remotePlayer.local_endpoint();
+                state.remainingLife = std::chrono::minutes{ 10 };
+                state.receivingFromClient = true;
+                state.publicSocketForClient = publicSocketForClient.release();
+                state.fakeRemotePlayerSocket = fakeRemotePlayerSocket.release();
+                this->connection = NatNeg::GameConnection::restore
+                (
+                    IOManager::ObjectMaker{ ioManager },
+                    {},
+                    {},
+                    this->budget->admit(),
+                    state
+                );
+            }
+
+            // Returns: false if a datagram was lost
+            bool roundTrip(const std::string& payload)
+            {
+                auto code = ErrorCode{};
+                auto from = UDP::endpoint{};
+                this->client.send_to(boost::asio::buffer(payload), this->fakeRemotePlayerAddress, 0, code);
+                if (code.failed() || !waitReadable(this->remotePlayer, std::chrono::milliseconds{ 100 }))
+                {
+                    return false;
+                }
+                this->remotePlayer.receive_from(boost::asio::buffer(this->buffer), from, 0, code);
+                this->remotePlayer.send_to(boost::asio::buffer(payload), this->publicAddress, 0, code);
+                if (code.failed() || !waitReadable(this->client, std::chrono::milliseconds{ 100 }))
+                {
+                    return false;
+                }
+                this->client.receive_from(boost::asio::buffer(this->buffer), from, 0, code);
+                return !code.failed();
+            }
+
+        private:
+            boost::asio::io_context context;
+            std::shared_ptr<NatNeg::SessionBudget> budget;
+            UDP::socket client;
+            UDP::socket remotePlayer;
+            UDP::endpoint publicAddress;
+            UDP::endpoint fakeRemotePlayerAddress;
+            std::shared_ptr<NatNeg::GameConnection> connection;
+            std::array<char, 2048> buffer;
+        };
+
+        void report(const std::string& line)
+        {
+            logLine(LogLevel::info, line);
+            std::cout << line << std::endl;
+        }
+
+        void reportCallSites()
+        {
+            for (const auto& callSite : AllocationTracker::getCallSites())
+            {
+                auto summary = std::ostringstream{};
+                summary << callSite.allocations << " allocations, " << callSite.bytes << " bytes"
+                    << (callSite.site != nullptr ? " in " : "") << (callSite.site != nullptr ? callSite.site : "");
+                report(summary.str());
+                for (auto i = std::size_t{ 0 }; i < std::min(callSite.stack.size(), shownFrames); ++i)
+                {
+                    report("    " + callSite.stack[i]);
+                }
+            }
+        }
+    }
+
+    bool runAllocationTest(const BenchmarkOptions& options, const RelayThreadOptions& relayThreads)
+    {
+        if (!AllocationTracker::isEnabled())
+        {
+            throw std::runtime_error{ "The allocation test requires a build with CNC_TRACK_ALLOCATIONS" };
+        }
+
+        const auto ioManager = IOManager::create(relayThreads.threads);
+        auto relay = Relay{ ioManager };
+        auto threads = std::vector<std::thread>{};
+        for (auto i = std::size_t{ 0 }; i < ioManager->getWorkerCount(); ++i)
+        {
+            threads.emplace_back([ioManager, i] { ioManager->runWorker(i); });
+        }
+        for (auto i = std::size_t{ 0 }; i < ioManager->getRelayThreadCount(); ++i)
+        {
+            threads.emplace_back([ioManager, i] { ioManager->runRelay(i, false, std::nullopt); });
+        }
+
+        const auto payload = std::string(std::max<std::size_t>(options.packetSize, 1), 'x');
+        auto lost = std::uint64_t{ 0 };
+        for (auto i = 0; i < warmUpRoundTrips; ++i)
+        {
+            lost += relay.roundTrip(payload) ? 0 : 1;
+        }
+
+        AllocationTracker::reset();
+        AllocationTracker::recordStacks(true);
+        const auto allocationsBefore = getOtherThreadAllocations();
+        auto roundTrips = std::uint64_t{ 0 };
+        const auto start = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - start < options.duration)
+        {
+            lost += relay.roundTrip(payload) ? 0 : 1;
+            ++roundTrips;
+        }
+        const auto relayAllocations = getOtherThreadAllocations() - allocationsBefore;
+        AllocationTracker::recordStacks(false);
+
+        ioManager->stop();
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        // Checked by every relayed packet of a real session
+        const auto rateLimiter = NatNeg::RelayRateLimiter::create(RelayLimitOptions{ 0, 0, 0, 0, {} });
+        auto limits = rateLimiter->makeSessionLimits();
+        const auto source = UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 1 };
+        const auto rateLimiterBefore = AllocationTracker::getThreadCounts().allocations;
+        for (auto i = std::uint64_t{ 0 }; i < roundTrips; ++i)
+        {
+            rateLimiter->allow(limits, source, payload.size());
+        }
+        const auto rateLimiterAllocations = AllocationTracker::getThreadCounts().allocations - rateLimiterBefore;
+
+        const auto packets = roundTrips * 2;
+        auto summary = std::ostringstream{};
+        summary << "Relayed " << packets << " packets (" << lost << " lost) with " << relayAllocations
+            << " allocations, " << (packets > 0 ? relayAllocations / static_cast<double>(packets) : 0.0)
+            << " per packet; RelayRateLimiter made " << rateLimiterAllocations << " allocations";
+        report(summary.str());
+
+        const auto passed = (relayAllocations == 0) && (rateLimiterAllocations == 0);
+        if (!passed)
+        {
+            reportCallSites();
+        }
+        report(passed ? "PASSED: no allocation at steady state" : "FAILED: relaying allocates");
+        return passed;
+    }
+}
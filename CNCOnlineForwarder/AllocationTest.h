@@ -0,0 +1,12 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Relays datagrams back and forth through an established GameConnection
+    // over loopback, and checks that relaying at steady state doesn't allocate.
+    // Every call site which still allocates is reported with its stack trace.
+    // Requires an instrumentation build with CNC_TRACK_ALLOCATIONS, throws std::runtime_error otherwise.
+    // Blocking. Returns: whether no allocation was made.
+    bool runAllocationTest(const BenchmarkOptions& options, const RelayThreadOptions& relayThreads);
+}
@@ -0,0 +1,351 @@
+#include "precompiled.h"
+#include "AllocationTracker.h"
+#include <cstdlib>
+#include <new>
+
+#ifdef __linux__
+#include <cxxabi.h>
+#include <execinfo.h>
+#endif
+
+namespace CNCOnlineForwarder::AllocationTracker
+{
+    namespace
+    {
+        // Threads beyond it share the last slot
+        constexpr auto maxThreads = std::size_t{ 256 };
+        // Call sites beyond it are not attributed
+        constexpr auto maxCallSites = std::size_t{ 512 };
+        constexpr auto maxFrames = 24;
+        // Frames of the tracker itself and of operator new
+        constexpr auto skippedFrames = 3;
+
+        struct ThreadSlot
+        {
+            std::atomic<std::uint64_t> allocations{ 0 };
+            std::atomic<std::uint64_t> deallocations{ 0 };
+            std::atomic<std::uint64_t> bytes{ 0 };
+        };
+
+        struct CallSiteSlot
+        {
+            // 0 means the slot is free
+            std::atomic<std::uint64_t> key{ 0 };
+            std::atomic<bool> ready{ false };
+            const char* site = nullptr;
+            std::array<void*, maxFrames> frames{};
+            int frameCount = 0;
+            std::atomic<std::uint64_t> allocations{ 0 };
+            std::atomic<std::uint64_t> bytes{ 0 };
+        };
+
+        // Plain arrays of atomics, so they are usable before any constructor runs
+        ThreadSlot threadSlots[maxThreads];
+        std::atomic<std::size_t> nextThreadSlot{ 0 };
+        CallSiteSlot callSites[maxCallSites];
+        std::atomic<bool> stacksEnabled{ false };
+
+        thread_local ThreadSlot* currentThread = nullptr;
+        thread_local const char* currentSite = nullptr;
+
+        ThreadSlot& getThreadSlot() noexcept
+        {
+            if (currentThread == nullptr)
+            {
+                const auto index = nextThreadSlot.fetch_add(1, std::memory_order_relaxed);
+                currentThread = &threadSlots[std::min(index, maxThreads - 1)];
+            }
+            return *currentThread;
+        }
+
+        Counts read(const ThreadSlot& slot) noexcept
+        {
+            return Counts
+            {
+                slot.allocations.load(std::memory_order_relaxed),
+                slot.deallocations.load(std::memory_order_relaxed),
+                slot.bytes.load(std::memory_order_relaxed)
+            };
+        }
+
+        std::vector<std::string> symbolize(void* const* frames, const int frameCount)
+        {
+            auto stack = std::vector<std::string>{};
+#ifdef __linux__
+            if (frameCount <= skippedFrames)
+            {
+                return stack;
+            }
+            const auto symbols = ::backtrace_symbols(frames + skippedFrames, frameCount - skippedFrames);
+            if (symbols == nullptr)
+            {
+                return stack;
+            }
+            for (auto i = 0; i < (frameCount - skippedFrames); ++i)
+            {
+                // binary(mangledName+offset) [address]
+                auto line = std::string{ symbols[i] };
+                const auto begin = line.find('(');
+                const auto end = line.find('+', begin);
+                if ((begin != line.npos) && (end != line.npos) && (end > begin + 1))
+                {
+                    const auto mangled = line.substr(begin + 1, end - begin - 1);
+                    auto status = 0;
+                    const auto demangled = abi::__cxa_demangle(mangled.c_str(), nullptr, nullptr, &status);
+                    if (status == 0)
+                    {
+                        line.replace(begin + 1, end - begin - 1, demangled);
+                    }
+                    std::free(demangled);
+                }
+                stack.push_back(std::move(line));
+            }
+            std::free(symbols);
+#endif
+            return stack;
+        }
+    }
+
+    bool isEnabled() noexcept
+    {
+#ifdef CNC_TRACK_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    Counts getThreadCounts() noexcept
+    {
+        return read(getThreadSlot());
+    }
+
+    Counts getTotalCounts() noexcept
+    {
+        auto total = Counts{ 0, 0, 0 };
+        const auto used = std::min(nextThreadSlot.load(std::memory_order_relaxed), maxThreads);
+        for (auto i = std::size_t{ 0 }; i < used; ++i)
+        {
+            const auto counts = read(threadSlots[i]);
+            total.allocations += counts.allocations;
+            total.deallocations += counts.deallocations;
+            total.bytes += counts.bytes;
+        }
+        return total;
+    }
+
+    Scope::Scope(const char* site) noexcept :
+        previous{ currentSite }
+    {
+        currentSite = site;
+    }
+
+    Scope::~Scope()
+    {
+        currentSite = this->previous;
+    }
+
+    void recordStacks(const bool enabled) noexcept
+    {
+#ifdef __linux__
+        if (enabled)
+        {
+            // The first call loads the unwinder, which allocates
+            auto frames = std::array<void*, 1>{};
+            ::backtrace(frames.data(), 1);
+        }
+#endif
+        stacksEnabled.store(enabled, std::memory_order_relaxed);
+    }
+
+    std::vector<CallSite> getCallSites()
+    {
+        auto result = std::vector<CallSite>{};
+        for (const auto& slot : callSites)
+        {
+            if (!slot.ready.load(std::memory_order_acquire) || (slot.allocations.load(std::memory_order_relaxed) == 0))
+            {
+                continue;
+            }
+            result.push_back(CallSite
+            {
+                slot.site,
+                symbolize(slot.frames.data(), slot.frameCount),
+                slot.allocations.load(std::memory_order_relaxed),
+                slot.bytes.load(std::memory_order_relaxed)
+            });
+        }
+        std::sort(result.begin(), result.end(), [](const CallSite& a, const CallSite& b)
+        {
+            return a.allocations > b.allocations;
+        });
+        return result;
+    }
+
+    void reset() noexcept
+    {
+        for (auto& slot : callSites)
+        {
+            slot.allocations.store(0, std::memory_order_relaxed);
+            slot.bytes.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+#ifdef CNC_TRACK_ALLOCATIONS
+namespace
+{
+    using namespace CNCOnlineForwarder::AllocationTracker;
+
+    // Set while the tracker itself runs, so nested allocations aren't tracked
+    thread_local bool tracking = false;
+
+    std::uint64_t hashCallSite(const char* site, void* const* frames, const int frameCount) noexcept
+    {
+        // FNV-1a
+        auto hash = std::uint64_t{ 14695981039346656037ull };
+        const auto mix = [&hash](const std::uintptr_t value)
+        {
+            hash ^= value;
+            hash *= 1099511628211ull;
+        };
+        mix(reinterpret_cast<std::uintptr_t>(site));
+        for (auto i = 0; i < frameCount; ++i)
+        {
+            mix(reinterpret_cast<std::uintptr_t>(frames[i]));
+        }
+        return hash | 1;
+    }
+
+    void recordCallSite(const std::size_t size) noexcept
+    {
+        auto frames = std::array<void*, maxFrames>{};
+        auto frameCount = 0;
+#ifdef __linux__
+        if (stacksEnabled.load(std::memory_order_relaxed))
+        {
+            frameCount = ::backtrace(frames.data(), maxFrames);
+        }
+#endif
+        const auto key = hashCallSite(currentSite, frames.data(), frameCount);
+        for (auto probe = std::size_t{ 0 }; probe < maxCallSites; ++probe)
+        {
+            auto& slot = callSites[(key + probe) % maxCallSites];
+            auto existing = slot.key.load(std::memory_order_acquire);
+            if (existing == 0)
+            {
+                if (slot.key.compare_exchange_strong(existing, key, std::memory_order_acq_rel))
+                {
+                    slot.site = currentSite;
+                    slot.frames = frames;
+                    slot.frameCount = frameCount;
+                    slot.ready.store(true, std::memory_order_release);
+                    existing = key;
+                }
+            }
+            if (existing == key)
+            {
+                slot.allocations.fetch_add(1, std::memory_order_relaxed);
+                slot.bytes.fetch_add(size, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+    void trackAllocation(const std::size_t size) noexcept
+    {
+        auto& slot = getThreadSlot();
+        slot.allocations.fetch_add(1, std::memory_order_relaxed);
+        slot.bytes.fetch_add(size, std::memory_order_relaxed);
+        if (tracking)
+        {
+            return;
+        }
+        tracking = true;
+        recordCallSite(size);
+        tracking = false;
+    }
+
+    void trackDeallocation(const void* pointer) noexcept
+    {
+        if (pointer != nullptr)
+        {
+            getThreadSlot().deallocations.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void* allocate(std::size_t size)
+    {
+        size = std::max<std::size_t>(size, 1);
+        const auto pointer = std::malloc(size);
+        if (pointer == nullptr)
+        {
+            throw std::bad_alloc{};
+        }
+        trackAllocation(size);
+        return pointer;
+    }
+
+    void* allocate(std::size_t size, const std::align_val_t alignment)
+    {
+        size = std::max<std::size_t>(size, 1);
+#ifdef _WIN32
+        const auto pointer = ::_aligned_malloc(size, static_cast<std::size_t>(alignment));
+#else
+        auto pointer = static_cast<void*>(nullptr);
+        if (::posix_memalign(&pointer, static_cast<std::size_t>(alignment), size) != 0)
+        {
+            pointer = nullptr;
+        }
+#endif
+        if (pointer == nullptr)
+        {
+            throw std::bad_alloc{};
+        }
+        trackAllocation(size);
+        return pointer;
+    }
+
+    void deallocate(void* pointer) noexcept
+    {
+        trackDeallocation(pointer);
+        std::free(pointer);
+    }
+
+    void deallocateAligned(void* pointer) noexcept
+    {
+        trackDeallocation(pointer);
+#ifdef _WIN32
+        ::_aligned_free(pointer);
+#else
+        std::free(pointer);
+#endif
+    }
+}
+
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, alignment); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try { return allocate(size); } catch (...) { return nullptr; }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    try { return allocate(size); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* pointer) noexcept { deallocate(pointer); }
+void operator delete[](void* pointer) noexcept { deallocate(pointer); }
+void operator delete(void* pointer, std::size_t) noexcept { deallocate(pointer); }
+void operator delete[](void* pointer, std::size_t) noexcept { deallocate(pointer); }
+void operator delete(void* pointer, const std::nothrow_t&) noexcept { deallocate(pointer); }
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept { deallocate(pointer); }
+void operator delete(void* pointer, std::align_val_t) noexcept { deallocateAligned(pointer); }
+void operator delete[](void* pointer, std::align_val_t) noexcept { deallocateAligned(pointer); }
+void operator delete(void* pointer, std::size_t, std::align_val_t) noexcept { deallocateAligned(pointer); }
+void operator delete[](void* pointer, std::size_t, std::align_val_t) noexcept { deallocateAligned(pointer); }
+#endif
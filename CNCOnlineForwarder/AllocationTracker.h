@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace CNCOnlineForwarder::AllocationTracker
+{
+    // Instrumentation builds define CNC_TRACK_ALLOCATIONS, which replaces the global
+    // operator new and delete with ones counting every heap allocation of every thread.
+    // Without it, all counts stay 0.
+    bool isEnabled() noexcept;
+
+    struct Counts
+    {
+        std::uint64_t allocations;
+        std::uint64_t deallocations;
+        std::uint64_t bytes;
+    };
+
+    // Returns: allocations made by the calling thread
+    Counts getThreadCounts() noexcept;
+
+    // Returns: allocations made by all threads
+    Counts getTotalCounts() noexcept;
+
+    // Allocations made by the current thread while a Scope is alive
+    // are attributed to its site, which must be a string literal.
+    class Scope
+    {
+    public:
+        explicit Scope(const char* site) noexcept;
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const char* previous;
+    };
+
+    struct CallSite
+    {
+        // Innermost Scope, or nullptr
+        const char* site;
+        // Symbolized stack trace, empty unless stacks are being recorded
+        std::vector<std::string> stack;
+        std::uint64_t allocations;
+        std::uint64_t bytes;
+    };
+
+    // While enabled, a stack trace is taken for every allocation
+    // so getCallSites() can tell which path made it. Very slow, Linux only.
+    void recordStacks(const bool enabled) noexcept;
+
+    // Returns: call sites of allocations since the last reset(), most frequent first
+    std::vector<CallSite> getCallSites();
+
+    // Forget call sites, counts are never reset
+    void reset() noexcept;
+}
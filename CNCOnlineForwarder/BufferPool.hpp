@@ -0,0 +1,193 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace CNCOnlineForwarder::Utility
+{
+    // Recycles the buffers of relayed datagrams, so relaying doesn't allocate at steady state.
+    // Sizes are rounded up to powers of two, and each thread keeps a few free buffers of each size:
+    // a buffer is returned to the pool of the thread destroying it, which is usually
+    // the thread of the strand which acquired it.
+    class BufferPool
+    {
+    public:
+        static constexpr auto minimumSize = std::size_t{ 64 };
+        static constexpr auto maximumSize = std::size_t{ 64 * 1024 };
+        // Free buffers kept by each thread for each size
+        static constexpr auto buffersPerSize = std::size_t{ 16 };
+
+        class Deleter
+        {
+        public:
+            // Buffers not acquired from the pool are just deleted
+            Deleter() noexcept = default;
+
+            explicit Deleter(const std::uint8_t sizeClass) noexcept :
+                sizeClass{ sizeClass }
+            {}
+
+            void operator()(char* data) const noexcept
+            {
+                if ((this->sizeClass == unpooled) || !BufferPool::release(data, this->sizeClass))
+                {
+                    delete[] data;
+                }
+            }
+
+        private:
+            std::uint8_t sizeClass = unpooled;
+        };
+
+        using Buffer = std::unique_ptr<char[], Deleter>;
+
+        // Returns: size of buffers returned by acquire(size)
+        static std::size_t getCapacity(const std::size_t size) noexcept
+        {
+            const auto sizeClass = getSizeClass(size);
+            return (sizeClass == unpooled) ? size : (minimumSize << sizeClass);
+        }
+
+        // Returns: buffer of getCapacity(size) bytes
+        static Buffer acquire(const std::size_t size)
+        {
+            const auto sizeClass = getSizeClass(size);
+            if (sizeClass == unpooled)
+            {
+                return Buffer{ new char[size], Deleter{} };
+            }
+
+            const auto freeLists = getFreeLists();
+            if ((freeLists == nullptr) || (freeLists->lists[sizeClass].count == 0))
+            {
+                return Buffer{ new char[minimumSize << sizeClass], Deleter{ sizeClass } };
+            }
+            auto& freeList = freeLists->lists[sizeClass];
+            --freeList.count;
+            return Buffer{ freeList.buffers[freeList.count], Deleter{ sizeClass } };
+        }
+
+        // Raw memory from the same pools, for asio handler allocations
+        static void* allocate(const std::size_t size)
+        {
+            return acquire(size).release();
+        }
+
+        static void deallocate(void* data, const std::size_t size) noexcept
+        {
+            Buffer{ static_cast<char*>(data), Deleter{ getSizeClass(size) } };
+        }
+
+        // Associated allocator of completion handlers, so asio takes their operations
+        // from the pools too instead of its small per thread cache, which misses
+        // as soon as a thread has more than two operations of different sizes in flight.
+        template<typename T>
+        class Allocator
+        {
+        public:
+            using value_type = T;
+
+            Allocator() noexcept = default;
+
+            template<typename U>
+            Allocator(const Allocator<U>&) noexcept
+            {}
+
+            T* allocate(const std::size_t count)
+            {
+                return static_cast<T*>(BufferPool::allocate(count * sizeof(T)));
+            }
+
+            void deallocate(T* data, const std::size_t count) noexcept
+            {
+                BufferPool::deallocate(data, count * sizeof(T));
+            }
+
+            template<typename U>
+            bool operator==(const Allocator<U>&) const noexcept
+            {
+                return true;
+            }
+
+            template<typename U>
+            bool operator!=(const Allocator<U>&) const noexcept
+            {
+                return false;
+            }
+        };
+
+    private:
+        static constexpr auto unpooled = std::uint8_t{ 0xFF };
+        static constexpr auto sizeClassCount = std::size_t{ 11 };
+        static_assert((minimumSize << (sizeClassCount - 1)) == maximumSize);
+
+        struct FreeList
+        {
+            std::array<char*, buffersPerSize> buffers;
+            std::size_t count = 0;
+        };
+
+        struct FreeLists
+        {
+            explicit FreeLists(bool& destroyed) noexcept :
+                destroyed{ destroyed }
+            {}
+
+            FreeLists(const FreeLists&) = delete;
+            FreeLists& operator=(const FreeLists&) = delete;
+
+            ~FreeLists()
+            {
+                for (auto& list : this->lists)
+                {
+                    for (auto i = std::size_t{ 0 }; i < list.count; ++i)
+                    {
+                        delete[] list.buffers[i];
+                    }
+                }
+                this->destroyed = true;
+            }
+
+            bool& destroyed;
+            std::array<FreeList, sizeClassCount> lists;
+        };
+
+        // Returns: nullptr once the pool of this thread has been destroyed, when the thread exits
+        static FreeLists* getFreeLists()
+        {
+            // Trivially destructible, so it's still usable after freeLists is destroyed
+            thread_local auto destroyed = false;
+            thread_local auto freeLists = FreeLists{ destroyed };
+            return destroyed ? nullptr : &freeLists;
+        }
+
+        static std::uint8_t getSizeClass(const std::size_t size) noexcept
+        {
+            if (size > maximumSize)
+            {
+                return unpooled;
+            }
+            auto sizeClass = std::uint8_t{ 0 };
+            while ((minimumSize << sizeClass) < size)
+            {
+                ++sizeClass;
+            }
+            return sizeClass;
+        }
+
+        // Returns: false if the pool of this thread is full
+        static bool release(char* data, const std::uint8_t sizeClass) noexcept
+        {
+            const auto freeLists = getFreeLists();
+            if ((freeLists == nullptr) || (freeLists->lists[sizeClass].count == buffersPerSize))
+            {
+                return false;
+            }
+            auto& freeList = freeLists->lists[sizeClass];
+            freeList.buffers[freeList.count] = data;
+            ++freeList.count;
+            return true;
+        }
+    };
+}
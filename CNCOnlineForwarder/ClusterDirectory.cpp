@@ -0,0 +1,605 @@
+#include "precompiled.h"
+#include "ClusterDirectory.h"
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <boost/container_hash/hash.hpp>
+#include <boost/endian/conversion.hpp>
+#include "HMAC.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "NatNegProxy.h"
+#include "SimpleWriteHandler.hpp"
+#include "WeakRefHandler.hpp"
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+using WriteHandler = CNCOnlineForwarder::Utility::SimpleWriteHandler<CNCOnlineForwarder::NatNeg::ClusterDirectory>;
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    namespace
+    {
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<ClusterDirectory>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        auto& claimsMade = Metrics::counter("cluster.claims");
+        auto& claimsLost = Metrics::counter("cluster.claimsLost");
+        auto& forwardedOut = Metrics::counter("cluster.forwardedOut");
+        auto& forwardedIn = Metrics::counter("cluster.forwardedIn");
+        auto& repliesOut = Metrics::counter("cluster.repliesOut");
+        auto& repliesIn = Metrics::counter("cluster.repliesIn");
+        auto& invalidMessages = Metrics::counter("cluster.invalidMessages");
+        auto& rejectedMessages = Metrics::counter("cluster.rejectedMessages");
+        auto& handedOver = Metrics::counter("cluster.handedOver");
+        auto& entryCount = Metrics::gauge("cluster.entries");
+        auto& nodeCount = Metrics::gauge("cluster.nodes");
+
+        // Message layout: magic, type, sender NodeID, milliseconds since the epoch when it was sent,
+        // then a body depending on type, and the HMAC-SHA256 of everything before it.
+        // All integers are big endian.
+        constexpr auto magic = std::string_view{ "CNCC" };
+        constexpr auto headerSize = magic.size() + 1 + sizeof(ClusterDirectory::NodeID) + sizeof(std::uint64_t);
+        constexpr auto tagSize = std::tuple_size_v<Utility::SHA256Digest>;
+        // Older messages are discarded, so a captured message can't be replayed later
+        constexpr auto maxMessageAge = std::chrono::milliseconds{ 10000 };
+        // Client address and port of forwarded packets and replies
+        constexpr auto clientSize = std::size_t{ 4 + 2 };
+        // NatNegID, owner, claimedAt and remaining lifetime in milliseconds
+        constexpr auto claimSize = std::size_t{ 4 + 8 + 8 + 4 };
+        // Keep gossip datagrams below common MTUs
+        constexpr auto maxClaimsPerMessage = std::size_t{ 48 };
+        // A node is considered dead after missing this many gossip rounds
+        constexpr auto missedGossipLimit = 5;
+        // Packets of a NatNegID kept for its new owner if the claim is lost, clients only retry a few times
+        constexpr auto maxRecentPackets = std::size_t{ 16 };
+
+        enum class MessageType : char
+        {
+            claims = 0,
+            forward = 1,
+            reply = 2,
+        };
+
+        template<typename Integer>
+        void append(std::string& output, const Integer value)
+        {
+            const auto bigEndian = boost::endian::native_to_big(value);
+            output.append(reinterpret_cast<const char*>(&bigEndian), sizeof(bigEndian));
+        }
+
+        template<typename Integer>
+        Integer read(const std::string_view input, const std::size_t offset)
+        {
+            auto bigEndian = Integer{};
+            std::memcpy(&bigEndian, input.data() + offset, sizeof(bigEndian));
+            return boost::endian::big_to_native(bigEndian);
+        }
+
+        std::uint64_t millisecondsSinceEpoch()
+        {
+            const auto now = std::chrono::system_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+        }
+
+        std::string makeHeader(const MessageType type, const ClusterDirectory::NodeID sender)
+        {
+            auto message = std::string{ magic };
+            message.push_back(static_cast<char>(type));
+            append(message, sender);
+            append(message, millisecondsSinceEpoch());
+            return message;
+        }
+
+        void appendClient(std::string& output, const UDP::endpoint& client)
+        {
+            append(output, client.address().to_v4().to_uint());
+            append(output, client.port());
+        }
+
+        UDP::endpoint readClient(const std::string_view input)
+        {
+            const auto address = boost::asio::ip::address_v4{ read<std::uint32_t>(input, 0) };
+            return UDP::endpoint{ address, read<std::uint16_t>(input, 4) };
+        }
+
+        UDP::endpoint parsePeer(const std::string& peer)
+        {
+            const auto separator = peer.rfind(':');
+            if (separator == peer.npos)
+            {
+                throw std::invalid_argument{ "Cluster peer must be address:port: " + peer };
+            }
+
+            auto code = ErrorCode{};
+            const auto address = boost::asio::ip::make_address_v4(peer.substr(0, separator), code);
+            const auto port = std::strtoul(peer.c_str() + separator + 1, nullptr, 10);
+            if (code.failed() || (port == 0) || (port > 65535))
+            {
+                throw std::invalid_argument{ "Invalid cluster peer: " + peer };
+            }
+            return UDP::endpoint{ address, static_cast<std::uint16_t>(port) };
+        }
+
+        std::string readSecret(const std::string& path)
+        {
+            if (path.empty())
+            {
+                throw std::invalid_argument{ "Cluster mode requires --cluster-secret-file" };
+            }
+
+            auto input = std::ifstream{ path, std::ios::binary };
+            auto secret = std::string{ std::istreambuf_iterator<char>{ input }, std::istreambuf_iterator<char>{} };
+            // Files written by echo end with a line break on some platforms but not on others
+            while (!secret.empty() && ((secret.back() == '\n') || (secret.back() == '\r')))
+            {
+                secret.pop_back();
+            }
+            if (!input.is_open() || secret.empty())
+            {
+                throw std::invalid_argument{ "Cannot read the cluster secret from " + path };
+            }
+            return secret;
+        }
+
+        ClusterDirectory::NodeID makeNodeID()
+        {
+            auto device = std::random_device{};
+            auto generator = std::mt19937_64{ (std::uint64_t{ device() } << 32) | device() };
+            return generator();
+        }
+    }
+
+    std::size_t ClusterDirectory::EndPointHash::operator()(const EndPoint& endPoint) const noexcept
+    {
+        auto hash = std::size_t{ 0 };
+        boost::hash_combine(hash, endPoint.address().to_v4().to_uint());
+        boost::hash_combine(hash, endPoint.port());
+        return hash;
+    }
+
+    std::shared_ptr<ClusterDirectory> ClusterDirectory::create
+    (
+        IOManager::StrandType& proxyStrand,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const ClusterOptions& options
+    )
+    {
+        const auto self = std::make_shared<ClusterDirectory>
+        (
+            PrivateConstructor{},
+            proxyStrand,
+            proxy,
+            options
+        );
+
+        const auto action = [](ClusterDirectory& self)
+        {
+            logLine
+            (
+                LogLevel::info,
+                "Node ", self.nodeID, " listening on ", self.socket->local_endpoint(),
+                " with ", self.peers.size(), " peers."
+            );
+            self.prepareForNextMessage();
+            self.prepareForNextGossip();
+        };
+        boost::asio::defer(proxyStrand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    ClusterDirectory::ClusterDirectory
+    (
+        PrivateConstructor,
+        IOManager::StrandType& proxyStrand,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const ClusterOptions& options
+    ) :
+        socket{ proxyStrand },
+        gossipTimer{ proxyStrand },
+        proxy{ proxy },
+        entryLifetime{ options.entryLifetime },
+        gossipInterval{ options.gossipInterval },
+        nodeID{ makeNodeID() }
+    {
+        for (const auto& peer : options.peers)
+        {
+            this->peers.push_back(parsePeer(peer));
+        }
+        this->secret = readSecret(options.secretFile);
+
+        auto code = ErrorCode{};
+        const auto bindAddress = boost::asio::ip::make_address_v4(options.bindAddress, code);
+        if (code.failed())
+        {
+            throw std::invalid_argument{ "Invalid cluster bind address: " + options.bindAddress };
+        }
+
+        this->socket->open(UDP::v4());
+        // A process taking over by hot restart binds the port before the old one exits
+        this->socket->set_option(UDP::socket::reuse_address{ true });
+        this->socket->bind(EndPoint{ bindAddress, options.port });
+    }
+
+    ClusterDirectory::NodeID ClusterDirectory::getNodeID() const noexcept
+    {
+        return this->nodeID;
+    }
+
+    std::optional<ClusterDirectory::EndPoint> ClusterDirectory::findRemoteOwner(const NatNegID natNegID) const
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const auto entry = this->entries.find(natNegID);
+        if ((entry == this->entries.end()) || (entry->second.owner == this->nodeID))
+        {
+            return std::nullopt;
+        }
+        if (entry->second.expiresAt <= now)
+        {
+            return std::nullopt;
+        }
+
+        const auto node = this->nodes.find(entry->second.owner);
+        if ((node == this->nodes.end()) || (node->second.expiresAt <= now))
+        {
+            // Owner stopped gossiping, it's probably dead
+            return std::nullopt;
+        }
+        return node->second.node;
+    }
+
+    void ClusterDirectory::claim(const NatNegID natNegID, const PacketView packet, const EndPoint& client)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const auto expiresAt = now + this->entryLifetime;
+        auto [entry, isNew] = this->entries.try_emplace(natNegID, Entry{ this->nodeID, 0, expiresAt });
+        if (!isNew && (entry->second.owner == this->nodeID) && (entry->second.expiresAt > now))
+        {
+            entry->second.expiresAt = expiresAt;
+        }
+        else
+        {
+            // New, expired, or previously owned by a node which is gone
+            entry->second = Entry{ this->nodeID, millisecondsSinceEpoch(), expiresAt };
+            claimsMade.add();
+            entryCount.set(this->entries.size());
+            logLine(LogLevel::info, "Claimed NatNegID ", natNegID);
+            this->recentPackets[natNegID] = RecentPackets{ {}, now + missedGossipLimit * this->gossipInterval };
+            this->gossip({ natNegID });
+        }
+
+        const auto recent = this->recentPackets.find(natNegID);
+        if ((recent != this->recentPackets.end()) && (recent->second.expiresAt > now) &&
+            (recent->second.packets.size() < maxRecentPackets))
+        {
+            recent->second.packets.push_back(ReceivedPacket{ packet.copyBuffer(), client });
+        }
+    }
+
+    void ClusterDirectory::forwardToOwner(const PacketView packet, const EndPoint& client, const EndPoint& owner)
+    {
+        auto message = makeHeader(MessageType::forward, this->nodeID);
+        appendClient(message, client);
+        message.append(packet.natNegPacket);
+        forwardedOut.add();
+        logLine(LogLevel::info, "Forwarding packet of ", client, " to owner ", owner);
+        this->send(std::move(message), owner);
+    }
+
+    bool ClusterDirectory::sendThroughForwarder(const PacketView packet, const EndPoint& client)
+    {
+        const auto forwarder = this->forwarders.find(client);
+        if (forwarder == this->forwarders.end())
+        {
+            return false;
+        }
+
+        auto message = makeHeader(MessageType::reply, this->nodeID);
+        appendClient(message, client);
+        message.append(packet.natNegPacket);
+        repliesOut.add();
+        this->send(std::move(message), forwarder->second.node);
+        return true;
+    }
+
+    void ClusterDirectory::prepareForNextMessage()
+    {
+        const auto action = [](ClusterDirectory& self, const ErrorCode& code, const std::size_t bytesReceived)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async receive failed: ", code);
+            }
+            else
+            {
+                self.handleMessage({ self.buffer.data(), bytesReceived }, self.from);
+            }
+            self.prepareForNextMessage();
+        };
+
+        this->socket.asyncReceiveFrom
+        (
+            boost::asio::buffer(this->buffer),
+            this->from,
+            makeWeakHandler(this, action)
+        );
+    }
+
+    void ClusterDirectory::handleMessage(const std::string_view message, const EndPoint& from)
+    {
+        if (!this->isPeer(from))
+        {
+            rejectedMessages.add();
+            logLine(LogLevel::warning, "Cluster message from ", from, " which is not a peer, discarded.");
+            return;
+        }
+
+        if ((message.size() < headerSize + tagSize) || (message.substr(0, magic.size()) != magic))
+        {
+            invalidMessages.add();
+            logLine(LogLevel::warning, "Invalid cluster message from ", from, ", discarded.");
+            return;
+        }
+
+        const auto authenticated = message.substr(0, message.size() - tagSize);
+        if (!Utility::verifyHMAC(this->secret, authenticated, message.substr(authenticated.size())))
+        {
+            rejectedMessages.add();
+            logLine(LogLevel::warning, "Cluster message from ", from, " has a wrong HMAC, discarded.");
+            return;
+        }
+
+        const auto sentAt = read<std::uint64_t>(authenticated, magic.size() + 1 + sizeof(NodeID));
+        const auto now = millisecondsSinceEpoch();
+        const auto age = std::chrono::milliseconds{ (now > sentAt) ? (now - sentAt) : (sentAt - now) };
+        if (age > maxMessageAge)
+        {
+            rejectedMessages.add();
+            logLine
+            (
+                LogLevel::warning,
+                "Cluster message from ", from, " sent ", age.count(), "ms away from now, discarded."
+            );
+            return;
+        }
+
+        const auto type = static_cast<MessageType>(message[magic.size()]);
+        const auto sender = read<NodeID>(message, magic.size() + 1);
+        const auto body = authenticated.substr(headerSize);
+        if (sender == this->nodeID)
+        {
+            // Our own address is in the peer list
+            return;
+        }
+
+        // Every message tells where its sender can be reached
+        const auto expiresAt = std::chrono::steady_clock::now() + missedGossipLimit * this->gossipInterval;
+        this->nodes[sender] = Route{ from, expiresAt };
+        nodeCount.set(this->nodes.size());
+
+        if (type == MessageType::claims)
+        {
+            return this->handleClaims(sender, body, from);
+        }
+
+        if ((type != MessageType::forward) && (type != MessageType::reply))
+        {
+            invalidMessages.add();
+            logLine(LogLevel::warning, "Unknown cluster message type from ", from, ", discarded.");
+            return;
+        }
+
+        if (body.size() < clientSize)
+        {
+            invalidMessages.add();
+            logLine(LogLevel::warning, "Truncated cluster message from ", from, ", discarded.");
+            return;
+        }
+
+        const auto proxy = this->proxy.lock();
+        if (!proxy)
+        {
+            logLine(LogLevel::warning, "Proxy already died when handling cluster message");
+            return;
+        }
+
+        const auto client = readClient(body);
+        const auto packet = PacketView{ body.substr(clientSize) };
+        if (type == MessageType::forward)
+        {
+            // Replies to client have to go through the node it's talking to
+            this->forwarders[client] = Route{ from, std::chrono::steady_clock::now() + this->entryLifetime };
+            forwardedIn.add();
+            proxy->handleForwardedPacket(packet, client);
+            return;
+        }
+
+        repliesIn.add();
+        proxy->sendFromProxySocket(packet, client);
+    }
+
+    void ClusterDirectory::handleClaims(const NodeID sender, const std::string_view claims, const EndPoint& from)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        for (auto offset = std::size_t{ 0 }; offset + claimSize <= claims.size(); offset += claimSize)
+        {
+            const auto natNegID = read<NatNegID>(claims, offset);
+            const auto owner = read<NodeID>(claims, offset + 4);
+            const auto claimedAt = read<std::uint64_t>(claims, offset + 12);
+            const auto lifetime = std::chrono::milliseconds{ read<std::uint32_t>(claims, offset + 20) };
+            if (owner != sender)
+            {
+                // Nodes only gossip their own claims
+                invalidMessages.add();
+                continue;
+            }
+
+            const auto claim = Entry{ owner, claimedAt, now + lifetime };
+            auto [entry, isNew] = this->entries.try_emplace(natNegID, claim);
+            if (isNew)
+            {
+                continue;
+            }
+
+            auto& current = entry->second;
+            const auto currentIsAlive = current.expiresAt > now;
+            const auto claimWins =
+                (current.owner == owner) ||
+                !currentIsAlive ||
+                (std::tie(claimedAt, owner) < std::tie(current.claimedAt, current.owner));
+            if (!claimWins)
+            {
+                continue;
+            }
+
+            const auto isLost = (current.owner == this->nodeID) && currentIsAlive;
+            current = claim;
+            if (isLost)
+            {
+                // Our packets of this NatNegID will be forwarded from now on
+                claimsLost.add();
+                logLine(LogLevel::info, "NatNegID ", natNegID, " claimed earlier by ", from);
+                this->handOver(natNegID, from);
+            }
+        }
+        entryCount.set(this->entries.size());
+    }
+
+    void ClusterDirectory::handOver(const NatNegID natNegID, const EndPoint& owner)
+    {
+        if (const auto proxy = this->proxy.lock())
+        {
+            proxy->forgetNatNegID(natNegID);
+        }
+
+        const auto recent = this->recentPackets.find(natNegID);
+        if (recent == this->recentPackets.end())
+        {
+            return;
+        }
+
+        // The owner handles them like the retries of our clients, the handshake goes on from there
+        logLine
+        (
+            LogLevel::info,
+            "Handing ", recent->second.packets.size(), " packets of NatNegID ", natNegID, " over to ", owner
+        );
+        handedOver.add(recent->second.packets.size());
+        for (const auto& received : recent->second.packets)
+        {
+            this->forwardToOwner(PacketView{ received.packet }, received.client, owner);
+        }
+        this->recentPackets.erase(recent);
+    }
+
+    bool ClusterDirectory::isPeer(const EndPoint& endPoint) const
+    {
+        return std::find(this->peers.begin(), this->peers.end(), endPoint) != this->peers.end();
+    }
+
+    void ClusterDirectory::prepareForNextGossip()
+    {
+        const auto action = [](ClusterDirectory& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+
+            self.removeExpired();
+
+            auto owned = std::vector<NatNegID>{};
+            for (const auto& [natNegID, entry] : self.entries)
+            {
+                if (entry.owner == self.nodeID)
+                {
+                    owned.push_back(natNegID);
+                }
+            }
+            // Also tells the peers this node is alive when it doesn't own anything
+            self.gossip(owned);
+            self.prepareForNextGossip();
+        };
+
+        this->gossipTimer.asyncWait(this->gossipInterval, makeWeakHandler(this, action));
+    }
+
+    void ClusterDirectory::gossip(const std::vector<NatNegID>& natNegIDs)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        auto message = makeHeader(MessageType::claims, this->nodeID);
+        const auto flush = [this, &message]
+        {
+            for (const auto& peer : this->peers)
+            {
+                this->send(message, peer);
+            }
+            message.resize(headerSize);
+        };
+
+        auto count = std::size_t{ 0 };
+        for (const auto natNegID : natNegIDs)
+        {
+            const auto& entry = this->entries.at(natNegID);
+            const auto lifetime = std::chrono::duration_cast<std::chrono::milliseconds>(entry.expiresAt - now);
+            append(message, natNegID);
+            append(message, entry.owner);
+            append(message, entry.claimedAt);
+            append(message, static_cast<std::uint32_t>(std::max<std::int64_t>(lifetime.count(), 0)));
+            if (++count % maxClaimsPerMessage == 0)
+            {
+                flush();
+            }
+        }
+
+        if ((count == 0) || (count % maxClaimsPerMessage != 0))
+        {
+            flush();
+        }
+    }
+
+    void ClusterDirectory::send(std::string message, const EndPoint& to)
+    {
+        const auto tag = Utility::computeHMAC(this->secret, message);
+        message.append(reinterpret_cast<const char*>(tag.data()), tag.size());
+        auto writeHandler = WriteHandler{ std::move(message) };
+        const auto data = writeHandler.getData();
+        this->socket.asyncSendTo(data, to, std::move(writeHandler));
+    }
+
+    void ClusterDirectory::removeExpired()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const auto removeFrom = [now](auto& map)
+        {
+            for (auto i = map.begin(); i != map.end();)
+            {
+                i = (i->second.expiresAt <= now) ? map.erase(i) : std::next(i);
+            }
+        };
+        removeFrom(this->entries);
+        removeFrom(this->nodes);
+        removeFrom(this->forwarders);
+        removeFrom(this->recentPackets);
+        entryCount.set(this->entries.size());
+        nodeCount.set(this->nodes.size());
+    }
+}
@@ -0,0 +1,145 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "IOManager.hpp"
+#include "NatNegPacket.hpp"
+#include "Options.h"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    class NatNegProxy;
+
+    // Eventually consistent directory of NatNegID => owning node, shared
+    // by forwarder instances over UDP gossip, so both players of a NatNegID
+    // are handled by the same node even if their packets land on different ones.
+    // Every node periodically sends the NatNegIDs it owns to all of its peers;
+    // concurrent claims are resolved by the earliest claim, then by the lowest node ID.
+    // Packets of NatNegIDs owned by another node are forwarded to it,
+    // and the replies are sent back to the client through the node which received them.
+    // Only datagrams coming from a listed peer and carrying a valid HMAC of the
+    // shared cluster secret are accepted, since replies are sent to any address they name.
+    // Runs on the strand of NatNegProxy, and must only be used from it.
+    class ClusterDirectory : public std::enable_shared_from_this<ClusterDirectory>
+    {
+    private:
+        struct PrivateConstructor{};
+    public:
+        using EndPoint = boost::asio::ip::udp::endpoint;
+        using Socket = WithStrand<boost::asio::ip::udp::socket>;
+        using Timer = WithStrand<boost::asio::steady_timer>;
+        using PacketView = NatNegPacketView;
+        using NodeID = std::uint64_t;
+
+        static constexpr auto description = "ClusterDirectory";
+
+        // Throws std::invalid_argument if a peer is not an "address:port",
+        // if the bind address is invalid or if the secret file can't be read
+        static std::shared_ptr<ClusterDirectory> create
+        (
+            IOManager::StrandType& proxyStrand,
+            const std::weak_ptr<NatNegProxy>& proxy,
+            const ClusterOptions& options
+        );
+
+        ClusterDirectory
+        (
+            PrivateConstructor,
+            IOManager::StrandType& proxyStrand,
+            const std::weak_ptr<NatNegProxy>& proxy,
+            const ClusterOptions& options
+        );
+
+        NodeID getNodeID() const noexcept;
+
+        // Returns: cluster address of the node owning natNegID,
+        // or nullopt if it's owned by this node or by nobody yet
+        std::optional<EndPoint> findRemoteOwner(const NatNegID natNegID) const;
+
+        // Take or keep the ownership of natNegID, new claims are sent to the peers immediately.
+        // Packets received while another node may still win the claim are kept,
+        // so they can be forwarded to the winner if this claim is lost.
+        void claim(const NatNegID natNegID, const PacketView packet, const EndPoint& client);
+
+        void forwardToOwner(const PacketView packet, const EndPoint& client, const EndPoint& owner);
+
+        // Returns: true if client's packets were forwarded by another node,
+        // in which case packet will be sent to client by that node
+        bool sendThroughForwarder(const PacketView packet, const EndPoint& client);
+
+    private:
+        struct Entry
+        {
+            NodeID owner;
+            // Milliseconds since the epoch, earlier claims win
+            std::uint64_t claimedAt;
+            std::chrono::steady_clock::time_point expiresAt;
+        };
+
+        struct Route
+        {
+            EndPoint node;
+            std::chrono::steady_clock::time_point expiresAt;
+        };
+
+        struct ReceivedPacket
+        {
+            std::string packet;
+            EndPoint client;
+        };
+
+        struct RecentPackets
+        {
+            std::vector<ReceivedPacket> packets;
+            // Conflicting claims are known after a few gossip rounds
+            std::chrono::steady_clock::time_point expiresAt;
+        };
+
+        struct EndPointHash
+        {
+            std::size_t operator()(const EndPoint& endPoint) const noexcept;
+        };
+
+        void prepareForNextMessage();
+
+        void handleMessage(const std::string_view message, const EndPoint& from);
+
+        void handleClaims(const NodeID sender, const std::string_view claims, const EndPoint& from);
+
+        // Forward packets of a lost NatNegID to its new owner, which never received them
+        void handOver(const NatNegID natNegID, const EndPoint& owner);
+
+        bool isPeer(const EndPoint& endPoint) const;
+
+        void prepareForNextGossip();
+
+        void gossip(const std::vector<NatNegID>& natNegIDs);
+
+        void send(std::string message, const EndPoint& to);
+
+        void removeExpired();
+
+        Socket socket;
+        Timer gossipTimer;
+        std::weak_ptr<NatNegProxy> proxy;
+        std::vector<EndPoint> peers;
+        std::string secret;
+        std::chrono::milliseconds entryLifetime;
+        std::chrono::milliseconds gossipInterval;
+        NodeID nodeID;
+        std::unordered_map<NatNegID, Entry> entries;
+        std::unordered_map<NodeID, Route> nodes;
+        // Clients whose packets were forwarded to this node
+        std::unordered_map<EndPoint, Route, EndPointHash> forwarders;
+        std::unordered_map<NatNegID, RecentPackets> recentPackets;
+        std::array<char, 65536> buffer;
+        EndPoint from;
+    };
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/ip/udp.hpp>
+
+namespace CNCOnlineForwarder::Utility
+{
+    // An IPv4 UDP endpoint stored in 8 bytes, instead of the 28 bytes 
+    // of udp::endpoint which has room for IPv6 addresses.
+    // NatNeg sockets are IPv4 only, so nothing is lost by the conversion.
+    class CompactEndPoint
+    {
+    public:
+        using EndPoint = boost::asio::ip::udp::endpoint;
+
+        CompactEndPoint() noexcept = default;
+
+        CompactEndPoint(const EndPoint& endPoint) noexcept :
+            address{ endPoint.address().is_v4() ? endPoint.address().to_v4().to_uint() : 0 },
+            port{ endPoint.port() }
+        {}
+
+        operator EndPoint() const noexcept
+        {
+            return EndPoint{ boost::asio::ip::address_v4{ this->address }, this->port };
+        }
+
+        friend bool operator==(const CompactEndPoint& a, const CompactEndPoint& b) noexcept
+        {
+            return (a.address == b.address) && (a.port == b.port);
+        }
+
+        friend bool operator==(const CompactEndPoint& a, const EndPoint& b) noexcept
+        {
+            return a == CompactEndPoint{ b };
+        }
+
+        friend bool operator==(const EndPoint& a, const CompactEndPoint& b) noexcept
+        {
+            return CompactEndPoint{ a } == b;
+        }
+
+        friend bool operator!=(const CompactEndPoint& a, const CompactEndPoint& b) noexcept
+        {
+            return !(a == b);
+        }
+
+        friend bool operator!=(const CompactEndPoint& a, const EndPoint& b) noexcept
+        {
+            return !(a == b);
+        }
+
+        friend bool operator!=(const EndPoint& a, const CompactEndPoint& b) noexcept
+        {
+            return !(a == b);
+        }
+
+        friend std::ostream& operator<<(std::ostream& stream, const CompactEndPoint& endPoint)
+        {
+            return stream << static_cast<EndPoint>(endPoint);
+        }
+
+    private:
+        std::uint32_t address = 0;
+        std::uint16_t port = 0;
+    };
+}
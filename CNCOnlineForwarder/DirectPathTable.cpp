@@ -0,0 +1,174 @@
+#include "precompiled.h"
+#include "DirectPathTable.h"
+#include "Logging.h"
+#include "Metrics.h"
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<DirectPathTable>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& mappingIndependent = Metrics::counter("directPath.mappingIndependent");
+        auto& mappingDependent = Metrics::counter("directPath.mappingDependent");
+        auto& offered = Metrics::counter("directPath.offered");
+        auto& relayed = Metrics::counter("directPath.relayed");
+        auto& succeeded = Metrics::counter("directPath.succeeded");
+        auto& failed = Metrics::counter("directPath.failed");
+        auto& knownClients = Metrics::gauge("directPath.knownClients");
+    }
+
+    std::shared_ptr<DirectPathTable> DirectPathTable::create(const DirectPathOptions& options)
+    {
+        return std::make_shared<DirectPathTable>(options);
+    }
+
+    DirectPathTable::DirectPathTable(const DirectPathOptions& options) :
+        memory{ options.memory }
+    {}
+
+    void DirectPathTable::addRelay(const std::uint16_t relayPort, const EndPoint& client)
+    {
+        const auto lock = std::scoped_lock{ this->mutex };
+        this->relays[relayPort] = client;
+    }
+
+    void DirectPathTable::removeRelay(const std::uint16_t relayPort)
+    {
+        const auto lock = std::scoped_lock{ this->mutex };
+        this->relays.erase(relayPort);
+    }
+
+    void DirectPathTable::recordMapping(const AddressV4& client, const bool endpointIndependent)
+    {
+        (endpointIndependent ? mappingIndependent : mappingDependent).add();
+
+        const auto now = Clock::now();
+        const auto lock = std::scoped_lock{ this->mutex };
+        if ((this->clients.size() >= maxClients) && (this->clients.count(client.to_uint()) == 0))
+        {
+            this->removeExpired(now);
+            if (this->clients.size() >= maxClients)
+            {
+                return;
+            }
+        }
+
+        auto& record = this->clients[client.to_uint()];
+        const auto isKnown = record.expiresAt > now;
+        // Any dependent mapping wins, since a single one breaks hole punching
+        record.endpointIndependent = endpointIndependent && (!isKnown || record.endpointIndependent);
+        record.expiresAt = now + this->memory;
+        knownClients.set(this->clients.size());
+    }
+
+    std::optional<DirectPathTable::EndPoint> DirectPathTable::findDirectPath
+    (
+        const NatNegID natNegID,
+        const EndPoint& client,
+        const EndPoint& remotePlayer,
+        const AddressV4& publicAddress
+    )
+    {
+        const auto now = Clock::now();
+        const auto lock = std::scoped_lock{ this->mutex };
+        const auto existing = this->decisions.find(natNegID);
+        if ((existing != this->decisions.end()) && (existing->second.expiresAt > now))
+        {
+            // The other player already decided for both
+            const auto& decision = existing->second;
+            if (!decision.direct)
+            {
+                return std::nullopt;
+            }
+            if (client == decision.first)
+            {
+                return decision.second;
+            }
+            if (client == decision.second)
+            {
+                return decision.first;
+            }
+            logLine(LogLevel::warning, "Client ", client, " is not part of the direct path of ", natNegID);
+            return std::nullopt;
+        }
+
+        // The other player is only known if it's also using this server
+        const auto isOurs = remotePlayer.address() == publicAddress;
+        const auto peer = isOurs ? this->relays.find(remotePlayer.port()) : this->relays.end();
+        const auto direct =
+            (peer != this->relays.end()) &&
+            (peer->second.address() != client.address()) &&
+            this->canTalkDirectly(client.address().to_v4(), now) &&
+            this->canTalkDirectly(peer->second.address().to_v4(), now);
+
+        const auto second = direct ? peer->second : EndPoint{};
+        this->decisions[natNegID] = Decision{ direct, client, second, now + decisionLifetime, false };
+        (direct ? offered : relayed).add();
+        if (!direct)
+        {
+            return std::nullopt;
+        }
+        logLine(LogLevel::info, "Direct path for ", natNegID, ": ", client, " <=> ", second);
+        return second;
+    }
+
+    void DirectPathTable::recordResult(const NatNegID natNegID, const bool success)
+    {
+        const auto now = Clock::now();
+        const auto lock = std::scoped_lock{ this->mutex };
+        const auto found = this->decisions.find(natNegID);
+        if ((found == this->decisions.end()) || !found->second.direct || found->second.reported)
+        {
+            return;
+        }
+
+        // Both clients report the same result, it's only counted once
+        auto& decision = found->second;
+        decision.reported = true;
+        if (success)
+        {
+            succeeded.add();
+            return;
+        }
+
+        failed.add();
+        logLine(LogLevel::warning, "Direct path failed: ", decision.first, " <=> ", decision.second);
+        for (const auto& endPoint : { decision.first, decision.second })
+        {
+            this->clients[endPoint.address().to_v4().to_uint()] = ClientRecord{ false, now + this->memory };
+        }
+        knownClients.set(this->clients.size());
+    }
+
+    void DirectPathTable::update()
+    {
+        const auto lock = std::scoped_lock{ this->mutex };
+        this->removeExpired(Clock::now());
+        knownClients.set(this->clients.size());
+    }
+
+    bool DirectPathTable::canTalkDirectly(const AddressV4& client, const Clock::time_point now) const
+    {
+        const auto found = this->clients.find(client.to_uint());
+        return (found != this->clients.end()) && (found->second.expiresAt > now) && found->second.endpointIndependent;
+    }
+
+    void DirectPathTable::removeExpired(const Clock::time_point now)
+    {
+        for (auto i = this->clients.begin(); i != this->clients.end();)
+        {
+            i = (i->second.expiresAt <= now) ? this->clients.erase(i) : std::next(i);
+        }
+        for (auto i = this->decisions.begin(); i != this->decisions.end();)
+        {
+            i = (i->second.expiresAt <= now) ? this->decisions.erase(i) : std::next(i);
+        }
+    }
+}
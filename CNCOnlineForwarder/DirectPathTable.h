@@ -0,0 +1,93 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <boost/asio/ip/address_v4.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include "NatNegPacket.hpp"
+#include "Options.h"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    // Decides which pairs of clients can talk to each other directly,
+    // so only the pairs which actually need it are relayed.
+    // A client IP address is probed by comparing the source port of its game socket
+    // as seen by the proxy socket and by the relay socket: if both are the same,
+    // its NAT maps the socket independently of the destination, and NatNeg hole punching
+    // works without relaying. The first session of a client is always relayed.
+    // A NatNeg report of a failed direct path disables direct paths of both clients.
+    // Can be used from any thread.
+    class DirectPathTable
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using EndPoint = boost::asio::ip::udp::endpoint;
+        using AddressV4 = boost::asio::ip::address_v4;
+
+        static constexpr auto description = "DirectPathTable";
+
+        // Client IP addresses remembered at most, new ones are not probed above it
+        static constexpr auto maxClients = std::size_t{ 65536 };
+        // How long both GameConnections of a NatNegID have to make the same decision
+        static constexpr auto decisionLifetime = std::chrono::minutes{ 2 };
+
+        static std::shared_ptr<DirectPathTable> create(const DirectPathOptions& options);
+
+        explicit DirectPathTable(const DirectPathOptions& options);
+
+        // relayPort is the port of the GameConnection socket talking to the NatNeg server,
+        // which is sent to the other player in connect packets
+        void addRelay(const std::uint16_t relayPort, const EndPoint& client);
+
+        void removeRelay(const std::uint16_t relayPort);
+
+        void recordMapping(const AddressV4& client, const bool endpointIndependent);
+
+        // Returns: real address of the other player if client should talk to it directly,
+        // or nullopt if it should be relayed. Both players of natNegID get the same decision.
+        std::optional<EndPoint> findDirectPath
+        (
+            const NatNegID natNegID,
+            const EndPoint& client,
+            const EndPoint& remotePlayer,
+            const AddressV4& publicAddress
+        );
+
+        // Result of a NatNeg report packet
+        void recordResult(const NatNegID natNegID, const bool success);
+
+        // Forget expired clients and decisions, called periodically by NatNegProxy
+        void update();
+
+    private:
+        struct ClientRecord
+        {
+            bool endpointIndependent;
+            Clock::time_point expiresAt;
+        };
+
+        struct Decision
+        {
+            bool direct;
+            EndPoint first;
+            EndPoint second;
+            Clock::time_point expiresAt;
+            bool reported;
+        };
+
+        // Must be called with mutex locked
+        bool canTalkDirectly(const AddressV4& client, const Clock::time_point now) const;
+
+        // Must be called with mutex locked
+        void removeExpired(const Clock::time_point now);
+
+        std::chrono::seconds memory;
+        mutable std::mutex mutex;
+        std::unordered_map<std::uint16_t, EndPoint> relays;
+        std::unordered_map<std::uint32_t, ClientRecord> clients;
+        std::unordered_map<NatNegID, Decision> decisions;
+    };
+}
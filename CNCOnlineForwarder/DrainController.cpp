@@ -0,0 +1,192 @@
+#include "precompiled.h"
+#include "DrainController.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "WeakRefHandler.hpp"
+
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<DrainController>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        const auto& initialPhaseCount = Metrics::gauge("initialPhase.count");
+        const auto& gameConnectionCount = Metrics::gauge("gameConnection.count");
+        const auto& bytesRelayed = Metrics::counter("gameConnection.bytesRelayed");
+    }
+
+    std::shared_ptr<DrainController> DrainController::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<IOManager>& ioManager,
+        const std::weak_ptr<NatNeg::NatNegProxy>& proxy,
+        const DrainOptions& options
+    )
+    {
+        const auto self = std::make_shared<DrainController>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            ioManager,
+            proxy,
+            options
+        );
+
+        const auto action = [](DrainController& self)
+        {
+            self.prepareForNextSignal();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    DrainController::DrainController
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<IOManager>& ioManager,
+        const std::weak_ptr<NatNeg::NatNegProxy>& proxy,
+        const DrainOptions& options
+    ) :
+        strand{ objectMaker.makeStrand() },
+        signals{ strand, SIGINT, SIGTERM },
+        timer{ strand },
+        ioManager{ ioManager },
+        proxy{ proxy },
+        options{ options },
+        draining{ false },
+        deadline{},
+        lastReport{},
+        lastBytesRelayed{ 0 }
+    {}
+
+    void DrainController::prepareForNextSignal()
+    {
+        const auto action = [](DrainController& self, const ErrorCode& code, const int signal)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Signal async wait failed: ", code);
+                return self.stop();
+            }
+
+            self.prepareForNextSignal();
+            self.handleSignal(signal);
+        };
+
+        this->signals->async_wait(boost::asio::bind_executor(this->strand, makeWeakHandler(this, action)));
+    }
+
+    void DrainController::handleSignal(const int signal)
+    {
+        logLine(LogLevel::info, "Received signal ", signal);
+        if (this->draining)
+        {
+            logLine(LogLevel::info, "Already draining, shutting down immediately.");
+            return this->stop();
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        this->draining = true;
+        this->deadline = now + this->options.timeout;
+        this->lastReport = now;
+        this->lastBytesRelayed = bytesRelayed.get();
+        logLine
+        (
+            LogLevel::info, 
+            "Draining, new sessions will be rejected. Deadline: ", 
+            this->options.timeout.count(), 
+            "s, send the signal again to shut down immediately."
+        );
+
+        if (const auto proxy = this->proxy.lock())
+        {
+            proxy->startDraining();
+        }
+        this->report();
+    }
+
+    void DrainController::prepareForNextReport()
+    {
+        const auto action = [](DrainController& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+
+            self.report();
+        };
+
+        const auto untilDeadline = this->deadline - std::chrono::steady_clock::now();
+        this->timer.asyncWait
+        (
+            std::min<std::chrono::steady_clock::duration>(this->options.reportInterval, untilDeadline),
+            makeWeakHandler(this, action)
+        );
+    }
+
+    void DrainController::report()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const auto elapsed = std::chrono::duration<double>{ now - this->lastReport }.count();
+        const auto bytes = bytesRelayed.get();
+        const auto bytesPerSecond = (elapsed > 0) ? ((bytes - this->lastBytesRelayed) / elapsed) : 0.0;
+        this->lastReport = now;
+        this->lastBytesRelayed = bytes;
+
+        const auto initialPhases = initialPhaseCount.get();
+        const auto gameConnections = gameConnectionCount.get();
+        const auto remaining = std::chrono::duration_cast<std::chrono::seconds>(this->deadline - now);
+        logLine
+        (
+            LogLevel::info,
+            "Draining: ", initialPhases, " InitialPhases, ",
+            gameConnections, " GameConnections remaining, ",
+            bytesPerSecond, " bytes/s relayed, ",
+            std::max<std::int64_t>(remaining.count(), 0), "s until deadline"
+        );
+
+        if ((initialPhases <= 0) && (gameConnections <= 0))
+        {
+            logLine(LogLevel::info, "All sessions finished, shutting down.");
+            return this->stop();
+        }
+
+        if (now >= this->deadline)
+        {
+            logLine(LogLevel::warning, "Drain deadline reached, shutting down with sessions remaining.");
+            return this->stop();
+        }
+
+        this->prepareForNextReport();
+    }
+
+    void DrainController::stop()
+    {
+        if (const auto ioManager = this->ioManager.lock())
+        {
+            ioManager->stop();
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "IOManager.hpp"
+#include "NatNegProxy.h"
+#include "Options.h"
+
+namespace CNCOnlineForwarder
+{
+    // Handles SIGINT / SIGTERM by draining instead of stopping immediately:
+    // NatNegProxy stops accepting new NatNegPlayerIDs, while existing sessions
+    // keep running until all of them are closed or the deadline is reached.
+    // A second signal stops IOManager immediately.
+    class DrainController : public std::enable_shared_from_this<DrainController>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        using Strand = IOManager::StrandType;
+        using Timer = WithStrand<boost::asio::steady_timer>;
+        using SignalSet = WithStrand<boost::asio::signal_set>;
+
+        static constexpr auto description = "DrainController";
+
+        static std::shared_ptr<DrainController> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<IOManager>& ioManager,
+            const std::weak_ptr<NatNeg::NatNegProxy>& proxy,
+            const DrainOptions& options
+        );
+
+        DrainController
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<IOManager>& ioManager,
+            const std::weak_ptr<NatNeg::NatNegProxy>& proxy,
+            const DrainOptions& options
+        );
+
+    private:
+        void prepareForNextSignal();
+
+        void handleSignal(const int signal);
+
+        void prepareForNextReport();
+
+        void report();
+
+        void stop();
+
+        Strand strand;
+        SignalSet signals;
+        Timer timer;
+        std::weak_ptr<IOManager> ioManager;
+        std::weak_ptr<NatNeg::NatNegProxy> proxy;
+        DrainOptions options;
+        bool draining;
+        std::chrono::steady_clock::time_point deadline;
+        std::chrono::steady_clock::time_point lastReport;
+        std::uint64_t lastBytesRelayed;
+    };
+}
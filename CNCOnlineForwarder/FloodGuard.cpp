@@ -0,0 +1,270 @@
+#include "precompiled.h"
+#include "FloodGuard.h"
+#include "Logging.h"
+#include "Metrics.h"
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<FloodGuard>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& held = Metrics::counter("floodGuard.held");
+        auto& admitted = Metrics::counter("floodGuard.admitted");
+        auto& rejectedBySource = Metrics::counter("floodGuard.rejectedBySource");
+        auto& rejectedGlobally = Metrics::counter("floodGuard.rejectedGlobally");
+        auto& rejectedBadSource = Metrics::counter("floodGuard.rejectedBadSource");
+        auto& badSources = Metrics::counter("floodGuard.badSources");
+        auto& unconfirmedFloods = Metrics::counter("floodGuard.unconfirmedFloods");
+        auto& unlimitedSources = Metrics::counter("floodGuard.unlimitedSources");
+
+        // Clients resend their first packets long before that
+        constexpr auto heldPacketLifetime = std::chrono::seconds{ 10 };
+        // Players keep their NAT mapping for a whole evening of games
+        constexpr auto confirmedSourceLifetime = std::chrono::hours{ 1 };
+
+        // splitmix64 finalizer
+        std::uint64_t mix(std::uint64_t value) noexcept
+        {
+            value ^= value >> 30;
+            value *= 0xBF58476D1CE4E5B9ull;
+            value ^= value >> 27;
+            value *= 0x94D049BB133111EBull;
+            value ^= value >> 31;
+            return value;
+        }
+
+        std::uint32_t toAddress(const FloodGuard::EndPoint& endPoint) noexcept
+        {
+            return endPoint.address().is_v4() ? endPoint.address().to_v4().to_uint() : 0;
+        }
+
+        std::uint64_t hashEndPoint(const FloodGuard::EndPoint& endPoint) noexcept
+        {
+            return mix((std::uint64_t{ toAddress(endPoint) } << 16) | endPoint.port());
+        }
+
+        Utility::TokenBucket makeBucket(const std::uint32_t ratePerSecond)
+        {
+            // Up to one second of creations may be done at once
+            const auto rate = static_cast<double>(ratePerSecond);
+            return Utility::TokenBucket{ rate, std::max(rate, 1.0) };
+        }
+    }
+
+    std::shared_ptr<FloodGuard> FloodGuard::create(const FloodProtectionOptions& options)
+    {
+        return std::make_shared<FloodGuard>(options);
+    }
+
+    FloodGuard::FloodGuard(const FloodProtectionOptions& options) :
+        options{ options },
+        tables{ std::make_unique<Tables>() },
+        creations{ makeBucket(options.creationsPerSecond) },
+        badSourcesRotatedAt{ Clock::now() }
+    {
+        this->tables->seen.fill(0);
+        for (auto& slot : this->tables->sources)
+        {
+            slot.creations = makeBucket(options.sourceCreationsPerSecond);
+        }
+    }
+
+    FloodGuard::Decision FloodGuard::admit
+    (
+        const NatNegPlayerID id,
+        const PacketView packet,
+        const EndPoint& from,
+        const bool confirmed
+    )
+    {
+        const auto now = Clock::now();
+        const auto address = toAddress(from);
+        if (this->isBadSource(address, now))
+        {
+            rejectedBadSource.add();
+            return Decision{ Verdict::rejected, std::nullopt };
+        }
+
+        auto heldPacket = std::optional<HeldPacket>{};
+        if (this->options.requireSecondPacket && !confirmed)
+        {
+            auto hash = mix(id.natNegID);
+            hash = mix(hash ^ static_cast<std::uint8_t>(id.playerID));
+            hash = mix(hash ^ address);
+            if (!this->isConfirmedBySource(hash, packet, from, now, heldPacket))
+            {
+                held.add();
+                return Decision{ Verdict::held, std::nullopt };
+            }
+        }
+
+        // A source isn't charged for creations refused by the global limit
+        this->creations.refill(now);
+        if (!this->creations.hasTokens(1))
+        {
+            rejectedGlobally.add();
+            return Decision{ Verdict::rejected, std::nullopt };
+        }
+
+        if (!this->allowSource(address, now))
+        {
+            rejectedBySource.add();
+            if (!this->isConfirmedSource(from, now))
+            {
+                // Maybe spoofed, ignoring the address would deny service to its real owner
+                unconfirmedFloods.add();
+                return Decision{ Verdict::rejected, std::nullopt };
+            }
+            this->addBadSource(address);
+            logLine(LogLevel::warning, "Source ", from, " creates NatNeg sessions too fast, ignoring it.");
+            return Decision{ Verdict::rejected, std::nullopt };
+        }
+
+        this->creations.consume(1);
+        admitted.add();
+        return Decision{ Verdict::admitted, std::move(heldPacket) };
+    }
+
+    void FloodGuard::confirmSource(const EndPoint& client)
+    {
+        const auto address = toAddress(client);
+        if (address == 0)
+        {
+            return;
+        }
+
+        // Older entries are simply overwritten, their sources are only rate limited until confirmed again
+        auto& slot = this->tables->confirmed[hashEndPoint(client) & (confirmedSlotCount - 1)];
+        slot.address = address;
+        slot.port = client.port();
+        slot.confirmedAt = Clock::now();
+    }
+
+    bool FloodGuard::isConfirmedSource(const EndPoint& from, const Clock::time_point now) const
+    {
+        const auto& slot = this->tables->confirmed[hashEndPoint(from) & (confirmedSlotCount - 1)];
+        return (slot.address == toAddress(from)) &&
+            (slot.port == from.port()) &&
+            ((now - slot.confirmedAt) < confirmedSourceLifetime);
+    }
+
+    bool FloodGuard::isConfirmedBySource
+    (
+        const std::uint64_t hash,
+        const PacketView packet,
+        const EndPoint& from,
+        const Clock::time_point now,
+        std::optional<HeldPacket>& heldPacket
+    )
+    {
+        const auto fingerprint = static_cast<std::uint32_t>(hash >> 32) | 1;
+        auto& seen = this->tables->seen[hash & (seenSlotCount - 1)];
+        auto& slot = this->tables->held[hash & (heldSlotCount - 1)];
+        const auto& data = packet.natNegPacket;
+        if (seen != fingerprint)
+        {
+            // Older entries are simply overwritten, their clients will need one more packet
+            seen = fingerprint;
+            if (data.size() <= maxHeldPacketSize)
+            {
+                slot.fingerprint = fingerprint;
+                slot.heldAt = now;
+                slot.packet.from = from;
+                slot.packet.size = static_cast<std::uint16_t>(data.size());
+                std::copy(data.begin(), data.end(), slot.packet.data.begin());
+            }
+            return false;
+        }
+
+        seen = 0;
+        if ((slot.fingerprint == fingerprint) && ((now - slot.heldAt) < heldPacketLifetime))
+        {
+            heldPacket = slot.packet;
+        }
+        slot.fingerprint = 0;
+        return true;
+    }
+
+    bool FloodGuard::allowSource(const std::uint32_t address, const Clock::time_point now)
+    {
+        if (address == 0)
+        {
+            return true;
+        }
+
+        // Each address may use either of two slots, so a busy source
+        // rarely takes the bucket of another one
+        const auto hash = mix(address);
+        auto* slot = static_cast<SourceSlot*>(nullptr);
+        for (const auto index : { hash & (sourceSlotCount - 1), (hash >> 32) & (sourceSlotCount - 1) })
+        {
+            auto& candidate = this->tables->sources[index];
+            candidate.creations.refill(now);
+            if (candidate.address == address)
+            {
+                slot = &candidate;
+                break;
+            }
+            if ((slot == nullptr) && candidate.creations.isFull())
+            {
+                // Previous owner of the slot is idle, let the new source take it
+                slot = &candidate;
+            }
+        }
+
+        if (slot == nullptr)
+        {
+            // Both slots belong to busy sources, which mustn't pay for this one's creations,
+            // so it's only bound by the global limit
+            unlimitedSources.add();
+            return true;
+        }
+        slot->address = address;
+        return slot->creations.tryConsume(1, now);
+    }
+
+    bool FloodGuard::isBadSource(const std::uint32_t address, const Clock::time_point now)
+    {
+        if ((address == 0) || (this->options.badSourceMemory == std::chrono::seconds::zero()))
+        {
+            return false;
+        }
+
+        auto& generations = this->tables->badSources;
+        if ((now - this->badSourcesRotatedAt) >= this->options.badSourceMemory)
+        {
+            generations[1] = generations[0];
+            generations[0].reset();
+            this->badSourcesRotatedAt = now;
+        }
+
+        const auto hash = mix(address);
+        const auto first = static_cast<std::size_t>(hash & (badSourceBits - 1));
+        const auto second = static_cast<std::size_t>((hash >> 32) & (badSourceBits - 1));
+        return std::any_of(generations.begin(), generations.end(), [first, second](const auto& bits)
+        {
+            return bits.test(first) && bits.test(second);
+        });
+    }
+
+    void FloodGuard::addBadSource(const std::uint32_t address)
+    {
+        if ((address == 0) || (this->options.badSourceMemory == std::chrono::seconds::zero()))
+        {
+            return;
+        }
+
+        const auto hash = mix(address);
+        auto& bits = this->tables->badSources[0];
+        bits.set(static_cast<std::size_t>(hash & (badSourceBits - 1)));
+        bits.set(static_cast<std::size_t>((hash >> 32) & (badSourceBits - 1)));
+        badSources.add();
+    }
+}
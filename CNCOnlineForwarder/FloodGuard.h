@@ -0,0 +1,149 @@
+#pragma once
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <boost/asio/ip/udp.hpp>
+#include "NatNegPacket.hpp"
+#include "Options.h"
+#include "TokenBucket.hpp"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    // Decides whether a packet of an unknown NatNegPlayerID may create an InitialPhase,
+    // which costs a socket, a DNS query and a timer. Spoofed floods of random NatNegIDs
+    // never get that far: the first packet of a NatNegPlayerID is only remembered,
+    // and creation rates are limited per source IP address and globally.
+    // Source addresses can be spoofed, so an address exceeding its rate is only ignored
+    // for a while if its endpoint is confirmed, that is if it received the relay port
+    // which was sent to it and used it. Spoofing a victim's address without knowing its
+    // port only rate limits the victim's new sessions while the flood lasts.
+    // Every table has a fixed size, so deciding is constant time and never allocates.
+    // Not thread safe, it's only used inside the strand of NatNegProxy.
+    class FloodGuard
+    {
+    public:
+        using Clock = Utility::TokenBucket::Clock;
+        using EndPoint = boost::asio::ip::udp::endpoint;
+        using PacketView = NatNegPacketView;
+
+        static constexpr auto maxHeldPacketSize = std::size_t{ 128 };
+
+        // First packet of a NatNegPlayerID, kept until its source sends another one
+        struct HeldPacket
+        {
+            EndPoint from;
+            std::uint16_t size;
+            std::array<char, maxHeldPacketSize> data;
+
+            PacketView getView() const noexcept
+            {
+                return PacketView{ std::string_view{ this->data.data(), this->size } };
+            }
+        };
+
+        enum class Verdict
+        {
+            // Create the InitialPhase
+            admitted,
+            // First packet of the NatNegPlayerID, nothing is created yet
+            held,
+            // Over a creation rate or from a bad source
+            rejected,
+        };
+
+        struct Decision
+        {
+            Verdict verdict;
+            // When admitted, the held first packet which must be handled before the current one
+            std::optional<HeldPacket> held;
+        };
+
+        static constexpr auto description = "FloodGuard";
+
+        static std::shared_ptr<FloodGuard> create(const FloodProtectionOptions& options);
+
+        explicit FloodGuard(const FloodProtectionOptions& options);
+
+        // Called with packets of NatNegPlayerIDs which don't have an InitialPhase.
+        // confirmed: the NatNegID is already being negotiated by another player,
+        // so a second packet isn't needed to trust it.
+        Decision admit
+        (
+            const NatNegPlayerID id,
+            const PacketView packet,
+            const EndPoint& from,
+            const bool confirmed
+        );
+
+        // client reached a relay port it could only learn from packets sent to it
+        void confirmSource(const EndPoint& client);
+
+    private:
+        // NatNegPlayerIDs seen once, as fingerprints of (NatNegPlayerID, source address)
+        static constexpr auto seenSlotCount = std::size_t{ 1 } << 16;
+        // Only the most recent first packets are kept, clients resend lost ones anyway
+        static constexpr auto heldSlotCount = std::size_t{ 1 } << 10;
+        static constexpr auto sourceSlotCount = std::size_t{ 1 } << 12;
+        static constexpr auto confirmedSlotCount = std::size_t{ 1 } << 12;
+        // Bloom filter of sources which exceeded their creation rate
+        static constexpr auto badSourceBits = std::size_t{ 1 } << 16;
+
+        struct HeldSlot
+        {
+            std::uint32_t fingerprint = 0;
+            Clock::time_point heldAt;
+            HeldPacket packet;
+        };
+
+        struct SourceSlot
+        {
+            std::uint32_t address = 0;
+            Utility::TokenBucket creations;
+        };
+
+        struct ConfirmedSlot
+        {
+            std::uint32_t address = 0;
+            std::uint16_t port = 0;
+            Clock::time_point confirmedAt;
+        };
+
+        struct Tables
+        {
+            std::array<std::uint32_t, seenSlotCount> seen;
+            std::array<HeldSlot, heldSlotCount> held;
+            std::array<SourceSlot, sourceSlotCount> sources;
+            std::array<ConfirmedSlot, confirmedSlotCount> confirmed;
+            // Current and previous generation, sources are forgotten after one or two generations
+            std::array<std::bitset<badSourceBits>, 2> badSources;
+        };
+
+        // Returns: true if it's the second packet of the NatNegPlayerID from this source
+        bool isConfirmedBySource
+        (
+            const std::uint64_t hash,
+            const PacketView packet,
+            const EndPoint& from,
+            const Clock::time_point now,
+            std::optional<HeldPacket>& held
+        );
+
+        bool allowSource(const std::uint32_t address, const Clock::time_point now);
+
+        bool isConfirmedSource(const EndPoint& from, const Clock::time_point now) const;
+
+        bool isBadSource(const std::uint32_t address, const Clock::time_point now);
+
+        void addBadSource(const std::uint32_t address);
+
+        FloodProtectionOptions options;
+        std::unique_ptr<Tables> tables;
+        Utility::TokenBucket creations;
+        Clock::time_point badSourcesRotatedAt;
+    };
+}
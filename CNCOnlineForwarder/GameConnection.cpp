@@ -1,12 +1,18 @@
 #include "precompiled.h"
 #include "GameConnection.h"
+#include <cstring>
 #include "Logging.h"
+#include "Metrics.h"
 #include "NatNegProxy.h"
+#include "PacketCapture.h"
 #include "ProxyAddressTranslator.h"
+#include "ReceiveBufferSizer.h"
+#include "SocketMessage.h"
 #include "WeakRefHandler.hpp"
 
 using UDP = boost::asio::ip::udp;
 using ErrorCode = boost::system::error_code;
+using TimePoint = std::chrono::system_clock::time_point;
 using LogLevel = CNCOnlineForwarder::Logging::Level;
 
 using CNCOnlineForwarder::Utility::makeWeakHandler;
@@ -19,15 +25,117 @@ namespace CNCOnlineForwarder::NatNeg
         return Logging::logLine<GameConnection>(level, std::forward<Arguments>(arguments)...);
     }
 
+    namespace
+    {
+        auto& liveConnections = Metrics::gauge("gameConnection.count");
+        auto& packetsRelayed = Metrics::counter("gameConnection.packetsRelayed");
+        auto& bytesRelayed = Metrics::counter("gameConnection.bytesRelayed");
+        auto& offloadedBursts = Metrics::counter("gameConnection.offloadedBursts");
+        auto& offloadFallbacks = Metrics::counter("gameConnection.offloadFallbacks");
+        auto& mailboxOverflows = Metrics::counter("gameConnection.mailboxOverflows");
+        auto& clientRoundTripHistogram = Metrics::histogram("gameConnection.clientRoundTripMicroseconds");
+        auto& remoteRoundTripHistogram = Metrics::histogram("gameConnection.remoteRoundTripMicroseconds");
+
+        // Initial size of receive buffers, later learned from received datagrams
+        constexpr auto receiveBufferSize = std::size_t{ 512 };
+        auto& relayReceiveSizes = Utility::ReceiveBufferSizer::forRole("relay", receiveBufferSize);
+        // Memory used by a GameConnection and its two pending receives
+        constexpr auto gameConnectionBytes = 
+            sizeof(GameConnection) + 2 * (receiveBufferSize + sizeof(GameConnection::EndPoint));
+
+        bool isConnectPing(const NatNegPacketView packet)
+        {
+            return packet.isNatNeg() && (packet.getStep() == NatNegStep::connectPing);
+        }
+
+        std::size_t countSegments(const std::size_t size, const std::uint16_t segmentSize)
+        {
+            return (segmentSize == 0) ? 1 : (size + segmentSize - 1) / segmentSize;
+        }
+
+        // Call action with each datagram of a buffer coalesced by UDP_GRO,
+        // or with the whole buffer if segmentSize is 0
+        template<typename Action>
+        void forEachSegment(const char* data, const std::size_t size, const std::uint16_t segmentSize, Action&& action)
+        {
+            const auto step = (segmentSize == 0) ? size : std::size_t{ segmentSize };
+            for (auto offset = std::size_t{ 0 }; offset < size; offset += step)
+            {
+                action(data + offset, std::min(step, size - offset));
+            }
+        }
+
+        void recordResidency(Metrics::WindowedHistogram& histogram, const TimePoint receivedAt)
+        {
+            const auto residency = std::chrono::system_clock::now() - receivedAt;
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(residency).count();
+            histogram.record(static_cast<std::uint64_t>(std::max<decltype(nanoseconds)>(nanoseconds, 0)));
+        }
+
+        // Time from a datagram arriving on one relay socket until it has been sent
+        // by the other one, kept per thread so recording doesn't contend
+        Metrics::WindowedHistogram& getResidencyHistogram(const bool toClient)
+        {
+            // Names are only built once per thread, since this is called for every relayed packet
+            const auto make = [](const std::string& direction) -> Metrics::WindowedHistogram&
+            {
+                const auto suffix = ".thread" + std::to_string(Metrics::getThreadIndex());
+                return Metrics::windowedHistogram("gameConnection.residencyNanoseconds." + direction + suffix);
+            };
+            thread_local auto& toClientHistogram = make("toClient");
+            thread_local auto& toRemoteHistogram = make("toRemote");
+            return toClient ? toClientHistogram : toRemoteHistogram;
+        }
+
+        void enableMessageInfo(GameConnection::Socket& socket)
+        {
+#ifdef __linux__
+            if (const auto code = Utility::enableMessageInfo(*socket.operator->()); code.failed())
+            {
+                logLine(LogLevel::warning, "Cannot enable receive timestamps: ", code);
+            }
+#endif
+        }
+
+        void enableBusyPoll(GameConnection::Socket& socket, const std::chrono::microseconds timeout)
+        {
+#ifdef __linux__
+            if (const auto code = Utility::enableBusyPoll(*socket.operator->(), timeout); code.failed())
+            {
+                logLine(LogLevel::warning, "Cannot enable busy polling: ", code);
+            }
+#endif
+        }
+
+        void enableReceiveOffload(GameConnection::Socket& socket)
+        {
+#ifdef __linux__
+            if (const auto code = Utility::enableReceiveOffload(*socket.operator->()); code.failed())
+            {
+                logLine(LogLevel::warning, "Cannot enable UDP receive offload: ", code);
+            }
+#endif
+        }
+    }
+
     template<typename NextAction, typename Handler>
     class ReceiveHandler
     {
     public:
         template<typename InputNextAction, typename InputNextHandler>
-        ReceiveHandler(InputNextAction&& nextAction, InputNextHandler&& handler) :
-            size{ 512 },
-            buffer{ std::make_unique<char[]>(this->size) },
-            from{ std::make_unique<GameConnection::EndPoint>() },
+        ReceiveHandler
+        (
+            GameConnection::Socket GameConnection::* socket,
+            Utility::SocketMonitor GameConnection::* monitor,
+            GameConnection::EndPoint GameConnection::* from,
+            InputNextAction&& nextAction, 
+            InputNextHandler&& handler
+        ) :
+            socket{ socket },
+            monitor{ monitor },
+            from{ from },
+            size{ Utility::BufferPool::getCapacity(relayReceiveSizes.getBufferSize()) },
+            buffer{ Utility::BufferPool::acquire(this->size) },
             nextAction{ std::forward<InputNextAction>(nextAction) },
             handler{ std::forward<InputNextHandler>(handler) }
         {}
@@ -37,11 +145,42 @@ namespace CNCOnlineForwarder::NatNeg
             return boost::asio::buffer(this->buffer.get(), this->size);
         }
 
-        GameConnection::EndPoint& getFrom() const noexcept
+        // Socket became readable, receive the datagram with its MessageInfo
+        void operator()(GameConnection& self, const ErrorCode& code)
         {
-            return *this->from;
+            if (code.failed())
+            {
+                return this->complete(self, code, 0, 0, TimePoint{});
+            }
+
+            auto& socket = self.*(this->socket);
+            auto info = Utility::MessageInfo{};
+            auto receiveCode = ErrorCode{};
+            const auto bytesReceived = Utility::receiveMessage
+            (
+                *socket.operator->(),
+                this->getBuffer(),
+                Utility::ReceiveBufferSizer::getOverflowBuffer(),
+                self.*(this->from),
+                info,
+                receiveCode
+            );
+            if (receiveCode == boost::asio::error::would_block)
+            {
+                return this->nextAction(self);
+            }
+            (self.*(this->monitor)).update(*socket.operator->(), info);
+            const auto segmentSize = (bytesReceived > info.segmentSize) ? info.segmentSize : std::uint16_t{ 0 };
+            if (!receiveCode.failed())
+            {
+                relayReceiveSizes.record((segmentSize == 0) ? bytesReceived : segmentSize);
+                Utility::ReceiveBufferSizer::merge(this->buffer, this->size, bytesReceived);
+            }
+
+            return this->complete(self, receiveCode, bytesReceived, segmentSize, info.receivedAt);
         }
 
+        // Datagram received by asyncReceiveFrom
         void operator()
         (
             GameConnection& self, 
@@ -49,17 +188,56 @@ namespace CNCOnlineForwarder::NatNeg
             const std::size_t bytesReceived
         )
         {
+            if (code.failed())
+            {
+                return this->complete(self, code, 0, 0, TimePoint{});
+            }
+            if (bytesReceived >= this->size)
+            {
+                // The true size is unknown without recvmsg(), 
+                // so discard the datagram and let the next buffers be larger
+                relayReceiveSizes.record(this->size + 1);
+                logLine(LogLevel::warning, "Received data may be truncated, discarded: ", bytesReceived);
+                return this->nextAction(self);
+            }
+            relayReceiveSizes.record(bytesReceived);
+            return this->complete(self, code, bytesReceived, 0, std::chrono::system_clock::now());
+        }
+
+    private:
+        void complete
+        (
+            GameConnection& self,
+            const ErrorCode& code,
+            const std::size_t bytesReceived,
+            const std::uint16_t segmentSize,
+            const TimePoint receivedAt
+        )
+        {
+            // The next receive may write to the sender before this handler returns
+            const auto from = self.*(this->from);
             this->nextAction(self);
 
+            if (code == boost::asio::error::operation_aborted)
+            {
+                // Cancelled by suspend()
+                return;
+            }
+
             if (code.failed())
             {
                 logLine(LogLevel::error, "Async receive failed: ", code);
                 return;
             }
 
-            if (bytesReceived >= this->size)
+            if (Capture::isEnabled())
             {
-                logLine(LogLevel::warning, "Received data may be truncated: ", bytesReceived, "/",  this->size);
+                const auto capture = [&](const char* segment, const std::size_t length)
+                {
+                    const auto data = boost::asio::buffer(segment, length);
+                    Capture::record(Capture::Direction::inbound, self.*(this->socket), from, data, receivedAt);
+                };
+                forEachSegment(this->buffer.get(), bytesReceived, segmentSize, capture);
             }
 
             return this->handler
@@ -67,22 +245,56 @@ namespace CNCOnlineForwarder::NatNeg
                 self, 
                 std::move(this->buffer), 
                 bytesReceived, 
-                this->getFrom()
+                segmentSize,
+                from,
+                receivedAt
             );
         }
 
-    private:
+        GameConnection::Socket GameConnection::* socket;
+        Utility::SocketMonitor GameConnection::* monitor;
+        GameConnection::EndPoint GameConnection::* from;
         std::size_t size;
         GameConnection::Buffer buffer;
-        std::unique_ptr<GameConnection::EndPoint> from;
         NextAction nextAction;
         Handler handler;
     };
 
+}
+
+namespace boost::asio
+{
+    // Receive operations are taken from the buffer pools too, like the ones of SendHandler
+    template<typename NextAction, typename Handler, typename Allocator>
+    struct associated_allocator
+    <
+        CNCOnlineForwarder::Utility::WeakRefHandler
+        <
+            CNCOnlineForwarder::NatNeg::GameConnection,
+            CNCOnlineForwarder::NatNeg::ReceiveHandler<NextAction, Handler>
+        >,
+        Allocator
+    >
+    {
+        using type = CNCOnlineForwarder::Utility::BufferPool::Allocator<void>;
+
+        template<typename WeakHandler>
+        static type get(const WeakHandler&, const Allocator& = Allocator{}) noexcept
+        {
+            return type{};
+        }
+    };
+}
+
+namespace CNCOnlineForwarder::NatNeg
+{
     template<typename NextAction, typename Handler>
     auto makeReceiveHandler
     (
         GameConnection* pointer, 
+        GameConnection::Socket GameConnection::* socket,
+        Utility::SocketMonitor GameConnection::* monitor,
+        GameConnection::EndPoint GameConnection::* from,
         NextAction&& nextAction, 
         Handler&& hanlder
     )
@@ -95,31 +307,78 @@ namespace CNCOnlineForwarder::NatNeg
             pointer, 
             ReceiveHandler<NextActionValue, HandlerValue>
             {
+                socket,
+                monitor,
+                from,
                 std::forward<NextAction>(nextAction),
                 std::forward<Handler>(hanlder)
             }
         );
     }
 
+    template<typename Handler>
+    void startReceive(GameConnection::Socket& socket, [[maybe_unused]] GameConnection::EndPoint& from, Handler&& handler)
+    {
+#ifdef __linux__
+        // Wait for readability and use recvmsg() to get kernel receive timestamps
+        socket.asyncWait(boost::asio::socket_base::wait_read, std::forward<Handler>(handler));
+#else
+        const auto buffer = handler->getBuffer();
+        socket.asyncReceiveFrom(buffer, from, std::forward<Handler>(handler));
+#endif
+    }
+
     class SendHandler
     {
     public:
+        using allocator_type = Utility::BufferPool::Allocator<SendHandler>;
+
         SendHandler
         (
             GameConnection::Buffer buffer,
             const std::size_t bytes
         ) :
-            buffer{ std::move(buffer) },
-            bytes{ bytes }
+            SendHandler{ std::move(buffer), bytes, TimePoint{}, nullptr, nullptr }
         {}
 
+        // pending is incremented now and decremented on completion
+        SendHandler
+        (
+            GameConnection::Buffer buffer,
+            const std::size_t bytes,
+            const TimePoint receivedAt,
+            Metrics::WindowedHistogram* residency,
+            std::shared_ptr<std::uint32_t> pending
+        ) :
+            buffer{ std::move(buffer) },
+            bytes{ bytes },
+            receivedAt{ receivedAt },
+            residency{ residency },
+            pending{ std::move(pending) }
+        {
+            if (this->pending)
+            {
+                ++*this->pending;
+            }
+        }
+
         boost::asio::const_buffer getBuffer() const noexcept
         {
             return boost::asio::buffer(this->buffer.get(), this->bytes);
         }
 
+        allocator_type get_allocator() const noexcept
+        {
+            return allocator_type{};
+        }
+
         void operator()(const ErrorCode& code, std::size_t bytesSent) const
         {
+            if (this->pending)
+            {
+                --*this->pending;
+            }
+
             if (code.failed())
             {
                 logLine(LogLevel::error, "Async write failed: ", code);
@@ -131,11 +390,19 @@ namespace CNCOnlineForwarder::NatNeg
                 logLine(LogLevel::error, "Only part of packet was sent: ", bytesSent, "/", this->bytes);
                 return;
             }
+
+            if (this->residency != nullptr)
+            {
+                recordResidency(*this->residency, this->receivedAt);
+            }
         }
 
     private:
         GameConnection::Buffer buffer;
         std::size_t bytes;
+        TimePoint receivedAt;
+        Metrics::WindowedHistogram* residency;
+        std::shared_ptr<std::uint32_t> pending;
     };
 
     std::shared_ptr<GameConnection> GameConnection::create
@@ -143,6 +410,8 @@ namespace CNCOnlineForwarder::NatNeg
         const IOManager::ObjectMaker& objectMaker,
         const std::weak_ptr<NatNegProxy>& proxy,
         const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        Ticket ticket,
+        const NatNegPlayerID id,
         const EndPoint& server,
         const EndPoint& client
     )
@@ -153,18 +422,65 @@ namespace CNCOnlineForwarder::NatNeg
             objectMaker, 
             proxy, 
             addressTranslator,
+            std::move(ticket),
+            id,
             server, 
             client
         );
 
         const auto action = [self]
         {
-            logLine(LogLevel::info, "New Connection ", self, " created, client = ", self->clientPublicAddress);
+            logLine(LogLevel::info, "New Connection ", self, " created, id = ", self->id, ", client = ", self->clientPublicAddress);
             self->extendLife();
             self->prepareForNextPacketToClient();
         };
         boost::asio::defer(self->strand, action);
 
+        if (const auto proxyRef = proxy.lock())
+        {
+            proxyRef->addGameConnection(id, self);
+        }
+
+        return self;
+    }
+
+    std::shared_ptr<GameConnection> GameConnection::restore
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        Ticket ticket,
+        const State& state
+    )
+    {
+        const auto self = std::make_shared<GameConnection>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            proxy,
+            addressTranslator,
+            std::move(ticket),
+            state
+        );
+
+        const auto action = [self, remainingLife = state.remainingLife, receivingFromClient = state.receivingFromClient]
+        {
+            logLine(LogLevel::info, "Connection ", self, " restored, id = ", self->id, ", client = ", self->clientPublicAddress);
+            self->extendLife(remainingLife);
+            self->prepareForNextPacketToClient();
+            if (receivingFromClient)
+            {
+                self->receivingFromClient = true;
+                self->prepareForNextPacketFromClient();
+            }
+        };
+        boost::asio::defer(self->strand, action);
+
+        if (const auto proxyRef = proxy.lock())
+        {
+            proxyRef->addGameConnection(state.id, self);
+        }
+
         return self;
     }
 
@@ -174,80 +490,401 @@ namespace CNCOnlineForwarder::NatNeg
         const IOManager::ObjectMaker& objectMaker,
         const std::weak_ptr<NatNegProxy>& proxy,
         const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        Ticket ticket,
+        const NatNegPlayerID id,
         const EndPoint& server,
         const EndPoint& clientPublicAddress
     ) :
-        strand{ objectMaker.makeStrand() },
-        proxy{ proxy },
-        addressTranslator{ addressTranslator },
-        server{ server },
-        clientPublicAddress{ clientPublicAddress },
-        clientRealAddress{ clientPublicAddress },
-        remotePlayer{},
+        strand{ objectMaker.makeRelayStrand() },
         publicSocketForClient{ strand, EndPoint{ UDP::v4(), 0 } },
         fakeRemotePlayerSocket{ strand, EndPoint{ UDP::v4(), 0 } },
-        timeout{ strand }
-    {}
+        clientRealAddress{ clientPublicAddress },
+        remotePlayer{},
+        relaying{ false },
+        receivingFromClient{ false },
+        timeout{ strand },
+        timeoutArmed{ false },
+        id{ id },
+        server{ server },
+        clientPublicAddress{ clientPublicAddress },
+        proxy{ proxy },
+        addressTranslator{ addressTranslator },
+        mappingProbed{ false },
+        clientConfirmed{ false },
+        suspended{ false },
+        pendingSendsToClient{ std::make_shared<std::uint32_t>(0) },
+        pendingSendsToRemotePlayer{ std::make_shared<std::uint32_t>(0) },
+        ticket{ std::move(ticket) },
+        mailboxRetryTimer{ strand },
+        mailboxRetryDelay{ decltype(mailbox)::minimumRetryDelay }
+    {
+        Profiling::nameStrand(&this->strand, description);
+        enableMessageInfo(this->publicSocketForClient);
+        enableMessageInfo(this->fakeRemotePlayerSocket);
+        this->initializeFromProxy();
+        this->ticket->charge(gameConnectionBytes);
+        liveConnections.add();
+    }
 
-    const GameConnection::EndPoint& GameConnection::getClientPublicAddress() const noexcept
+    GameConnection::GameConnection
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        Ticket ticket,
+        const State& state
+    ) :
+        strand{ objectMaker.makeRelayStrand() },
+        publicSocketForClient{ strand, UDP::v4(), state.publicSocketForClient },
+        fakeRemotePlayerSocket{ strand, UDP::v4(), state.fakeRemotePlayerSocket },
+        clientRealAddress{ state.clientRealAddress },
+        remotePlayer{ state.remotePlayer },
+        relaying{ false },
+        receivingFromClient{ false },
+        timeout{ strand },
+        timeoutArmed{ false },
+        id{ state.id },
+        server{ state.server },
+        clientPublicAddress{ state.clientPublicAddress },
+        proxy{ proxy },
+        addressTranslator{ addressTranslator },
+        mappingProbed{ state.receivingFromClient },
+        clientConfirmed{ false },
+        suspended{ false },
+        pendingSendsToClient{ std::make_shared<std::uint32_t>(0) },
+        pendingSendsToRemotePlayer{ std::make_shared<std::uint32_t>(0) },
+        ticket{ std::move(ticket) },
+        mailboxRetryTimer{ strand },
+        mailboxRetryDelay{ decltype(mailbox)::minimumRetryDelay }
     {
-        return this->clientPublicAddress;
+        Profiling::nameStrand(&this->strand, description);
+        enableMessageInfo(this->publicSocketForClient);
+        enableMessageInfo(this->fakeRemotePlayerSocket);
+        this->initializeFromProxy();
+        this->ticket->charge(gameConnectionBytes);
+        liveConnections.add();
     }
 
-    void GameConnection::handlePacketToServer(const PacketView packet)
+    GameConnection::~GameConnection()
+    {
+        auto code = ErrorCode{};
+        const auto relayAddress = this->publicSocketForClient->local_endpoint(code);
+        if (this->directPaths && !code.failed())
+        {
+            this->directPaths->removeRelay(relayAddress.port());
+        }
+        this->ticket->refund(gameConnectionBytes);
+        liveConnections.subtract();
+    }
+
+    void GameConnection::initializeFromProxy()
     {
-        auto action = [data = packet.copyBuffer()](GameConnection& self)
+        if (const auto proxy = this->proxy.lock())
         {
-            const auto packet = PacketView{ data };
-            if (!packet.isNatNeg())
+            this->rateLimiter = proxy->getRateLimiter();
+            this->rateLimits = this->rateLimiter->makeSessionLimits();
+            this->idleTimeouts = proxy->getIdleTimeouts();
+            const auto& bufferOptions = proxy->getOptions().socketBuffers;
+            this->publicSocketMonitor.attach(*this->publicSocketForClient.operator->(), bufferOptions, "relay", false);
+            this->fakeRemotePlayerMonitor.attach(*this->fakeRemotePlayerSocket.operator->(), bufferOptions, "relay", false);
+            if (proxy->getOptions().udpOffload)
             {
-                logLine(LogLevel::warning, "Packet to server is not NatNeg, discarded.");
-                return;
+                enableReceiveOffload(this->publicSocketForClient);
+                enableReceiveOffload(this->fakeRemotePlayerSocket);
+            }
+            if (const auto busyPoll = proxy->getOptions().socketBusyPoll; busyPoll.count() > 0)
+            {
+                enableBusyPoll(this->publicSocketForClient, busyPoll);
+                enableBusyPoll(this->fakeRemotePlayerSocket, busyPoll);
             }
+            this->directPaths = proxy->getDirectPaths();
+            if (this->directPaths)
+            {
+                const auto relayPort = this->publicSocketForClient->local_endpoint().port();
+                this->directPaths->addRelay(relayPort, this->clientPublicAddress);
+            }
+        }
+    }
 
-            logLine(LogLevel::info, "Packet to server handler: NatNeg step ", packet.getStep());
-            logLine(LogLevel::info, "Sending data to server through client public socket...");
+    std::optional<GameConnection::EndPoint> GameConnection::findDirectPath()
+    {
+        const auto addressTranslator = this->addressTranslator.lock();
+        if (!this->directPaths || !addressTranslator)
+        {
+            return std::nullopt;
+        }
 
-            const auto& packetContent = packet.natNegPacket;
-            auto copy = std::make_unique<char[]>(packetContent.size());
-            std::copy_n(packetContent.begin(), packetContent.size(), copy.get());
-            auto handler = SendHandler{ std::move(copy), packetContent.size() };
-            self.publicSocketForClient.asyncSendTo
-            (
-                handler.getBuffer(),
-                self.server,
-                std::move(handler)
-            );
+        return this->directPaths->findDirectPath
+        (
+            this->id.natNegID,
+            this->clientPublicAddress,
+            this->remotePlayer,
+            addressTranslator->getPublicAddress()
+        );
+    }
 
-            self.extendLife();
+    std::size_t GameConnection::allowRelay(const EndPoint& from, const std::size_t size, const std::uint16_t segmentSize)
+    {
+        if (!this->rateLimiter)
+        {
+            return size;
+        }
+
+        // A burst exceeding the limit is trimmed instead of being dropped as a whole
+        auto allowed = std::size_t{ 0 };
+        const auto step = (segmentSize == 0) ? size : std::size_t{ segmentSize };
+        while (allowed < size)
+        {
+            const auto length = std::min(step, size - allowed);
+            if (!this->rateLimiter->allow(this->rateLimits, from, length))
+            {
+                break;
+            }
+            allowed += length;
+        }
+        return allowed;
+    }
+
+    GameConnection::NatNegPlayerID GameConnection::getID() const noexcept
+    {
+        return this->id;
+    }
+
+    GameConnection::EndPoint GameConnection::getClientPublicAddress() const noexcept
+    {
+        return this->clientPublicAddress;
+    }
+
+    void GameConnection::suspend(StateHandler handler)
+    {
+        auto action = [handler = std::move(handler)](GameConnection& self)
+        {
+            logLine(LogLevel::info, "Suspending connection ", self.id);
+            self.suspended = true;
+            auto ignored = ErrorCode{};
+            self.publicSocketForClient->cancel(ignored);
+            self.fakeRemotePlayerSocket->cancel(ignored);
+            self.timeout->cancel();
+            self.timeoutArmed = false;
+            handler(self.exportState());
         };
 
         boost::asio::defer(this->strand, makeWeakHandler(this, std::move(action)));
     }
 
+    void GameConnection::resume()
+    {
+        auto action = [](GameConnection& self)
+        {
+            logLine(LogLevel::info, "Resuming connection ", self.id);
+            self.suspended = false;
+            self.extendLife(self.exportState().remainingLife);
+            self.prepareForNextPacketToClient();
+            if (self.receivingFromClient)
+            {
+                self.prepareForNextPacketFromClient();
+            }
+        };
+
+        boost::asio::defer(this->strand, makeWeakHandler(this, std::move(action)));
+    }
+
+    GameConnection::State GameConnection::exportState()
+    {
+        const auto expiry = this->deadline;
+        const auto now = std::chrono::steady_clock::now();
+        auto remainingLife = (expiry > now) ? (expiry - now) : std::chrono::steady_clock::duration::zero();
+        if (expiry == std::chrono::steady_clock::time_point{})
+        {
+            // Not started yet, it gets a whole handshake timeout like a new connection
+            remainingLife = this->idleTimeouts ?
+                this->idleTimeouts->get(IdleTimeoutPolicy::Phase::handshake) :
+                std::chrono::minutes{ 1 };
+        }
+
+        return State
+        {
+            this->id,
+            this->server,
+            this->clientPublicAddress,
+            this->clientRealAddress,
+            this->remotePlayer,
+            remainingLife,
+            this->receivingFromClient,
+            this->publicSocketForClient->native_handle(),
+            this->fakeRemotePlayerSocket->native_handle()
+        };
+    }
+
+    void GameConnection::handlePacketToServer(const PacketView packet)
+    {
+        const auto& data = packet.natNegPacket;
+        if (data.size() > Message::maxPacketSize)
+        {
+            // Far above any NatNeg packet, and queueing it apart would reorder it
+            logLine(LogLevel::warning, "Packet of ", data.size(), " bytes to server is too large, discarded.");
+            return;
+        }
+
+        const auto fill = [&data](Message& message)
+        {
+            message.type = Message::Type::packetToServer;
+            message.size = static_cast<std::uint16_t>(data.size());
+            std::copy(data.begin(), data.end(), message.packet.begin());
+        };
+        this->postMessage(fill);
+    }
+
     void GameConnection::handleCommunicationPacketFromServer
     (
         const PacketView packet,
         const EndPoint& communicationAddress
     )
     {
-        auto action = [data = packet.copyBuffer(), communicationAddress](GameConnection& self)
+        const auto& data = packet.natNegPacket;
+        if (data.size() > Message::maxPacketSize)
         {
-            return self.handleCommunicationPacketFromServerInternal
-            (
-                PacketView{ data },
-                communicationAddress
-            );
+            logLine(LogLevel::warning, "Packet of ", data.size(), " bytes from server is too large, discarded.");
+            return;
+        }
+
+        const auto fill = [&data, &communicationAddress](Message& message)
+        {
+            message.type = Message::Type::communicationPacket;
+            message.size = static_cast<std::uint16_t>(data.size());
+            message.address = communicationAddress;
+            std::copy(data.begin(), data.end(), message.packet.begin());
+        };
+        this->postMessage(fill);
+    }
+
+    template<typename Fill>
+    void GameConnection::postMessage(Fill&& fill)
+    {
+        const auto result = this->mailbox.push(std::forward<Fill>(fill));
+        if (result.spilled)
+        {
+            mailboxOverflows.add();
+        }
+
+        if (result.first)
+        {
+            const auto action = [](GameConnection& self) { self.drainMailbox(); };
+            boost::asio::defer(this->strand, makeWeakHandler(this, action));
+        }
+    }
+
+    void GameConnection::drainMailbox()
+    {
+        const auto handler = [this](const Message& message)
+        {
+            const auto packet = PacketView{ { message.packet.data(), message.size } };
+            switch (message.type)
+            {
+            case Message::Type::packetToServer:
+                this->handlePacketToServerInternal(packet);
+                break;
+            case Message::Type::communicationPacket:
+                this->handleCommunicationPacketFromServerInternal(packet, message.address);
+                break;
+            }
+        };
+
+        if (this->mailbox.drain(handler))
+        {
+            this->mailboxRetryDelay = decltype(this->mailbox)::minimumRetryDelay;
+            return;
+        }
+
+        // A producer was interrupted while writing its message, wait for it to be scheduled again
+        const auto action = [](GameConnection& self, const ErrorCode& code)
+        {
+            if (code != boost::asio::error::operation_aborted)
+            {
+                self.drainMailbox();
+            }
+        };
+        this->mailboxRetryTimer.asyncWait
+        (
+            this->mailboxRetryDelay,
+            boost::asio::bind_executor(this->strand, makeWeakHandler(this, action))
+        );
+        this->mailboxRetryDelay = std::min(this->mailboxRetryDelay * 2, decltype(this->mailbox)::maximumRetryDelay);
+    }
+
+    void GameConnection::handlePacketToServerInternal(const PacketView packet)
+    {
+        if (!packet.isNatNeg())
+        {
+            logLine(LogLevel::warning, "Packet to server is not NatNeg, discarded.");
+            return;
+        }
+
+        logLine(LogLevel::info, "Packet to server handler: NatNeg step ", packet.getStep());
+        logLine(LogLevel::info, "Sending data to server through client public socket...");
+
+        const auto& packetContent = packet.natNegPacket;
+        auto copy = Utility::BufferPool::acquire(packetContent.size());
+        std::copy_n(packetContent.begin(), packetContent.size(), copy.get());
+        auto handler = SendHandler{ std::move(copy), packetContent.size() };
+        Capture::record(Capture::Direction::outbound, this->publicSocketForClient, this->server, handler.getBuffer());
+        this->publicSocketForClient.asyncSendTo
+        (
+            handler.getBuffer(),
+            this->server,
+            std::move(handler)
+        );
+
+        this->extendLife();
+    }
+
+    void GameConnection::queryRoundTrip(RoundTripHandler handler)
+    {
+        auto action = [handler = std::move(handler)](GameConnection& self)
+        {
+            handler(RelayRoundTrip{ self.clientRoundTrip.getStatistics(), self.remoteRoundTrip.getStatistics() });
         };
 
         boost::asio::defer(this->strand, makeWeakHandler(this, std::move(action)));
     }
 
     void GameConnection::extendLife()
+    {
+        if (!this->idleTimeouts)
+        {
+            return this->extendLife(std::chrono::minutes{ 1 });
+        }
+
+        const auto phase = this->relaying ? 
+            IdleTimeoutPolicy::Phase::relay : 
+            IdleTimeoutPolicy::Phase::handshake;
+        return this->extendLife(this->idleTimeouts->get(phase));
+    }
+
+    void GameConnection::extendLife(const std::chrono::steady_clock::duration life)
+    {
+        if (this->suspended)
+        {
+            return;
+        }
+
+        // Re-arming the timer for every relayed packet would cost an allocation each,
+        // so a pending wait is kept if it doesn't expire after the new deadline.
+        // When it fires early, it's re-armed for the rest of the deadline.
+        this->deadline = std::chrono::steady_clock::now() + life;
+        if (this->timeoutArmed && (this->timeout->expiry() <= this->deadline))
+        {
+            return;
+        }
+        this->waitForTimeout(life);
+    }
+
+    void GameConnection::waitForTimeout(const std::chrono::steady_clock::duration life)
     {
         auto waitHandler = [self = this->shared_from_this()](const ErrorCode& code)
         {
-            if (code == boost::asio::error::operation_aborted)
+            if ((code == boost::asio::error::operation_aborted) || self->suspended)
             {
                 return;
             }
@@ -256,15 +893,36 @@ namespace CNCOnlineForwarder::NatNeg
             {
                 logLine(LogLevel::error, "Async wait failed: ", code);
             }
+            else if (const auto now = std::chrono::steady_clock::now(); now < self->deadline)
+            {
+                return self->waitForTimeout(self->deadline - now);
+            }
 
             logLine(LogLevel::error, "Timeout reached, closing self: ", self.get());
+            logLine
+            (
+                LogLevel::info, 
+                "Round trip of ", self->id, ": ", 
+                RelayRoundTrip{ self->clientRoundTrip.getStatistics(), self->remoteRoundTrip.getStatistics() }
+            );
+            if (const auto proxy = self->proxy.lock())
+            {
+                proxy->removeGameConnection(self->id, self.get());
+            }
         };
 
-        this->timeout.asyncWait(std::chrono::minutes{ 1 }, std::move(waitHandler));
+        // Bound to the strand, since the handler reads the deadline and re-arms the timer like extendLife()
+        this->timeoutArmed = true;
+        this->timeout.asyncWait(life, boost::asio::bind_executor(this->strand, std::move(waitHandler)));
     }
 
     void GameConnection::prepareForNextPacketFromClient()
     {
+        if (this->suspended)
+        {
+            return;
+        }
+
         const auto then = [](GameConnection& self)
         {
             return self.prepareForNextPacketFromClient();
@@ -275,23 +933,33 @@ namespace CNCOnlineForwarder::NatNeg
             GameConnection& self, 
             Buffer&& data, 
             const std::size_t size,
-            const EndPoint& from
+            const std::uint16_t segmentSize,
+            const EndPoint& from,
+            const TimePoint receivedAt
         )
         {
-            return self.handlePacketToRemotePlayer(std::move(data), size, from);
+            return self.handlePacketToRemotePlayer(std::move(data), size, segmentSize, from, receivedAt);
         };
 
-        auto handler = makeReceiveHandler(this, then, dispatcher);
-        this->fakeRemotePlayerSocket.asyncReceiveFrom
+        auto handler = makeReceiveHandler
         (
-            handler->getBuffer(),
-            handler->getFrom(),
-            std::move(handler)
+            this, 
+            &GameConnection::fakeRemotePlayerSocket, 
+            &GameConnection::fakeRemotePlayerMonitor, 
+            &GameConnection::fakeRemotePlayerSender,
+            then, 
+            dispatcher
         );
+        startReceive(this->fakeRemotePlayerSocket, this->fakeRemotePlayerSender, std::move(handler));
     }
 
     void GameConnection::prepareForNextPacketToClient()
     {
+        if (this->suspended)
+        {
+            return;
+        }
+
         const auto then = [](GameConnection& self)
         {
             return self.prepareForNextPacketToClient();
@@ -302,23 +970,40 @@ namespace CNCOnlineForwarder::NatNeg
             GameConnection& self, 
             Buffer&& data,
             const std::size_t size,
-            const EndPoint& from
+            const std::uint16_t segmentSize,
+            const EndPoint& from,
+            const TimePoint receivedAt
         )
         {
+            if ((from == self.server) && (segmentSize != 0))
+            {
+                // Packets from server are handled one by one
+                const auto split = [&self](const char* segment, const std::size_t length)
+                {
+                    auto copy = Utility::BufferPool::acquire(length);
+                    std::memcpy(copy.get(), segment, length);
+                    self.handlePacketFromServer(std::move(copy), length);
+                };
+                return forEachSegment(data.get(), size, segmentSize, split);
+            }
+
             if (from == self.server)
             {
                 return self.handlePacketFromServer(std::move(data), size);
             }
 
-            return self.handlePacketFromRemotePlayer(std::move(data), size, from);
+            return self.handlePacketFromRemotePlayer(std::move(data), size, segmentSize, from, receivedAt);
         };
-        auto handler = makeReceiveHandler(this, then, dispatcher);
-        this->publicSocketForClient.asyncReceiveFrom
+        auto handler = makeReceiveHandler
         (
-            handler->getBuffer(),
-            handler->getFrom(),
-            std::move(handler)
+            this, 
+            &GameConnection::publicSocketForClient, 
+            &GameConnection::publicSocketMonitor, 
+            &GameConnection::publicSocketSender,
+            then, 
+            dispatcher
         );
+        startReceive(this->publicSocketForClient, this->publicSocketSender, std::move(handler));
     }
 
     void GameConnection::handlePacketFromServer(Buffer buffer, const std::size_t size)
@@ -368,11 +1053,22 @@ namespace CNCOnlineForwarder::NatNeg
 
             {
                 const auto[ip, port] = parseAddress(packet.natNegPacket, addressOffset.value());
-                this->remotePlayer.address(boost::asio::ip::address_v4{ ip });
-                this->remotePlayer.port(boost::endian::big_to_native(port));
+                this->remotePlayer = EndPoint{ boost::asio::ip::address_v4{ ip }, boost::endian::big_to_native(port) };
                 logLine(LogLevel::info, "CommPacket's address stored in this->remotePlayer: ", this->remotePlayer);
             }
 
+            if (const auto directPath = this->findDirectPath(); directPath.has_value())
+            {
+                // Clients will talk to each other, this connection stays idle until it times out
+                const auto ip = directPath->address().to_v4().to_bytes();
+                const auto port = boost::endian::native_to_big(directPath->port());
+                rewriteAddress(outputBuffer, addressOffset.value(), ip, port);
+                logLine(LogLevel::info, "Address rewritten as the direct path ", directPath.value());
+                proxy->sendFromProxySocket(PacketView{ outputBuffer }, communicationAddress);
+                this->extendLife();
+                return;
+            }
+
             const auto fakeRemotePlayerAddress = fakeRemotePlayerSocket->local_endpoint();
             logLine(LogLevel::info, "FakeRemote local endpoint:", fakeRemotePlayerAddress);
             const auto addressTranslator = this->addressTranslator.lock();
@@ -388,8 +1084,12 @@ namespace CNCOnlineForwarder::NatNeg
             rewriteAddress(outputBuffer, addressOffset.value(), ip, port);
 
             logLine(LogLevel::info, "Address rewritten as ", publicRemoteFakeAddress);
-            logLine(LogLevel::info, "Preparing to receive packet from player to fakeRemote");
-            this->prepareForNextPacketFromClient();
+            if (!this->receivingFromClient)
+            {
+                logLine(LogLevel::info, "Preparing to receive packet from player to fakeRemote");
+                this->receivingFromClient = true;
+                this->prepareForNextPacketFromClient();
+            }
         }
         logLine(LogLevel::info, "CommPacket from server will be send to client from proxy.");
         proxy->sendFromProxySocket(PacketView{ outputBuffer }, communicationAddress);
@@ -401,26 +1101,47 @@ namespace CNCOnlineForwarder::NatNeg
     (
         Buffer buffer,
         const std::size_t size,
-        const EndPoint& from
+        const std::uint16_t segmentSize,
+        const EndPoint& from,
+        const std::chrono::system_clock::time_point receivedAt
     )
     {
+        const auto allowedSize = this->allowRelay(from, size, segmentSize);
+        if (allowedSize == 0)
+        {
+            return;
+        }
+
         if (this->remotePlayer != from)
         {
             logLine(LogLevel::warning, "Updating remote player address from ", this->remotePlayer, " to ", from);
             this->remotePlayer = from;
         }
 
-        if (PacketView{ { buffer.get(), size } }.isNatNeg())
+        // Coalesced datagrams are a burst of game data, only the first one is inspected
+        const auto firstSize = (segmentSize == 0) ? size : std::size_t{ segmentSize };
+        const auto now = RoundTripEstimator::Clock::now();
+        if (const auto sample = this->remoteRoundTrip.completeProbe(now); sample.has_value())
+        {
+            remoteRoundTripHistogram.record(static_cast<std::uint64_t>(sample->count()));
+        }
+        this->clientRoundTrip.startProbe(now, isConnectPing(PacketView{ { buffer.get(), firstSize } }));
+
+        if (PacketView{ { buffer.get(), firstSize } }.isNatNeg())
         {
             logLine(LogLevel::info, "Forwarding NatNeg Packet from remote ", this->remotePlayer, " to ", this->clientRealAddress);
         }
 
-        auto handler = SendHandler{ std::move(buffer), size };
-        this->fakeRemotePlayerSocket.asyncSendTo
+        this->relaying = true;
+        this->sendRelayed
         (
-            handler.getBuffer(),
-            this->clientRealAddress,
-            std::move(handler)
+            this->fakeRemotePlayerSocket, 
+            this->clientRealAddress, 
+            std::move(buffer), 
+            allowedSize, 
+            segmentSize, 
+            receivedAt, 
+            true
         );
 
         this->extendLife();
@@ -430,28 +1151,123 @@ namespace CNCOnlineForwarder::NatNeg
     (
         Buffer buffer,
         const std::size_t size,
-        const EndPoint& from
+        const std::uint16_t segmentSize,
+        const EndPoint& from,
+        const std::chrono::system_clock::time_point receivedAt
     )
     {
+        const auto allowedSize = this->allowRelay(from, size, segmentSize);
+        if (allowedSize == 0)
+        {
+            return;
+        }
+
         if (from != this->clientRealAddress)
         {
             logLine(LogLevel::warning, "Updating client address from ", this->clientRealAddress, " to ", from);
             this->clientRealAddress = from;
         }
 
-        if (PacketView{ { buffer.get(), size } }.isNatNeg())
+        if (!this->clientConfirmed)
+        {
+            // This port was only sent to the client's NatNeg endpoint, so its address isn't spoofed
+            this->clientConfirmed = true;
+            if (const auto proxy = this->proxy.lock())
+            {
+                proxy->confirmClient(this->clientPublicAddress);
+            }
+        }
+
+        if (!this->mappingProbed && this->directPaths)
+        {
+            // The client reached the proxy socket and this socket from the same game socket
+            this->mappingProbed = true;
+            this->directPaths->recordMapping(from.address().to_v4(), from == this->clientPublicAddress);
+        }
+
+        // Coalesced datagrams are a burst of game data, only the first one is inspected
+        const auto firstSize = (segmentSize == 0) ? size : std::size_t{ segmentSize };
+        const auto now = RoundTripEstimator::Clock::now();
+        if (const auto sample = this->clientRoundTrip.completeProbe(now); sample.has_value())
+        {
+            clientRoundTripHistogram.record(static_cast<std::uint64_t>(sample->count()));
+        }
+        this->remoteRoundTrip.startProbe(now, isConnectPing(PacketView{ { buffer.get(), firstSize } }));
+
+        if (PacketView{ { buffer.get(), firstSize } }.isNatNeg())
         {
             logLine(LogLevel::info, "Forwarding NatNeg Packet from client ", this->remotePlayer, " to ", this->clientRealAddress);
         }
 
-        auto handler = SendHandler{ std::move(buffer), size };
-        this->publicSocketForClient.asyncSendTo
+        this->relaying = true;
+        this->sendRelayed
         (
-            handler.getBuffer(),
-            this->remotePlayer,
-            std::move(handler)
+            this->publicSocketForClient, 
+            this->remotePlayer, 
+            std::move(buffer), 
+            allowedSize, 
+            segmentSize, 
+            receivedAt, 
+            false
         );
 
         this->extendLife();
     }
-}
\ No newline at end of file
+
+    void GameConnection::sendRelayed
+    (
+        Socket& socket,
+        const EndPoint& to,
+        Buffer buffer,
+        const std::size_t size,
+        const std::uint16_t segmentSize,
+        const std::chrono::system_clock::time_point receivedAt,
+        const bool toClient
+    )
+    {
+        auto& residency = getResidencyHistogram(toClient);
+        packetsRelayed.add(countSegments(size, segmentSize));
+        bytesRelayed.add(size);
+        if (Capture::isEnabled())
+        {
+            const auto capture = [&socket, &to](const char* segment, const std::size_t length)
+            {
+                Capture::record(Capture::Direction::outbound, socket, to, boost::asio::buffer(segment, length));
+            };
+            forEachSegment(buffer.get(), size, segmentSize, capture);
+        }
+
+        const auto& pending = toClient ? this->pendingSendsToClient : this->pendingSendsToRemotePlayer;
+        if (segmentSize != 0)
+        {
+            // Sending synchronously while earlier datagrams wait in the socket's queue would reorder them
+            if (*pending == 0)
+            {
+                auto code = ErrorCode{};
+                const auto data = boost::asio::buffer(buffer.get(), size);
+                Utility::sendSegments(*socket.operator->(), data, to, segmentSize, code);
+                if (!code.failed())
+                {
+                    offloadedBursts.add();
+                    recordResidency(residency, receivedAt);
+                    return;
+                }
+            }
+
+            // Send buffer is full, earlier sends are still queued,
+            // or the route doesn't support segmentation offload
+            offloadFallbacks.add();
+            const auto send = [&socket, &to, &residency, &pending, receivedAt](const char* segment, const std::size_t length)
+            {
+                auto copy = Utility::BufferPool::acquire(length);
+                std::memcpy(copy.get(), segment, length);
+                auto handler = SendHandler{ std::move(copy), length, receivedAt, &residency, pending };
+                socket.asyncSendTo(handler.getBuffer(), to, std::move(handler));
+            };
+            return forEachSegment(buffer.get(), size, segmentSize, send);
+        }
+
+        auto handler = SendHandler{ std::move(buffer), size, receivedAt, &residency, pending };
+        socket.asyncSendTo(handler.getBuffer(), to, std::move(handler));
+    }
+}
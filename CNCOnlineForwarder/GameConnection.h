@@ -1,13 +1,25 @@
 #pragma once
 #include <array>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
+#include "BufferPool.hpp"
+#include "CompactEndPoint.hpp"
+#include "DirectPathTable.h"
+#include "IdleTimeoutPolicy.h"
 #include "IOManager.hpp"
+#include "Mailbox.hpp"
 #include "NatNegPacket.hpp"
 #include "ProxyAddressTranslator.h"
+#include "RelayRateLimiter.h"
+#include "RoundTripEstimator.hpp"
+#include "SessionBudget.h"
+#include "SocketMonitor.h"
 
 namespace CNCOnlineForwarder::NatNeg
 {
@@ -25,7 +37,26 @@ namespace CNCOnlineForwarder::NatNeg
         using Timer = WithStrand<boost::asio::steady_timer>;
         using NatNegPlayerID = NatNegPlayerID;
         using PacketView = NatNegPacketView;
-        using Buffer = std::unique_ptr<char[]>;
+        using Buffer = Utility::BufferPool::Buffer;
+        using NativeHandle = boost::asio::ip::udp::socket::native_handle_type;
+        using RoundTripHandler = std::function<void(const RelayRoundTrip&)>;
+        using Ticket = std::shared_ptr<SessionBudget::Ticket>;
+
+        // Everything needed to recreate a GameConnection in another process
+        struct State
+        {
+            NatNegPlayerID id;
+            EndPoint server;
+            EndPoint clientPublicAddress;
+            EndPoint clientRealAddress;
+            EndPoint remotePlayer;
+            std::chrono::steady_clock::duration remainingLife;
+            bool receivingFromClient;
+            NativeHandle publicSocketForClient;
+            NativeHandle fakeRemotePlayerSocket;
+        };
+
+        using StateHandler = std::function<void(const State& state)>;
 
         static constexpr auto description = "GameConnection";
 
@@ -34,24 +65,65 @@ namespace CNCOnlineForwarder::NatNeg
             const IOManager::ObjectMaker& objectMaker,
             const std::weak_ptr<NatNegProxy>& proxy,
             const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            Ticket ticket,
+            const NatNegPlayerID id,
             const EndPoint& server,
             const EndPoint& clientPublicAddress
         );
 
+        // Recreate a GameConnection from a state exported by another process.
+        // The sockets inside state will be owned by the new GameConnection.
+        static std::shared_ptr<GameConnection> restore
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<NatNegProxy>& proxy,
+            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            Ticket ticket,
+            const State& state
+        );
+
         GameConnection
         (
             PrivateConstructor,
             const IOManager::ObjectMaker& objectMaker,
             const std::weak_ptr<NatNegProxy>& proxy,
             const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            Ticket ticket,
+            const NatNegPlayerID id,
             const EndPoint& server,
             const EndPoint& clientPublicAddress
         );
 
-        const EndPoint& getClientPublicAddress() const noexcept;
+        GameConnection
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<NatNegProxy>& proxy,
+            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            Ticket ticket,
+            const State& state
+        );
+
+        GameConnection(const GameConnection&) = delete;
+        GameConnection& operator=(const GameConnection&) = delete;
+        ~GameConnection();
+
+        NatNegPlayerID getID() const noexcept;
+
+        EndPoint getClientPublicAddress() const noexcept;
+
+        // Stop relaying and timing out, then call handler inside the connection's strand
+        // with its state. A suspended connection is only kept alive by its owners.
+        void suspend(StateHandler handler);
+
+        // Relay again after suspend(), when the state could not be handed over
+        void resume();
 
         void handlePacketToServer(const PacketView packet);
 
+        // handler will be executed inside GameConnection's strand
+        void queryRoundTrip(RoundTripHandler handler);
+
         void handleCommunicationPacketFromServer
         (
             const PacketView packet,
@@ -59,9 +131,51 @@ namespace CNCOnlineForwarder::NatNeg
         );
 
     private:
+        // Cross-strand calls, batched by a mailbox instead of posting a handler each
+        struct Message
+        {
+            enum class Type : std::uint8_t
+            {
+                packetToServer,
+                communicationPacket,
+            };
+
+            static constexpr auto maxPacketSize = std::size_t{ 128 };
+
+            Type type;
+            std::uint16_t size;
+            Utility::CompactEndPoint address;
+            std::array<char, maxPacketSize> packet;
+        };
+
+        // NatNeg packets of a session come a few at a time
+        static constexpr auto mailboxCapacity = std::size_t{ 4 };
+
+        template<typename Fill>
+        void postMessage(Fill&& fill);
+
+        void drainMailbox();
+
+        void handlePacketToServerInternal(const PacketView packet);
+
+        State exportState();
+
+        // Get shared rate limiter and idle timeouts from proxy
+        void initializeFromProxy();
+
+        // Returns: real address of the other player if both clients should talk directly
+        std::optional<EndPoint> findDirectPath();
+
+        // Each datagram of a buffer coalesced by UDP_GRO is charged separately.
+        // Returns: size of the leading datagrams from a player which should be relayed
+        std::size_t allowRelay(const EndPoint& from, const std::size_t size, const std::uint16_t segmentSize);
 
         void extendLife();
 
+        void extendLife(const std::chrono::steady_clock::duration life);
+
+        void waitForTimeout(const std::chrono::steady_clock::duration life);
+
         void prepareForNextPacketFromClient();
 
         void prepareForNextPacketToClient();
@@ -74,30 +188,82 @@ namespace CNCOnlineForwarder::NatNeg
             const EndPoint& communicationAddress
         );
 
+        // segmentSize is non zero if buffer contains several datagrams coalesced by UDP_GRO
         void handlePacketFromRemotePlayer
         (
             Buffer buffer, 
             const std::size_t size, 
-            const EndPoint& from
+            const std::uint16_t segmentSize,
+            const EndPoint& from,
+            const std::chrono::system_clock::time_point receivedAt
         );
 
         void handlePacketToRemotePlayer
         (
             Buffer buffer, 
             const std::size_t size, 
-            const EndPoint& from
+            const std::uint16_t segmentSize,
+            const EndPoint& from,
+            const std::chrono::system_clock::time_point receivedAt
+        );
+
+        // Send relayed datagrams, coalesced ones with a single UDP_SEGMENT send if possible
+        void sendRelayed
+        (
+            Socket& socket,
+            const EndPoint& to,
+            Buffer buffer,
+            const std::size_t size,
+            const std::uint16_t segmentSize,
+            const std::chrono::system_clock::time_point receivedAt,
+            const bool toClient
         );
 
+        // Fields used for every relayed packet come first
         Strand strand;
-        std::weak_ptr<NatNegProxy> proxy;
-        std::weak_ptr<ProxyAddressTranslator> addressTranslator;
-        EndPoint server;
-        EndPoint clientPublicAddress;
-        EndPoint clientRealAddress;
-        EndPoint remotePlayer;
         Socket publicSocketForClient;
         Socket fakeRemotePlayerSocket;
+        Utility::CompactEndPoint clientRealAddress;
+        Utility::CompactEndPoint remotePlayer;
+        // Whether any game traffic has been relayed, which ends the handshake phase
+        bool relaying;
+        bool receivingFromClient;
+        RelayRateLimiter::SessionLimits rateLimits;
+        std::shared_ptr<RelayRateLimiter> rateLimiter;
         Timer timeout;
+        std::chrono::steady_clock::time_point deadline;
+        // Whether a wait of timeout is pending
+        bool timeoutArmed;
+        // Senders of the datagrams being received, one receive is pending on each socket
+        EndPoint publicSocketSender;
+        EndPoint fakeRemotePlayerSender;
+        RoundTripEstimator clientRoundTrip;
+        RoundTripEstimator remoteRoundTrip;
+        Utility::SocketMonitor publicSocketMonitor;
+        Utility::SocketMonitor fakeRemotePlayerMonitor;
+        // Fields only used during the handshake or when closing
+        NatNegPlayerID id;
+        Utility::CompactEndPoint server;
+        Utility::CompactEndPoint clientPublicAddress;
+        std::weak_ptr<NatNegProxy> proxy;
+        std::weak_ptr<ProxyAddressTranslator> addressTranslator;
+        std::shared_ptr<IdleTimeoutPolicy> idleTimeouts;
+        // nullptr if direct paths are disabled
+        std::shared_ptr<DirectPathTable> directPaths;
+        // Whether the NAT mapping of the client has been compared on both sockets
+        bool mappingProbed;
+        // Whether the proxy knows the client's NatNeg endpoint is really the client's
+        bool clientConfirmed;
+        // Whether the connection is being handed over to another process
+        bool suspended;
+        // Asynchronous sends not completed yet on each relay socket, so a burst is only
+        // sent synchronously with UDP_SEGMENT when it can't overtake earlier datagrams
+        std::shared_ptr<std::uint32_t> pendingSendsToClient;
+        std::shared_ptr<std::uint32_t> pendingSendsToRemotePlayer;
+        Ticket ticket;
+        Utility::Mailbox<Message, mailboxCapacity> mailbox;
+        Timer mailboxRetryTimer;
+        std::chrono::microseconds mailboxRetryDelay;
     };
 }
 
@@ -0,0 +1,185 @@
+#include "precompiled.h"
+#include "HMAC.h"
+#include <cstring>
+#include <string>
+
+namespace CNCOnlineForwarder::Utility
+{
+    namespace
+    {
+        constexpr auto blockSize = std::size_t{ 64 };
+
+        constexpr std::uint32_t roundConstants[64] =
+        {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+        };
+
+        constexpr std::uint32_t rotateRight(const std::uint32_t value, const int bits) noexcept
+        {
+            return (value >> bits) | (value << (32 - bits));
+        }
+
+        class SHA256
+        {
+        public:
+            SHA256() noexcept :
+                state{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+                block{},
+                blockUsed{ 0 },
+                totalSize{ 0 }
+            {}
+
+            void update(const std::string_view data) noexcept
+            {
+                for (const auto byte : data)
+                {
+                    this->block[this->blockUsed++] = static_cast<std::uint8_t>(byte);
+                    if (this->blockUsed == blockSize)
+                    {
+                        this->compress();
+                        this->blockUsed = 0;
+                    }
+                }
+                this->totalSize += data.size();
+            }
+
+            SHA256Digest finish() noexcept
+            {
+                const auto totalBits = this->totalSize * 8;
+                this->block[this->blockUsed++] = 0x80;
+                if (this->blockUsed > blockSize - 8)
+                {
+                    std::memset(this->block.data() + this->blockUsed, 0, blockSize - this->blockUsed);
+                    this->compress();
+                    this->blockUsed = 0;
+                }
+                std::memset(this->block.data() + this->blockUsed, 0, blockSize - 8 - this->blockUsed);
+                for (auto i = 0; i < 8; ++i)
+                {
+                    this->block[blockSize - 1 - i] = static_cast<std::uint8_t>(totalBits >> (8 * i));
+                }
+                this->compress();
+
+                auto digest = SHA256Digest{};
+                for (auto i = std::size_t{ 0 }; i < digest.size(); ++i)
+                {
+                    digest[i] = static_cast<std::uint8_t>(this->state[i / 4] >> (24 - 8 * (i % 4)));
+                }
+                return digest;
+            }
+
+        private:
+            void compress() noexcept
+            {
+                std::uint32_t schedule[64];
+                for (auto i = 0; i < 16; ++i)
+                {
+                    schedule[i] =
+                        (std::uint32_t{ this->block[4 * i] } << 24) |
+                        (std::uint32_t{ this->block[4 * i + 1] } << 16) |
+                        (std::uint32_t{ this->block[4 * i + 2] } << 8) |
+                        std::uint32_t{ this->block[4 * i + 3] };
+                }
+                for (auto i = 16; i < 64; ++i)
+                {
+                    const auto s0 = rotateRight(schedule[i - 15], 7) ^ rotateRight(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+                    const auto s1 = rotateRight(schedule[i - 2], 17) ^ rotateRight(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+                    schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+                }
+
+                auto [a, b, c, d, e, f, g, h] = this->state;
+                for (auto i = 0; i < 64; ++i)
+                {
+                    const auto s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+                    const auto choice = (e & f) ^ (~e & g);
+                    const auto temporary1 = h + s1 + choice + roundConstants[i] + schedule[i];
+                    const auto s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+                    const auto majority = (a & b) ^ (a & c) ^ (b & c);
+                    const auto temporary2 = s0 + majority;
+                    h = g;
+                    g = f;
+                    f = e;
+                    e = d + temporary1;
+                    d = c;
+                    c = b;
+                    b = a;
+                    a = temporary1 + temporary2;
+                }
+
+                const std::uint32_t results[8] = { a, b, c, d, e, f, g, h };
+                for (auto i = 0; i < 8; ++i)
+                {
+                    this->state[i] += results[i];
+                }
+            }
+
+            std::array<std::uint32_t, 8> state;
+            std::array<std::uint8_t, blockSize> block;
+            std::size_t blockUsed;
+            std::uint64_t totalSize;
+        };
+    }
+
+    SHA256Digest computeSHA256(const std::string_view data)
+    {
+        auto hash = SHA256{};
+        hash.update(data);
+        return hash.finish();
+    }
+
+    SHA256Digest computeHMAC(const std::string_view key, const std::string_view message)
+    {
+        // Keys longer than a block are hashed first, shorter ones are padded with zeroes
+        auto paddedKey = std::string(blockSize, '\0');
+        if (key.size() > blockSize)
+        {
+            const auto hashedKey = computeSHA256(key);
+            std::memcpy(paddedKey.data(), hashedKey.data(), hashedKey.size());
+        }
+        else
+        {
+            std::memcpy(paddedKey.data(), key.data(), key.size());
+        }
+
+        auto innerPad = paddedKey;
+        auto outerPad = paddedKey;
+        for (auto i = std::size_t{ 0 }; i < blockSize; ++i)
+        {
+            innerPad[i] = static_cast<char>(innerPad[i] ^ 0x36);
+            outerPad[i] = static_cast<char>(outerPad[i] ^ 0x5c);
+        }
+
+        auto inner = SHA256{};
+        inner.update(innerPad);
+        inner.update(message);
+        const auto innerDigest = inner.finish();
+
+        auto outer = SHA256{};
+        outer.update(outerPad);
+        outer.update({ reinterpret_cast<const char*>(innerDigest.data()), innerDigest.size() });
+        return outer.finish();
+    }
+
+    bool verifyHMAC(const std::string_view key, const std::string_view message, const std::string_view tag)
+    {
+        const auto expected = computeHMAC(key, message);
+        if (tag.size() != expected.size())
+        {
+            return false;
+        }
+
+        auto difference = 0;
+        for (auto i = std::size_t{ 0 }; i < expected.size(); ++i)
+        {
+            difference |= expected[i] ^ static_cast<std::uint8_t>(tag[i]);
+        }
+        return difference == 0;
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+namespace CNCOnlineForwarder::Utility
+{
+    using SHA256Digest = std::array<std::uint8_t, 32>;
+
+    SHA256Digest computeSHA256(const std::string_view data);
+
+    // HMAC-SHA256 as specified by RFC 2104, keys of any length are accepted
+    SHA256Digest computeHMAC(const std::string_view key, const std::string_view message);
+
+    // Returns: true if tag is the HMAC of message,
+    // in a time which doesn't depend on where they differ
+    bool verifyHMAC(const std::string_view key, const std::string_view message, const std::string_view tag);
+}
@@ -0,0 +1,515 @@
+#include "precompiled.h"
+#include "HTTPProxy.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "WeakRefHandler.hpp"
+
+namespace Http = boost::beast::http;
+using TCP = boost::asio::ip::tcp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder::HTTP
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<HTTPProxy>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& liveSessions = Metrics::gauge("httpProxy.sessions");
+
+        // Returns: key of the request inside the response cache,
+        // or nullopt if the request should not be cached.
+        std::optional<std::string> getCacheKey(const HTTPProxy::Request& request)
+        {
+            const auto method = request.method();
+            if (method != Http::verb::get && method != Http::verb::head)
+            {
+                return std::nullopt;
+            }
+
+            // Don't risk sharing per-user responses
+            if (request.count(Http::field::authorization) > 0 || request.count(Http::field::cookie) > 0)
+            {
+                return std::nullopt;
+            }
+
+            // Beast may use boost::string_view, which std::string can't be appended with
+            const auto methodName = request.method_string();
+            const auto target = request.target();
+            const auto encoding = request[Http::field::accept_encoding];
+            auto key = std::string{};
+            key.append(methodName.data(), methodName.size());
+            key += ' ';
+            key.append(target.data(), target.size());
+            // gzip and identity responses must not be served to each other's clients,
+            // responses varying on anything else are never cached (see ResponseCache::getLifetime)
+            key += '\n';
+            key.append(encoding.data(), encoding.size());
+            return key;
+        }
+
+        void removeHopByHopFields(Http::fields& fields)
+        {
+            for (const auto field :
+            {
+                Http::field::connection,
+                Http::field::keep_alive,
+                Http::field::proxy_connection,
+                Http::field::te,
+                Http::field::trailer,
+                Http::field::transfer_encoding,
+                Http::field::upgrade
+            })
+            {
+                fields.erase(field);
+            }
+        }
+
+        void prepareUpstreamRequest(HTTPProxy::Request& request, const HTTPProxyOptions& options)
+        {
+            removeHopByHopFields(request);
+            request.version(11);
+            request.set(Http::field::host, options.upstreamHostName);
+            request.keep_alive(true);
+            request.prepare_payload();
+        }
+
+        HTTPProxy::SharedResponse prepareResponse
+        (
+            std::shared_ptr<HTTPProxy::Response> response,
+            const bool isHead
+        )
+        {
+            removeHopByHopFields(*response);
+            // Response of HEAD requests should keep the original Content-Length
+            if (!isHead)
+            {
+                response->prepare_payload();
+            }
+            return response;
+        }
+
+        HTTPProxy::Response makeErrorResponse(const Http::status status)
+        {
+            auto response = HTTPProxy::Response{ status, 11 };
+            response.set(Http::field::server, BOOST_BEAST_VERSION_STRING);
+            response.set(Http::field::content_type, "text/plain");
+            response.body() = std::string{ Http::obsolete_reason(status) };
+            response.prepare_payload();
+            return response;
+        }
+    }
+
+    class HTTPProxy::Session : public std::enable_shared_from_this<Session>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        using TCPStream = boost::beast::tcp_stream;
+        using FlatBuffer = boost::beast::flat_buffer;
+
+        static constexpr auto description = "HTTPSession";
+
+        static void start
+        (
+            const std::weak_ptr<HTTPProxy>& proxy,
+            const Strand& strand,
+            TCP::socket socket
+        )
+        {
+            const auto self = std::make_shared<Session>
+            (
+                PrivateConstructor{},
+                proxy,
+                strand,
+                std::move(socket)
+            );
+
+            boost::asio::defer(self->strand, [self] { self->readRequest(); });
+        }
+
+        Session
+        (
+            PrivateConstructor,
+            const std::weak_ptr<HTTPProxy>& proxy,
+            const Strand& strand,
+            TCP::socket socket
+        ) :
+            proxy{ proxy },
+            strand{ strand },
+            stream{ std::move(socket) },
+            buffer{},
+            request{},
+            response{}
+        {
+            liveSessions.add();
+        }
+
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+
+        ~Session()
+        {
+            liveSessions.subtract();
+        }
+
+    private:
+        template<typename... Arguments>
+        static void log(const LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<Session>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        void readRequest()
+        {
+            this->request = {};
+            this->stream.expires_after(std::chrono::seconds{ 30 });
+            Http::async_read
+            (
+                this->stream,
+                this->buffer,
+                this->request,
+                boost::beast::bind_front_handler
+                (
+                    &Session::onRead,
+                    this->shared_from_this()
+                )
+            );
+        }
+
+        void onRead(const ErrorCode& code, const std::size_t /* bytesTransferred */)
+        {
+            if (code == Http::error::end_of_stream)
+            {
+                return this->close();
+            }
+
+            if (code.failed())
+            {
+                log(LogLevel::info, "Async read failed: ", code);
+                return;
+            }
+
+            const auto proxy = this->proxy.lock();
+            if (!proxy)
+            {
+                log(LogLevel::warning, "HTTPProxy already died when handling request");
+                return;
+            }
+
+            log(LogLevel::info, "Request: ", this->request.method_string(), " ", this->request.target());
+            auto onResponse = [self = this->shared_from_this()](SharedResponse response)
+            {
+                boost::asio::defer
+                (
+                    self->strand,
+                    [self, response = std::move(response)] { self->writeResponse(response); }
+                );
+            };
+            proxy->fetch(this->request, std::move(onResponse));
+        }
+
+        void writeResponse(const SharedResponse& response)
+        {
+            this->response = response ? *response : makeErrorResponse(Http::status::bad_gateway);
+            this->response.version(this->request.version());
+            this->response.keep_alive(this->request.keep_alive());
+
+            this->stream.expires_after(std::chrono::seconds{ 30 });
+            Http::async_write
+            (
+                this->stream,
+                this->response,
+                boost::beast::bind_front_handler
+                (
+                    &Session::onWrite,
+                    this->shared_from_this(),
+                    this->response.need_eof()
+                )
+            );
+        }
+
+        void onWrite(const bool close, const ErrorCode& code, const std::size_t /* bytesTransferred */)
+        {
+            if (code.failed())
+            {
+                log(LogLevel::info, "Async write failed: ", code);
+                return;
+            }
+
+            if (close)
+            {
+                return this->close();
+            }
+
+            this->readRequest();
+        }
+
+        void close()
+        {
+            auto ignored = ErrorCode{};
+            this->stream.socket().shutdown(TCP::socket::shutdown_send, ignored);
+        }
+
+        std::weak_ptr<HTTPProxy> proxy;
+        Strand strand;
+        TCPStream stream;
+        FlatBuffer buffer;
+        Request request;
+        Response response;
+    };
+
+    std::shared_ptr<HTTPProxy> HTTPProxy::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const HTTPProxyOptions& options
+    )
+    {
+        const auto self = std::make_shared<HTTPProxy>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            options
+        );
+
+        const auto action = [](HTTPProxy& self)
+        {
+            logLine(LogLevel::info, "HTTPProxy created, listening on port ", self.options.port);
+            self.prepareForNextConnection();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    HTTPProxy::HTTPProxy
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const HTTPProxyOptions& options
+    ) :
+        objectMaker{ objectMaker },
+        options{ options },
+        strand{ objectMaker.makeStrand() },
+        acceptor{ strand, TCP::endpoint{ TCP::v4(), options.port } },
+        cache{ options.cacheCapacity },
+        inFlight{},
+        idleUpstreams{},
+        upstreamCount{ 0 },
+        pendingUpstreamRequests{}
+    {
+        Profiling::nameStrand(&this->strand, description);
+    }
+
+    void HTTPProxy::fetch(Request request, ResponseHandler handler)
+    {
+        auto action = [request = std::move(request), handler = std::move(handler)](HTTPProxy& self) mutable
+        {
+            self.handleFetch(std::move(request), std::move(handler));
+        };
+
+        boost::asio::defer(this->strand, makeWeakHandler(this, std::move(action)));
+    }
+
+    std::future<void> HTTPProxy::stopAccepting()
+    {
+        auto closed = std::make_shared<std::promise<void>>();
+        auto future = closed->get_future();
+        auto action = [closed](HTTPProxy& self)
+        {
+            logLine(LogLevel::info, "No longer accepting connections on port ", self.options.port);
+            auto ignored = ErrorCode{};
+            self.acceptor->close(ignored);
+            closed->set_value();
+        };
+
+        boost::asio::defer(this->strand, makeWeakHandler(this, std::move(action)));
+        return future;
+    }
+
+    void HTTPProxy::prepareForNextConnection()
+    {
+        const auto sessionStrand = this->objectMaker.makeStrand();
+        auto onAccept = [sessionStrand](HTTPProxy& self, const ErrorCode& code, TCP::socket socket)
+        {
+            if (!self.acceptor->is_open())
+            {
+                // Closed by stopAccepting()
+                return;
+            }
+            self.prepareForNextConnection();
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async accept failed: ", code);
+                return;
+            }
+
+            auto endPointCode = ErrorCode{};
+            logLine(LogLevel::info, "New HTTP client: ", socket.remote_endpoint(endPointCode));
+            Session::start(self.weak_from_this(), sessionStrand, std::move(socket));
+        };
+
+        this->acceptor.asyncAccept(sessionStrand, makeWeakHandler(this, std::move(onAccept)));
+    }
+
+    void HTTPProxy::handleFetch(Request request, ResponseHandler handler)
+    {
+        const auto key = getCacheKey(request);
+        prepareUpstreamRequest(request, this->options);
+
+        if (!key.has_value())
+        {
+            logLine(LogLevel::info, "Request is not cacheable, forwarding directly");
+            return this->sendToUpstream(std::move(request), std::move(handler));
+        }
+
+        const auto lookup = this->cache.find(key.value(), ResponseCache::Clock::now());
+        switch (lookup.freshness)
+        {
+        case ResponseCache::Freshness::fresh:
+            logLine(LogLevel::info, "Cache hit: ", key.value());
+            return handler(lookup.response);
+        case ResponseCache::Freshness::stale:
+            logLine(LogLevel::info, "Serving stale response while revalidating: ", key.value());
+            handler(lookup.response);
+            return this->fetchCollapsed(key.value(), std::move(request), nullptr);
+        default:
+            logLine(LogLevel::info, "Cache miss: ", key.value());
+            return this->fetchCollapsed(key.value(), std::move(request), std::move(handler));
+        }
+    }
+
+    void HTTPProxy::fetchCollapsed
+    (
+        const std::string& key,
+        Request request,
+        ResponseHandler handler
+    )
+    {
+        const auto [position, inserted] = this->inFlight.try_emplace(key);
+        if (handler)
+        {
+            position->second.emplace_back(std::move(handler));
+        }
+
+        if (!inserted)
+        {
+            logLine(LogLevel::info, "Request already in flight, waiting for it: ", key);
+            return;
+        }
+
+        auto onResponse = [key](HTTPProxy& self, SharedResponse response)
+        {
+            self.handleCollapsedResponse(key, std::move(response));
+        };
+        this->sendToUpstream(std::move(request), makeWeakHandler(this, std::move(onResponse)));
+    }
+
+    void HTTPProxy::handleCollapsedResponse(const std::string& key, SharedResponse response)
+    {
+        const auto position = this->inFlight.find(key);
+        auto waiters = std::move(position->second);
+        this->inFlight.erase(position);
+
+        if (response)
+        {
+            const auto defaultLifetime = ResponseCache::Lifetime
+            {
+                this->options.defaultTimeToLive,
+                this->options.staleWhileRevalidate
+            };
+            const auto lifetime = ResponseCache::getLifetime(*response, defaultLifetime);
+            if (lifetime.has_value())
+            {
+                const auto now = ResponseCache::Clock::now();
+                this->cache.store(key, response, lifetime.value(), now);
+                logLine(LogLevel::info, "Response cached: ", key, ", cache size = ", this->cache.getSize());
+            }
+        }
+
+        for (const auto& waiter : waiters)
+        {
+            waiter(response);
+        }
+    }
+
+    void HTTPProxy::sendToUpstream(Request request, ResponseHandler handler)
+    {
+        if (!this->idleUpstreams.empty())
+        {
+            auto connection = std::move(this->idleUpstreams.back());
+            this->idleUpstreams.pop_back();
+            return this->startUpstreamRequest(std::move(connection), std::move(request), std::move(handler));
+        }
+
+        if (this->upstreamCount < this->options.maxUpstreamConnections)
+        {
+            ++this->upstreamCount;
+            auto connection = UpstreamConnection::create
+            (
+                this->objectMaker,
+                this->options.upstreamHostName,
+                this->options.upstreamPort
+            );
+            return this->startUpstreamRequest(std::move(connection), std::move(request), std::move(handler));
+        }
+
+        this->pendingUpstreamRequests.emplace_back(std::move(request), std::move(handler));
+    }
+
+    void HTTPProxy::startUpstreamRequest
+    (
+        std::shared_ptr<UpstreamConnection> connection,
+        Request request,
+        ResponseHandler handler
+    )
+    {
+        const auto isHead = (request.method() == Http::verb::head);
+        auto onResponse = [ref = this->weak_from_this(), strand = this->strand, connection, isHead, handler = std::move(handler)]
+        (
+            std::shared_ptr<Response> response,
+            const bool reusable
+        )
+        {
+            auto action = [connection, response = std::move(response), reusable, isHead, handler](HTTPProxy& self)
+            {
+                auto prepared = response ? prepareResponse(response, isHead) : nullptr;
+                self.handleUpstreamResponse(connection, reusable);
+                handler(std::move(prepared));
+            };
+            boost::asio::defer(strand, makeWeakHandler(ref, std::move(action)));
+        };
+
+        connection->asyncSend(std::move(request), std::move(onResponse));
+    }
+
+    void HTTPProxy::handleUpstreamResponse
+    (
+        std::shared_ptr<UpstreamConnection> connection,
+        const bool reusable
+    )
+    {
+        if (reusable)
+        {
+            this->idleUpstreams.emplace_back(std::move(connection));
+        }
+        else
+        {
+            --this->upstreamCount;
+        }
+
+        if (!this->pendingUpstreamRequests.empty())
+        {
+            auto [request, handler] = std::move(this->pendingUpstreamRequests.front());
+            this->pendingUpstreamRequests.pop_front();
+            this->sendToUpstream(std::move(request), std::move(handler));
+        }
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio/ip/tcp.hpp>
+#include "HTTPResponseCache.h"
+#include "HTTPUpstreamConnection.h"
+#include "IOManager.hpp"
+#include "Options.h"
+
+namespace CNCOnlineForwarder::HTTP
+{
+    // Local HTTP server which forwards requests to the C&C:Online HTTP server.
+    // Responses are cached, and concurrent identical requests are collapsed
+    // into a single upstream request.
+    class HTTPProxy : public std::enable_shared_from_this<HTTPProxy>
+    {
+    private:
+        struct PrivateConstructor {};
+        class Session;
+    public:
+        using Strand = IOManager::StrandType;
+        using Acceptor = WithStrand<boost::asio::ip::tcp::acceptor>;
+        using Request = UpstreamConnection::Request;
+        using Response = ResponseCache::Response;
+        using SharedResponse = ResponseCache::SharedResponse;
+        // response is null if it cannot be retrieved from upstream
+        using ResponseHandler = std::function<void(SharedResponse response)>;
+
+        static constexpr auto description = "HTTPProxy";
+
+        static std::shared_ptr<HTTPProxy> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const HTTPProxyOptions& options
+        );
+
+        HTTPProxy
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const HTTPProxyOptions& options
+        );
+
+        // handler will be executed inside HTTPProxy's strand
+        void fetch(Request request, ResponseHandler handler);
+
+        // Close the listening socket, established sessions keep being served.
+        // The future is ready once the port is released.
+        std::future<void> stopAccepting();
+
+    private:
+        void prepareForNextConnection();
+
+        void handleFetch(Request request, ResponseHandler handler);
+
+        void fetchCollapsed
+        (
+            const std::string& key,
+            Request request,
+            ResponseHandler handler
+        );
+
+        void handleCollapsedResponse(const std::string& key, SharedResponse response);
+
+        void sendToUpstream(Request request, ResponseHandler handler);
+
+        void startUpstreamRequest
+        (
+            std::shared_ptr<UpstreamConnection> connection,
+            Request request,
+            ResponseHandler handler
+        );
+
+        void handleUpstreamResponse
+        (
+            std::shared_ptr<UpstreamConnection> connection,
+            const bool reusable
+        );
+
+        IOManager::ObjectMaker objectMaker;
+        HTTPProxyOptions options;
+        Strand strand;
+        Acceptor acceptor;
+        ResponseCache cache;
+        std::unordered_map<std::string, std::vector<ResponseHandler>> inFlight;
+        std::vector<std::shared_ptr<UpstreamConnection>> idleUpstreams;
+        std::size_t upstreamCount;
+        std::deque<std::pair<Request, ResponseHandler>> pendingUpstreamRequests;
+    };
+}
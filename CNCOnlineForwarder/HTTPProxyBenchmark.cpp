@@ -0,0 +1,266 @@
+#include "precompiled.h"
+#include "HTTPProxyBenchmark.h"
+#include <thread>
+#include "Histogram.hpp"
+#include "HTTPProxy.h"
+#include "IOManager.hpp"
+#include "Logging.h"
+
+namespace Http = boost::beast::http;
+using TCP = boost::asio::ip::tcp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct HTTPProxyBenchmark
+        {
+            static constexpr auto description = "HTTPProxyBenchmark";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<HTTPProxyBenchmark>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        // Keep-alive connections sending requests back to back
+        constexpr auto clientCount = std::size_t{ 8 };
+        // Distinct targets requested by the clients
+        constexpr auto targetCount = std::size_t{ 64 };
+        constexpr auto bodySize = std::size_t{ 4096 };
+
+        const auto loopback = boost::asio::ip::address_v4::loopback();
+
+        std::uint16_t findFreePort(boost::asio::io_context& context)
+        {
+            auto acceptor = TCP::acceptor{ context, TCP::endpoint{ loopback, 0 } };
+            return acceptor.local_endpoint().port();
+        }
+
+        // Stand-in of http.server.cnc-online.net, answers every request with bodySize bytes,
+        // which may be cached if the target starts with /cached
+        class Upstream
+        {
+        public:
+            Upstream(boost::asio::io_context& context) :
+                acceptor{ context, TCP::endpoint{ loopback, 0 } },
+                requests{ 0 }
+            {
+                this->accept();
+            }
+
+            std::uint16_t getPort() const
+            {
+                return this->acceptor.local_endpoint().port();
+            }
+
+            std::uint64_t getRequests() const noexcept
+            {
+                return this->requests.load(std::memory_order_relaxed);
+            }
+
+        private:
+            struct Session
+            {
+                Session(TCP::socket socket) : stream{ std::move(socket) } {}
+
+                boost::beast::tcp_stream stream;
+                boost::beast::flat_buffer buffer;
+                Http::request<Http::string_body> request;
+                Http::response<Http::string_body> response;
+            };
+
+            void accept()
+            {
+                this->acceptor.async_accept([this](const ErrorCode& code, TCP::socket socket)
+                {
+                    if (code.failed())
+                    {
+                        return;
+                    }
+                    this->read(std::make_shared<Session>(std::move(socket)));
+                    this->accept();
+                });
+            }
+
+            void read(const std::shared_ptr<Session>& session)
+            {
+                session->request = {};
+                Http::async_read
+                (
+                    session->stream,
+                    session->buffer,
+                    session->request,
+                    [this, session](const ErrorCode& code, const std::size_t)
+                    {
+                        if (code.failed())
+                        {
+                            return;
+                        }
+                        this->requests.fetch_add(1, std::memory_order_relaxed);
+                        this->write(session);
+                    }
+                );
+            }
+
+            void write(const std::shared_ptr<Session>& session)
+            {
+                const auto cacheable = (session->request.target().find("/cached") == 0);
+                session->response = Http::response<Http::string_body>{ Http::status::ok, 11 };
+                session->response.set(Http::field::cache_control, cacheable ? "max-age=3600" : "no-store");
+                session->response.set(Http::field::content_type, "text/plain");
+                session->response.body() = std::string(bodySize, 'x');
+                session->response.keep_alive(true);
+                session->response.prepare_payload();
+                Http::async_write
+                (
+                    session->stream,
+                    session->response,
+                    [this, session](const ErrorCode& code, const std::size_t)
+                    {
+                        if (!code.failed())
+                        {
+                            this->read(session);
+                        }
+                    }
+                );
+            }
+
+            TCP::acceptor acceptor;
+            std::atomic<std::uint64_t> requests;
+        };
+
+        struct Clients
+        {
+            Clients() : responses{ 0 }, failures{ 0 }, stopping{ false } {}
+
+            // Sends requests over a single connection until stopping
+            void run(const std::uint16_t port, const std::string& prefix, const std::size_t index)
+            {
+                auto context = boost::asio::io_context{};
+                auto stream = boost::beast::tcp_stream{ context };
+                auto buffer = boost::beast::flat_buffer{};
+                auto code = ErrorCode{};
+                stream.socket().connect(TCP::endpoint{ loopback, port }, code);
+                for (auto i = index; !code.failed() && !this->stopping.load(std::memory_order_relaxed); ++i)
+                {
+                    auto request = Http::request<Http::empty_body>{ Http::verb::get, prefix + std::to_string(i % targetCount), 11 };
+                    request.set(Http::field::host, "localhost");
+                    request.keep_alive(true);
+                    auto response = Http::response<Http::string_body>{};
+
+                    const auto start = std::chrono::steady_clock::now();
+                    Http::write(stream, request, code);
+                    if (!code.failed())
+                    {
+                        Http::read(stream, buffer, response, code);
+                    }
+                    if (code.failed() || response.result() != Http::status::ok)
+                    {
+                        break;
+                    }
+                    const auto latency = std::chrono::steady_clock::now() - start;
+                    this->latencies.record(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+                    this->responses.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                if (!this->stopping.load(std::memory_order_relaxed))
+                {
+                    this->failures.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+
+            Metrics::Histogram latencies;
+            std::atomic<std::uint64_t> responses;
+            // Connections which stopped before the end of the run
+            std::atomic<std::uint64_t> failures;
+            std::atomic<bool> stopping;
+        };
+
+        std::string run(const BenchmarkOptions& options, const bool cacheable)
+        {
+            auto upstreamContext = boost::asio::io_context{};
+            auto upstream = Upstream{ upstreamContext };
+            const auto proxyOptions = HTTPProxyOptions
+            {
+                findFreePort(upstreamContext),
+                loopback.to_string(),
+                upstream.getPort(),
+                4,
+                16 * 1024 * 1024,
+                std::chrono::seconds{ 60 },
+                std::chrono::seconds{ 600 }
+            };
+            auto upstreamThread = std::thread{ [&upstreamContext] { upstreamContext.run(); } };
+
+            const auto ioManager = IOManager::create();
+            const auto proxy = HTTP::HTTPProxy::create(IOManager::ObjectMaker{ ioManager }, proxyOptions);
+            auto workers = std::vector<std::thread>{};
+            for (auto i = std::size_t{ 0 }; i < ioManager->getWorkerCount(); ++i)
+            {
+                workers.emplace_back([ioManager, i] { ioManager->runWorker(i); });
+            }
+
+            const auto clients = std::make_unique<Clients>();
+            const auto prefix = std::string{ cacheable ? "/cached/" : "/uncached/" };
+            const auto start = std::chrono::steady_clock::now();
+            auto clientThreads = std::vector<std::thread>{};
+            for (auto i = std::size_t{ 0 }; i < clientCount; ++i)
+            {
+                clientThreads.emplace_back([&clients, &proxyOptions, &prefix, i]
+                {
+                    clients->run(proxyOptions.port, prefix, i);
+                });
+            }
+
+            std::this_thread::sleep_for(options.duration);
+            clients->stopping.store(true, std::memory_order_relaxed);
+            for (auto& thread : clientThreads)
+            {
+                thread.join();
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+
+            ioManager->stop();
+            for (auto& thread : workers)
+            {
+                thread.join();
+            }
+            upstreamContext.stop();
+            upstreamThread.join();
+
+            const auto responses = clients->responses.load();
+            const auto snapshot = clients->latencies.snapshot();
+            const auto seconds = std::chrono::duration<double>{ elapsed }.count();
+            const auto toMicroseconds = [](const std::uint64_t nanoseconds) { return nanoseconds / 1000.0; };
+            auto summary = std::ostringstream{};
+            summary << (cacheable ? "Cacheable" : "Uncacheable") << ": "
+                << static_cast<std::uint64_t>(responses / seconds) << " requests/s, "
+                << "latency p50 " << toMicroseconds(snapshot.getQuantile(0.5)) << "us"
+                << " p99 " << toMicroseconds(snapshot.getQuantile(0.99)) << "us"
+                << " max " << toMicroseconds(snapshot.getMax()) << "us, "
+                << upstream.getRequests() << " of " << responses << " requests reached upstream, "
+                << clients->failures.load() << " of " << clientCount << " connections failed";
+            return summary.str();
+        }
+    }
+
+    void runHTTPProxyBenchmark(const BenchmarkOptions& options)
+    {
+        logLine
+        (
+            LogLevel::info,
+            "Sending requests for ", targetCount, " targets over ", clientCount,
+            " connections for ", options.duration.count(), "s, with cacheable and uncacheable responses"
+        );
+        for (const auto cacheable : { true, false })
+        {
+            const auto summary = run(options, cacheable);
+            logLine(LogLevel::info, summary);
+            std::cout << summary << std::endl;
+        }
+    }
+}
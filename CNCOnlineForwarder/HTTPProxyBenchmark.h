@@ -0,0 +1,11 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Sends keep-alive GET requests through an HTTPProxy to a stand-in upstream server
+    // on loopback, once for cacheable responses and once for uncacheable ones,
+    // and reports the requests per second, their latency and how many of them
+    // reached the upstream server. Blocking.
+    void runHTTPProxyBenchmark(const BenchmarkOptions& options);
+}
@@ -0,0 +1,200 @@
+#include "precompiled.h"
+#include "HTTPResponseCache.h"
+
+namespace Http = boost::beast::http;
+
+namespace CNCOnlineForwarder::HTTP
+{
+    namespace
+    {
+        std::size_t estimateSize(const std::string& key, const ResponseCache::Response& response)
+        {
+            auto size = key.size() + response.body().size();
+            for (const auto& field : response)
+            {
+                size += field.name_string().size() + field.value().size();
+            }
+            return size;
+        }
+
+        // Returns: value of a "name=value" directive of Cache-Control,
+        // if the directive has the specified name
+        std::optional<std::chrono::seconds> parseSecondsDirective
+        (
+            const std::string_view directive,
+            const std::string_view name
+        )
+        {
+            if ((directive.size() <= name.size()) || (directive.compare(0, name.size(), name) != 0))
+            {
+                return std::nullopt;
+            }
+
+            if (directive.at(name.size()) != '=')
+            {
+                return std::nullopt;
+            }
+
+            try
+            {
+                const auto value = std::string{ directive.substr(name.size() + 1) };
+                return std::chrono::seconds{ std::stoul(value) };
+            }
+            catch (const std::exception&)
+            {
+                return std::nullopt;
+            }
+        }
+    }
+
+    std::optional<ResponseCache::Lifetime> ResponseCache::getLifetime
+    (
+        const Response& response,
+        const Lifetime& defaultLifetime
+    )
+    {
+        switch (response.result())
+        {
+        case Http::status::ok:
+        case Http::status::non_authoritative_information:
+        case Http::status::moved_permanently:
+        case Http::status::not_found:
+        case Http::status::gone:
+            break;
+        default:
+            return std::nullopt;
+        }
+
+        if (response.count(Http::field::set_cookie) > 0)
+        {
+            return std::nullopt;
+        }
+
+        // Cache keys only tell apart requests by their Accept-Encoding
+        auto vary = std::string{ response[Http::field::vary] };
+        boost::algorithm::to_lower(vary);
+        auto varyingFields = std::vector<std::string>{};
+        boost::algorithm::split(varyingFields, vary, boost::algorithm::is_any_of(","));
+        for (auto& field : varyingFields)
+        {
+            boost::algorithm::trim(field);
+            if (!field.empty() && field != "accept-encoding")
+            {
+                return std::nullopt;
+            }
+        }
+
+        auto lifetime = defaultLifetime;
+        auto cacheControl = std::string{ response[Http::field::cache_control] };
+        boost::algorithm::to_lower(cacheControl);
+
+        auto directives = std::vector<std::string>{};
+        boost::algorithm::split(directives, cacheControl, boost::algorithm::is_any_of(","));
+        for (auto& directive : directives)
+        {
+            boost::algorithm::trim(directive);
+            if (directive == "no-store" || directive == "no-cache" || directive == "private")
+            {
+                return std::nullopt;
+            }
+
+            if (const auto maxAge = parseSecondsDirective(directive, "max-age"))
+            {
+                lifetime.timeToLive = maxAge.value();
+            }
+            else if (const auto sharedMaxAge = parseSecondsDirective(directive, "s-maxage"))
+            {
+                lifetime.timeToLive = sharedMaxAge.value();
+            }
+            else if (const auto stale = parseSecondsDirective(directive, "stale-while-revalidate"))
+            {
+                lifetime.staleWhileRevalidate = stale.value();
+            }
+        }
+
+        return lifetime;
+    }
+
+    ResponseCache::ResponseCache(const std::size_t capacity) :
+        capacity{ capacity },
+        size{ 0 },
+        entries{},
+        index{}
+    {}
+
+    ResponseCache::LookupResult ResponseCache::find
+    (
+        const std::string& key,
+        const Clock::time_point now
+    )
+    {
+        const auto position = this->index.find(key);
+        if (position == this->index.end())
+        {
+            return { nullptr, Freshness::missing };
+        }
+
+        const auto entry = position->second;
+        if (now >= entry->staleUntil)
+        {
+            this->erase(entry);
+            return { nullptr, Freshness::missing };
+        }
+
+        // Move to the front of LRU list
+        this->entries.splice(this->entries.begin(), this->entries, entry);
+        const auto freshness = (now < entry->freshUntil) ? Freshness::fresh : Freshness::stale;
+        return { entry->response, freshness };
+    }
+
+    void ResponseCache::store
+    (
+        const std::string& key,
+        SharedResponse response,
+        const Lifetime& lifetime,
+        const Clock::time_point now
+    )
+    {
+        if (const auto existing = this->index.find(key); existing != this->index.end())
+        {
+            this->erase(existing->second);
+        }
+
+        const auto entrySize = estimateSize(key, *response);
+        // Don't let a single response flush most of the cache
+        if (entrySize > (this->capacity / 8))
+        {
+            return;
+        }
+
+        this->evictUntilFits(entrySize);
+
+        const auto freshUntil = now + lifetime.timeToLive;
+        this->entries.push_front
+        (
+            Entry{ key, std::move(response), entrySize, freshUntil, freshUntil + lifetime.staleWhileRevalidate }
+        );
+        this->index.emplace(key, this->entries.begin());
+        this->size += entrySize;
+    }
+
+    std::size_t ResponseCache::getSize() const noexcept
+    {
+        return this->size;
+    }
+
+    void ResponseCache::erase(const Entries::iterator entry)
+    {
+        this->size -= entry->size;
+        this->index.erase(entry->key);
+        this->entries.erase(entry);
+    }
+
+    void ResponseCache::evictUntilFits(const std::size_t incomingSize)
+    {
+        while (!this->entries.empty() && (this->size + incomingSize > this->capacity))
+        {
+            this->erase(std::prev(this->entries.end()));
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/string_body.hpp>
+
+namespace CNCOnlineForwarder::HTTP
+{
+    // Size-bounded LRU cache of HTTP responses.
+    // Not thread safe: it's supposed to be used only inside HTTPProxy's strand.
+    class ResponseCache
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Response = boost::beast::http::response<boost::beast::http::string_body>;
+        using SharedResponse = std::shared_ptr<const Response>;
+
+        enum class Freshness
+        {
+            missing,
+            fresh,
+            stale,
+        };
+
+        struct LookupResult
+        {
+            SharedResponse response;
+            Freshness freshness;
+        };
+
+        struct Lifetime
+        {
+            Clock::duration timeToLive;
+            Clock::duration staleWhileRevalidate;
+        };
+
+        // Returns: how long the response may be cached,
+        // or nullopt if the response must not be cached at all
+        static std::optional<Lifetime> getLifetime
+        (
+            const Response& response,
+            const Lifetime& defaultLifetime
+        );
+
+        ResponseCache(const std::size_t capacity);
+
+        LookupResult find(const std::string& key, const Clock::time_point now);
+
+        void store
+        (
+            const std::string& key,
+            SharedResponse response,
+            const Lifetime& lifetime,
+            const Clock::time_point now
+        );
+
+        std::size_t getSize() const noexcept;
+
+    private:
+        struct Entry
+        {
+            std::string key;
+            SharedResponse response;
+            std::size_t size;
+            Clock::time_point freshUntil;
+            Clock::time_point staleUntil;
+        };
+
+        using Entries = std::list<Entry>;
+
+        void erase(const Entries::iterator entry);
+
+        void evictUntilFits(const std::size_t incomingSize);
+
+        std::size_t capacity;
+        std::size_t size;
+        Entries entries;
+        std::unordered_map<std::string, Entries::iterator> index;
+    };
+}
@@ -0,0 +1,206 @@
+#include "precompiled.h"
+#include "HTTPUpstreamConnection.h"
+#include "Logging.h"
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::HTTP
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<UpstreamConnection>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    std::shared_ptr<UpstreamConnection> UpstreamConnection::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::string_view hostName,
+        const std::uint16_t port
+    )
+    {
+        return std::make_shared<UpstreamConnection>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            hostName,
+            port
+        );
+    }
+
+    UpstreamConnection::UpstreamConnection
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::string_view hostName,
+        const std::uint16_t port
+    ) :
+        strand{ objectMaker.makeStrand() },
+        resolver{ strand },
+        stream{ strand },
+        buffer{},
+        hostName{ hostName },
+        port{ std::to_string(port) },
+        connected{ false },
+        retried{ false },
+        request{},
+        parser{},
+        handler{}
+    {}
+
+    void UpstreamConnection::asyncSend(Request request, ResponseHandler handler)
+    {
+        auto action = [self = this->shared_from_this(), request = std::move(request), handler = std::move(handler)]() mutable
+        {
+            self->request = std::move(request);
+            self->handler = std::move(handler);
+            self->retried = false;
+
+            if (self->connected)
+            {
+                return self->write();
+            }
+
+            return self->connect();
+        };
+
+        boost::asio::defer(this->strand, std::move(action));
+    }
+
+    void UpstreamConnection::connect()
+    {
+        logLine(LogLevel::info, "Connecting to ", this->hostName, ":", this->port);
+        this->resolver.asyncResolve
+        (
+            this->hostName,
+            this->port,
+            boost::asio::bind_executor
+            (
+                this->strand,
+                boost::beast::bind_front_handler
+                (
+                    &UpstreamConnection::onResolve,
+                    this->shared_from_this()
+                )
+            )
+        );
+    }
+
+    void UpstreamConnection::onResolve(const ErrorCode& code, const ResolvedHostName& results)
+    {
+        if (code.failed())
+        {
+            return this->fail("Resolve", code);
+        }
+
+        this->stream.expires_after(std::chrono::seconds{ 30 });
+        this->stream.async_connect
+        (
+            results,
+            boost::beast::bind_front_handler
+            (
+                &UpstreamConnection::onConnect,
+                this->shared_from_this()
+            )
+        );
+    }
+
+    void UpstreamConnection::onConnect(const ErrorCode& code, const TCPEndPoint& endPoint)
+    {
+        if (code.failed())
+        {
+            return this->fail("Connect", code);
+        }
+
+        logLine(LogLevel::info, "Connected to ", endPoint);
+        this->connected = true;
+        this->write();
+    }
+
+    void UpstreamConnection::write()
+    {
+        this->stream.expires_after(std::chrono::seconds{ 30 });
+        boost::beast::http::async_write
+        (
+            this->stream,
+            this->request,
+            boost::beast::bind_front_handler
+            (
+                &UpstreamConnection::onWrite,
+                this->shared_from_this()
+            )
+        );
+    }
+
+    void UpstreamConnection::onWrite(const ErrorCode& code, const std::size_t /* bytesTransferred */)
+    {
+        if (code.failed())
+        {
+            return this->fail("Write", code);
+        }
+
+        this->parser.emplace();
+        // Response of HEAD requests does not have a body, even if Content-Length is set
+        this->parser->skip(this->request.method() == boost::beast::http::verb::head);
+        boost::beast::http::async_read
+        (
+            this->stream,
+            this->buffer,
+            *this->parser,
+            boost::beast::bind_front_handler
+            (
+                &UpstreamConnection::onRead,
+                this->shared_from_this()
+            )
+        );
+    }
+
+    void UpstreamConnection::onRead(const ErrorCode& code, const std::size_t /* bytesTransferred */)
+    {
+        if (code.failed())
+        {
+            return this->fail("Read", code);
+        }
+
+        this->stream.expires_never();
+        auto response = std::make_shared<Response>(this->parser->release());
+        const auto reusable = response->keep_alive();
+        if (!reusable)
+        {
+            this->connected = false;
+            auto ignored = ErrorCode{};
+            this->stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+            this->stream.close();
+        }
+
+        this->complete(std::move(response), reusable);
+    }
+
+    void UpstreamConnection::fail(const std::string_view operation, const ErrorCode& code)
+    {
+        const auto wasConnected = this->connected;
+        this->connected = false;
+        this->stream.close();
+        this->buffer.clear();
+
+        // The upstream server may have closed an idle keep-alive connection,
+        // in that case reconnect and try again once.
+        if (wasConnected && !this->retried)
+        {
+            logLine(LogLevel::info, operation, " failed on reused connection, retrying: ", code);
+            this->retried = true;
+            return this->connect();
+        }
+
+        logLine(LogLevel::error, operation, " failed: ", code);
+        this->complete(nullptr, false);
+    }
+
+    void UpstreamConnection::complete(std::shared_ptr<Response> response, const bool reusable)
+    {
+        auto handler = std::move(this->handler);
+        this->handler = nullptr;
+        this->parser.reset();
+        handler(std::move(response), reusable);
+    }
+}
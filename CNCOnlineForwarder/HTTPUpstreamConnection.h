@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/core/tcp_stream.hpp>
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/parser.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include "IOManager.hpp"
+
+namespace CNCOnlineForwarder::HTTP
+{
+    // A persistent (keep-alive) connection to the upstream HTTP server.
+    // Only one request can be in progress at the same time.
+    class UpstreamConnection : public std::enable_shared_from_this<UpstreamConnection>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        using Strand = IOManager::StrandType;
+        using Resolver = WithStrand<boost::asio::ip::tcp::resolver>;
+        using TCPStream = boost::beast::tcp_stream;
+        using FlatBuffer = boost::beast::flat_buffer;
+        using Request = boost::beast::http::request<boost::beast::http::string_body>;
+        using Response = boost::beast::http::response<boost::beast::http::string_body>;
+        using ResponseParser = boost::beast::http::response_parser<boost::beast::http::string_body>;
+        // response is null if the request failed;
+        // reusable tells whether this connection can be used for next request.
+        using ResponseHandler = std::function<void(std::shared_ptr<Response> response, bool reusable)>;
+
+        static constexpr auto description = "HTTPUpstreamConnection";
+
+        static std::shared_ptr<UpstreamConnection> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const std::string_view hostName,
+            const std::uint16_t port
+        );
+
+        UpstreamConnection
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const std::string_view hostName,
+            const std::uint16_t port
+        );
+
+        void asyncSend(Request request, ResponseHandler handler);
+
+    private:
+        using ErrorCode = boost::beast::error_code;
+        using ResolvedHostName = boost::asio::ip::tcp::resolver::results_type;
+        using TCPEndPoint = boost::asio::ip::tcp::endpoint;
+
+        void connect();
+
+        void onResolve(const ErrorCode& code, const ResolvedHostName& results);
+
+        void onConnect(const ErrorCode& code, const TCPEndPoint& endPoint);
+
+        void write();
+
+        void onWrite(const ErrorCode& code, const std::size_t bytesTransferred);
+
+        void onRead(const ErrorCode& code, const std::size_t bytesTransferred);
+
+        void fail(const std::string_view operation, const ErrorCode& code);
+
+        void complete(std::shared_ptr<Response> response, const bool reusable);
+
+        Strand strand;
+        Resolver resolver;
+        TCPStream stream;
+        FlatBuffer buffer;
+        std::string hostName;
+        std::string port;
+        bool connected;
+        bool retried;
+        Request request;
+        std::optional<ResponseParser> parser;
+        ResponseHandler handler;
+    };
+}
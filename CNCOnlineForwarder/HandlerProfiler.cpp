@@ -0,0 +1,256 @@
+#include "precompiled.h"
+#include "HandlerProfiler.h"
+#include <map>
+#include <mutex>
+#include <boost/core/demangle.hpp>
+#include "Logging.h"
+#include "Metrics.h"
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Profiling
+{
+    class HandlerProfile
+    {
+    public:
+        static constexpr auto description = "HandlerProfiler";
+
+        explicit HandlerProfile(const std::string& name) :
+            name{ name },
+            execution{ Metrics::windowedHistogram("handlers." + name + ".executionNanoseconds") },
+            queueing{ Metrics::windowedHistogram("handlers." + name + ".queueingNanoseconds") },
+            overBudget{ Metrics::counter("handlers." + name + ".overBudget") },
+            lastWarnedAt{ 0 }
+        {}
+
+        std::string name;
+        Metrics::WindowedHistogram& execution;
+        Metrics::WindowedHistogram& queueing;
+        Metrics::Counter& overBudget;
+        // Clock ticks of the last warning, so a slow handler doesn't flood the log
+        std::atomic<Clock::rep> lastWarnedAt;
+    };
+
+    namespace
+    {
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<HandlerProfile>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        auto& overBudget = Metrics::counter("handlers.overBudget");
+        auto& unnamedBacklogs = Metrics::windowedHistogram("handlers.strandBacklog.unnamed");
+
+        constexpr auto backlogSlotCount = std::size_t{ 1 } << 12;
+        // Warnings about a kind of handler are logged at most once in this interval
+        constexpr auto warningInterval = std::chrono::seconds{ 10 };
+
+        auto budget = Clock::duration{ std::chrono::milliseconds{ 1 } };
+        std::array<StrandBacklog, backlogSlotCount> backlogs;
+
+        std::uint64_t toNanoseconds(const Clock::duration duration)
+        {
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            return static_cast<std::uint64_t>(std::max<decltype(nanoseconds)>(nanoseconds, 0));
+        }
+
+        // Returns: position of the character closing the bracket opened at begin
+        std::size_t findClosing(const std::string& text, const std::size_t begin)
+        {
+            const auto opening = text[begin];
+            const auto closing = (opening == '<') ? '>' : ((opening == '(') ? ')' : '}');
+            auto depth = std::size_t{ 0 };
+            for (auto i = begin; i < text.size(); ++i)
+            {
+                if (text[i] == opening)
+                {
+                    ++depth;
+                }
+                else if ((text[i] == closing) && (--depth == 0))
+                {
+                    return i;
+                }
+            }
+            return text.size();
+        }
+
+        // Removes template arguments and parameter lists
+        std::string removeBrackets(const std::string& text)
+        {
+            auto result = std::string{};
+            for (auto i = std::size_t{ 0 }; i < text.size(); ++i)
+            {
+                if ((text[i] == '<') || (text[i] == '('))
+                {
+                    // "(anonymous namespace)" is a name, not a parameter list
+                    if (text.compare(i, 21, "(anonymous namespace)") != 0)
+                    {
+                        i = findClosing(text, i);
+                        continue;
+                    }
+                }
+                result.push_back(text[i]);
+            }
+            return result;
+        }
+
+        // Turns demangled names such as
+        // CNCOnlineForwarder::Utility::WeakRefHandler<CNCOnlineForwarder::NatNeg::NatNegProxy,
+        //     CNCOnlineForwarder::NatNeg::NatNegProxy::prepareForNextPacketToServer()::{lambda(...)#1}>
+        // into NatNegProxy.prepareForNextPacketToServer
+        std::string getShortName(std::string name)
+        {
+            const auto weakRefHandler = std::string_view{ "WeakRefHandler<" };
+            if (const auto begin = name.find(weakRefHandler); begin != std::string::npos)
+            {
+                // The type of the handler is the last template argument
+                const auto arguments = begin + weakRefHandler.size();
+                const auto end = findClosing(name, arguments - 1);
+                auto depth = 0;
+                auto last = arguments;
+                for (auto i = arguments; i < end; ++i)
+                {
+                    depth += (name[i] == '<' || name[i] == '(' || name[i] == '{') ? 1 : 0;
+                    depth -= (name[i] == '>' || name[i] == ')' || name[i] == '}') ? 1 : 0;
+                    if ((depth == 0) && (name[i] == ','))
+                    {
+                        last = i + 1;
+                    }
+                }
+                name = name.substr(last, end - last);
+            }
+
+            auto lambdaIndex = std::string{};
+            if (const auto lambda = name.find("::{lambda("); lambda != std::string::npos)
+            {
+                const auto end = findClosing(name, lambda + 2);
+                const auto index = name.rfind('#', end);
+                if ((index != std::string::npos) && (index > lambda) && (name.compare(index, 3, "#1}") != 0))
+                {
+                    lambdaIndex = ".lambda" + name.substr(index + 1, end - index - 1);
+                }
+                name.erase(lambda);
+            }
+
+            name = removeBrackets(name);
+            boost::algorithm::trim(name);
+            if (const auto suffix = std::string_view{ " const" };
+                (name.size() > suffix.size()) && (name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0))
+            {
+                name.erase(name.size() - suffix.size());
+            }
+
+            // Class and function are enough to find the handler
+            auto components = std::vector<std::string>{};
+            boost::algorithm::split(components, name, boost::algorithm::is_any_of(":"), boost::algorithm::token_compress_on);
+            components.erase(std::remove(components.begin(), components.end(), ""), components.end());
+            const auto first = components.size() > 2 ? components.end() - 2 : components.begin();
+            auto result = std::string{};
+            for (auto i = first; i != components.end(); ++i)
+            {
+                result += (result.empty() ? "" : ".") + *i;
+            }
+            for (auto& character : result)
+            {
+                character = (character == ' ') ? '_' : character;
+            }
+            return (result.empty() ? "unknown" : result) + lambdaIndex;
+        }
+    }
+
+    void enable(const ProfilingOptions& options)
+    {
+        budget = options.budget;
+        Details::enabled.store(options.enabled, std::memory_order_relaxed);
+        if (options.enabled)
+        {
+            logLine
+            (
+                LogLevel::info,
+                "Profiling handlers, budget: ",
+                std::chrono::duration_cast<std::chrono::microseconds>(budget).count(), "us"
+            );
+        }
+    }
+
+    HandlerProfile& makeProfile(const std::type_info& type)
+    {
+        static auto mutex = std::mutex{};
+        static auto profiles = std::map<std::string, std::unique_ptr<HandlerProfile>, std::less<>>{};
+
+        // Different kinds of handlers may get the same short name, they just share their metrics
+        const auto name = getShortName(boost::core::demangle(type.name()));
+        const auto lock = std::scoped_lock{ mutex };
+        auto& profile = profiles[name];
+        if (!profile)
+        {
+            profile = std::make_unique<HandlerProfile>(name);
+        }
+        return *profile;
+    }
+
+    void recordExecution(HandlerProfile& profile, const Clock::duration duration) noexcept
+    {
+        profile.execution.record(toNanoseconds(duration));
+        if (duration <= budget)
+        {
+            return;
+        }
+
+        overBudget.add();
+        profile.overBudget.add();
+        const auto now = Clock::now().time_since_epoch().count();
+        auto lastWarnedAt = profile.lastWarnedAt.load(std::memory_order_relaxed);
+        const auto interval = std::chrono::duration_cast<Clock::duration>(warningInterval).count();
+        if (((now - lastWarnedAt) >= interval) && profile.lastWarnedAt.compare_exchange_strong(lastWarnedAt, now))
+        {
+            try
+            {
+                logLine
+                (
+                    LogLevel::warning,
+                    "Handler ", profile.name, " ran for ",
+                    std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), "us, over the budget of ",
+                    std::chrono::duration_cast<std::chrono::microseconds>(budget).count(), "us"
+                );
+            }
+            catch (...)
+            {
+                // Logging failures must not break the handler being profiled
+            }
+        }
+    }
+
+    void recordQueueing
+    (
+        HandlerProfile& profile,
+        const Clock::duration delay,
+        const StrandBacklog& backlog,
+        const std::size_t queued
+    ) noexcept
+    {
+        profile.queueing.record(toNanoseconds(delay));
+        const auto histogram = backlog.histogram.load(std::memory_order_relaxed);
+        (histogram != nullptr ? *histogram : unnamedBacklogs).record(queued);
+    }
+
+    StrandBacklog& backlogOf(const void* strand) noexcept
+    {
+        // Fibonacci hashing of the address, its lowest bits are the same for every strand
+        const auto address = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(strand));
+        return backlogs[(address * 11400714819323198485ull) >> (64 - 12)];
+    }
+
+    void nameStrand(const void* strand, const std::string_view name)
+    {
+        if (!isEnabled())
+        {
+            return;
+        }
+
+        // A strand whose address is reused by another object gets the name of the new one
+        auto& histogram = Metrics::windowedHistogram("handlers.strandBacklog." + std::string{ name });
+        backlogOf(strand).histogram.store(&histogram, std::memory_order_relaxed);
+    }
+}
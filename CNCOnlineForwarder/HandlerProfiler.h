@@ -0,0 +1,200 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <string_view>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <boost/asio/execution_context.hpp>
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Metrics
+{
+    class WindowedHistogram;
+}
+
+namespace CNCOnlineForwarder::Profiling
+{
+    // While enabled, handlers made by makeWeakHandler record their execution time,
+    // and completion handlers of WithStrand wrappers record how long they waited
+    // in their strand and how many handlers of the strand were waiting with them,
+    // recorded per name of strand, see nameStrand().
+    // Metrics are named after the kind of handler: the function defining the lambda,
+    // or the handler class, like handlers.NatNegProxy.prepareForNextPacketToServer.*
+    // When disabled, the only cost is a relaxed atomic load per handler.
+    using Clock = std::chrono::steady_clock;
+
+    class HandlerProfile;
+
+    // Profiled handlers queued on a strand
+    struct StrandBacklog
+    {
+        std::atomic<std::size_t> queued;
+        // Set by nameStrand(), backlogs of unnamed strands are recorded together
+        std::atomic<Metrics::WindowedHistogram*> histogram;
+    };
+
+    namespace Details
+    {
+        inline std::atomic<bool> enabled{ false };
+    }
+
+    // Must be called before any handler is started
+    void enable(const ProfilingOptions& options);
+
+    inline bool isEnabled() noexcept
+    {
+        return Details::enabled.load(std::memory_order_relaxed);
+    }
+
+    HandlerProfile& makeProfile(const std::type_info& type);
+
+    template<typename Handler>
+    HandlerProfile& profileOf()
+    {
+        // Names are only built once for each kind of handler
+        static auto& profile = makeProfile(typeid(Handler));
+        return profile;
+    }
+
+    // Also counts and logs handlers over the budget
+    void recordExecution(HandlerProfile& profile, const Clock::duration duration) noexcept;
+
+    // queued: profiled handlers of the same strand which were still queued, including this one
+    void recordQueueing
+    (
+        HandlerProfile& profile,
+        const Clock::duration delay,
+        const StrandBacklog& backlog,
+        const std::size_t queued
+    ) noexcept;
+
+    // Strands are told apart by address in a fixed table,
+    // so two strands may occasionally share a backlog.
+    StrandBacklog& backlogOf(const void* strand) noexcept;
+
+    // Backlogs of strand are recorded as handlers.strandBacklog.<name>,
+    // objects of the same class should give their strands the same name.
+    // Does nothing unless profiling is enabled.
+    void nameStrand(const void* strand, const std::string_view name);
+
+    // Executor of completion handlers while profiling: handlers are stamped
+    // when they become ready and are queued in Inner, and record their queueing delay
+    // once Inner runs them. Only used by WithStrand wrappers while profiling is enabled.
+    template<typename Inner>
+    class ProfiledExecutor
+    {
+    public:
+        ProfiledExecutor(const Inner& inner, HandlerProfile& profile, StrandBacklog& backlog) noexcept :
+            inner{ inner },
+            profile{ &profile },
+            backlog{ &backlog }
+        {}
+
+        boost::asio::execution_context& context() const noexcept
+        {
+            return this->inner.context();
+        }
+
+        void on_work_started() const noexcept
+        {
+            this->inner.on_work_started();
+        }
+
+        void on_work_finished() const noexcept
+        {
+            this->inner.on_work_finished();
+        }
+
+        template<typename Function, typename Allocator>
+        void dispatch(Function&& function, const Allocator& allocator) const
+        {
+            this->inner.dispatch(this->stamp(std::forward<Function>(function)), allocator);
+        }
+
+        template<typename Function, typename Allocator>
+        void post(Function&& function, const Allocator& allocator) const
+        {
+            this->inner.post(this->stamp(std::forward<Function>(function)), allocator);
+        }
+
+        template<typename Function, typename Allocator>
+        void defer(Function&& function, const Allocator& allocator) const
+        {
+            this->inner.defer(this->stamp(std::forward<Function>(function)), allocator);
+        }
+
+        friend bool operator==(const ProfiledExecutor& left, const ProfiledExecutor& right) noexcept
+        {
+            return (left.inner == right.inner) && (left.profile == right.profile);
+        }
+
+        friend bool operator!=(const ProfiledExecutor& left, const ProfiledExecutor& right) noexcept
+        {
+            return !(left == right);
+        }
+
+    private:
+        // Handlers destroyed without running, like when their io_context is stopped,
+        // leave the backlog too
+        template<typename Function>
+        class Stamped
+        {
+        public:
+            Stamped(Function&& function, HandlerProfile& profile, StrandBacklog& backlog) :
+                function{ std::move(function) },
+                profile{ profile },
+                backlog{ &backlog },
+                queuedAt{ Clock::now() }
+            {
+                this->backlog->queued.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            Stamped(Stamped&& other) noexcept(std::is_nothrow_move_constructible_v<Function>) :
+                function{ std::move(other.function) },
+                profile{ other.profile },
+                backlog{ std::exchange(other.backlog, nullptr) },
+                queuedAt{ other.queuedAt }
+            {}
+
+            Stamped(const Stamped&) = delete;
+            Stamped& operator=(const Stamped&) = delete;
+            Stamped& operator=(Stamped&&) = delete;
+
+            ~Stamped()
+            {
+                if (this->backlog != nullptr)
+                {
+                    this->backlog->queued.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+
+            void operator()()
+            {
+                const auto backlog = std::exchange(this->backlog, nullptr);
+                const auto queued = backlog->queued.fetch_sub(1, std::memory_order_relaxed);
+                recordQueueing(this->profile, Clock::now() - this->queuedAt, *backlog, queued);
+                std::move(this->function)();
+            }
+
+        private:
+            Function function;
+            HandlerProfile& profile;
+            // nullptr once the handler left the backlog, by running or by being moved from
+            StrandBacklog* backlog;
+            Clock::time_point queuedAt;
+        };
+
+        template<typename Function>
+        auto stamp(Function&& function) const
+        {
+            using FunctionValue = std::decay_t<Function>;
+            return Stamped<FunctionValue>{ FunctionValue{ std::forward<Function>(function) }, *this->profile, *this->backlog };
+        }
+
+        Inner inner;
+        HandlerProfile* profile;
+        StrandBacklog* backlog;
+    };
+}
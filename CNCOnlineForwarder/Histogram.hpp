@@ -0,0 +1,191 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace CNCOnlineForwarder::Metrics
+{
+    // Lock-free histogram of non-negative integers in the style of HDR histograms:
+    // values are grouped by their highest bit, and each group is split into
+    // linear sub-buckets, so the relative error is below 1 / subBucketCount.
+    // Recording is a few relaxed atomic increments and never allocates.
+    class Histogram
+    {
+    public:
+        static constexpr auto subBucketBits = std::size_t{ 4 };
+        static constexpr auto subBucketCount = std::size_t{ 1 } << subBucketBits;
+        static constexpr auto bucketCount = (64 - subBucketBits + 1) * subBucketCount;
+
+        class Snapshot;
+
+        static std::size_t indexOf(const std::uint64_t value) noexcept
+        {
+            if (value < subBucketCount)
+            {
+                return static_cast<std::size_t>(value);
+            }
+            const auto exponent = highestBit(value);
+            const auto shift = exponent - subBucketBits;
+            const auto subBucket = static_cast<std::size_t>(value >> shift) - subBucketCount;
+            return (shift + 1) * subBucketCount + subBucket;
+        }
+
+        // Returns: the largest value which would be recorded in bucket index
+        static std::uint64_t upperBoundOf(const std::size_t index) noexcept
+        {
+            if (index < subBucketCount)
+            {
+                return index;
+            }
+            const auto shift = index / subBucketCount - 1;
+            const auto subBucket = index % subBucketCount;
+            const auto lowerBound = static_cast<std::uint64_t>(subBucketCount + subBucket) << shift;
+            return lowerBound + ((std::uint64_t{ 1 } << shift) - 1);
+        }
+
+        void record(const std::uint64_t value) noexcept
+        {
+            this->counts[indexOf(value)].fetch_add(1, std::memory_order_relaxed);
+            this->total.fetch_add(1, std::memory_order_relaxed);
+            auto currentMax = this->max.load(std::memory_order_relaxed);
+            while ((value > currentMax) && !this->max.compare_exchange_weak(currentMax, value, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        Snapshot snapshot() const noexcept;
+
+        void reset() noexcept
+        {
+            for (auto& count : this->counts)
+            {
+                count.store(0, std::memory_order_relaxed);
+            }
+            this->total.store(0, std::memory_order_relaxed);
+            this->max.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        static std::size_t highestBit(std::uint64_t value) noexcept
+        {
+            auto result = std::size_t{ 0 };
+            for (auto step = std::size_t{ 32 }; step > 0; step /= 2)
+            {
+                if ((value >> step) != 0)
+                {
+                    value >>= step;
+                    result += step;
+                }
+            }
+            return result;
+        }
+
+        std::array<std::atomic<std::uint64_t>, bucketCount> counts{};
+        std::atomic<std::uint64_t> total{ 0 };
+        std::atomic<std::uint64_t> max{ 0 };
+    };
+
+    // A plain copy of a Histogram, which can be merged and queried
+    class Histogram::Snapshot
+    {
+    public:
+        void merge(const Snapshot& other) noexcept
+        {
+            for (auto i = std::size_t{ 0 }; i < bucketCount; ++i)
+            {
+                this->counts[i] += other.counts[i];
+            }
+            this->total += other.total;
+            this->max = (other.max > this->max) ? other.max : this->max;
+        }
+
+        std::uint64_t getCount() const noexcept
+        {
+            return this->total;
+        }
+
+        std::uint64_t getMax() const noexcept
+        {
+            return this->max;
+        }
+
+        // Returns: upper bound of the bucket containing the given quantile (0 to 1),
+        // or 0 if nothing has been recorded.
+        std::uint64_t getQuantile(const double quantile) const noexcept
+        {
+            if (this->total == 0)
+            {
+                return 0;
+            }
+
+            const auto rank = static_cast<std::uint64_t>(quantile * static_cast<double>(this->total - 1)) + 1;
+            auto seen = std::uint64_t{ 0 };
+            for (auto i = std::size_t{ 0 }; i < bucketCount; ++i)
+            {
+                seen += this->counts[i];
+                if (seen >= rank)
+                {
+                    const auto upperBound = upperBoundOf(i);
+                    return (upperBound < this->max) ? upperBound : this->max;
+                }
+            }
+            return this->max;
+        }
+
+    private:
+        friend class Histogram;
+
+        std::array<std::uint64_t, bucketCount> counts{};
+        std::uint64_t total = 0;
+        std::uint64_t max = 0;
+    };
+
+    inline Histogram::Snapshot Histogram::snapshot() const noexcept
+    {
+        auto result = Snapshot{};
+        for (auto i = std::size_t{ 0 }; i < bucketCount; ++i)
+        {
+            result.counts[i] = this->counts[i].load(std::memory_order_relaxed);
+        }
+        result.total = this->total.load(std::memory_order_relaxed);
+        result.max = this->max.load(std::memory_order_relaxed);
+        return result;
+    }
+
+    // Histogram of the last few time slices: values are recorded into the current slice,
+    // and rotate() drops the oldest one. Recording is as cheap as Histogram::record().
+    class WindowedHistogram
+    {
+    public:
+        static constexpr auto sliceCount = std::size_t{ 6 };
+
+        void record(const std::uint64_t value) noexcept
+        {
+            const auto current = this->current.load(std::memory_order_acquire);
+            this->slices[current % sliceCount].record(value);
+        }
+
+        // Values being recorded concurrently may be lost, which is acceptable for statistics
+        void rotate() noexcept
+        {
+            const auto next = this->current.load(std::memory_order_relaxed) + 1;
+            this->slices[next % sliceCount].reset();
+            this->current.store(next, std::memory_order_release);
+        }
+
+        Histogram::Snapshot snapshot() const noexcept
+        {
+            auto result = Histogram::Snapshot{};
+            for (const auto& slice : this->slices)
+            {
+                result.merge(slice.snapshot());
+            }
+            return result;
+        }
+
+    private:
+        std::array<Histogram, sliceCount> slices;
+        std::atomic<std::size_t> current{ 0 };
+    };
+}
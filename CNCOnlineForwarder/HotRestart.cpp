@@ -0,0 +1,645 @@
+#include "precompiled.h"
+#include "HotRestart.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "WeakRefHandler.hpp"
+
+#ifdef __linux__
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+using NatNegProxy = CNCOnlineForwarder::NatNeg::NatNegProxy;
+using GameConnection = CNCOnlineForwarder::NatNeg::GameConnection;
+
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder::HotRestart
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<TakeoverListener>(level, std::forward<Arguments>(arguments)...);
+    }
+
+#ifdef __linux__
+    namespace
+    {
+        // Message layout (SOCK_SEQPACKET, big endian):
+        // Header: magic, connection count; carries the NatNeg server socket
+        // Batch: record count, records; carries 2 sockets per record
+        // Ack: a single byte sent back by the new process
+        constexpr auto magic = std::string_view{ "CNCOFHR1" };
+        constexpr auto acknowledgement = 'K';
+        constexpr auto maxRecordsPerBatch = std::size_t{ 100 };
+        constexpr auto maxMessageSize = std::size_t{ 64 * 1024 };
+        constexpr auto acknowledgementTimeout = std::chrono::seconds{ 5 };
+        // How long the new process waits for the old one to release its TCP ports
+        constexpr auto releaseTimeout = std::chrono::seconds{ 10 };
+        constexpr auto lingerReportInterval = std::chrono::seconds{ 1 };
+
+        // Established TCP connections, which are left to finish after the handoff
+        auto& tcpConnections = Metrics::gauge("tcpForwarder.connections");
+        auto& httpSessions = Metrics::gauge("httpProxy.sessions");
+
+        ErrorCode lastError()
+        {
+            return ErrorCode{ errno, boost::system::system_category() };
+        }
+
+        class Writer
+        {
+        public:
+            template<typename Integer>
+            void put(const Integer value)
+            {
+                const auto bigEndian = boost::endian::native_to_big(value);
+                this->data.append(reinterpret_cast<const char*>(&bigEndian), sizeof(bigEndian));
+            }
+
+            void put(const std::string_view value)
+            {
+                this->data.append(value);
+            }
+
+            void put(const UDP::endpoint& endPoint)
+            {
+                this->put(static_cast<std::uint32_t>(endPoint.address().to_v4().to_uint()));
+                this->put(static_cast<std::uint16_t>(endPoint.port()));
+            }
+
+            const std::string& getData() const noexcept
+            {
+                return this->data;
+            }
+
+        private:
+            std::string data;
+        };
+
+        class Reader
+        {
+        public:
+            Reader(const std::string_view data) : data{ data } {}
+
+            template<typename Integer>
+            Integer get()
+            {
+                auto value = Integer{};
+                std::memcpy(&value, this->take(sizeof(value)).data(), sizeof(value));
+                return boost::endian::big_to_native(value);
+            }
+
+            std::string_view take(const std::size_t size)
+            {
+                if (this->data.size() < size)
+                {
+                    throw std::runtime_error{ "Truncated hot restart message" };
+                }
+                const auto result = this->data.substr(0, size);
+                this->data.remove_prefix(size);
+                return result;
+            }
+
+            UDP::endpoint getEndPoint()
+            {
+                const auto address = boost::asio::ip::address_v4{ this->get<std::uint32_t>() };
+                const auto port = this->get<std::uint16_t>();
+                return UDP::endpoint{ address, port };
+            }
+
+        private:
+            std::string_view data;
+        };
+
+        ErrorCode sendMessage(const int socket, const std::string_view data, const std::vector<int>& descriptors)
+        {
+            auto vector = ::iovec{ const_cast<char*>(data.data()), data.size() };
+            auto message = ::msghdr{};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+
+            auto control = std::vector<char>(CMSG_SPACE(sizeof(int) * descriptors.size()));
+            if (!descriptors.empty())
+            {
+                message.msg_control = control.data();
+                message.msg_controllen = control.size();
+                const auto header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_SOCKET;
+                header->cmsg_type = SCM_RIGHTS;
+                header->cmsg_len = CMSG_LEN(sizeof(int) * descriptors.size());
+                std::memcpy(CMSG_DATA(header), descriptors.data(), sizeof(int) * descriptors.size());
+            }
+
+            if (::sendmsg(socket, &message, MSG_NOSIGNAL) < 0)
+            {
+                return lastError();
+            }
+            return {};
+        }
+
+        std::string receiveMessage(const int socket, std::vector<int>& descriptors)
+        {
+            auto data = std::string(maxMessageSize, '\0');
+            auto vector = ::iovec{ data.data(), data.size() };
+            auto control = std::vector<char>(CMSG_SPACE(sizeof(int) * maxRecordsPerBatch * 2));
+            auto message = ::msghdr{};
+            message.msg_iov = &vector;
+            message.msg_iovlen = 1;
+            message.msg_control = control.data();
+            message.msg_controllen = control.size();
+
+            const auto size = ::recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+            if (size < 0)
+            {
+                throw boost::system::system_error{ lastError(), "Hot restart receive failed" };
+            }
+            if (size == 0)
+            {
+                throw std::runtime_error{ "Old process closed the hot restart connection" };
+            }
+
+            for (auto header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+            {
+                if ((header->cmsg_level != SOL_SOCKET) || (header->cmsg_type != SCM_RIGHTS))
+                {
+                    continue;
+                }
+                const auto count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const auto begin = descriptors.size();
+                descriptors.resize(begin + count);
+                std::memcpy(descriptors.data() + begin, CMSG_DATA(header), sizeof(int) * count);
+            }
+
+            if ((message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0)
+            {
+                throw std::runtime_error{ "Hot restart message truncated" };
+            }
+
+            data.resize(static_cast<std::size_t>(size));
+            return data;
+        }
+
+        ::sockaddr_un makeAddress(const std::string& path)
+        {
+            auto address = ::sockaddr_un{};
+            address.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(address.sun_path))
+            {
+                throw std::invalid_argument{ "Hot restart socket path is too long: " + path };
+            }
+            std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+            return address;
+        }
+
+        int openListeningSocket(const std::string& path)
+        {
+            const auto address = makeAddress(path);
+            const auto socket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (socket < 0)
+            {
+                throw boost::system::system_error{ lastError(), "Failed to create hot restart socket" };
+            }
+
+            // Remove the socket file left by a previous process
+            ::unlink(path.c_str());
+            const auto addressPointer = reinterpret_cast<const ::sockaddr*>(&address);
+            if ((::bind(socket, addressPointer, sizeof(address)) != 0) || (::listen(socket, 1) != 0))
+            {
+                const auto error = lastError();
+                ::close(socket);
+                throw boost::system::system_error{ error, "Failed to listen on " + path };
+            }
+            return socket;
+        }
+
+        void encode(Writer& writer, const GameConnection::State& connection)
+        {
+            const auto remainingLife =
+                std::chrono::duration_cast<std::chrono::milliseconds>(connection.remainingLife);
+            writer.put(static_cast<std::uint32_t>(connection.id.natNegID));
+            writer.put(static_cast<std::uint8_t>(connection.id.playerID));
+            writer.put(connection.server);
+            writer.put(connection.clientPublicAddress);
+            writer.put(connection.clientRealAddress);
+            writer.put(connection.remotePlayer);
+            writer.put(static_cast<std::uint32_t>(remainingLife.count()));
+            writer.put(static_cast<std::uint8_t>(connection.receivingFromClient ? 1 : 0));
+        }
+
+        GameConnection::State decode(Reader& reader, const int publicSocketForClient, const int fakeRemotePlayerSocket)
+        {
+            auto connection = GameConnection::State{};
+            connection.id.natNegID = reader.get<std::uint32_t>();
+            connection.id.playerID = static_cast<std::int8_t>(reader.get<std::uint8_t>());
+            connection.server = reader.getEndPoint();
+            connection.clientPublicAddress = reader.getEndPoint();
+            connection.clientRealAddress = reader.getEndPoint();
+            connection.remotePlayer = reader.getEndPoint();
+            connection.remainingLife = std::chrono::milliseconds{ reader.get<std::uint32_t>() };
+            connection.receivingFromClient = (reader.get<std::uint8_t>() & 1) != 0;
+            connection.publicSocketForClient = publicSocketForClient;
+            connection.fakeRemotePlayerSocket = fakeRemotePlayerSocket;
+            return connection;
+        }
+    }
+
+    std::shared_ptr<TakeoverListener> TakeoverListener::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<IOManager>& ioManager,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const std::string& path,
+        const std::chrono::seconds lingerTimeout,
+        StopAccepting stopAccepting
+    )
+    {
+        const auto self = std::make_shared<TakeoverListener>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            ioManager,
+            proxy,
+            path,
+            lingerTimeout,
+            std::move(stopAccepting)
+        );
+
+        const auto action = [](TakeoverListener& self)
+        {
+            logLine(LogLevel::info, "Waiting for takeover on ", self.path);
+            self.prepareForNextTakeover();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    TakeoverListener::TakeoverListener
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<IOManager>& ioManager,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const std::string& path,
+        const std::chrono::seconds lingerTimeout,
+        StopAccepting stopAccepting
+    ) :
+        ioManager{ ioManager },
+        proxy{ proxy },
+        path{ path },
+        lingerTimeout{ lingerTimeout },
+        stopAccepting{ std::move(stopAccepting) },
+        strand{ objectMaker.makeStrand() },
+        listener{ strand, openListeningSocket(path) },
+        lingerTimer{ strand },
+        peer{ -1 },
+        handoffThread{}
+    {}
+
+    TakeoverListener::~TakeoverListener()
+    {
+        if (this->handoffThread.joinable())
+        {
+            this->handoffThread.join();
+        }
+        this->closePeer();
+    }
+
+    void TakeoverListener::startHandoff(NatNegProxy::State state)
+    {
+        if (this->handoffThread.joinable())
+        {
+            // Left by a failed handoff, which has already finished
+            this->handoffThread.join();
+        }
+
+        // Sending blocks, so it must not happen on a thread running IOManager
+        this->handoffThread = std::thread{ [this, state = std::move(state)]() mutable
+        {
+            if (!this->handOff(state))
+            {
+                this->closePeer();
+                if (const auto proxy = this->proxy.lock())
+                {
+                    proxy->resume(std::move(state));
+                }
+                const auto action = [](TakeoverListener& self) { self.prepareForNextTakeover(); };
+                boost::asio::defer(this->strand, makeWeakHandler(this, action));
+                return;
+            }
+
+            // The new process owns every socket now, they must never be used here again
+            if (const auto proxy = this->proxy.lock())
+            {
+                proxy->abandon();
+            }
+            state = {};
+            this->finishHandoff();
+        } };
+    }
+
+    bool TakeoverListener::handOff(const NatNegProxy::State& state)
+    {
+        auto header = Writer{};
+        header.put(magic);
+        header.put(static_cast<std::uint32_t>(state.connections.size()));
+        if (const auto code = sendMessage(this->peer, header.getData(), { state.serverSocket }); code.failed())
+        {
+            logLine(LogLevel::error, "Handoff failed, resuming: ", code);
+            return false;
+        }
+
+        const auto& connections = state.connections;
+        for (auto begin = std::size_t{ 0 }; begin < connections.size(); begin += maxRecordsPerBatch)
+        {
+            const auto end = std::min(begin + maxRecordsPerBatch, connections.size());
+            auto batch = Writer{};
+            auto descriptors = std::vector<int>{};
+            batch.put(static_cast<std::uint32_t>(end - begin));
+            for (auto i = begin; i < end; ++i)
+            {
+                encode(batch, connections[i]);
+                descriptors.push_back(connections[i].publicSocketForClient);
+                descriptors.push_back(connections[i].fakeRemotePlayerSocket);
+            }
+
+            if (const auto code = sendMessage(this->peer, batch.getData(), descriptors); code.failed())
+            {
+                // The proxy socket is already shared with the new process, so it can't be resumed
+                logLine(LogLevel::error, "Handoff failed after sending sockets, not resuming: ", code);
+                return true;
+            }
+        }
+
+        const auto timeout = ::timeval{ acknowledgementTimeout.count(), 0 };
+        ::setsockopt(this->peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        auto reply = char{};
+        const auto replySize = ::recv(this->peer, &reply, sizeof(reply), 0);
+        if (replySize < 0)
+        {
+            logLine(LogLevel::error, "Handoff acknowledgement failed, not resuming: ", lastError());
+            return true;
+        }
+        if ((replySize != sizeof(reply)) || (reply != acknowledgement))
+        {
+            logLine(LogLevel::error, "New process did not acknowledge the state, not resuming.");
+            return true;
+        }
+
+        logLine(LogLevel::info, "Handed over ", connections.size(), " GameConnections.");
+        return true;
+    }
+
+    void TakeoverListener::finishHandoff()
+    {
+        if (this->stopAccepting)
+        {
+            this->stopAccepting();
+        }
+        // Tells the new process that TCP ports have been released
+        this->closePeer();
+
+        const auto deadline = std::chrono::steady_clock::now() + this->lingerTimeout;
+        const auto action = [deadline](TakeoverListener& self)
+        {
+            self.waitForConnectionsToFinish(deadline);
+        };
+        boost::asio::defer(this->strand, makeWeakHandler(this, action));
+    }
+
+    void TakeoverListener::waitForConnectionsToFinish(const std::chrono::steady_clock::time_point deadline)
+    {
+        const auto remaining = tcpConnections.get() + httpSessions.get();
+        if ((remaining <= 0) || (std::chrono::steady_clock::now() >= deadline))
+        {
+            logLine(LogLevel::info, "Taken over by another process, stopping with ", remaining, " TCP connections left.");
+            if (const auto ioManager = this->ioManager.lock())
+            {
+                ioManager->stop();
+            }
+            return;
+        }
+
+        logLine(LogLevel::info, "Waiting for ", remaining, " TCP connections to finish.");
+        const auto action = [deadline](TakeoverListener& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+            self.waitForConnectionsToFinish(deadline);
+        };
+        this->lingerTimer.asyncWait(lingerReportInterval, makeWeakHandler(this, action));
+    }
+
+    void TakeoverListener::prepareForNextTakeover()
+    {
+        const auto action = [](TakeoverListener& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+                return;
+            }
+
+            const auto peer = ::accept4(self.listener.native_handle(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (peer < 0)
+            {
+                logLine(LogLevel::warning, "Accept failed: ", lastError());
+                self.prepareForNextTakeover();
+                return;
+            }
+
+            const auto proxy = self.proxy.lock();
+            if (!proxy)
+            {
+                logLine(LogLevel::error, "Proxy already died, rejecting takeover.");
+                ::close(peer);
+                self.prepareForNextTakeover();
+                return;
+            }
+
+            logLine(LogLevel::info, "New process connected, suspending NatNegProxy for takeover.");
+            self.peer = peer;
+            proxy->suspend([weakSelf = self.weak_from_this()](NatNegProxy::State state)
+            {
+                const auto self = weakSelf.lock();
+                if (!self)
+                {
+                    return;
+                }
+                auto action = [state = std::move(state)](TakeoverListener& self) mutable
+                {
+                    self.startHandoff(std::move(state));
+                };
+                boost::asio::defer(self->strand, makeWeakHandler(self, std::move(action)));
+            });
+        };
+
+        this->listener.async_wait
+        (
+            boost::asio::posix::stream_descriptor::wait_read,
+            makeWeakHandler(this, action)
+        );
+    }
+
+    void TakeoverListener::closePeer() noexcept
+    {
+        if (this->peer >= 0)
+        {
+            ::close(this->peer);
+            this->peer = -1;
+        }
+    }
+
+    NatNegProxy::State takeOver(const std::string& path)
+    {
+        const auto address = makeAddress(path);
+        const auto socket = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (socket < 0)
+        {
+            throw boost::system::system_error{ lastError(), "Failed to create hot restart socket" };
+        }
+
+        try
+        {
+            const auto addressPointer = reinterpret_cast<const ::sockaddr*>(&address);
+            if (::connect(socket, addressPointer, sizeof(address)) != 0)
+            {
+                throw boost::system::system_error{ lastError(), "Failed to connect to " + path };
+            }
+
+            auto descriptors = std::vector<int>{};
+            const auto headerData = receiveMessage(socket, descriptors);
+            auto header = Reader{ headerData };
+            if ((header.take(magic.size()) != magic) || (descriptors.size() != 1))
+            {
+                throw std::runtime_error{ "Invalid hot restart header" };
+            }
+
+            auto state = NatNegProxy::State{};
+            state.serverSocket = descriptors.front();
+            const auto count = header.get<std::uint32_t>();
+            state.connections.reserve(count);
+            while (state.connections.size() < count)
+            {
+                descriptors.clear();
+                const auto batchData = receiveMessage(socket, descriptors);
+                auto batch = Reader{ batchData };
+                const auto recordCount = batch.get<std::uint32_t>();
+                if (descriptors.size() != recordCount * 2)
+                {
+                    throw std::runtime_error{ "Hot restart batch has wrong number of sockets" };
+                }
+
+                for (auto i = std::size_t{ 0 }; i < recordCount; ++i)
+                {
+                    const auto connection = decode(batch, descriptors[i * 2], descriptors[i * 2 + 1]);
+                    state.connections.push_back(connection);
+                }
+            }
+
+            if (::send(socket, &acknowledgement, sizeof(acknowledgement), MSG_NOSIGNAL) < 0)
+            {
+                throw boost::system::system_error{ lastError(), "Failed to acknowledge hot restart" };
+            }
+
+            // The old process closes the connection once it stopped listening on TCP ports
+            const auto timeout = ::timeval{ releaseTimeout.count(), 0 };
+            ::setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            auto ignored = char{};
+            if (::recv(socket, &ignored, sizeof(ignored), 0) < 0)
+            {
+                logLine(LogLevel::warning, "Old process did not release its TCP ports in time: ", lastError());
+            }
+            ::close(socket);
+
+            logLine(LogLevel::info, "Took over ", state.connections.size(), " GameConnections from ", path);
+            return state;
+        }
+        catch (...)
+        {
+            ::close(socket);
+            throw;
+        }
+    }
+#else
+    std::shared_ptr<TakeoverListener> TakeoverListener::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<IOManager>& ioManager,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const std::string& path,
+        const std::chrono::seconds lingerTimeout,
+        StopAccepting stopAccepting
+    )
+    {
+        return std::make_shared<TakeoverListener>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            ioManager,
+            proxy,
+            path,
+            lingerTimeout,
+            std::move(stopAccepting)
+        );
+    }
+
+    TakeoverListener::TakeoverListener
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<IOManager>& ioManager,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const std::string& path,
+        const std::chrono::seconds lingerTimeout,
+        StopAccepting stopAccepting
+    ) :
+        ioManager{ ioManager },
+        proxy{ proxy },
+        path{ path },
+        lingerTimeout{ lingerTimeout },
+        stopAccepting{ std::move(stopAccepting) },
+        strand{ objectMaker.makeStrand() },
+        lingerTimer{ strand },
+        peer{ -1 },
+        handoffThread{}
+    {
+        throw std::runtime_error{ "Hot restart is not supported on this platform" };
+    }
+
+    TakeoverListener::~TakeoverListener() = default;
+
+    void TakeoverListener::prepareForNextTakeover() {}
+
+    void TakeoverListener::startHandoff(NatNegProxy::State) {}
+
+    bool TakeoverListener::handOff(const NatNegProxy::State&)
+    {
+        return false;
+    }
+
+    void TakeoverListener::finishHandoff() {}
+
+    void TakeoverListener::waitForConnectionsToFinish(const std::chrono::steady_clock::time_point) {}
+
+    void TakeoverListener::closePeer() noexcept {}
+
+    NatNegProxy::State takeOver(const std::string&)
+    {
+        throw std::runtime_error{ "Hot restart is not supported on this platform" };
+    }
+#endif
+}
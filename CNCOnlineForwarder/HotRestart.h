@@ -0,0 +1,94 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <boost/asio/steady_timer.hpp>
+#ifdef __linux__
+#include <boost/asio/posix/stream_descriptor.hpp>
+#endif
+#include "IOManager.hpp"
+#include "NatNegProxy.h"
+
+namespace CNCOnlineForwarder::HotRestart
+{
+    // Waits for a newer process to connect to a Unix socket, then suspends
+    // NatNegProxy and hands its state over on a separate thread.
+    // Sockets are passed to the new process with SCM_RIGHTS,
+    // so packets arriving during the handoff just wait in kernel buffers.
+    // Once they have been sent, this process stops accepting TCP connections,
+    // lets the established ones finish, and stops IOManager.
+    class TakeoverListener : public std::enable_shared_from_this<TakeoverListener>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        using Strand = IOManager::StrandType;
+        using Timer = WithStrand<boost::asio::steady_timer>;
+        // Blocking, closes the listening TCP sockets so the new process can bind them
+        using StopAccepting = std::function<void()>;
+
+        static constexpr auto description = "TakeoverListener";
+
+        static std::shared_ptr<TakeoverListener> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<IOManager>& ioManager,
+            const std::weak_ptr<NatNeg::NatNegProxy>& proxy,
+            const std::string& path,
+            const std::chrono::seconds lingerTimeout,
+            StopAccepting stopAccepting
+        );
+
+        TakeoverListener
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<IOManager>& ioManager,
+            const std::weak_ptr<NatNeg::NatNegProxy>& proxy,
+            const std::string& path,
+            const std::chrono::seconds lingerTimeout,
+            StopAccepting stopAccepting
+        );
+
+        TakeoverListener(const TakeoverListener&) = delete;
+        TakeoverListener& operator=(const TakeoverListener&) = delete;
+        ~TakeoverListener();
+
+    private:
+        void prepareForNextTakeover();
+
+        void startHandoff(NatNeg::NatNegProxy::State state);
+
+        // Blocking, runs on the handoff thread.
+        // Returns: false if nothing has been sent and this process should keep running,
+        // true once any socket has been sent, even if the new process failed afterwards.
+        bool handOff(const NatNeg::NatNegProxy::State& state);
+
+        // Blocking, runs on the handoff thread after handOff() returned true
+        void finishHandoff();
+
+        void waitForConnectionsToFinish(const std::chrono::steady_clock::time_point deadline);
+
+        void closePeer() noexcept;
+
+        std::weak_ptr<IOManager> ioManager;
+        std::weak_ptr<NatNeg::NatNegProxy> proxy;
+        std::string path;
+        std::chrono::seconds lingerTimeout;
+        StopAccepting stopAccepting;
+        Strand strand;
+#ifdef __linux__
+        boost::asio::posix::stream_descriptor listener;
+#endif
+        Timer lingerTimer;
+        int peer;
+        std::thread handoffThread;
+    };
+
+    // Connects to the old process listening on path, and receives its state.
+    // Then waits for the old process to release its TCP ports.
+    // Blocking, should be called before IOManager starts running.
+    NatNeg::NatNegProxy::State takeOver(const std::string& path);
+}
@@ -1,11 +1,26 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <memory>
+#include <optional>
+#include <vector>
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ip/udp.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
+#include "HandlerProfiler.h"
+#include "Options.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace CNCOnlineForwarder
 {
@@ -22,12 +37,120 @@ namespace CNCOnlineForwarder
 
         static std::shared_ptr<IOManager> create()
         {
-            return std::make_shared<IOManager>(PrivateConstructor{});
+            return create(0);
+        }
+
+        // Each relay thread gets its own io_context, used by strands from
+        // ObjectMaker::makeRelayStrand(), and must be run by runRelay()
+        static std::shared_ptr<IOManager> create(const std::size_t relayThreads)
+        {
+            return create(relayThreads, ExecutorOptions{ ExecutorOptions::Type::shared, 2 });
+        }
+
+        // With a work stealing executor, every worker thread gets its own io_context,
+        // strands from ObjectMaker::makeStrand() are spread over them
+        // and an idle worker runs ready handlers of the other ones.
+        static std::shared_ptr<IOManager> create(const std::size_t relayThreads, const ExecutorOptions& executor)
+        {
+            return std::make_shared<IOManager>(PrivateConstructor{}, relayThreads, executor);
+        }
+
+        IOManager(PrivateConstructor, const std::size_t relayThreads, const ExecutorOptions& executor) :
+            workerCount{ std::max<std::size_t>(executor.threads, 1) },
+            nextRelayContext{ 0 },
+            nextWorkerContext{ 0 },
+            parkedCount{ 0 },
+            steals{ 0 }
+        {
+            for (auto i = std::size_t{ 0 }; i < relayThreads; ++i)
+            {
+                // Only used by a single thread
+                this->relayContexts.push_back(std::make_unique<ContextType>(1));
+                // Relay threads keep running even when there are no sessions
+                this->relayWork.emplace_back(this->relayContexts.back()->get_executor());
+            }
+
+            if (executor.type == ExecutorOptions::Type::workStealing)
+            {
+                // The first worker runs the main io_context
+                this->workerContexts.push_back(&this->context);
+                for (auto i = std::size_t{ 1 }; i < this->workerCount; ++i)
+                {
+                    this->ownedWorkerContexts.push_back(std::make_unique<ContextType>());
+                    this->workerContexts.push_back(this->ownedWorkerContexts.back().get());
+                }
+                // Idle workers park in their own reactor instead of returning
+                for (const auto workerContext : this->workerContexts)
+                {
+                    this->workerWork.emplace_back(workerContext->get_executor());
+                }
+                this->parked = std::make_unique<std::atomic<bool>[]>(this->workerCount);
+            }
+        }
+
+        std::size_t getRelayThreadCount() const noexcept
+        {
+            return this->relayContexts.size();
         }
 
-        IOManager(PrivateConstructor) {}
+        // Number of threads which must call runWorker()
+        std::size_t getWorkerCount() const noexcept
+        {
+            return this->workerCount;
+        }
 
-        auto stop() { return this->context.stop(); }
+        // Handlers run by a worker on the io_context of another one
+        std::uint64_t getStealCount() const noexcept
+        {
+            return this->steals.load(std::memory_order_relaxed);
+        }
+
+        // Executor of the io_context of every thread, worker ones first then relay ones.
+        // With the shared executor, every worker gets the executor of the same io_context.
+        std::vector<ContextType::executor_type> getThreadExecutors()
+        {
+            auto executors = std::vector<ContextType::executor_type>{};
+            if (this->workerContexts.empty())
+            {
+                executors.resize(this->workerCount, this->context.get_executor());
+            }
+            for (const auto workerContext : this->workerContexts)
+            {
+                executors.push_back(workerContext->get_executor());
+            }
+            for (const auto& relayContext : this->relayContexts)
+            {
+                executors.push_back(relayContext->get_executor());
+            }
+            return executors;
+        }
+
+        auto stop() 
+        { 
+            for (const auto& relayContext : this->relayContexts)
+            {
+                relayContext->stop();
+            }
+            for (const auto& workerContext : this->ownedWorkerContexts)
+            {
+                workerContext->stop();
+            }
+            return this->context.stop(); 
+        }
+
+        // Prepare for a subsequent run() after stop()
+        auto restart() 
+        { 
+            for (const auto& relayContext : this->relayContexts)
+            {
+                relayContext->restart();
+            }
+            for (const auto& workerContext : this->ownedWorkerContexts)
+            {
+                workerContext->restart();
+            }
+            return this->context.restart(); 
+        }
 
         auto run() 
         { 
@@ -42,8 +165,172 @@ namespace CNCOnlineForwarder
             }
         }
 
+        // Run handlers of worker index until stop(), must be called
+        // by getWorkerCount() threads with different indices.
+        void runWorker(const std::size_t index)
+        {
+            if (this->workerContexts.empty())
+            {
+                this->run();
+                return;
+            }
+
+            auto& own = *this->workerContexts.at(index);
+            try
+            {
+                while (!own.stopped())
+                {
+                    if (const auto ran = own.poll(); ran > 0)
+                    {
+                        if (ran > 1)
+                        {
+                            // Handlers were waiting for each other, an idle worker could have run some
+                            this->wakeParkedWorker();
+                        }
+                        continue;
+                    }
+                    if (this->trySteal(index))
+                    {
+                        continue;
+                    }
+                    this->park(index);
+                }
+            }
+            catch (...)
+            {
+                this->stop();
+                throw;
+            }
+        }
+
+        // Run the io_context of a relay thread until stop(). 
+        // When spinning, io_context::poll() is called in a loop instead of
+        // sleeping until something happens, trading a whole CPU for latency.
+        void runRelay(const std::size_t index, const bool spin, const std::optional<int> cpu)
+        {
+#ifdef __linux__
+            if (cpu.has_value())
+            {
+                auto cpus = ::cpu_set_t{};
+                CPU_ZERO(&cpus);
+                CPU_SET(cpu.value(), &cpus);
+                ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+            }
+#endif
+            auto& relayContext = *this->relayContexts.at(index);
+            try
+            {
+                if (!spin)
+                {
+                    relayContext.run();
+                    return;
+                }
+                while (!relayContext.stopped())
+                {
+                    relayContext.poll();
+                }
+            }
+            catch (...)
+            {
+                this->stop();
+                throw;
+            }
+        }
+
     private:
+        // A wake up may be lost when its handler is stolen by another idle worker,
+        // so parked workers still look for work to steal every parkTimeout
+        static constexpr auto parkTimeout = std::chrono::milliseconds{ 100 };
+
+        // Returns: whether a ready handler of another worker has been run
+        bool trySteal(const std::size_t index)
+        {
+            const auto count = this->workerContexts.size();
+            for (auto offset = std::size_t{ 1 }; offset < count; ++offset)
+            {
+                auto& victim = *this->workerContexts[(index + offset) % count];
+                if (victim.poll_one() > 0)
+                {
+                    this->steals.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Sleeps in the reactor of worker index until it gets work of its own,
+        // or until a busy worker wakes it up to steal some
+        void park(const std::size_t index)
+        {
+            auto& own = *this->workerContexts[index];
+            this->parked[index].store(true);
+            this->parkedCount.fetch_add(1);
+            // Work may have piled up before the flag was seen by busy workers
+            if (!this->trySteal(index))
+            {
+                own.run_one_for(parkTimeout);
+            }
+            if (this->parked[index].exchange(false))
+            {
+                this->parkedCount.fetch_sub(1);
+            }
+        }
+
+        void wakeParkedWorker()
+        {
+            if (this->parkedCount.load(std::memory_order_relaxed) == 0)
+            {
+                return;
+            }
+            for (auto i = std::size_t{ 0 }; i < this->workerContexts.size(); ++i)
+            {
+                if (this->parked[i].exchange(false))
+                {
+                    this->parkedCount.fetch_sub(1);
+                    // Makes its run_one_for() return
+                    boost::asio::post(*this->workerContexts[i], [] {});
+                    return;
+                }
+            }
+        }
+
+        // Strands stay on the worker they were created on, unless stolen
+        ContextType& getNextWorkerContext()
+        {
+            if (this->workerContexts.empty())
+            {
+                return this->context;
+            }
+            const auto index = this->nextWorkerContext.fetch_add(1, std::memory_order_relaxed);
+            return *this->workerContexts[index % this->workerContexts.size()];
+        }
+
+        ContextType& getNextRelayContext()
+        {
+            if (this->relayContexts.empty())
+            {
+                return this->context;
+            }
+            const auto index = this->nextRelayContext.fetch_add(1, std::memory_order_relaxed);
+            return *this->relayContexts[index % this->relayContexts.size()];
+        }
+
+        using WorkGuard = boost::asio::executor_work_guard<ContextType::executor_type>;
+
         ContextType context;
+        std::size_t workerCount;
+        // Empty unless the executor is work stealing, the first one is context
+        std::vector<ContextType*> workerContexts;
+        std::vector<std::unique_ptr<ContextType>> ownedWorkerContexts;
+        std::vector<WorkGuard> workerWork;
+        std::vector<std::unique_ptr<ContextType>> relayContexts;
+        std::vector<WorkGuard> relayWork;
+        std::atomic<std::size_t> nextRelayContext;
+        std::atomic<std::size_t> nextWorkerContext;
+        // Whether each worker is parked, only allocated with a work stealing executor
+        std::unique_ptr<std::atomic<bool>[]> parked;
+        std::atomic<std::size_t> parkedCount;
+        std::atomic<std::uint64_t> steals;
     };
 
     class IOManager::ObjectMaker
@@ -62,7 +349,14 @@ namespace CNCOnlineForwarder
         StrandType makeStrand() const
         {
             const auto ioManager = std::shared_ptr{ this->ioManager };
-            return boost::asio::make_strand(ioManager->context);
+            return boost::asio::make_strand(ioManager->getNextWorkerContext());
+        }
+
+        // Strand for relaying packets, on one of the relay threads if there are any
+        StrandType makeRelayStrand() const
+        {
+            const auto ioManager = std::shared_ptr{ this->ioManager };
+            return boost::asio::make_strand(ioManager->getNextRelayContext());
         }
 
     private:
@@ -86,6 +380,26 @@ namespace CNCOnlineForwarder
             const T* operator->() const noexcept { return &this->object; }
 
         protected:
+            // Starts an operation with handler bound to the strand,
+            // through a ProfiledExecutor while handlers are being profiled
+            template<typename Handler, typename Start>
+            void startOnStrand(Handler&& handler, Start&& start)
+            {
+                if (Profiling::isEnabled())
+                {
+                    const auto executor = Profiling::ProfiledExecutor<IOManager::StrandType>
+                    {
+                        this->strand,
+                        Profiling::profileOf<std::decay_t<Handler>>(),
+                        Profiling::backlogOf(&this->strand)
+                    };
+                    start(boost::asio::bind_executor(executor, std::forward<Handler>(handler)));
+                    return;
+                }
+
+                start(boost::asio::bind_executor(this->strand, std::forward<Handler>(handler)));
+            }
+
             IOManager::StrandType& strand;
             T object;
         };
@@ -113,12 +427,23 @@ namespace CNCOnlineForwarder
             ReadHandler&& handler
         )
         {
-            return this->object.async_receive_from
-            (
-                buffers,
-                from,
-                boost::asio::bind_executor(this->strand, std::forward<ReadHandler>(handler))
-            );
+            this->startOnStrand(std::forward<ReadHandler>(handler), [&](auto&& boundHandler)
+            {
+                this->object.async_receive_from(buffers, from, std::move(boundHandler));
+            });
+        }
+
+        template<typename WaitHandler>
+        auto asyncWait
+        (
+            const boost::asio::socket_base::wait_type waitType,
+            WaitHandler&& handler
+        )
+        {
+            this->startOnStrand(std::forward<WaitHandler>(handler), [&](auto&& boundHandler)
+            {
+                this->object.async_wait(waitType, std::move(boundHandler));
+            });
         }
 
         template<typename ConstBufferSequence, typename EndPoint, typename WriteHandler>
@@ -129,12 +454,29 @@ namespace CNCOnlineForwarder
             WriteHandler&& handler
         )
         {
-            return this->object.async_send_to
-            (
-                buffers,
-                to,
-                boost::asio::bind_executor(this->strand, std::forward<WriteHandler>(handler))
-            );
+            this->startOnStrand(std::forward<WriteHandler>(handler), [&](auto&& boundHandler)
+            {
+                this->object.async_send_to(buffers, to, std::move(boundHandler));
+            });
+        }
+    };
+
+    template<>
+    class WithStrand<boost::asio::ip::tcp::acceptor> :
+        public Details::WithStrandBase<boost::asio::ip::tcp::acceptor>
+    {
+    public:
+        using Details::WithStrandBase<boost::asio::ip::tcp::acceptor>::WithStrandBase;
+
+        // Accepted socket will use socketExecutor,
+        // while handler is executed inside acceptor's strand
+        template<typename Executor, typename AcceptHandler>
+        auto asyncAccept(const Executor& socketExecutor, AcceptHandler&& handler)
+        {
+            this->startOnStrand(std::forward<AcceptHandler>(handler), [&](auto&& boundHandler)
+            {
+                this->object.async_accept(socketExecutor, std::move(boundHandler));
+            });
         }
     };
 
@@ -146,7 +488,7 @@ namespace CNCOnlineForwarder
         using Details::WithStrandBase<boost::asio::steady_timer>::WithStrandBase;
 
         template<typename WaitHandler>
-        auto asyncWait(const std::chrono::minutes timeout, WaitHandler&& waitHandler)
+        auto asyncWait(const std::chrono::steady_clock::duration timeout, WaitHandler&& waitHandler)
         {
             this->object.expires_from_now(timeout);
             this->object.async_wait(std::forward<WaitHandler>(waitHandler));
@@ -0,0 +1,170 @@
+#include "precompiled.h"
+#include "IdleTimeoutPolicy.h"
+#include <fstream>
+#include <optional>
+#include "Logging.h"
+#include "Metrics.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/resource.h>
+#endif
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<IdleTimeoutPolicy>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& handshakeTimeout = Metrics::gauge("idleTimeout.handshakeMilliseconds");
+        auto& relayTimeout = Metrics::gauge("idleTimeout.relayMilliseconds");
+        auto& fileDescriptorUsage = Metrics::gauge("idleTimeout.fileDescriptorPercent");
+        auto& memoryUsage = Metrics::gauge("idleTimeout.memoryPercent");
+
+#ifdef __linux__
+        // Returns: open file descriptors / RLIMIT_NOFILE
+        std::optional<double> getFileDescriptorUsage()
+        {
+            auto limit = ::rlimit{};
+            if ((::getrlimit(RLIMIT_NOFILE, &limit) != 0) || (limit.rlim_cur == RLIM_INFINITY) || (limit.rlim_cur == 0))
+            {
+                return std::nullopt;
+            }
+
+            const auto directory = ::opendir("/proc/self/fd");
+            if (directory == nullptr)
+            {
+                return std::nullopt;
+            }
+            auto count = std::size_t{ 0 };
+            while (::readdir(directory) != nullptr)
+            {
+                ++count;
+            }
+            ::closedir(directory);
+            // ".", ".." and the descriptor of the directory itself
+            count = (count > 3) ? (count - 3) : 0;
+
+            return static_cast<double>(count) / static_cast<double>(limit.rlim_cur);
+        }
+
+        // Returns: 1 - MemAvailable / MemTotal
+        std::optional<double> getMemoryUsage()
+        {
+            auto input = std::ifstream{ "/proc/meminfo" };
+            auto total = std::optional<double>{};
+            auto available = std::optional<double>{};
+            auto key = std::string{};
+            auto value = double{};
+            auto unit = std::string{};
+            while (input >> key >> value)
+            {
+                std::getline(input, unit);
+                if (key == "MemTotal:")
+                {
+                    total = value;
+                }
+                else if (key == "MemAvailable:")
+                {
+                    available = value;
+                }
+            }
+
+            if (!total.has_value() || !available.has_value() || (total.value() <= 0))
+            {
+                return std::nullopt;
+            }
+            return 1.0 - (available.value() / total.value());
+        }
+#else
+        std::optional<double> getFileDescriptorUsage()
+        {
+            return std::nullopt;
+        }
+
+        std::optional<double> getMemoryUsage()
+        {
+            return std::nullopt;
+        }
+#endif
+
+        std::int64_t toPercent(const std::optional<double> usage)
+        {
+            return static_cast<std::int64_t>(usage.value_or(0) * 100);
+        }
+    }
+
+    std::shared_ptr<IdleTimeoutPolicy> IdleTimeoutPolicy::create(const IdleTimeoutOptions& options)
+    {
+        return std::make_shared<IdleTimeoutPolicy>(options);
+    }
+
+    IdleTimeoutPolicy::IdleTimeoutPolicy(const IdleTimeoutOptions& options) :
+        options{ options },
+        handshakeMilliseconds{ std::chrono::milliseconds{ options.handshake }.count() },
+        relayMilliseconds{ std::chrono::milliseconds{ options.relay }.count() }
+    {
+        handshakeTimeout.set(this->handshakeMilliseconds.load());
+        relayTimeout.set(this->relayMilliseconds.load());
+        logLine
+        (
+            LogLevel::info,
+            "Idle timeouts: handshake ", options.handshake.count(), "s, relay ", options.relay.count(), "s, ",
+            "shortened above ", static_cast<int>(lowPressure * 100), "% fd / memory usage, down to ", 
+            options.minimum.count(), "s"
+        );
+    }
+
+    IdleTimeoutPolicy::Duration IdleTimeoutPolicy::get(const Phase phase) const noexcept
+    {
+        const auto& value = (phase == Phase::handshake) ? this->handshakeMilliseconds : this->relayMilliseconds;
+        return std::chrono::milliseconds{ value.load(std::memory_order_relaxed) };
+    }
+
+    void IdleTimeoutPolicy::update()
+    {
+        const auto fileDescriptors = getFileDescriptorUsage();
+        const auto memory = getMemoryUsage();
+        fileDescriptorUsage.set(toPercent(fileDescriptors));
+        memoryUsage.set(toPercent(memory));
+
+        const auto pressure = std::max(fileDescriptors.value_or(0), memory.value_or(0));
+        const auto progress = std::clamp((pressure - lowPressure) / (highPressure - lowPressure), 0.0, 1.0);
+        // Rounded to 10% steps, so timeouts don't change on every small fluctuation
+        const auto factor = std::round((1.0 - progress * (1.0 - minimumScale)) * 10) / 10;
+
+        const auto handshake = this->scale(this->options.handshake, factor).count();
+        const auto relay = this->scale(this->options.relay, factor).count();
+        const auto previousRelay = this->relayMilliseconds.exchange(relay, std::memory_order_relaxed);
+        this->handshakeMilliseconds.store(handshake, std::memory_order_relaxed);
+        handshakeTimeout.set(handshake);
+        relayTimeout.set(relay);
+
+        if (previousRelay != relay)
+        {
+            logLine
+            (
+                LogLevel::info,
+                "Idle timeouts changed to handshake ", handshake, "ms, relay ", relay, "ms ",
+                "(fd usage ", toPercent(fileDescriptors), "%, memory usage ", toPercent(memory), "%)"
+            );
+        }
+    }
+
+    std::chrono::milliseconds IdleTimeoutPolicy::scale(const std::chrono::seconds timeout, const double factor) const
+    {
+        const auto scaled = std::chrono::duration_cast<std::chrono::milliseconds>
+        (
+            std::chrono::duration<double>{ timeout } * factor
+        );
+        // Never shorter than the minimum, unless the configured timeout already is
+        const auto minimum = std::min<std::chrono::milliseconds>(this->options.minimum, timeout);
+        return std::max(scaled, minimum);
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "Options.h"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    // Idle timeouts of NatNeg sessions, which are shortened when the process
+    // is running out of file descriptors or the system is running out of memory,
+    // so dead sessions are released sooner.
+    // Timeouts can be read from any thread, update() is called periodically by NatNegProxy.
+    class IdleTimeoutPolicy
+    {
+    public:
+        using Duration = std::chrono::steady_clock::duration;
+
+        enum class Phase
+        {
+            // NatNeg handshake still in progress
+            handshake,
+            // Relaying game traffic
+            relay,
+        };
+
+        static constexpr auto description = "IdleTimeoutPolicy";
+
+        // Timeouts start shrinking above this pressure...
+        static constexpr auto lowPressure = 0.5;
+        // ...and are shortest at this pressure
+        static constexpr auto highPressure = 0.9;
+        // Fraction of configured timeouts left at highPressure
+        static constexpr auto minimumScale = 0.1;
+
+        static std::shared_ptr<IdleTimeoutPolicy> create(const IdleTimeoutOptions& options);
+
+        explicit IdleTimeoutPolicy(const IdleTimeoutOptions& options);
+
+        Duration get(const Phase phase) const noexcept;
+
+        // Sample file descriptor and memory usage, and recompute current timeouts
+        void update();
+
+    private:
+        std::chrono::milliseconds scale(const std::chrono::seconds timeout, const double factor) const;
+
+        IdleTimeoutOptions options;
+        std::atomic<std::int64_t> handshakeMilliseconds;
+        std::atomic<std::int64_t> relayMilliseconds;
+    };
+}
@@ -2,8 +2,13 @@
 #include "InitialPhase.h"
 #include "GameConnection.h"
 #include "Logging.h"
+#include "Metrics.h"
 #include "NatNegProxy.h"
+#include "PacketCapture.h"
+#include "ReceiveBufferSizer.h"
 #include "SimpleWriteHandler.hpp"
+#include "SocketFilter.h"
+#include "SocketMessage.h"
 #include "WeakRefHandler.hpp"
 
 using AddressV4 = boost::asio::ip::address_v4;
@@ -23,6 +28,18 @@ namespace CNCOnlineForwarder::NatNeg
         return Logging::logLine<InitialPhase>(level, std::forward<Arguments>(arguments)...);
     }
 
+    namespace
+    {
+        auto& liveInitialPhases = Metrics::gauge("initialPhase.count");
+        auto& kernelDrops = Metrics::counter("initialPhase.kernelDrops");
+
+        // Initial size of receive buffers, later learned from received datagrams
+        constexpr auto receiveBufferSize = std::size_t{ 128 };
+        auto& communicationReceiveSizes = Utility::ReceiveBufferSizer::forRole("communication", receiveBufferSize);
+        // Memory used by an InitialPhase and its pending receive
+        constexpr auto initialPhaseBytes = sizeof(InitialPhase) + receiveBufferSize + sizeof(InitialPhase::EndPoint);
+    }
+
     class InitialPhase::ReceiveHandler
     {
     public:
@@ -33,7 +50,7 @@ namespace CNCOnlineForwarder::NatNeg
 
         boost::asio::mutable_buffer getBuffer() 
         { 
-            return boost::asio::buffer(*this->buffer); 
+            return boost::asio::buffer(this->buffer.get(), this->size); 
         }
 
         EndPoint& getFrom() 
@@ -41,7 +58,66 @@ namespace CNCOnlineForwarder::NatNeg
             return *this->from; 
         }
 
+        // Socket became readable, receive the datagram with its MessageInfo
+        void operator()(InitialPhase& self, const ErrorCode& code)
+        {
+            if (code.failed())
+            {
+                return this->complete(self, code, 0);
+            }
+
+            auto& socket = *self.communicationSocket.operator->();
+            auto info = Utility::MessageInfo{};
+            auto receiveCode = ErrorCode{};
+            const auto bytesReceived = Utility::receiveMessage
+            (
+                socket, 
+                this->getBuffer(), 
+                Utility::ReceiveBufferSizer::getOverflowBuffer(),
+                this->getFrom(), 
+                info, 
+                receiveCode
+            );
+            if (receiveCode == boost::asio::error::would_block)
+            {
+                return self.prepareForNextPacketToCommunicationAddress();
+            }
+            self.communicationMonitor.update(socket, info);
+            if (!receiveCode.failed())
+            {
+                communicationReceiveSizes.record(bytesReceived);
+                Utility::ReceiveBufferSizer::merge(this->buffer, this->size, bytesReceived);
+            }
+            return this->complete(self, receiveCode, bytesReceived);
+        }
+
+        // Datagram received by asyncReceiveFrom
         void operator()(InitialPhase& self, const ErrorCode& code, const std::size_t bytesReceived) const
+        {
+            if (code.failed())
+            {
+                return this->complete(self, code, 0);
+            }
+            if (bytesReceived >= this->size)
+            {
+                // The true size is unknown without recvmsg(), 
+                // so discard the datagram and let the next buffers be larger
+                communicationReceiveSizes.record(this->size + 1);
+                logLine(LogLevel::warning, "Received data may be truncated, discarded: ", bytesReceived);
+                return self.prepareForNextPacketToCommunicationAddress();
+            }
+            communicationReceiveSizes.record(bytesReceived);
+            return this->complete(self, code, bytesReceived);
+        }
+
+    private:
+        ReceiveHandler() :
+            size{ communicationReceiveSizes.getBufferSize() },
+            buffer{ std::make_unique<char[]>(this->size) },
+            from{ std::make_unique<EndPoint>() }
+        {}
+
+        void complete(InitialPhase& self, const ErrorCode& code, const std::size_t bytesReceived) const
         {
             self.prepareForNextPacketToCommunicationAddress();
 
@@ -58,27 +134,27 @@ namespace CNCOnlineForwarder::NatNeg
                 return;
             }
 
-            const auto packet = PacketView{ {this->buffer->data(), bytesReceived} };
+            const auto data = boost::asio::buffer(this->buffer.get(), bytesReceived);
+            Capture::record(Capture::Direction::inbound, self.communicationSocket, *this->from, data);
+
+            const auto packet = PacketView{ {this->buffer.get(), bytesReceived} };
             return self.handlePacketFromServer(packet);
         }
 
-    private:
-        ReceiveHandler() :
-            buffer{ std::make_unique<std::array<char, 1024>>() },
-            from{ std::make_unique<EndPoint>() }
-        {}
-
+        std::size_t size;
+        std::unique_ptr<char[]> buffer;
         std::unique_ptr<EndPoint> from;
-        std::unique_ptr<std::array<char, 1024>> buffer;
     };
 
     std::shared_ptr<InitialPhase> InitialPhase::create
     (
         const IOManager::ObjectMaker& objectMaker,
         const std::weak_ptr<NatNegProxy>& proxy,
+        Ticket ticket,
         const NatNegPlayerID id,
         const std::string& natNegServer,
-        const std::uint16_t natNegPort
+        const std::uint16_t natNegPort,
+        const bool socketFilter
     )
     {
         const auto self = std::make_shared<InitialPhase>
@@ -86,7 +162,9 @@ namespace CNCOnlineForwarder::NatNeg
             PrivateConstructor{}, 
             objectMaker, 
             proxy, 
-            id
+            std::move(ticket),
+            id,
+            socketFilter
         );
 
         const auto action = [self, natNegServer, natNegPort]
@@ -138,19 +216,69 @@ namespace CNCOnlineForwarder::NatNeg
         PrivateConstructor,
         const IOManager::ObjectMaker& objectMaker,
         const std::weak_ptr<NatNegProxy>& proxy,
-        const NatNegPlayerID id
+        Ticket ticket,
+        const NatNegPlayerID id,
+        const bool socketFilter
     ) :
         strand{ objectMaker.makeStrand() },
         resolver{ strand },
         communicationSocket{ strand, EndPoint{ UDP::v4(), 0 } },
         timeout{ strand },
         proxy{ proxy },
+        idleTimeouts{},
+        ticket{ std::move(ticket) },
         connection{ {} },
         id{ id },
         server{ {} }, 
         clientCommunication{}/*,
         socketReadyToReceive{ {} }*/
-    {}
+    {
+        Profiling::nameStrand(&this->strand, description);
+        auto filtered = false;
+        if (socketFilter)
+        {
+            const auto code = attachSocketFilter
+            (
+                this->communicationSocket->native_handle(), 
+                SocketFilterRole::communication
+            );
+            if (code.failed())
+            {
+                logLine(LogLevel::warning, "Failed to attach socket filter: ", code);
+            }
+            filtered = !code.failed();
+        }
+#ifdef __linux__
+        if (const auto code = Utility::enableMessageInfo(*this->communicationSocket.operator->()); code.failed())
+        {
+            logLine(LogLevel::warning, "Cannot enable drop counts: ", code);
+        }
+#endif
+        if (const auto proxyRef = proxy.lock())
+        {
+            this->idleTimeouts = proxyRef->getIdleTimeouts();
+            this->communicationMonitor.attach
+            (
+                *this->communicationSocket.operator->(), 
+                proxyRef->getOptions().socketBuffers, 
+                "communication",
+                filtered
+            );
+        }
+        this->ticket->charge(initialPhaseBytes);
+        liveInitialPhases.add();
+    }
+
+    InitialPhase::~InitialPhase()
+    {
+        const auto drops = getKernelDropCount(this->communicationSocket->native_handle());
+        if (drops.has_value())
+        {
+            kernelDrops.add(drops.value());
+        }
+        this->ticket->refund(initialPhaseBytes);
+        liveInitialPhases.subtract();
+    }
 
     void InitialPhase::prepareGameConnection
     (
@@ -171,6 +299,8 @@ namespace CNCOnlineForwarder::NatNeg
                     objectMaker,
                     this->proxy,
                     addressTranslator,
+                    this->ticket,
+                    this->id,
                     server,
                     client
                 );
@@ -184,6 +314,20 @@ namespace CNCOnlineForwarder::NatNeg
         boost::asio::defer(this->strand, makeWeakHandler(this, action));
     }
 
+    void InitialPhase::adoptGameConnection(const std::weak_ptr<GameConnection>& existing)
+    {
+        const auto action = [existing](InitialPhase& self)
+        {
+            if (!self.connection->isReady())
+            {
+                logLine(LogLevel::info, "Adopting existing GameConnection of ", self.id);
+                self.connection->ref = existing;
+            }
+            self.connection.trySetReady();
+        };
+        boost::asio::defer(this->strand, makeWeakHandler(this, action));
+    }
+
     void InitialPhase::handlePacketToServer
     (
         const PacketView packet, 
@@ -265,7 +409,10 @@ namespace CNCOnlineForwarder::NatNeg
             logLine(LogLevel::info, "Closing self (natNegId ", self->id, ")");
             self->close();
         };
-        this->timeout.asyncWait(std::chrono::minutes{ 1 }, std::move(waitHandler));
+        const auto life = this->idleTimeouts ?
+            this->idleTimeouts->get(IdleTimeoutPolicy::Phase::handshake) :
+            std::chrono::minutes{ 1 };
+        this->timeout.asyncWait(life, std::move(waitHandler));
     }
 
     void InitialPhase::prepareForNextPacketToCommunicationAddress()
@@ -273,12 +420,14 @@ namespace CNCOnlineForwarder::NatNeg
         /*const auto action = [this]
         {*/
         auto handler = ReceiveHandler::create(this);
-        this->communicationSocket.asyncReceiveFrom
-        (
-            handler->getBuffer(),
-            handler->getFrom(),
-            std::move(handler)
-        );
+#ifdef __linux__
+        // Wait for readability and use recvmsg() to get drop counts
+        this->communicationSocket.asyncWait(boost::asio::socket_base::wait_read, std::move(handler));
+#else
+        const auto buffer = handler->getBuffer();
+        auto& from = handler->getFrom();
+        this->communicationSocket.asyncReceiveFrom(buffer, from, std::move(handler));
+#endif
         /*};
         this->socketReadyToReceive.asyncDo(action);*/
     }
@@ -336,6 +485,7 @@ namespace CNCOnlineForwarder::NatNeg
             [](InitialPhase& self) { return self.socketReadyToReceive; }
         );*/
         auto writeHandler = makeWriteHandler<InitialPhase>(packet.copyBuffer());
+        Capture::record(Capture::Direction::outbound, this->communicationSocket, server, writeHandler.getData());
         this->communicationSocket.asyncSendTo
         (
             writeHandler.getData(),
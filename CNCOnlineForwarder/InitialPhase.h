@@ -7,10 +7,13 @@
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/steady_timer.hpp>
 #include <boost/asio/strand.hpp>
+#include "IdleTimeoutPolicy.h"
 #include "IOManager.hpp"
 #include "NatNegPacket.hpp"
 #include "ProxyAddressTranslator.h"
 #include "PendingActions.hpp"
+#include "SessionBudget.h"
+#include "SocketMonitor.h"
 
 namespace CNCOnlineForwarder::NatNeg
 {
@@ -34,13 +37,17 @@ namespace CNCOnlineForwarder::NatNeg
 
         static constexpr auto description = "InitialPhase";
 
+        using Ticket = std::shared_ptr<SessionBudget::Ticket>;
+
         static std::shared_ptr<InitialPhase> create
         (
             const IOManager::ObjectMaker& objectMaker,
             const std::weak_ptr<NatNegProxy>& proxy,
+            Ticket ticket,
             const NatNegPlayerID id,
             const std::string& natNegServer,
-            const std::uint16_t natNegPort
+            const std::uint16_t natNegPort,
+            const bool socketFilter
         );
 
         InitialPhase
@@ -48,11 +55,14 @@ namespace CNCOnlineForwarder::NatNeg
             PrivateConstructor,
             const IOManager::ObjectMaker& objectMaker,
             const std::weak_ptr<NatNegProxy>& proxy,
-            const NatNegPlayerID id
+            Ticket ticket,
+            const NatNegPlayerID id,
+            const bool socketFilter
         );
 
         InitialPhase(const InitialPhase&) = delete;
         InitialPhase& operator=(const InitialPhase&) = delete;
+        ~InitialPhase();
 
         void prepareGameConnection
         (
@@ -63,6 +73,10 @@ namespace CNCOnlineForwarder::NatNeg
 
         void handlePacketToServer(const PacketView packet, const EndPoint& from);
 
+        // Use a GameConnection which already exists, 
+        // such as one restored by hot restart, instead of creating another one
+        void adoptGameConnection(const std::weak_ptr<GameConnection>& existing);
+
     private:
         struct PromisedEndPoint
         {
@@ -127,9 +141,13 @@ namespace CNCOnlineForwarder::NatNeg
         Strand strand;
         Resolver resolver;
         Socket communicationSocket;
+        Utility::SocketMonitor communicationMonitor;
         Timer timeout;
 
         std::weak_ptr<NatNegProxy> proxy;
+        std::shared_ptr<IdleTimeoutPolicy> idleTimeouts;
+        // Shared with GameConnection
+        Ticket ticket;
         FutureConnection connection;
 
         NatNegPlayerID id;
@@ -0,0 +1,306 @@
+#include "precompiled.h"
+#include "LoadMonitor.h"
+#include <array>
+#include "Logging.h"
+#include "Metrics.h"
+#include "WeakRefHandler.hpp"
+
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder
+{
+    namespace
+    {
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<LoadMonitor>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        auto& sheddingLevel = Metrics::gauge("eventLoop.sheddingLevel");
+        auto& monitorLag = Metrics::windowedHistogram("eventLoop.lagNanoseconds.loadMonitor");
+
+        // Read by every thread deciding whether to shed something
+        std::atomic<LoadMonitor::SheddingLevel> currentLevel{ LoadMonitor::SheddingLevel::none };
+        // Bit 1 << level is set for each kind of work whose threshold isn't 0,
+        // since a disabled kind must not be shed when a further level is reached
+        std::atomic<unsigned> enabledLevels{ 0 };
+
+        constexpr auto sheddableLevels = std::array
+        {
+            LoadMonitor::SheddingLevel::newSessions,
+            LoadMonitor::SheddingLevel::infoLogging,
+            LoadMonitor::SheddingLevel::addressRefresh,
+        };
+
+        constexpr unsigned toBit(const LoadMonitor::SheddingLevel level) noexcept
+        {
+            return 1u << static_cast<unsigned>(level);
+        }
+
+        constexpr std::string_view describe(const LoadMonitor::SheddingLevel level) noexcept
+        {
+            switch (level)
+            {
+            case LoadMonitor::SheddingLevel::newSessions:
+                return "new sessions";
+            case LoadMonitor::SheddingLevel::infoLogging:
+                return "info logging";
+            case LoadMonitor::SheddingLevel::addressRefresh:
+                return "public address refreshes";
+            default:
+                return "nothing";
+            }
+        }
+
+        // Returns: the kinds of work shed at level, like "new sessions and info logging"
+        std::string describeShedWork(const LoadMonitor::SheddingLevel level)
+        {
+            auto shed = std::vector<std::string_view>{};
+            for (const auto candidate : sheddableLevels)
+            {
+                if ((candidate <= level) && ((enabledLevels.load() & toBit(candidate)) != 0))
+                {
+                    shed.push_back(describe(candidate));
+                }
+            }
+            if (shed.empty())
+            {
+                return std::string{ describe(LoadMonitor::SheddingLevel::none) };
+            }
+
+            auto text = std::string{ shed.front() };
+            for (auto i = std::size_t{ 1 }; i < shed.size(); ++i)
+            {
+                text += (i + 1 == shed.size()) ? " and " : ", ";
+                text += shed[i];
+            }
+            return text;
+        }
+
+        std::uint64_t toNanoseconds(const LoadMonitor::Clock::duration duration)
+        {
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            return static_cast<std::uint64_t>(std::max<decltype(nanoseconds)>(nanoseconds, 0));
+        }
+
+        // Kept per thread like the residency of relayed packets, so recording doesn't contend
+        Metrics::WindowedHistogram& getThreadLagHistogram()
+        {
+            thread_local auto& histogram = Metrics::windowedHistogram
+            (
+                "eventLoop.lagNanoseconds.thread" + std::to_string(Metrics::getThreadIndex())
+            );
+            return histogram;
+        }
+    }
+
+    std::shared_ptr<LoadMonitor> LoadMonitor::create
+    (
+        const std::shared_ptr<IOManager>& ioManager,
+        const IOManager::ObjectMaker& objectMaker,
+        const LoadSheddingOptions& options
+    )
+    {
+        const auto self = std::make_shared<LoadMonitor>(PrivateConstructor{}, ioManager, objectMaker, options);
+
+        const auto action = [](LoadMonitor& self)
+        {
+            logLine
+            (
+                LogLevel::info,
+                "Measuring event loop lag of ", self.threadExecutors.size(), " threads every ",
+                self.options.interval.count(), "ms"
+            );
+            self.prepareForNextMeasurement();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    bool LoadMonitor::isShedding(const SheddingLevel level) noexcept
+    {
+        return (currentLevel.load(std::memory_order_relaxed) >= level) &&
+            ((enabledLevels.load(std::memory_order_relaxed) & toBit(level)) != 0);
+    }
+
+    LoadMonitor::LoadMonitor
+    (
+        PrivateConstructor,
+        const std::shared_ptr<IOManager>& ioManager,
+        const IOManager::ObjectMaker& objectMaker,
+        const LoadSheddingOptions& options
+    ) :
+        strand{ objectMaker.makeStrand() },
+        timer{ strand },
+        threadExecutors{ ioManager->getThreadExecutors() },
+        options{ options },
+        pendingMarkers{ 0 },
+        roundLagNanoseconds{ 0 },
+        level{ SheddingLevel::none }
+    {
+        auto enabled = 0u;
+        for (const auto candidate : sheddableLevels)
+        {
+            if (this->getThreshold(candidate).count() > 0)
+            {
+                enabled |= toBit(candidate);
+            }
+        }
+        enabledLevels.store(enabled);
+    }
+
+    void LoadMonitor::watch(const std::string_view name, const Strand& strand)
+    {
+        auto& histogram = Metrics::windowedHistogram("eventLoop.lagNanoseconds." + std::string{ name });
+        const auto action = [strand, &histogram](LoadMonitor& self)
+        {
+            self.watchedStrands.push_back(WatchedStrand{ strand, &histogram });
+        };
+        boost::asio::post(this->strand, makeWeakHandler(this, action));
+    }
+
+    void LoadMonitor::prepareForNextMeasurement()
+    {
+        const auto action = [](LoadMonitor& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+            self.measure();
+        };
+
+        this->expectedAt = Clock::now() + this->options.interval;
+        this->timer.asyncWait
+        (
+            this->options.interval,
+            boost::asio::bind_executor(this->strand, makeWeakHandler(this, action))
+        );
+    }
+
+    void LoadMonitor::measure()
+    {
+        const auto now = Clock::now();
+        // The timer firing late is lag of the strand of LoadMonitor itself
+        const auto lateness = now - this->expectedAt;
+        monitorLag.record(toNanoseconds(lateness));
+
+        const auto roundLag = std::chrono::nanoseconds{ this->roundLagNanoseconds.exchange(0) };
+        auto lag = std::max(lateness, std::chrono::duration_cast<Clock::duration>(roundLag));
+        const auto stillPending = this->pendingMarkers.load() > 0;
+        if (stillPending)
+        {
+            // Markers which didn't run yet are at least this late
+            lag = std::max(lag, now - this->roundPostedAt);
+        }
+
+        this->updateSheddingLevel(lag);
+        if (!stillPending)
+        {
+            this->postMarkers(now);
+        }
+        this->prepareForNextMeasurement();
+    }
+
+    void LoadMonitor::postMarkers(const Clock::time_point now)
+    {
+        this->roundPostedAt = now;
+        this->pendingMarkers.store(this->threadExecutors.size() + this->watchedStrands.size());
+        const auto self = this->weak_from_this();
+        for (const auto& executor : this->threadExecutors)
+        {
+            boost::asio::post(executor, [self, now]
+            {
+                const auto lag = toNanoseconds(Clock::now() - now);
+                getThreadLagHistogram().record(lag);
+                if (const auto monitor = self.lock())
+                {
+                    monitor->markerDone(lag);
+                }
+            });
+        }
+        for (const auto& watched : this->watchedStrands)
+        {
+            const auto histogram = watched.histogram;
+            boost::asio::post(watched.strand, [self, now, histogram]
+            {
+                const auto lag = toNanoseconds(Clock::now() - now);
+                histogram->record(lag);
+                if (const auto monitor = self.lock())
+                {
+                    monitor->markerDone(lag);
+                }
+            });
+        }
+    }
+
+    void LoadMonitor::markerDone(const std::uint64_t lagNanoseconds) noexcept
+    {
+        auto current = this->roundLagNanoseconds.load(std::memory_order_relaxed);
+        while ((current < lagNanoseconds) && !this->roundLagNanoseconds.compare_exchange_weak(current, lagNanoseconds))
+        {
+        }
+        this->pendingMarkers.fetch_sub(1);
+    }
+
+    void LoadMonitor::updateSheddingLevel(const Clock::duration lag)
+    {
+        auto target = SheddingLevel::none;
+        for (const auto candidate : sheddableLevels)
+        {
+            const auto threshold = this->getThreshold(candidate);
+            if ((threshold.count() > 0) && (lag >= threshold))
+            {
+                target = candidate;
+            }
+        }
+
+        if (target < this->level)
+        {
+            // Work only comes back one level at a time, once the lag is well below the current threshold,
+            // so shedding doesn't flap around a threshold
+            const auto threshold = this->getThreshold(this->level);
+            if ((threshold.count() > 0) && (lag >= (threshold / 2)))
+            {
+                return;
+            }
+            target = static_cast<SheddingLevel>(static_cast<int>(this->level) - 1);
+        }
+
+        if (target == this->level)
+        {
+            return;
+        }
+
+        const auto lagMilliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(lag).count();
+        logLine(LogLevel::warning, "Event loop lag ", lagMilliseconds, "ms, now shedding ", describeShedWork(target));
+        this->level = target;
+        currentLevel.store(target, std::memory_order_relaxed);
+        sheddingLevel.set(static_cast<std::int64_t>(target));
+        Logging::setInfoShedding(isShedding(SheddingLevel::infoLogging));
+    }
+
+    LoadMonitor::Clock::duration LoadMonitor::getThreshold(const SheddingLevel level) const noexcept
+    {
+        switch (level)
+        {
+        case SheddingLevel::newSessions:
+            return this->options.newSessionsLag;
+        case SheddingLevel::infoLogging:
+            return this->options.infoLoggingLag;
+        case SheddingLevel::addressRefresh:
+            return this->options.addressRefreshLag;
+        default:
+            return Clock::duration::zero();
+        }
+    }
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/steady_timer.hpp>
+#include "IOManager.hpp"
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Metrics
+{
+    class WindowedHistogram;
+}
+
+namespace CNCOnlineForwarder
+{
+    // Continuously measures the event loop lag, the time from posting a marker handler
+    // until it runs, on the io_context of every thread and on watched strands.
+    // Lag is recorded as eventLoop.lagNanoseconds.* metrics, and when it exceeds
+    // the configured thresholds the most expendable work is shed first:
+    // new NatNeg sessions, then info logging, then public address refreshes.
+    // Established GameConnections are never shed.
+    class LoadMonitor : public std::enable_shared_from_this<LoadMonitor>
+    {
+    private:
+        struct PrivateConstructor{};
+    public:
+        using Strand = IOManager::StrandType;
+        using Timer = WithStrand<boost::asio::steady_timer>;
+        using Clock = std::chrono::steady_clock;
+
+        // Ordered from the most expendable work
+        enum class SheddingLevel
+        {
+            none,
+            newSessions,
+            infoLogging,
+            addressRefresh,
+        };
+
+        static constexpr auto description = "LoadMonitor";
+
+        static std::shared_ptr<LoadMonitor> create
+        (
+            const std::shared_ptr<IOManager>& ioManager,
+            const IOManager::ObjectMaker& objectMaker,
+            const LoadSheddingOptions& options
+        );
+
+        // Returns: true if work of this level must be skipped, can be called from any thread
+        static bool isShedding(const SheddingLevel level) noexcept;
+
+        LoadMonitor
+        (
+            PrivateConstructor,
+            const std::shared_ptr<IOManager>& ioManager,
+            const IOManager::ObjectMaker& objectMaker,
+            const LoadSheddingOptions& options
+        );
+
+        // Measure the lag of a strand too, its lag is recorded as eventLoop.lagNanoseconds.<name>
+        void watch(const std::string_view name, const Strand& strand);
+
+    private:
+        struct WatchedStrand
+        {
+            Strand strand;
+            Metrics::WindowedHistogram* histogram;
+        };
+
+        void prepareForNextMeasurement();
+
+        void measure();
+
+        void postMarkers(const Clock::time_point now);
+
+        // Called by markers, from any thread
+        void markerDone(const std::uint64_t lagNanoseconds) noexcept;
+
+        void updateSheddingLevel(const Clock::duration lag);
+
+        Clock::duration getThreshold(const SheddingLevel level) const noexcept;
+
+        Strand strand;
+        Timer timer;
+        std::vector<IOManager::ContextType::executor_type> threadExecutors;
+        std::vector<WatchedStrand> watchedStrands;
+        LoadSheddingOptions options;
+        Clock::time_point expectedAt;
+        // Markers of the current round are only posted once all of the previous one ran,
+        // so an overloaded loop isn't flooded by them
+        Clock::time_point roundPostedAt;
+        std::atomic<std::size_t> pendingMarkers;
+        std::atomic<std::uint64_t> roundLagNanoseconds;
+        SheddingLevel level;
+    };
+}
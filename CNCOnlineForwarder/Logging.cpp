@@ -4,6 +4,19 @@
 
 namespace CNCOnlineForwarder::Logging
 {
+    namespace
+    {
+        std::atomic<bool> infoShedding{ false };
+
+        Logging::LogRecord openRecord(Logging::SeverityLogger& logger, const Level level)
+        {
+            if ((level <= Level::info) && infoShedding.load(std::memory_order_relaxed))
+            {
+                return Logging::LogRecord{};
+            }
+            return logger.open_record(boost::log::keywords::severity = level);
+        }
+    }
 
     Logging::Logging()
     {
@@ -27,7 +40,7 @@ namespace CNCOnlineForwarder::Logging
 
     Logging::LogProxy::LogProxy(Logging::SeverityLogger& logger, Level level) :
         logger{ logger },
-        record{ logger.open_record(boost::log::keywords::severity = level) }
+        record{ openRecord(logger, level) }
     {
         if (this->record)
         {
@@ -71,5 +84,10 @@ namespace CNCOnlineForwarder::Logging
         firstTime = false;
         boost::log::core::get()->set_filter(boost::log::trivial::severity >= level);
     }
+
+    void setInfoShedding(const bool shedding) noexcept
+    {
+        infoShedding.store(shedding, std::memory_order_relaxed);
+    }
     
 }
\ No newline at end of file
@@ -41,6 +41,10 @@ namespace CNCOnlineForwarder::Logging
 
     void setFilterLevel(Level level);
 
+    // While set, lines of info level and below are dropped before being formatted,
+    // can be called from any thread
+    void setInfoShedding(const bool shedding) noexcept;
+
     template<typename T>
     Logging::LogStream& Logging::LogProxy::operator<<(T&& argument)
     {
@@ -0,0 +1,198 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+namespace CNCOnlineForwarder::Utility
+{
+    // Bounded lock-free multiple producer single consumer queue of fixed size records,
+    // stored inline so pushing never allocates (Vyukov's bounded queue).
+    // Producers are told when the mailbox goes from empty to non empty,
+    // so a single drain task is scheduled for a whole batch of records.
+    // When the ring is full, records spill into a locked list instead, and later
+    // records of any producer follow them there until it's drained, so every
+    // producer's records are drained in the order it pushed them.
+    // Any thread may push, only one strand may drain.
+    template<typename Record, std::size_t capacity>
+    class Mailbox
+    {
+        static_assert((capacity >= 2) && ((capacity & (capacity - 1)) == 0), "capacity must be a power of two");
+        static_assert(std::is_trivially_copyable_v<Record>, "records are reused without being destroyed");
+    public:
+        // Drains retried while a producer is writing the next record wait this long,
+        // doubled after each failed attempt, instead of spinning on the strand
+        static constexpr auto minimumRetryDelay = std::chrono::microseconds{ 20 };
+        static constexpr auto maximumRetryDelay = std::chrono::microseconds{ 1000 };
+
+        struct PushResult
+        {
+            // Mailbox was empty, the caller must schedule drain()
+            bool first;
+            // Ring was full, the record was stored in the spill list, which allocates
+            bool spilled;
+        };
+
+        Mailbox() noexcept :
+            tail{ 0 },
+            pending{ 0 },
+            spilling{ false },
+            head{ 0 }
+        {
+            for (auto i = std::size_t{ 0 }; i < capacity; ++i)
+            {
+                this->cells[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        Mailbox(const Mailbox&) = delete;
+        Mailbox& operator=(const Mailbox&) = delete;
+
+        // fill is called with the record to be written, in place
+        template<typename Fill>
+        PushResult push(Fill&& fill)
+        {
+            if (!this->spilling.load(std::memory_order_acquire) && this->tryPushToRing(fill))
+            {
+                const auto wasEmpty = this->pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+                return PushResult{ wasEmpty, false };
+            }
+
+            const auto lock = std::scoped_lock{ this->spillMutex };
+            auto& spilled = this->spill.emplace_back();
+            fill(spilled.record);
+            // Ring records claimed before this one must be drained first
+            spilled.ringPosition = this->tail.load(std::memory_order_acquire);
+            this->spilling.store(true, std::memory_order_release);
+            const auto wasEmpty = this->pending.fetch_add(1, std::memory_order_acq_rel) == 0;
+            return PushResult{ wasEmpty, true };
+        }
+
+        // Calls handler with every record pushed so far.
+        // Returns: false if a producer is still writing a record which is next in line,
+        // in which case drain() must be scheduled again.
+        template<typename Handler>
+        bool drain(Handler&& handler)
+        {
+            auto remaining = this->pending.load(std::memory_order_acquire);
+            while (remaining != 0)
+            {
+                auto handled = std::size_t{ 0 };
+                for (; handled < remaining; ++handled)
+                {
+                    auto& cell = this->cells[this->head & mask];
+                    if (cell.sequence.load(std::memory_order_acquire) != (this->head + 1))
+                    {
+                        break;
+                    }
+                    handler(static_cast<const Record&>(cell.record));
+                    cell.sequence.store(this->head + capacity, std::memory_order_release);
+                    ++this->head;
+                }
+
+                if (handled < remaining)
+                {
+                    handled += this->drainSpill(handler, remaining - handled);
+                }
+
+                if (handled == 0)
+                {
+                    return false;
+                }
+                remaining = this->pending.fetch_sub(handled, std::memory_order_acq_rel) - handled;
+            }
+            return true;
+        }
+
+    private:
+        static constexpr auto mask = capacity - 1;
+
+        struct Cell
+        {
+            std::atomic<std::size_t> sequence;
+            Record record;
+        };
+
+        struct Spilled
+        {
+            Record record;
+            std::size_t ringPosition;
+        };
+
+        template<typename Fill>
+        bool tryPushToRing(Fill& fill) noexcept
+        {
+            auto position = this->tail.load(std::memory_order_relaxed);
+            auto* cell = static_cast<Cell*>(nullptr);
+            while (true)
+            {
+                cell = &this->cells[position & mask];
+                const auto sequence = cell->sequence.load(std::memory_order_acquire);
+                const auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+                if (difference == 0)
+                {
+                    if (this->tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = this->tail.load(std::memory_order_relaxed);
+                }
+            }
+
+            fill(cell->record);
+            cell->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Handles at most limit records, so pending never goes below zero.
+        // Returns: number of spilled records handled, the ones behind ring records
+        // which are still being written are kept for the next drain
+        template<typename Handler>
+        std::size_t drainSpill(Handler& handler, const std::size_t limit)
+        {
+            {
+                const auto lock = std::scoped_lock{ this->spillMutex };
+                while (!this->spill.empty() && (this->drained.size() < limit) &&
+                    (this->spill.front().ringPosition <= this->head))
+                {
+                    this->drained.push_back(this->spill.front().record);
+                    this->spill.pop_front();
+                }
+                this->spilling.store(!this->spill.empty(), std::memory_order_release);
+            }
+
+            // Handlers may push again, so they're called without the lock
+            for (const auto& record : this->drained)
+            {
+                handler(record);
+            }
+            const auto count = this->drained.size();
+            this->drained.clear();
+            return count;
+        }
+
+        std::array<Cell, capacity> cells;
+        std::atomic<std::size_t> tail;
+        // Records pushed but not drained yet
+        std::atomic<std::size_t> pending;
+        // Set while spill isn't empty, so later records queue up behind it
+        std::atomic<bool> spilling;
+        std::mutex spillMutex;
+        std::deque<Spilled> spill;
+        // Only used by the consumer
+        std::size_t head;
+        std::vector<Record> drained;
+    };
+}
@@ -0,0 +1,268 @@
+#include "precompiled.h"
+#include "Metrics.h"
+#include "Logging.h"
+#include "WeakRefHandler.hpp"
+#include <map>
+#include <mutex>
+
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder::Metrics
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<Reporter>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        class Registry
+        {
+        public:
+            static Registry& instance()
+            {
+                static auto registry = Registry{};
+                return registry;
+            }
+
+            template<typename Metric>
+            Metric& find(std::map<std::string, std::unique_ptr<Metric>, std::less<>>& metrics, const std::string_view name)
+            {
+                const auto lock = std::scoped_lock{ this->mutex };
+                const auto found = metrics.find(name);
+                if (found != metrics.end())
+                {
+                    return *found->second;
+                }
+                return *metrics.emplace(std::string{ name }, std::make_unique<Metric>()).first->second;
+            }
+
+            std::vector<Sample> snapshot()
+            {
+                const auto lock = std::scoped_lock{ this->mutex };
+                auto samples = std::vector<Sample>{};
+                samples.reserve(this->counters.size() + this->gauges.size());
+                for (const auto& [name, counter] : this->counters)
+                {
+                    samples.push_back(Sample{ name, static_cast<std::int64_t>(counter->get()), true });
+                }
+                for (const auto& [name, gauge] : this->gauges)
+                {
+                    samples.push_back(Sample{ name, gauge->get(), false });
+                }
+                std::sort
+                (
+                    samples.begin(), 
+                    samples.end(), 
+                    [](const Sample& a, const Sample& b) { return a.name < b.name; }
+                );
+                return samples;
+            }
+
+            std::vector<HistogramSample> histogramSnapshot()
+            {
+                const auto lock = std::scoped_lock{ this->mutex };
+                auto samples = std::vector<HistogramSample>{};
+                samples.reserve(this->histograms.size() + this->windowedHistograms.size());
+                for (const auto& [name, histogram] : this->histograms)
+                {
+                    samples.push_back(HistogramSample{ name, histogram->snapshot() });
+                }
+                for (const auto& [name, histogram] : this->windowedHistograms)
+                {
+                    samples.push_back(HistogramSample{ name, histogram->snapshot() });
+                }
+                std::sort
+                (
+                    samples.begin(),
+                    samples.end(),
+                    [](const HistogramSample& a, const HistogramSample& b) { return a.name < b.name; }
+                );
+                return samples;
+            }
+
+            void rotateWindowedHistograms()
+            {
+                const auto lock = std::scoped_lock{ this->mutex };
+                for (const auto& [name, histogram] : this->windowedHistograms)
+                {
+                    histogram->rotate();
+                }
+            }
+
+            std::mutex mutex;
+            std::map<std::string, std::unique_ptr<Counter>, std::less<>> counters;
+            std::map<std::string, std::unique_ptr<Gauge>, std::less<>> gauges;
+            std::map<std::string, std::unique_ptr<Histogram>, std::less<>> histograms;
+            std::map<std::string, std::unique_ptr<WindowedHistogram>, std::less<>> windowedHistograms;
+        };
+    }
+
+    Counter& counter(const std::string_view name)
+    {
+        auto& registry = Registry::instance();
+        return registry.find(registry.counters, name);
+    }
+
+    Gauge& gauge(const std::string_view name)
+    {
+        auto& registry = Registry::instance();
+        return registry.find(registry.gauges, name);
+    }
+
+    Histogram& histogram(const std::string_view name)
+    {
+        auto& registry = Registry::instance();
+        return registry.find(registry.histograms, name);
+    }
+
+    WindowedHistogram& windowedHistogram(const std::string_view name)
+    {
+        auto& registry = Registry::instance();
+        return registry.find(registry.windowedHistograms, name);
+    }
+
+    std::size_t getThreadIndex()
+    {
+        static auto nextIndex = std::atomic<std::size_t>{ 0 };
+        thread_local const auto index = nextIndex.fetch_add(1);
+        return index;
+    }
+
+    std::vector<Sample> snapshot()
+    {
+        return Registry::instance().snapshot();
+    }
+
+    std::vector<HistogramSample> histogramSnapshot()
+    {
+        return Registry::instance().histogramSnapshot();
+    }
+
+    void rotateWindowedHistograms()
+    {
+        return Registry::instance().rotateWindowedHistograms();
+    }
+
+    std::shared_ptr<Reporter> Reporter::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::chrono::steady_clock::duration interval
+    )
+    {
+        const auto self = std::make_shared<Reporter>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            interval
+        );
+
+        const auto action = [](Reporter& self)
+        {
+            self.lastReport = std::chrono::steady_clock::now();
+            if (self.interval.count() > 0)
+            {
+                self.prepareForNextReport();
+            }
+            self.prepareForNextRotation();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    Reporter::Reporter
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::chrono::steady_clock::duration interval
+    ) :
+        strand{ objectMaker.makeStrand() },
+        timer{ strand },
+        rotationTimer{ strand },
+        interval{ interval },
+        lastReport{},
+        lastCounterValues{}
+    {}
+
+    void Reporter::prepareForNextReport()
+    {
+        const auto action = [](Reporter& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+
+            self.report();
+            self.prepareForNextReport();
+        };
+
+        this->timer.asyncWait(this->interval, makeWeakHandler(this, action));
+    }
+
+    void Reporter::prepareForNextRotation()
+    {
+        const auto action = [](Reporter& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+
+            rotateWindowedHistograms();
+            self.prepareForNextRotation();
+        };
+
+        this->rotationTimer.asyncWait(sliceLength, makeWeakHandler(this, action));
+    }
+
+    void Reporter::report()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const auto elapsed = std::chrono::duration<double>{ now - this->lastReport }.count();
+        this->lastReport = now;
+
+        for (const auto& sample : snapshot())
+        {
+            if (!sample.isCounter)
+            {
+                logLine(LogLevel::info, sample.name, " = ", sample.value);
+                continue;
+            }
+
+            auto& lastValue = this->lastCounterValues[sample.name];
+            const auto rate = (elapsed > 0) ? ((sample.value - lastValue) / elapsed) : 0.0;
+            lastValue = sample.value;
+            logLine(LogLevel::info, sample.name, " = ", sample.value, " (", rate, "/s)");
+        }
+
+        for (const auto& [name, histogram] : histogramSnapshot())
+        {
+            logLine
+            (
+                LogLevel::info, 
+                name, 
+                ": count = ", histogram.getCount(),
+                ", p50 = ", histogram.getQuantile(0.5),
+                ", p99 = ", histogram.getQuantile(0.99),
+                ", p999 = ", histogram.getQuantile(0.999),
+                ", max = ", histogram.getMax()
+            );
+        }
+    }
+}
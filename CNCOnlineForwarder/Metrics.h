@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio/steady_timer.hpp>
+#include "Histogram.hpp"
+#include "IOManager.hpp"
+
+namespace CNCOnlineForwarder::Metrics
+{
+    // A monotonically increasing value, can be updated from any thread
+    class Counter
+    {
+    public:
+        void add(const std::uint64_t amount = 1) noexcept
+        {
+            this->value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        std::uint64_t get() const noexcept
+        {
+            return this->value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<std::uint64_t> value{ 0 };
+    };
+
+    // A value which can go up and down, can be updated from any thread
+    class Gauge
+    {
+    public:
+        void add(const std::int64_t amount = 1) noexcept
+        {
+            this->value.fetch_add(amount, std::memory_order_relaxed);
+        }
+
+        void subtract(const std::int64_t amount = 1) noexcept
+        {
+            this->value.fetch_sub(amount, std::memory_order_relaxed);
+        }
+
+        void set(const std::int64_t newValue) noexcept
+        {
+            this->value.store(newValue, std::memory_order_relaxed);
+        }
+
+        std::int64_t get() const noexcept
+        {
+            return this->value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<std::int64_t> value{ 0 };
+    };
+
+    // Returns the metric with the given name, creating it if it doesn't exist yet.
+    // Returned references stay valid until the program exits, 
+    // so they can be looked up once and cached.
+    Counter& counter(const std::string_view name);
+
+    Gauge& gauge(const std::string_view name);
+
+    Histogram& histogram(const std::string_view name);
+
+    // Windowed histograms are rotated by Reporter
+    WindowedHistogram& windowedHistogram(const std::string_view name);
+
+    // A small number identifying the calling thread, for metrics kept per thread
+    std::size_t getThreadIndex();
+
+    struct Sample
+    {
+        std::string name;
+        std::int64_t value;
+        bool isCounter;
+    };
+
+    struct HistogramSample
+    {
+        std::string name;
+        Histogram::Snapshot value;
+    };
+
+    // Current values of all counters and gauges, sorted by name
+    std::vector<Sample> snapshot();
+
+    // Current values of all histograms, including windowed ones, sorted by name
+    std::vector<HistogramSample> histogramSnapshot();
+
+    void rotateWindowedHistograms();
+
+    // Periodically writes all metrics to the log, and rotates windowed histograms
+    class Reporter : public std::enable_shared_from_this<Reporter>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        using Strand = IOManager::StrandType;
+        using Timer = WithStrand<boost::asio::steady_timer>;
+
+        static constexpr auto description = "Metrics";
+
+        static std::shared_ptr<Reporter> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            // 0 means metrics are not written to the log
+            const std::chrono::steady_clock::duration interval
+        );
+
+        // Length of each slice of windowed histograms
+        static constexpr auto sliceLength = std::chrono::seconds{ 10 };
+
+        Reporter
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const std::chrono::steady_clock::duration interval
+        );
+
+    private:
+        void prepareForNextReport();
+
+        void prepareForNextRotation();
+
+        void report();
+
+        Strand strand;
+        Timer timer;
+        Timer rotationTimer;
+        std::chrono::steady_clock::duration interval;
+        std::chrono::steady_clock::time_point lastReport;
+        std::unordered_map<std::string, std::int64_t> lastCounterValues;
+    };
+}
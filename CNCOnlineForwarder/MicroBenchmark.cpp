@@ -0,0 +1,346 @@
+#include "precompiled.h"
+#include "MicroBenchmark.h"
+#include <ctime>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <thread>
+#include "BuildConfiguration.h"
+#include "IOManager.hpp"
+#include "Logging.h"
+#include "NatNegPacket.hpp"
+#include "PendingActions.hpp"
+#include "SimpleWriteHandler.hpp"
+#include "WeakRefHandler.hpp"
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct MicroBenchmark
+        {
+            static constexpr auto description = "MicroBenchmark";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<MicroBenchmark>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        // Keeps the compiler from optimizing away the results of the measured code,
+        // by making it believe value is read
+        template<typename T>
+        void keep(const T& value)
+        {
+#ifdef _WIN32
+            // No inline assembly on x64 MSVC, every byte is read through volatile instead
+            static auto volatile sink = char{ 0 };
+            const auto bytes = reinterpret_cast<const volatile char*>(&value);
+            for (auto i = std::size_t{ 0 }; i < sizeof(T); ++i)
+            {
+                sink = bytes[i];
+            }
+#else
+            asm volatile("" : : "g"(&value) : "memory");
+#endif
+        }
+
+        struct Result
+        {
+            std::string name;
+            std::uint64_t iterations;
+            double realTime;
+            double cpuTime;
+        };
+
+        // Runs body(iterations) with growing iteration counts until a batch takes minimumTime.
+        // Returns: nanoseconds per iteration of the last batch.
+        template<typename Body>
+        Result measure(const std::string& name, const std::chrono::nanoseconds minimumTime, Body&& body)
+        {
+            auto iterations = std::uint64_t{ 1 };
+            while (true)
+            {
+                const auto cpuBefore = std::clock();
+                const auto before = std::chrono::steady_clock::now();
+                body(iterations);
+                const auto elapsed = std::chrono::steady_clock::now() - before;
+                const auto cpuUsed = static_cast<double>(std::clock() - cpuBefore) / CLOCKS_PER_SEC;
+
+                if ((elapsed >= minimumTime) || (iterations >= (std::uint64_t{ 1 } << 40)))
+                {
+                    const auto nanoseconds = std::chrono::duration<double, std::nano>{ elapsed }.count();
+                    return Result{ name, iterations, nanoseconds / iterations, cpuUsed * 1e9 / iterations };
+                }
+
+                // Aim a bit past minimumTime, but never grow more than 10 times at once
+                const auto scale = elapsed.count() > 0 ? 1.4 * minimumTime / elapsed : 10.0;
+                const auto next = static_cast<std::uint64_t>(iterations * std::clamp(scale, 1.5, 10.0));
+                iterations = std::max(next, iterations + 1);
+            }
+        }
+
+        class Target : public std::enable_shared_from_this<Target>
+        {
+        public:
+            static constexpr auto description = "MicroBenchmarkTarget";
+
+            std::uint64_t value = 0;
+        };
+
+        // Same shape as InitialPhase::PromisedEndPoint
+        struct PromisedValue
+        {
+            using ActionType = std::function<void(std::uint64_t)>;
+
+            template<typename Action>
+            void apply(Action&& action)
+            {
+                action(this->value.value());
+            }
+
+            bool isReady() const noexcept
+            {
+                return this->value.has_value();
+            }
+
+            std::optional<std::uint64_t> value;
+        };
+
+        std::string makePacket(const NatNeg::NatNegStep step)
+        {
+            auto packet = std::string{ "\xFD\xFC\x1E\x66\x6A\xB2\x03", 7 };
+            packet.push_back(static_cast<char>(step));
+            const auto natNegID = NatNeg::NatNegID{ 0x12345678 };
+            packet.append(reinterpret_cast<const char*>(&natNegID), sizeof(natNegID));
+            // Player ID, or IP address and port in connect packets
+            packet.append("\x01\x7F\x00\x00\x01\x1F\x90\x00\x00\x00\x00", 11);
+            return packet;
+        }
+
+        // Two strands of the same IOManager deferring to each other, like NatNegProxy and GameConnection
+        class PingPong
+        {
+        public:
+            PingPong(const IOManager::ObjectMaker& objectMaker) :
+                first{ objectMaker.makeStrand() },
+                second{ objectMaker.makeStrand() },
+                remaining{ 0 }
+            {}
+
+            void run(const std::uint64_t roundTrips)
+            {
+                this->remaining = roundTrips;
+                this->done = std::promise<void>{};
+                auto finished = this->done.get_future();
+                this->ping();
+                finished.get();
+            }
+
+        private:
+            void ping()
+            {
+                boost::asio::defer(this->second, [this]
+                {
+                    boost::asio::defer(this->first, [this]
+                    {
+                        if (--this->remaining == 0)
+                        {
+                            this->done.set_value();
+                            return;
+                        }
+                        this->ping();
+                    });
+                });
+            }
+
+            IOManager::StrandType first;
+            IOManager::StrandType second;
+            std::uint64_t remaining;
+            std::promise<void> done;
+        };
+
+        std::vector<Result> runAll(const std::chrono::nanoseconds minimumTime)
+        {
+            using namespace NatNeg;
+            using Utility::makeWeakHandler;
+
+            auto results = std::vector<Result>{};
+            const auto target = std::make_shared<Target>();
+
+            results.push_back(measure("WeakRefHandler/invoke", minimumTime, [&](const std::uint64_t iterations)
+            {
+                auto handler = makeWeakHandler(target.get(), [](Target& self, const std::uint64_t x) { self.value += x; });
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    handler(i);
+                }
+                keep(target->value);
+            }));
+
+            results.push_back(measure("makeWeakHandler/rawPointer", minimumTime, [&](const std::uint64_t iterations)
+            {
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    const auto handler = makeWeakHandler(target.get(), [i](Target& self) { self.value += i; });
+                    keep(handler);
+                }
+            }));
+
+            results.push_back(measure("makeWeakHandler/weakPointer", minimumTime, [&](const std::uint64_t iterations)
+            {
+                const auto weak = std::weak_ptr<Target>{ target };
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    const auto handler = makeWeakHandler(weak, [i](Target& self) { self.value += i; });
+                    keep(handler);
+                }
+            }));
+
+            results.push_back(measure("PendingActions/asyncDoPending", minimumTime, [&](const std::uint64_t iterations)
+            {
+                auto sum = std::uint64_t{ 0 };
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    auto future = Utility::PendingActions<PromisedValue>{ PromisedValue{} };
+                    future.asyncDo([&sum](const std::uint64_t value) { sum += value; });
+                    future.asyncDo([&sum](const std::uint64_t value) { sum ^= value; });
+                    future->value = i;
+                    future.trySetReady();
+                }
+                keep(sum);
+            }));
+
+            results.push_back(measure("PendingActions/asyncDoReady", minimumTime, [&](const std::uint64_t iterations)
+            {
+                auto sum = std::uint64_t{ 0 };
+                auto future = Utility::PendingActions<PromisedValue>{ PromisedValue{} };
+                future->value = 1;
+                future.trySetReady();
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    future.asyncDo([&sum, i](const std::uint64_t value) { sum += value + i; });
+                }
+                keep(sum);
+            }));
+
+            const auto initPacket = makePacket(NatNegStep::init);
+            results.push_back(measure("NatNegPacketView/parse", minimumTime, [&](const std::uint64_t iterations)
+            {
+                auto sum = std::uint64_t{ 0 };
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    const auto packet = NatNegPacketView{ initPacket };
+                    if (!packet.isNatNeg())
+                    {
+                        continue;
+                    }
+                    const auto step = packet.getStep();
+                    const auto playerID = packet.getNatNegPlayerID();
+                    const auto addressOffset = NatNegPacketView::getAddressOffset(step);
+                    sum += playerID.value().natNegID + playerID.value().playerID + addressOffset.value_or(0);
+                }
+                keep(sum);
+            }));
+
+            auto connectPacket = makePacket(NatNegStep::connect);
+            const auto addressOffset = NatNegPacketView::getAddressOffset(NatNegStep::connect).value();
+            results.push_back(measure("parseAddress+rewriteAddress", minimumTime, [&](const std::uint64_t iterations)
+            {
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    auto[ip, port] = parseAddress(connectPacket, addressOffset);
+                    ip[3] ^= static_cast<std::uint8_t>(i);
+                    rewriteAddress(connectPacket, addressOffset, ip, port);
+                }
+                keep(connectPacket);
+            }));
+
+            results.push_back(measure("SimpleWriteHandler/construct", minimumTime, [&](const std::uint64_t iterations)
+            {
+                const auto packet = NatNegPacketView{ initPacket };
+                for (auto i = std::uint64_t{ 0 }; i < iterations; ++i)
+                {
+                    const auto handler = Utility::makeWriteHandler<MicroBenchmark>(packet.copyBuffer());
+                    keep(handler);
+                }
+            }));
+
+            const auto ioManager = IOManager::create();
+            const auto objectMaker = IOManager::ObjectMaker{ ioManager };
+            // Keeps the io_context running between batches
+            auto idle = objectMaker.make<boost::asio::steady_timer>(std::chrono::steady_clock::time_point::max());
+            idle.async_wait([](const boost::system::error_code&) {});
+            auto worker = std::thread{ [ioManager] { ioManager->runWorker(0); } };
+            auto pingPong = PingPong{ objectMaker };
+            results.push_back(measure("IOManager/strandDeferRoundTrip", minimumTime, [&](const std::uint64_t iterations)
+            {
+                pingPong.run(iterations);
+            }));
+            ioManager->stop();
+            worker.join();
+
+            return results;
+        }
+
+        std::string escape(const std::string& text)
+        {
+            auto escaped = std::string{};
+            for (const auto character : text)
+            {
+                if ((character == '"') || (character == '\\'))
+                {
+                    escaped.push_back('\\');
+                }
+                escaped.push_back(character);
+            }
+            return escaped;
+        }
+    }
+
+    void runMicroBenchmark(const BenchmarkOptions& options)
+    {
+        // Number of cases in runAll()
+        constexpr auto caseCount = 9;
+        const auto minimumTime = std::max<std::chrono::nanoseconds>
+        (
+            std::chrono::nanoseconds{ options.duration } / caseCount, 
+            std::chrono::milliseconds{ 100 }
+        );
+        logLine(LogLevel::info, "Running micro benchmarks, ", minimumTime.count() / 1000000, "ms each");
+
+        const auto results = runAll(minimumTime);
+
+        const auto now = std::time(nullptr);
+        auto date = std::array<char, 32>{};
+        std::strftime(date.data(), date.size(), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+        auto output = std::ostringstream{};
+        output << std::setprecision(6) << std::fixed;
+        output << "{\n"
+            << "  \"context\": {\n"
+            << "    \"date\": \"" << date.data() << "\",\n"
+            << "    \"executable\": \"" << PROJECT_NAME << "\",\n"
+            << "    \"num_cpus\": " << std::thread::hardware_concurrency() << "\n"
+            << "  },\n"
+            << "  \"benchmarks\": [";
+        for (auto i = std::size_t{ 0 }; i < results.size(); ++i)
+        {
+            const auto& result = results[i];
+            output << (i == 0 ? "\n" : ",\n")
+                << "    {\n"
+                << "      \"name\": \"" << escape(result.name) << "\",\n"
+                << "      \"run_type\": \"iteration\",\n"
+                << "      \"iterations\": " << result.iterations << ",\n"
+                << "      \"real_time\": " << result.realTime << ",\n"
+                << "      \"cpu_time\": " << result.cpuTime << ",\n"
+                << "      \"time_unit\": \"ns\"\n"
+                << "    }";
+            logLine(LogLevel::info, result.name, ": ", result.realTime, "ns per iteration");
+        }
+        output << "\n  ]\n}\n";
+        std::cout << output.str() << std::flush;
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Times the utility templates every packet goes through (weak handlers,
+    // pending actions, NatNeg packet parsing, write handlers, strand round trips)
+    // and writes the results to standard output as JSON, in the format of
+    // Google Benchmark's --benchmark_format=json, so they can be compared between builds.
+    // Every case runs for options.duration divided by the number of cases. Blocking.
+    void runMicroBenchmark(const BenchmarkOptions& options);
+}
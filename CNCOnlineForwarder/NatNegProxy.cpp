@@ -1,8 +1,15 @@
 #include "precompiled.h"
 #include "NatNegProxy.h"
+#include "ClusterDirectory.h"
 #include "InitialPhase.h"
+#include "LoadMonitor.h"
 #include "Logging.h"
+#include "Metrics.h"
+#include "PacketCapture.h"
+#include "ReceiveBufferSizer.h"
 #include "SimpleWriteHandler.hpp"
+#include "SocketFilter.h"
+#include "SocketMessage.h"
 #include "WeakRefHandler.hpp"
 
 using UDP = boost::asio::ip::udp;
@@ -19,6 +26,17 @@ namespace CNCOnlineForwarder::NatNeg
         return Logging::logLine<NatNegProxy>(level, std::forward<Arguments>(arguments)...);
     }
 
+    namespace
+    {
+        auto& rejectedWhileDraining = Metrics::counter("natNegProxy.rejectedWhileDraining");
+        auto& rejectedOverBudget = Metrics::counter("natNegProxy.rejectedOverBudget");
+        auto& rejectedUnderLoad = Metrics::counter("natNegProxy.rejectedUnderLoad");
+        auto& kernelDrops = Metrics::gauge("natNegProxy.kernelDrops");
+        auto& proxyReceiveSizes = Utility::ReceiveBufferSizer::forRole("proxy", 128);
+        auto& mailboxOverflows = Metrics::counter("natNegProxy.mailboxOverflows");
+        auto& mailboxBatchSizes = Metrics::windowedHistogram("natNegProxy.mailboxBatchSize");
+    }
+
     class NatNegProxy::ReceiveHandler
     {
     public:
@@ -30,7 +48,7 @@ namespace CNCOnlineForwarder::NatNeg
 
         boost::asio::mutable_buffer getBuffer() 
         { 
-            return boost::asio::buffer(*this->buffer); 
+            return boost::asio::buffer(this->buffer.get(), this->size); 
         }
 
         EndPoint& getFrom() 
@@ -38,27 +56,90 @@ namespace CNCOnlineForwarder::NatNeg
             return *this->from; 
         }
 
-        void operator()(NatNegProxy& self, const ErrorCode& code, const std::size_t bytesReceived) const
+        // Socket became readable, receive the datagram with its MessageInfo
+        void operator()(NatNegProxy& self, const ErrorCode& code)
         {
-            self.prepareForNextPacketToServer();
-
             if (code.failed())
             {
-                logLine(LogLevel::error, "Async receive failed: ", code);
-                return;
+                return this->complete(self, code, 0);
             }
 
-            const auto view = PacketView{ {this->buffer->data(), bytesReceived} };
-            self.handlePacketToServer(view, *this->from);
+            auto& socket = *self.serverSocket.operator->();
+            auto info = Utility::MessageInfo{};
+            auto receiveCode = ErrorCode{};
+            const auto bytesReceived = Utility::receiveMessage
+            (
+                socket, 
+                this->getBuffer(), 
+                Utility::ReceiveBufferSizer::getOverflowBuffer(),
+                this->getFrom(), 
+                info, 
+                receiveCode
+            );
+            if (receiveCode == boost::asio::error::would_block)
+            {
+                return self.prepareForNextPacketToServer();
+            }
+            self.serverSocketMonitor.update(socket, info);
+            if (!receiveCode.failed())
+            {
+                proxyReceiveSizes.record(bytesReceived);
+                Utility::ReceiveBufferSizer::merge(this->buffer, this->size, bytesReceived);
+            }
+            return this->complete(self, receiveCode, bytesReceived);
+        }
+
+        // Datagram received by asyncReceiveFrom
+        void operator()(NatNegProxy& self, const ErrorCode& code, const std::size_t bytesReceived) const
+        {
+            if (code.failed())
+            {
+                return this->complete(self, code, 0);
+            }
+            if (bytesReceived >= this->size)
+            {
+                // The true size is unknown without recvmsg(), 
+                // so discard the datagram and let the next buffers be larger
+                proxyReceiveSizes.record(this->size + 1);
+                logLine(LogLevel::warning, "Received data may be truncated, discarded: ", bytesReceived);
+                return self.prepareForNextPacketToServer();
+            }
+            proxyReceiveSizes.record(bytesReceived);
+            return this->complete(self, code, bytesReceived);
         }
 
     private:
         ReceiveHandler() :
-            buffer{ std::make_unique<std::array<char, 1024>>() },
+            size{ proxyReceiveSizes.getBufferSize() },
+            buffer{ std::make_unique<char[]>(this->size) },
             from{ std::make_unique<EndPoint>() }
         {}
 
-        std::unique_ptr<std::array<char, 1024>> buffer;
+        void complete(NatNegProxy& self, const ErrorCode& code, const std::size_t bytesReceived) const
+        {
+            self.prepareForNextPacketToServer();
+
+            if (code == boost::asio::error::operation_aborted)
+            {
+                // Cancelled by suspend()
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async receive failed: ", code);
+                return;
+            }
+
+            const auto data = boost::asio::buffer(this->buffer.get(), bytesReceived);
+            Capture::record(Capture::Direction::inbound, self.serverSocket, *this->from, data);
+
+            const auto view = PacketView{ {this->buffer.get(), bytesReceived} };
+            self.handlePacketToServer(view, *this->from, true);
+        }
+
+        std::size_t size;
+        std::unique_ptr<char[]> buffer;
         std::unique_ptr<EndPoint> from;
     };
 
@@ -67,7 +148,8 @@ namespace CNCOnlineForwarder::NatNeg
         const IOManager::ObjectMaker& objectMaker,
         const std::string_view serverHostName,
         const std::uint16_t serverPort,
-        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator
+        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        const NatNegOptions& options
     )
     {
         const auto self = std::make_shared<NatNegProxy>
@@ -76,13 +158,63 @@ namespace CNCOnlineForwarder::NatNeg
             objectMaker, 
             serverHostName,
             serverPort,
-            addressTranslator
+            addressTranslator,
+            options,
+            std::nullopt
         );
+        if (options.cluster.port != 0)
+        {
+            self->cluster = ClusterDirectory::create(self->proxyStrand, self, options.cluster);
+        }
 
         const auto action = [](NatNegProxy& self)
         {
             logLine(LogLevel::info, "NatNegProxy created.");
             self.prepareForNextPacketToServer();
+            self.prepareForNextStatisticsUpdate();
+        };
+        boost::asio::defer(self->proxyStrand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    std::shared_ptr<NatNegProxy> NatNegProxy::restore
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::string_view serverHostName,
+        const std::uint16_t serverPort,
+        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        const NatNegOptions& options,
+        const State& state
+    )
+    {
+        const auto self = std::make_shared<NatNegProxy>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            serverHostName,
+            serverPort,
+            addressTranslator,
+            options,
+            state.serverSocket
+        );
+        if (options.cluster.port != 0)
+        {
+            // Claims of the old process expire, and restored sessions are claimed again by their next packets
+            self->cluster = ClusterDirectory::create(self->proxyStrand, self, options.cluster);
+        }
+
+        for (const auto& connection : state.connections)
+        {
+            // Restored sessions are always kept, even if they exceed the budget
+            GameConnection::restore(objectMaker, self, addressTranslator, self->sessionBudget->admit(), connection);
+        }
+
+        const auto action = [count = state.connections.size()](NatNegProxy& self)
+        {
+            logLine(LogLevel::info, "NatNegProxy restored with ", count, " GameConnections.");
+            self.prepareForNextPacketToServer();
+            self.prepareForNextStatisticsUpdate();
         };
         boost::asio::defer(self->proxyStrand, makeWeakHandler(self, action));
 
@@ -95,28 +227,204 @@ namespace CNCOnlineForwarder::NatNeg
         const IOManager::ObjectMaker& objectMaker,
         const std::string_view serverHostName,
         const std::uint16_t serverPort,
-        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator
+        const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+        const NatNegOptions& options,
+        const std::optional<NativeHandle> serverSocketHandle
     ) :
         objectMaker{ objectMaker },
         proxyStrand{ objectMaker.makeStrand() },
-        serverSocket{ proxyStrand, EndPoint{ UDP::v4(), serverPort } },
+        serverSocket{ proxyStrand },
         serverHostName{ serverHostName },
         serverPort{ serverPort },
-        addressTranslator{ addressTranslator }
-    {}
+        options{ options },
+        statisticsTimer{ proxyStrand },
+        addressTranslator{ addressTranslator },
+        rateLimiter{ RelayRateLimiter::create(options.relayLimits) },
+        idleTimeouts{ IdleTimeoutPolicy::create(options.idleTimeouts) },
+        sessionBudget{ SessionBudget::create(options.budget) },
+        directPaths{ options.directPath.enabled ? DirectPathTable::create(options.directPath) : nullptr },
+        floodGuard{ FloodGuard::create(options.floodProtection) },
+        draining{ false },
+        suspended{ false },
+        mailboxRetryTimer{ proxyStrand },
+        mailboxRetryDelay{ decltype(mailbox)::minimumRetryDelay }
+    {
+        Profiling::nameStrand(&this->proxyStrand, description);
+        if (serverSocketHandle.has_value())
+        {
+            this->serverSocket->assign(UDP::v4(), serverSocketHandle.value());
+        }
+        else
+        {
+            this->serverSocket->open(UDP::v4());
+            this->serverSocket->bind(EndPoint{ UDP::v4(), options.port });
+        }
+
+        auto filtered = false;
+        if (options.socketFilter)
+        {
+            const auto code = attachSocketFilter(this->serverSocket->native_handle(), SocketFilterRole::proxy);
+            if (code.failed())
+            {
+                logLine(LogLevel::warning, "Failed to attach socket filter: ", code);
+            }
+            filtered = !code.failed();
+        }
+
+#ifdef __linux__
+        if (const auto code = Utility::enableMessageInfo(*this->serverSocket.operator->()); code.failed())
+        {
+            logLine(LogLevel::warning, "Cannot enable drop counts: ", code);
+        }
+#endif
+        this->serverSocketMonitor.attach(*this->serverSocket.operator->(), options.socketBuffers, "proxy", filtered);
+    }
 
     void NatNegProxy::sendFromProxySocket(const PacketView packetView, const EndPoint& to)
     {
-        auto action = [data = packetView.copyBuffer(), to](NatNegProxy& self)
+        const auto& data = packetView.natNegPacket;
+        if (data.size() > Message::maxPacketSize)
         {
-            logLine(LogLevel::info, "Sending data to ", to);
-            auto writeHandler = WriteHandler{ data };
-            self.serverSocket.asyncSendTo
-            (
-                writeHandler.getData(), 
-                to, 
-                std::move(writeHandler)
-            );
+            // Far above any NatNeg packet, and queueing it apart would reorder it
+            logLine(LogLevel::warning, "Packet of ", data.size(), " bytes to ", to, " is too large, discarded.");
+            return;
+        }
+
+        const auto fill = [&data, &to](Message& message)
+        {
+            message.type = Message::Type::send;
+            message.size = static_cast<std::uint16_t>(data.size());
+            message.to = to;
+            std::copy(data.begin(), data.end(), message.packet.begin());
+        };
+        this->postMessage(fill);
+    }
+
+    void NatNegProxy::removeConnection(const NatNegPlayerID id)
+    {
+        const auto fill = [id](Message& message)
+        {
+            message.type = Message::Type::removeConnection;
+            message.id = id;
+        };
+        this->postMessage(fill);
+    }
+
+    void NatNegProxy::confirmClient(const EndPoint& client)
+    {
+        const auto fill = [&client](Message& message)
+        {
+            message.type = Message::Type::confirmClient;
+            message.to = client;
+        };
+        this->postMessage(fill);
+    }
+
+    template<typename Fill>
+    void NatNegProxy::postMessage(Fill&& fill)
+    {
+        const auto result = this->mailbox.push(std::forward<Fill>(fill));
+        if (result.spilled)
+        {
+            mailboxOverflows.add();
+        }
+
+        if (result.first)
+        {
+            const auto action = [](NatNegProxy& self) { self.drainMailbox(); };
+            boost::asio::defer(this->proxyStrand, makeWeakHandler(this, action));
+        }
+    }
+
+    void NatNegProxy::drainMailbox()
+    {
+        auto batchSize = std::uint64_t{ 0 };
+        const auto handler = [this, &batchSize](const Message& message)
+        {
+            ++batchSize;
+            switch (message.type)
+            {
+            case Message::Type::send:
+                this->sendFromProxySocketInternal(PacketView{ { message.packet.data(), message.size } }, message.to);
+                break;
+            case Message::Type::removeConnection:
+                this->removeConnectionInternal(message.id);
+                break;
+            case Message::Type::confirmClient:
+                this->floodGuard->confirmSource(message.to);
+                break;
+            }
+        };
+
+        const auto drained = this->mailbox.drain(handler);
+        mailboxBatchSizes.record(batchSize);
+        if (drained)
+        {
+            this->mailboxRetryDelay = decltype(this->mailbox)::minimumRetryDelay;
+            return;
+        }
+
+        // A producer was interrupted while writing its message, wait for it to be scheduled again
+        const auto action = [](NatNegProxy& self, const ErrorCode& code)
+        {
+            if (code != boost::asio::error::operation_aborted)
+            {
+                self.drainMailbox();
+            }
+        };
+        this->mailboxRetryTimer.asyncWait
+        (
+            this->mailboxRetryDelay,
+            boost::asio::bind_executor(this->proxyStrand, makeWeakHandler(this, action))
+        );
+        this->mailboxRetryDelay = std::min(this->mailboxRetryDelay * 2, decltype(this->mailbox)::maximumRetryDelay);
+    }
+
+    void NatNegProxy::sendFromProxySocketInternal(const PacketView packetView, const EndPoint& to)
+    {
+        if (this->suspended)
+        {
+            logLine(LogLevel::warning, "Suspended, packet to ", to, " discarded");
+            return;
+        }
+
+        if (this->cluster && this->cluster->sendThroughForwarder(packetView, to))
+        {
+            logLine(LogLevel::info, "Sending data to ", to, " through the cluster node it's talking to");
+            return;
+        }
+
+        logLine(LogLevel::info, "Sending data to ", to);
+        auto writeHandler = WriteHandler{ packetView.copyBuffer() };
+        Capture::record(Capture::Direction::outbound, this->serverSocket, to, writeHandler.getData());
+        this->serverSocket.asyncSendTo
+        (
+            writeHandler.getData(), 
+            to, 
+            std::move(writeHandler)
+        );
+    }
+
+    void NatNegProxy::removeConnectionInternal(const NatNegPlayerID id)
+    {
+        logLine(LogLevel::error, "Removing InitaialPhase ", id);
+        this->initialPhases.erase(id);
+    }
+
+    void NatNegProxy::forgetNatNegID(const NatNegID natNegID)
+    {
+        for (const auto playerID : { 0, 1 })
+        {
+            this->initialPhases.erase(NatNegPlayerID{ natNegID, static_cast<std::int8_t>(playerID) });
+        }
+    }
+
+    void NatNegProxy::handleForwardedPacket(const PacketView packetView, const EndPoint& client)
+    {
+        auto action = [data = packetView.copyBuffer(), client](NatNegProxy& self)
+        {
+            // Never forward again, even if the owner changed in the meantime
+            self.handlePacketToServer(PacketView{ data }, client, false);
         };
 
         boost::asio::defer
@@ -126,34 +434,320 @@ namespace CNCOnlineForwarder::NatNeg
         );
     }
 
-    void NatNegProxy::removeConnection(const NatNegPlayerID id)
+    NatNegProxy::EndPoint NatNegProxy::getLocalEndPoint() const
+    {
+        return this->serverSocket->local_endpoint();
+    }
+
+    const NatNegProxy::Strand& NatNegProxy::getStrand() const noexcept
+    {
+        return this->proxyStrand;
+    }
+
+    const std::shared_ptr<RelayRateLimiter>& NatNegProxy::getRateLimiter() const noexcept
+    {
+        return this->rateLimiter;
+    }
+
+    const std::shared_ptr<IdleTimeoutPolicy>& NatNegProxy::getIdleTimeouts() const noexcept
+    {
+        return this->idleTimeouts;
+    }
+
+    const std::shared_ptr<DirectPathTable>& NatNegProxy::getDirectPaths() const noexcept
+    {
+        return this->directPaths;
+    }
+
+    const NatNegOptions& NatNegProxy::getOptions() const noexcept
+    {
+        return this->options;
+    }
+
+    void NatNegProxy::queryRoundTrip
+    (
+        const NatNegPlayerID id, 
+        std::function<void(const std::optional<RelayRoundTrip>&)> handler
+    )
     {
-        auto action = [id](NatNegProxy& self)
+        auto action = [id, handler = std::move(handler)](NatNegProxy& self)
         {
-            logLine(LogLevel::error, "Removing InitaialPhase ", id);
-            self.initialPhases.erase(id);
+            const auto found = self.gameConnections.find(id);
+            const auto connection = (found != self.gameConnections.end()) ? found->second.lock() : nullptr;
+            if (!connection)
+            {
+                handler(std::nullopt);
+                return;
+            }
+            connection->queryRoundTrip(handler);
         };
 
         boost::asio::defer
         (
-            this->proxyStrand, 
+            this->proxyStrand,
             makeWeakHandler(this, std::move(action))
         );
     }
 
-    void NatNegProxy::prepareForNextPacketToServer()
+    void NatNegProxy::logRoundTrips()
     {
-        auto handler = ReceiveHandler::create(this);
-        this->serverSocket.asyncReceiveFrom
+        auto action = [](NatNegProxy& self)
+        {
+            logLine(LogLevel::info, "Round trips of ", self.gameConnections.size(), " GameConnections:");
+            for (const auto& [id, connectionRef] : self.gameConnections)
+            {
+                const auto connection = connectionRef.lock();
+                if (!connection)
+                {
+                    continue;
+                }
+                connection->queryRoundTrip([id = id](const RelayRoundTrip& roundTrip)
+                {
+                    logLine(LogLevel::info, "Round trip of ", id, ": ", roundTrip);
+                });
+            }
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::startDraining()
+    {
+        auto action = [](NatNegProxy& self)
+        {
+            logLine(LogLevel::info, "Draining, new NatNegIDs will be rejected.");
+            self.draining = true;
+        };
+
+        boost::asio::defer
         (
-            handler->getBuffer(),
-            handler->getFrom(),
-            std::move(handler)
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
         );
     }
 
-    void NatNegProxy::handlePacketToServer(const PacketView packet, const EndPoint& from)
+    bool NatNegProxy::isDraining() const noexcept
+    {
+        return this->draining.load(std::memory_order_relaxed);
+    }
+
+    void NatNegProxy::registerProbe(const NatNegID natNegID, const EndPoint& server)
     {
+        auto action = [natNegID, server](NatNegProxy& self)
+        {
+            self.probe = std::pair{ natNegID, server };
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::addGameConnection
+    (
+        const NatNegPlayerID id, 
+        const std::weak_ptr<GameConnection>& connection
+    )
+    {
+        auto action = [id, connection](NatNegProxy& self)
+        {
+            self.gameConnections[id] = connection;
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::removeGameConnection(const NatNegPlayerID id, const GameConnection* connection)
+    {
+        auto action = [id, connection](NatNegProxy& self)
+        {
+            const auto found = self.gameConnections.find(id);
+            if (found == self.gameConnections.end())
+            {
+                return;
+            }
+
+            const auto current = found->second.lock();
+            if (current && (current.get() != connection))
+            {
+                return;
+            }
+
+            logLine(LogLevel::info, "Removing GameConnection ", id);
+            self.gameConnections.erase(found);
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::suspend(StateHandler handler)
+    {
+        // Filled by GameConnections from their own strands, then finished inside proxy's strand
+        struct Collector
+        {
+            State state;
+            std::size_t pending;
+            StateHandler handler;
+        };
+
+        auto action = [handler = std::move(handler)](NatNegProxy& self) mutable
+        {
+            logLine(LogLevel::info, "Suspending for handoff.");
+            self.suspended = true;
+            auto ignored = ErrorCode{};
+            self.serverSocket->cancel(ignored);
+            self.statisticsTimer->cancel();
+
+            const auto collector = std::make_shared<Collector>();
+            collector->state.serverSocket = self.serverSocket->native_handle();
+            collector->handler = std::move(handler);
+            for (const auto& [id, connectionRef] : self.gameConnections)
+            {
+                // Even connections about to time out are handed over, so none disappears unexpectedly
+                if (auto connection = connectionRef.lock())
+                {
+                    collector->state.owners.push_back(std::move(connection));
+                }
+            }
+
+            collector->pending = collector->state.owners.size();
+            if (collector->pending == 0)
+            {
+                logLine(LogLevel::info, "Suspended without GameConnections.");
+                return collector->handler(std::move(collector->state));
+            }
+
+            for (const auto& connection : collector->state.owners)
+            {
+                connection->suspend([collector, strand = self.proxyStrand](const GameConnection::State& state)
+                {
+                    boost::asio::defer(strand, [collector, state]
+                    {
+                        collector->state.connections.push_back(state);
+                        if (--collector->pending == 0)
+                        {
+                            logLine(LogLevel::info, "Suspended ", collector->state.connections.size(), " GameConnections.");
+                            collector->handler(std::move(collector->state));
+                        }
+                    });
+                });
+            }
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::resume(State state)
+    {
+        auto action = [state = std::move(state)](NatNegProxy& self)
+        {
+            logLine(LogLevel::info, "Resuming ", state.owners.size(), " GameConnections after failed handoff.");
+            self.suspended = false;
+            for (const auto& connection : state.owners)
+            {
+                connection->resume();
+            }
+            self.prepareForNextPacketToServer();
+            self.prepareForNextStatisticsUpdate();
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::abandon()
+    {
+        auto action = [](NatNegProxy& self)
+        {
+            logLine(LogLevel::info, "Handed over, closing proxy socket.");
+            auto ignored = ErrorCode{};
+            self.serverSocket->close(ignored);
+        };
+
+        boost::asio::defer
+        (
+            this->proxyStrand,
+            makeWeakHandler(this, std::move(action))
+        );
+    }
+
+    void NatNegProxy::prepareForNextPacketToServer()
+    {
+        if (this->suspended)
+        {
+            return;
+        }
+
+        auto handler = ReceiveHandler::create(this);
+#ifdef __linux__
+        // Wait for readability and use recvmsg() to get drop counts
+        this->serverSocket.asyncWait(boost::asio::socket_base::wait_read, std::move(handler));
+#else
+        const auto buffer = handler->getBuffer();
+        auto& from = handler->getFrom();
+        this->serverSocket.asyncReceiveFrom(buffer, from, std::move(handler));
+#endif
+    }
+
+    void NatNegProxy::prepareForNextStatisticsUpdate()
+    {
+        const auto action = [](NatNegProxy& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+
+            const auto drops = getKernelDropCount(self.serverSocket->native_handle());
+            if (drops.has_value())
+            {
+                kernelDrops.set(drops.value());
+            }
+            self.idleTimeouts->update();
+            if (self.directPaths)
+            {
+                self.directPaths->update();
+            }
+            self.prepareForNextStatisticsUpdate();
+        };
+
+        this->statisticsTimer.asyncWait(std::chrono::seconds{ 10 }, makeWeakHandler(this, action));
+    }
+
+    void NatNegProxy::handlePacketToServer(const PacketView packet, const EndPoint& from, const bool canForward)
+    {
+        if (this->suspended)
+        {
+            // Forwarded by another cluster node while handing over, the client will retry
+            return;
+        }
+
         if (!packet.isNatNeg())
         {
             logLine(LogLevel::warning, "Packet is not natneg, discarded.");
@@ -169,26 +763,125 @@ namespace CNCOnlineForwarder::NatNeg
         }
         const auto natNegPlayerID = natNegPlayerIDHolder.value();
 
-        auto& initialPhaseRef = this->initialPhases[natNegPlayerID];
-        if (initialPhaseRef.expired())
+        // Probes negotiate with a mock upstream on this host, they can't be served by another node
+        const auto fromProbe = this->isProbe(natNegPlayerID.natNegID, from);
+        if (this->cluster && canForward && !fromProbe)
+        {
+            const auto owner = this->cluster->findRemoteOwner(natNegPlayerID.natNegID);
+            if (owner.has_value())
+            {
+                // Both players of a NatNegID must be handled by the same node
+                this->cluster->forwardToOwner(packet, from, owner.value());
+                return;
+            }
+        }
+
+        const auto existing = this->initialPhases.find(natNegPlayerID);
+        auto initialPhase = (existing != this->initialPhases.end()) ? existing->second.lock() : nullptr;
+        if (!initialPhase)
+        {
+            // Restored by hot restart, or outlived its InitialPhase:
+            // it's not a new session, so it's never rejected
+            const auto found = this->gameConnections.find(natNegPlayerID);
+            const auto connection = (found != this->gameConnections.end()) ? found->second.lock() : nullptr;
+            if (connection)
+            {
+                logLine(LogLevel::info, "Existing GameConnection, creating InitialPhase: ", natNegPlayerID);
+                const auto[serverHostName, serverPort] = this->getServerFor(natNegPlayerID.natNegID, from);
+                initialPhase = InitialPhase::create
+                (
+                    this->objectMaker,
+                    this->weak_from_this(),
+                    this->sessionBudget->admit(),
+                    natNegPlayerID,
+                    serverHostName,
+                    serverPort,
+                    this->options.socketFilter
+                );
+                initialPhase->adoptGameConnection(connection);
+                this->initialPhases[natNegPlayerID] = initialPhase;
+            }
+        }
+
+        // The second player of a session whose first player is already here must be served
+        // by this node too, so sessions are rejected per NatNegID, not per NatNegPlayerID
+        const auto joinsSession = !initialPhase && this->hasOtherPlayer(natNegPlayerID);
+        if (!initialPhase && !joinsSession && this->draining)
+        {
+            // Client will retry, hopefully on another server
+            logLine(LogLevel::info, "Draining, rejected new NatNegID: ", natNegPlayerID);
+            rejectedWhileDraining.add();
+            this->initialPhases.erase(natNegPlayerID);
+            return;
+        }
+
+        if (!initialPhase && !joinsSession && LoadMonitor::isShedding(LoadMonitor::SheddingLevel::newSessions))
+        {
+            // Not logged, info lines are the next thing to be shed.
+            // Established sessions and players joining them keep being served,
+            // new ones will be retried by their clients.
+            rejectedUnderLoad.add();
+            this->initialPhases.erase(natNegPlayerID);
+            return;
+        }
+
+        if (!initialPhase)
         {
+            // Decided before touching anything else, so a flood of new NatNegPlayerIDs costs nothing
+            auto decision = this->floodGuard->admit(natNegPlayerID, packet, from, joinsSession);
+            if (decision.verdict != FloodGuard::Verdict::admitted)
+            {
+                this->initialPhases.erase(natNegPlayerID);
+                return;
+            }
+
+            auto ticket = this->sessionBudget->tryAdmit();
+            if (!ticket)
+            {
+                // Like when draining, client will retry later or on another server
+                logLine(LogLevel::info, "Over budget, rejected new NatNegPlayerID: ", natNegPlayerID);
+                rejectedOverBudget.add();
+                this->initialPhases.erase(natNegPlayerID);
+                return;
+            }
+
             logLine(LogLevel::info, "New NatNegPlayerID, creating InitialPhase: ", natNegPlayerID);
-            initialPhaseRef = InitialPhase::create
+            const auto[serverHostName, serverPort] = this->getServerFor(natNegPlayerID.natNegID, from);
+            initialPhase = InitialPhase::create
             (
                 this->objectMaker,
                 this->weak_from_this(),
+                std::move(ticket),
                 natNegPlayerID,
-                this->serverHostName,
-                this->serverPort
+                serverHostName,
+                serverPort,
+                this->options.socketFilter
             );
+            this->initialPhases[natNegPlayerID] = initialPhase;
+
+            if (decision.held.has_value())
+            {
+                // The first packet was only remembered, it must be handled before this one
+                const auto& held = decision.held.value();
+                this->handlePacketOfInitialPhase(*initialPhase, natNegPlayerID, held.getView(), held.from);
+            }
         }
 
-        const auto initialPhase = initialPhaseRef.lock();
-        if (!initialPhase)
+        this->handlePacketOfInitialPhase(*initialPhase, natNegPlayerID, packet, from);
+    }
+
+    void NatNegProxy::handlePacketOfInitialPhase
+    (
+        InitialPhase& initialPhase,
+        const NatNegPlayerID natNegPlayerID,
+        const PacketView packet,
+        const EndPoint& from
+    )
+    {
+        const auto step = packet.getStep();
+        if (this->cluster && !this->isProbe(natNegPlayerID.natNegID, from))
         {
-            logLine(LogLevel::error, "InitialPhase already expired: ", natNegPlayerID);
-            this->removeConnection(natNegPlayerID);
-            return;
+            this->cluster->claim(natNegPlayerID.natNegID, packet, from);
         }
 
         logLine(LogLevel::info, "Processing packet (step ", step, ") from ", from);
@@ -204,7 +897,7 @@ namespace CNCOnlineForwarder::NatNeg
             {
                 // Packet is from client public address
                 logLine(LogLevel::info, "Preparing GameConnection, client = ", from);
-                initialPhase->prepareGameConnection
+                initialPhase.prepareGameConnection
                 (
                     this->objectMaker, 
                     this->addressTranslator, 
@@ -213,6 +906,52 @@ namespace CNCOnlineForwarder::NatNeg
             }
         }
 
-        initialPhase->handlePacketToServer(packet, from);
+        if ((step == NatNegStep::report) && this->directPaths)
+        {
+            constexpr auto resultOffset = 14;
+            if (packet.natNegPacket.size() > resultOffset)
+            {
+                const auto success = packet.natNegPacket.at(resultOffset) != 0;
+                this->directPaths->recordResult(natNegPlayerID.natNegID, success);
+            }
+        }
+
+        initialPhase.handlePacketToServer(packet, from);
+    }
+
+    bool NatNegProxy::hasOtherPlayer(const NatNegPlayerID id) const
+    {
+        for (const auto playerID : { 0, 1 })
+        {
+            const auto other = NatNegPlayerID{ id.natNegID, static_cast<std::int8_t>(playerID) };
+            if (other == id)
+            {
+                continue;
+            }
+            const auto initialPhase = this->initialPhases.find(other);
+            const auto connection = this->gameConnections.find(other);
+            if (((initialPhase != this->initialPhases.end()) && !initialPhase->second.expired()) ||
+                ((connection != this->gameConnections.end()) && !connection->second.expired()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool NatNegProxy::isProbe(const NatNegID natNegID, const EndPoint& from) const
+    {
+        // Only trusted from loopback, so remote clients can't pick the mock upstream
+        return this->probe.has_value() && (this->probe->first == natNegID) && from.address().is_loopback();
+    }
+
+    std::pair<std::string, std::uint16_t> NatNegProxy::getServerFor(const NatNegID natNegID, const EndPoint& from) const
+    {
+        if (this->isProbe(natNegID, from))
+        {
+            const auto& server = this->probe->second;
+            return { server.address().to_string(), server.port() };
+        }
+        return { this->serverHostName, this->serverPort };
     }
 }
\ No newline at end of file
@@ -1,21 +1,37 @@
 #pragma once
+#include <array>
+#include <atomic>
 #include <cstddef>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <unordered_set>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <boost/asio/ip/address_v4.hpp>
 #include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "DirectPathTable.h"
+#include "FloodGuard.h"
+#include "GameConnection.h"
+#include "IdleTimeoutPolicy.h"
 #include "IOManager.hpp"
+#include "Mailbox.hpp"
 #include "NatNegPacket.hpp"
+#include "Options.h"
 #include "ProxyAddressTranslator.h"
+#include "RelayRateLimiter.h"
+#include "SessionBudget.h"
+#include "SocketMonitor.h"
 
 namespace CNCOnlineForwarder::NatNeg
 {
     class InitialPhase;
     class Connection;
+    class ClusterDirectory;
 
     class NatNegProxy : public std::enable_shared_from_this<NatNegProxy>
     {
@@ -26,9 +42,22 @@ namespace CNCOnlineForwarder::NatNeg
         using Strand = IOManager::StrandType;
         using EndPoint = boost::asio::ip::udp::endpoint;
         using Socket = WithStrand<boost::asio::ip::udp::socket>;
+        using Timer = WithStrand<boost::asio::steady_timer>;
         using AddressV4 = boost::asio::ip::address_v4;
         using NatNegPlayerID = NatNegPlayerID;
         using PacketView = NatNegPacketView;
+        using NativeHandle = boost::asio::ip::udp::socket::native_handle_type;
+
+        // Everything needed to hand the proxy over to another process
+        struct State
+        {
+            NativeHandle serverSocket;
+            std::vector<GameConnection::State> connections;
+            // Keeps the sockets of suspended connections open, empty when restoring
+            std::vector<std::shared_ptr<GameConnection>> owners;
+        };
+
+        using StateHandler = std::function<void(State state)>;
 
         static constexpr auto description = "NatNegProxy";
 
@@ -37,7 +66,21 @@ namespace CNCOnlineForwarder::NatNeg
             const IOManager::ObjectMaker& objectMaker,
             const std::string_view serverHostName,
             const std::uint16_t serverPort,
-            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator
+            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            const NatNegOptions& options
+        );
+
+        // Recreate the proxy and its GameConnections from a state
+        // exported by another process. The sockets inside state 
+        // will be owned by the new objects.
+        static std::shared_ptr<NatNegProxy> restore
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const std::string_view serverHostName,
+            const std::uint16_t serverPort,
+            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            const NatNegOptions& options,
+            const State& state
         );
 
         NatNegProxy
@@ -46,24 +89,163 @@ namespace CNCOnlineForwarder::NatNeg
             const IOManager::ObjectMaker& objectMaker,
             const std::string_view serverHostName,
             const std::uint16_t serverPort,
-            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator
+            const std::weak_ptr<ProxyAddressTranslator>& addressTranslator,
+            const NatNegOptions& options,
+            const std::optional<NativeHandle> serverSocketHandle
         );
 
+        // Can be used from any thread, since the socket is bound by the constructor
+        EndPoint getLocalEndPoint() const;
+
+        // Strand of the proxy socket and of the InitialPhase table, for measuring its lag
+        const Strand& getStrand() const noexcept;
+
         void sendFromProxySocket(const PacketView packetView, const EndPoint& to);
 
         void removeConnection(const NatNegPlayerID id);
 
+        // client proved it owns its NatNeg endpoint by reaching its relay port
+        void confirmClient(const EndPoint& client);
+
+        // Handle a packet forwarded by another cluster node as if it was received from client
+        void handleForwardedPacket(const PacketView packetView, const EndPoint& client);
+
+        // Another cluster node won natNegID: stop routing its packets to our InitialPhases,
+        // which expire on their own. Must be called on the proxy strand.
+        void forgetNatNegID(const NatNegID natNegID);
+
+        const std::shared_ptr<RelayRateLimiter>& getRateLimiter() const noexcept;
+
+        const std::shared_ptr<IdleTimeoutPolicy>& getIdleTimeouts() const noexcept;
+
+        // nullptr if direct paths are disabled
+        const std::shared_ptr<DirectPathTable>& getDirectPaths() const noexcept;
+
+        const NatNegOptions& getOptions() const noexcept;
+
+        // handler will be called with nullopt if there is no GameConnection of id
+        void queryRoundTrip
+        (
+            const NatNegPlayerID id, 
+            std::function<void(const std::optional<RelayRoundTrip>&)> handler
+        );
+
+        // Write round trip statistics of every GameConnection to the log
+        void logRoundTrips();
+
+        // Stop accepting new NatNegIDs, existing sessions are kept running,
+        // including players joining a session whose other player is already here
+        void startDraining();
+
+        // Can be used from any thread
+        bool isDraining() const noexcept;
+
+        // Sessions of natNegID whose packets come from loopback negotiate with server
+        // instead of the NatNeg server, so a SelfProbe can go through this proxy
+        // with a mock upstream. Replaces the previously registered probe.
+        void registerProbe(const NatNegID natNegID, const EndPoint& server);
+
+        void addGameConnection
+        (
+            const NatNegPlayerID id, 
+            const std::weak_ptr<GameConnection>& connection
+        );
+
+        // Only removes the entry if it still refers to connection
+        void removeGameConnection(const NatNegPlayerID id, const GameConnection* connection);
+
+        // Stop receiving and suspend every GameConnection, then call handler
+        // inside the proxy's strand with the state to be handed over.
+        // Other services on the same IOManager keep running.
+        void suspend(StateHandler handler);
+
+        // Receive and relay again, if state could not be handed over at all
+        void resume(State state);
+
+        // Close the proxy socket after its state has been handed over.
+        // Relays are closed when the owners inside state are released.
+        void abandon();
+
     private:
+        // Cross-strand calls, batched by a mailbox instead of posting a handler each
+        struct Message
+        {
+            enum class Type : std::uint8_t
+            {
+                send,
+                removeConnection,
+                confirmClient,
+            };
+
+            static constexpr auto maxPacketSize = std::size_t{ 128 };
+
+            Type type;
+            std::uint16_t size;
+            NatNegPlayerID id;
+            Utility::CompactEndPoint to;
+            std::array<char, maxPacketSize> packet;
+        };
+
+        static constexpr auto mailboxCapacity = std::size_t{ 256 };
+
+        template<typename Fill>
+        void postMessage(Fill&& fill);
+
+        void drainMailbox();
+
+        void sendFromProxySocketInternal(const PacketView packetView, const EndPoint& to);
+
+        void removeConnectionInternal(const NatNegPlayerID id);
+
         void prepareForNextPacketToServer();
 
-        void handlePacketToServer(const PacketView packetView, const EndPoint& from);
+        // Packets of NatNegIDs owned by another cluster node are forwarded to it if canForward
+        void handlePacketToServer(const PacketView packetView, const EndPoint& from, const bool canForward);
+
+        void handlePacketOfInitialPhase
+        (
+            InitialPhase& initialPhase,
+            const NatNegPlayerID natNegPlayerID,
+            const PacketView packet,
+            const EndPoint& from
+        );
+
+        // Returns: whether the other player of the NatNegID already has a session
+        bool hasOtherPlayer(const NatNegPlayerID id) const;
+
+        // Returns: whether from is the SelfProbe negotiating natNegID
+        bool isProbe(const NatNegID natNegID, const EndPoint& from) const;
+
+        // Returns: host name and port of the NatNeg server of a new InitialPhase
+        std::pair<std::string, std::uint16_t> getServerFor(const NatNegID natNegID, const EndPoint& from) const;
+
+        void prepareForNextStatisticsUpdate();
 
         IOManager::ObjectMaker objectMaker;
         Strand proxyStrand;
         Socket serverSocket;
+        Utility::SocketMonitor serverSocketMonitor;
         std::string serverHostName;
         std::uint16_t serverPort;
+        NatNegOptions options;
+        Timer statisticsTimer;
         std::unordered_map<NatNegPlayerID, std::weak_ptr<InitialPhase>, NatNegPlayerID::Hash> initialPhases;
+        std::unordered_map<NatNegPlayerID, std::weak_ptr<GameConnection>, NatNegPlayerID::Hash> gameConnections;
         std::shared_ptr<ProxyAddressTranslator> addressTranslator;
+        std::shared_ptr<RelayRateLimiter> rateLimiter;
+        std::shared_ptr<IdleTimeoutPolicy> idleTimeouts;
+        std::shared_ptr<SessionBudget> sessionBudget;
+        std::shared_ptr<DirectPathTable> directPaths;
+        std::shared_ptr<FloodGuard> floodGuard;
+        // nullptr if cluster mode is disabled
+        std::shared_ptr<ClusterDirectory> cluster;
+        std::atomic<bool> draining;
+        // NatNegID of the current self probe and its mock upstream
+        std::optional<std::pair<NatNegID, EndPoint>> probe;
+        // Whether the proxy is being handed over to another process
+        bool suspended;
+        Utility::Mailbox<Message, mailboxCapacity> mailbox;
+        Timer mailboxRetryTimer;
+        std::chrono::microseconds mailboxRetryDelay;
     };
 }
\ No newline at end of file
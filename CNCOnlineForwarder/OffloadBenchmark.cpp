@@ -0,0 +1,231 @@
+#include "precompiled.h"
+#include "OffloadBenchmark.h"
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "Logging.h"
+#include "SocketMessage.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <time.h>
+#endif
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct OffloadBenchmark
+        {
+            static constexpr auto description = "OffloadBenchmark";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<OffloadBenchmark>(level, std::forward<Arguments>(arguments)...);
+        }
+
+#ifdef __linux__
+        struct RunResult
+        {
+            std::uint64_t sent;
+            std::uint64_t relayed;
+            std::uint64_t received;
+            std::chrono::nanoseconds relayCpuTime;
+        };
+
+        std::chrono::nanoseconds getThreadCpuTime()
+        {
+            auto time = ::timespec{};
+            ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+            return std::chrono::seconds{ time.tv_sec } + std::chrono::nanoseconds{ time.tv_nsec };
+        }
+
+        bool waitReadable(UDP::socket& socket)
+        {
+            auto descriptor = ::pollfd{ socket.native_handle(), POLLIN, 0 };
+            return ::poll(&descriptor, 1, 100) > 0;
+        }
+
+        std::uint64_t countSegments(const std::size_t size, const std::uint16_t segmentSize)
+        {
+            return (segmentSize == 0 || size <= segmentSize) ? 1 : (size + segmentSize - 1) / segmentSize;
+        }
+
+        UDP::socket makeSocket(boost::asio::io_context& context, const bool offload)
+        {
+            auto socket = UDP::socket{ context, UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 0 } };
+            if (const auto code = Utility::enableMessageInfo(socket); code.failed())
+            {
+                throw std::runtime_error{ "Cannot enable recvmsg(): " + code.message() };
+            }
+            if (offload)
+            {
+                if (const auto code = Utility::enableReceiveOffload(socket); code.failed())
+                {
+                    throw std::runtime_error{ "Cannot enable UDP_GRO: " + code.message() };
+                }
+            }
+            return socket;
+        }
+
+        // source => relayIn, relayOut => sink, like a GameConnection relaying between two players
+        RunResult run(const BenchmarkOptions& options, const bool offload)
+        {
+            auto context = boost::asio::io_context{};
+            auto source = makeSocket(context, offload);
+            auto relayIn = makeSocket(context, offload);
+            auto relayOut = makeSocket(context, offload);
+            auto sink = makeSocket(context, offload);
+            const auto relayInAddress = relayIn.local_endpoint();
+            const auto sinkAddress = sink.local_endpoint();
+
+            auto stopping = std::atomic<bool>{ false };
+            auto sent = std::uint64_t{ 0 };
+            auto relayed = std::uint64_t{ 0 };
+            auto received = std::uint64_t{ 0 };
+            auto relayCpuTime = std::chrono::nanoseconds{};
+
+            const auto sender = [&]
+            {
+                const auto burst = std::string(std::size_t{ options.packetSize } * options.burstSize, 'x');
+                auto code = ErrorCode{};
+                while (!stopping.load(std::memory_order_relaxed))
+                {
+                    if (offload)
+                    {
+                        const auto data = boost::asio::buffer(burst);
+                        Utility::sendSegments(source, data, relayInAddress, options.packetSize, code);
+                        sent += code.failed() ? 0 : options.burstSize;
+                        continue;
+                    }
+                    for (auto i = std::size_t{ 0 }; i < options.burstSize; ++i)
+                    {
+                        const auto data = boost::asio::buffer(burst.data(), options.packetSize);
+                        source.send_to(data, relayInAddress, 0, code);
+                        sent += code.failed() ? 0 : 1;
+                    }
+                }
+            };
+
+            const auto receive = [](UDP::socket& socket, std::unique_ptr<char[]>& buffer, Utility::MessageInfo& info)
+            {
+                auto from = UDP::endpoint{};
+                auto code = ErrorCode{};
+                const auto overflow = boost::asio::mutable_buffer{};
+                const auto size = Utility::receiveMessage
+                (
+                    socket,
+                    boost::asio::buffer(buffer.get(), 65536),
+                    overflow,
+                    from,
+                    info,
+                    code
+                );
+                return code.failed() ? std::optional<std::size_t>{} : size;
+            };
+
+            const auto relay = [&]
+            {
+                const auto start = getThreadCpuTime();
+                auto buffer = std::make_unique<char[]>(65536);
+                auto info = Utility::MessageInfo{};
+                auto code = ErrorCode{};
+                while (!stopping.load(std::memory_order_relaxed))
+                {
+                    if (!waitReadable(relayIn))
+                    {
+                        continue;
+                    }
+                    while (const auto size = receive(relayIn, buffer, info))
+                    {
+                        const auto data = boost::asio::buffer(buffer.get(), size.value());
+                        if (info.segmentSize != 0 && size.value() > info.segmentSize)
+                        {
+                            Utility::sendSegments(relayOut, data, sinkAddress, info.segmentSize, code);
+                        }
+                        else
+                        {
+                            relayOut.send_to(data, sinkAddress, 0, code);
+                        }
+                        relayed += code.failed() ? 0 : countSegments(size.value(), info.segmentSize);
+                    }
+                }
+                relayCpuTime = getThreadCpuTime() - start;
+            };
+
+            const auto drain = [&]
+            {
+                auto buffer = std::make_unique<char[]>(65536);
+                auto info = Utility::MessageInfo{};
+                while (!stopping.load(std::memory_order_relaxed))
+                {
+                    if (!waitReadable(sink))
+                    {
+                        continue;
+                    }
+                    while (const auto size = receive(sink, buffer, info))
+                    {
+                        received += countSegments(size.value(), info.segmentSize);
+                    }
+                }
+            };
+
+            auto threads = std::vector<std::thread>{};
+            threads.emplace_back(drain);
+            threads.emplace_back(relay);
+            threads.emplace_back(sender);
+            std::this_thread::sleep_for(options.duration);
+            stopping = true;
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            return RunResult{ sent, relayed, received, relayCpuTime };
+        }
+
+        std::string describe(const char* name, const RunResult& result, const std::chrono::seconds duration)
+        {
+            const auto cpuSeconds = std::chrono::duration<double>{ result.relayCpuTime }.count();
+            const auto perCore = (cpuSeconds > 0) ? static_cast<double>(result.relayed) / cpuSeconds : 0.0;
+            auto output = std::ostringstream{};
+            output << name << ": " << result.sent << " sent, " << result.relayed << " relayed, "
+                << result.received << " received, "
+                << static_cast<std::uint64_t>(result.relayed / duration.count()) << " packets/s, "
+                << "relay thread used " << cpuSeconds << "s of CPU, "
+                << static_cast<std::uint64_t>(perCore) << " packets/s per core";
+            return output.str();
+        }
+#endif
+    }
+
+#ifdef __linux__
+    void runOffloadBenchmark(const BenchmarkOptions& options)
+    {
+        logLine
+        (
+            LogLevel::info,
+            "Relaying bursts of ", options.burstSize, " datagrams of ", options.packetSize,
+            " bytes for ", options.duration.count(), "s, with and without offload"
+        );
+        for (const auto offload : { false, true })
+        {
+            const auto result = run(options, offload);
+            const auto summary = describe(offload ? "UDP GRO / GSO" : "Plain datagrams", result, options.duration);
+            logLine(LogLevel::info, summary);
+            std::cout << summary << std::endl;
+        }
+    }
+#else
+    void runOffloadBenchmark(const BenchmarkOptions&)
+    {
+        throw std::runtime_error{ "The offload benchmark is only supported on Linux" };
+    }
+#endif
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Relays bursts of datagrams between loopback sockets the same way
+    // GameConnection does, once with plain datagrams and once with UDP GRO / GSO,
+    // and reports how many datagrams the relay thread forwards per second of CPU time.
+    // Blocking, throws std::runtime_error on platforms without recvmsg().
+    void runOffloadBenchmark(const BenchmarkOptions& options);
+}
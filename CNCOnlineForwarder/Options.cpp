@@ -0,0 +1,491 @@
+#include "precompiled.h"
+#include "Options.h"
+
+namespace CNCOnlineForwarder
+{
+    std::optional<Options> Options::parse(int argc, char** argv)
+    {
+        namespace ProgramOptions = boost::program_options;
+
+        auto options = Options{};
+        auto httpTimeToLive = std::uint32_t{};
+        auto httpStaleWhileRevalidate = std::uint32_t{};
+        auto peerchatIdleTimeout = std::uint32_t{};
+        auto relayBurst = std::uint32_t{};
+        auto handshakeTimeout = std::uint32_t{};
+        auto relayTimeout = std::uint32_t{};
+        auto minimumIdleTimeout = std::uint32_t{};
+        auto sessionMemory = std::uint32_t{};
+        auto benchmarkDuration = std::uint32_t{};
+        auto relayCpus = std::string{};
+        auto executor = std::string{};
+        auto socketBusyPoll = std::uint32_t{};
+        auto socketBufferMinimum = std::uint32_t{};
+        auto socketBufferMaximum = std::uint32_t{};
+        auto clusterPeers = std::string{};
+        auto clusterEntryLifetime = std::uint32_t{};
+        auto clusterGossipInterval = std::uint32_t{};
+        auto directPathMemory = std::uint32_t{};
+        auto badSourceMemory = std::uint32_t{};
+        auto selfProbeInterval = std::uint32_t{};
+        auto selfProbeTimeout = std::uint32_t{};
+        auto lagInterval = std::uint32_t{};
+        auto shedSessionsLag = std::uint32_t{};
+        auto shedInfoLoggingLag = std::uint32_t{};
+        auto shedAddressRefreshLag = std::uint32_t{};
+        auto handlerBudget = std::uint32_t{};
+        auto drainTimeout = std::uint32_t{};
+        auto drainReportInterval = std::uint32_t{};
+        auto metricsReportInterval = std::uint32_t{};
+        auto captureFileSize = std::uint32_t{};
+
+        auto description = ProgramOptions::options_description{ "Options" };
+        description.add_options()
+        (
+            "help",
+            "Show this message"
+        )
+        (
+            "http-port",
+            ProgramOptions::value(&options.httpProxy.port)->default_value(0),
+            "Port of the local caching HTTP server, 0 to disable it"
+        )
+        (
+            "http-upstream",
+            ProgramOptions::value(&options.httpProxy.upstreamHostName)
+                ->default_value("http.server.cnc-online.net"),
+            "Host name of the upstream HTTP server"
+        )
+        (
+            "http-upstream-port",
+            ProgramOptions::value(&options.httpProxy.upstreamPort)->default_value(80),
+            "Port of the upstream HTTP server"
+        )
+        (
+            "http-upstream-connections",
+            ProgramOptions::value(&options.httpProxy.maxUpstreamConnections)->default_value(4),
+            "Maximum number of persistent connections to the upstream HTTP server"
+        )
+        (
+            "http-cache-size",
+            ProgramOptions::value(&options.httpProxy.cacheCapacity)->default_value(16 * 1024 * 1024),
+            "Maximum size in bytes of cached HTTP responses"
+        )
+        (
+            "http-cache-ttl",
+            ProgramOptions::value(&httpTimeToLive)->default_value(60),
+            "Seconds a response without Cache-Control: max-age stays fresh"
+        )
+        (
+            "http-stale-ttl",
+            ProgramOptions::value(&httpStaleWhileRevalidate)->default_value(600),
+            "Seconds an expired response may still be served while it is being revalidated"
+        )
+        (
+            "peerchat-port",
+            ProgramOptions::value(&options.peerchat.port)->default_value(0),
+            "Port of the Peerchat proxy, 0 to disable it"
+        )
+        (
+            "peerchat-upstream",
+            ProgramOptions::value(&options.peerchat.upstreamHostName)
+                ->default_value("peerchat.server.cnc-online.net"),
+            "Host name of the upstream Peerchat server"
+        )
+        (
+            "peerchat-upstream-port",
+            ProgramOptions::value(&options.peerchat.upstreamPort)->default_value(6667),
+            "Port of the upstream Peerchat server"
+        )
+        (
+            "peerchat-idle-timeout",
+            ProgramOptions::value(&peerchatIdleTimeout)->default_value(600),
+            "Seconds without any traffic before a Peerchat connection is closed"
+        )
+        (
+            "peerchat-splice",
+            ProgramOptions::value(&options.peerchat.useSplice)->default_value(true),
+            "Forward Peerchat traffic with splice() on Linux"
+        )
+        (
+            "natneg-port",
+            ProgramOptions::value(&options.natNeg.port)->default_value(27901),
+            "Port on which NatNeg packets from clients are received"
+        )
+        (
+            "cluster-port",
+            ProgramOptions::value(&options.natNeg.cluster.port)->default_value(0),
+            "Port on which cluster nodes share NatNegID owners and forward packets, 0 to disable cluster mode"
+        )
+        (
+            "cluster-bind-address",
+            ProgramOptions::value(&options.natNeg.cluster.bindAddress)->default_value("0.0.0.0"),
+            "Local address on which cluster messages are received, preferably on a private network"
+        )
+        (
+            "cluster-peers",
+            ProgramOptions::value(&clusterPeers),
+            "Comma separated address:port of the cluster ports of every other node, messages from other addresses are discarded"
+        )
+        (
+            "cluster-secret-file",
+            ProgramOptions::value(&options.natNeg.cluster.secretFile),
+            "File holding a secret shared by every node, which authenticates cluster messages, required in cluster mode"
+        )
+        (
+            "cluster-entry-lifetime",
+            ProgramOptions::value(&clusterEntryLifetime)->default_value(60),
+            "Seconds a NatNegID stays owned by a node after its last packet"
+        )
+        (
+            "cluster-gossip-interval",
+            ProgramOptions::value(&clusterGossipInterval)->default_value(1000),
+            "Milliseconds between two rounds of cluster gossip"
+        )
+        (
+            "natneg-direct-path",
+            ProgramOptions::value(&options.natNeg.directPath.enabled)->default_value(false),
+            "Let pairs of clients whose NATs allow it talk directly instead of relaying their games"
+        )
+        (
+            "natneg-direct-path-memory",
+            ProgramOptions::value(&directPathMemory)->default_value(3600),
+            "Seconds the NAT behaviour of a client IP address is remembered for direct paths"
+        )
+        (
+            "natneg-second-packet",
+            ProgramOptions::value(&options.natNeg.floodProtection.requireSecondPacket)->default_value(true),
+            "Only create a NatNeg session once its client sent a second packet, so spoofed floods don't create any"
+        )
+        (
+            "natneg-source-creations",
+            ProgramOptions::value(&options.natNeg.floodProtection.sourceCreationsPerSecond)->default_value(10),
+            "Maximum NatNeg sessions created per second for a single IP address, 0 for unlimited"
+        )
+        (
+            "natneg-creations",
+            ProgramOptions::value(&options.natNeg.floodProtection.creationsPerSecond)->default_value(500),
+            "Maximum NatNeg sessions created per second in total, 0 for unlimited"
+        )
+        (
+            "natneg-bad-source-seconds",
+            ProgramOptions::value(&badSourceMemory)->default_value(60),
+            "Seconds IP addresses exceeding --natneg-source-creations are ignored, if they recently relayed a game from the same port, 0 to never ignore them"
+        )
+        (
+            "natneg-socket-filter",
+            ProgramOptions::value(&options.natNeg.socketFilter)->default_value(true),
+            "Drop non-NatNeg datagrams inside the kernel with a BPF socket filter on Linux"
+        )
+        (
+            "natneg-udp-offload",
+            ProgramOptions::value(&options.natNeg.udpOffload)->default_value(true),
+            "Receive and send bursts of relayed game packets as single datagrams with UDP GRO / GSO on Linux"
+        )
+        (
+            "self-probe-interval",
+            ProgramOptions::value(&selfProbeInterval)->default_value(60),
+            "Seconds between two synthetic NatNeg handshakes through the NatNeg proxy on loopback, "
+            "measuring setup time and relay round trip, 0 to disable them"
+        )
+        (
+            "self-probe-timeout-ms",
+            ProgramOptions::value(&selfProbeTimeout)->default_value(5000),
+            "Milliseconds after which a synthetic handshake is considered failed"
+        )
+        (
+            "lag-interval-ms",
+            ProgramOptions::value(&lagInterval)->default_value(100),
+            "Milliseconds between two measurements of the event loop lag of every thread and of the NatNeg strand, "
+            "0 to disable them along with load shedding"
+        )
+        (
+            "shed-sessions-lag-ms",
+            ProgramOptions::value(&shedSessionsLag)->default_value(200),
+            "Event loop lag in milliseconds from which new NatNeg sessions are rejected, 0 to never reject them"
+        )
+        (
+            "shed-info-logging-lag-ms",
+            ProgramOptions::value(&shedInfoLoggingLag)->default_value(500),
+            "Event loop lag in milliseconds from which info log lines are dropped, 0 to never drop them"
+        )
+        (
+            "shed-address-refresh-lag-ms",
+            ProgramOptions::value(&shedAddressRefreshLag)->default_value(1000),
+            "Event loop lag in milliseconds from which public address refreshes are postponed, 0 to never postpone them"
+        )
+        (
+            "profile-handlers",
+            ProgramOptions::value(&options.profiling.enabled)->default_value(false),
+            "Record execution time and queueing delay of every kind of handler, and the backlog of strands, "
+            "as handlers.* metrics"
+        )
+        (
+            "handler-budget-us",
+            ProgramOptions::value(&handlerBudget)->default_value(1000),
+            "Microseconds after which a profiled handler is considered too slow, counted and logged as a warning"
+        )
+        (
+            "executor",
+            ProgramOptions::value(&executor)->default_value("shared"),
+            "How handlers are scheduled: shared (one io_context run by every thread), "
+            "work-stealing (one io_context per thread, strands are spread over them "
+            "and idle threads run the handlers of busy ones)"
+        )
+        (
+            "executor-threads",
+            ProgramOptions::value(&options.executor.threads)->default_value(2),
+            "Threads running the handlers of the forwarder"
+        )
+        (
+            "relay-threads",
+            ProgramOptions::value(&options.relayThreads.threads)->default_value(0),
+            "Dedicated threads relaying game packets, 0 to relay on the shared threads"
+        )
+        (
+            "relay-cpus",
+            ProgramOptions::value(&relayCpus),
+            "Comma separated CPUs the relay threads are pinned to on Linux"
+        )
+        (
+            "relay-spin",
+            ProgramOptions::value(&options.relayThreads.spin)->default_value(false),
+            "Relay threads busy wait for packets instead of sleeping, using a whole CPU each"
+        )
+        (
+            "relay-busy-poll-us",
+            ProgramOptions::value(&socketBusyPoll)->default_value(0),
+            "SO_BUSY_POLL microseconds of relay sockets on Linux, 0 to disable"
+        )
+        (
+            "relay-session-pps",
+            ProgramOptions::value(&options.natNeg.relayLimits.sessionPacketsPerSecond)->default_value(500),
+            "Maximum packets per second relayed for a single NatNeg session, 0 for unlimited"
+        )
+        (
+            "relay-session-bps",
+            ProgramOptions::value(&options.natNeg.relayLimits.sessionBytesPerSecond)->default_value(256 * 1024),
+            "Maximum bytes per second relayed for a single NatNeg session, 0 for unlimited"
+        )
+        (
+            "relay-source-pps",
+            ProgramOptions::value(&options.natNeg.relayLimits.sourcePacketsPerSecond)->default_value(2000),
+            "Maximum packets per second relayed from a single IP address, 0 for unlimited"
+        )
+        (
+            "relay-source-bps",
+            ProgramOptions::value(&options.natNeg.relayLimits.sourceBytesPerSecond)->default_value(1024 * 1024),
+            "Maximum bytes per second relayed from a single IP address, 0 for unlimited"
+        )
+        (
+            "relay-burst-ms",
+            ProgramOptions::value(&relayBurst)->default_value(1000),
+            "Milliseconds a relayed flow may exceed its rate limit before being throttled"
+        )
+        (
+            "handshake-timeout",
+            ProgramOptions::value(&handshakeTimeout)->default_value(30),
+            "Seconds without any packet before a NatNeg session still doing its handshake is closed"
+        )
+        (
+            "relay-timeout",
+            ProgramOptions::value(&relayTimeout)->default_value(60),
+            "Seconds without any packet before a NatNeg session relaying game traffic is closed"
+        )
+        (
+            "min-idle-timeout",
+            ProgramOptions::value(&minimumIdleTimeout)->default_value(5),
+            "Seconds idle timeouts may be shortened to when running out of file descriptors or memory"
+        )
+        (
+            "max-sessions",
+            ProgramOptions::value(&options.natNeg.budget.maxSessions)->default_value(0),
+            "Maximum number of NatNeg sessions, 0 to derive it from the file descriptor limit"
+        )
+        (
+            "session-memory-mb",
+            ProgramOptions::value(&sessionMemory)->default_value(256),
+            "Megabytes of memory NatNeg sessions may use before new ones are rejected, 0 for unlimited"
+        )
+        (
+            "socket-buffer-min-kb",
+            ProgramOptions::value(&socketBufferMinimum)->default_value(64),
+            "Smallest size in kilobytes NatNeg socket buffers are shrunk to when they stay mostly empty"
+        )
+        (
+            "socket-buffer-max-kb",
+            ProgramOptions::value(&socketBufferMaximum)->default_value(4096),
+            "Largest size in kilobytes NatNeg socket buffers are grown to when datagrams are dropped"
+        )
+        (
+            "hot-restart-socket",
+            ProgramOptions::value(&options.hotRestart.socketPath),
+            "Unix socket on which a newer process can take over the NatNeg sessions"
+        )
+        (
+            "take-over",
+            ProgramOptions::value(&options.hotRestart.takeOverFrom),
+            "Take over the NatNeg sessions of the process listening on this Unix socket"
+        )
+        (
+            "drain-timeout",
+            ProgramOptions::value(&drainTimeout)->default_value(1800),
+            "Seconds existing sessions may keep running after SIGINT / SIGTERM, 0 to stop immediately"
+        )
+        (
+            "drain-report-interval",
+            ProgramOptions::value(&drainReportInterval)->default_value(10),
+            "Seconds between progress reports while draining"
+        )
+        (
+            "metrics-interval",
+            ProgramOptions::value(&metricsReportInterval)->default_value(60),
+            "Seconds between writing metrics to the log, 0 to disable it"
+        )
+        (
+            "capture",
+            ProgramOptions::value(&options.capture.path),
+            "Capture NatNeg datagrams into pcapng files with this base name"
+        )
+        (
+            "capture-file-mb",
+            ProgramOptions::value(&captureFileSize)->default_value(64),
+            "Megabytes written to a capture file before starting a new one"
+        )
+        (
+            "capture-files",
+            ProgramOptions::value(&options.capture.fileCount)->default_value(8),
+            "Number of capture files kept, older ones are deleted, 0 to keep all of them"
+        )
+        (
+            "replay",
+            ProgramOptions::value(&options.replay.path),
+            "Instead of running the forwarder, replay datagrams of this pcapng capture to --replay-target"
+        )
+        (
+            "replay-target",
+            ProgramOptions::value(&options.replay.target)->default_value("127.0.0.1"),
+            "Host name of the forwarder receiving replayed datagrams"
+        )
+        (
+            "replay-target-port",
+            ProgramOptions::value(&options.replay.targetPort)->default_value(27901),
+            "Port of the forwarder receiving replayed datagrams"
+        )
+        (
+            "replay-port",
+            ProgramOptions::value(&options.replay.capturedPort)->default_value(27901),
+            "Only datagrams captured on this port are replayed"
+        )
+        (
+            "replay-speed",
+            ProgramOptions::value(&options.replay.speed)->default_value(1.0),
+            "Speed multiplier of the replay, 0 to send as fast as possible"
+        )
+        (
+            "benchmark",
+            ProgramOptions::value(&options.benchmark.name),
+            "Instead of running the forwarder, run a loopback benchmark: "
+            "offload (relay throughput with and without UDP GRO / GSO), "
+            "relay-threads (relay latency and CPU usage of each relay thread mode), "
+            "scheduler (cross-strand handler throughput, steals and context switches of each executor), "
+            "micro (JSON timings of the core utility templates), "
+            "http (requests per second of the local HTTP server with and without cache hits), "
+            "peerchat (throughput of the Peerchat proxy with and without splice()), "
+            "allocations (fails if relaying allocates, requires a build with CNC_TRACK_ALLOCATIONS)"
+        )
+        (
+            "benchmark-seconds",
+            ProgramOptions::value(&benchmarkDuration)->default_value(5),
+            "Length of each benchmark run"
+        )
+        (
+            "benchmark-packet-size",
+            ProgramOptions::value(&options.benchmark.packetSize)->default_value(200),
+            "Size of datagrams sent during benchmarks"
+        )
+        (
+            "benchmark-burst",
+            ProgramOptions::value(&options.benchmark.burstSize)->default_value(16),
+            "Datagrams sent back to back during the offload benchmark"
+        )
+        (
+            "benchmark-rate",
+            ProgramOptions::value(&options.benchmark.packetRate)->default_value(10000),
+            "Round trips per second during the relay-threads benchmark"
+        );
+
+        auto variables = ProgramOptions::variables_map{};
+        ProgramOptions::store(ProgramOptions::parse_command_line(argc, argv, description), variables);
+        ProgramOptions::notify(variables);
+
+        if (variables.count("help") > 0)
+        {
+            std::cout << description << std::endl;
+            return std::nullopt;
+        }
+
+        options.httpProxy.defaultTimeToLive = std::chrono::seconds{ httpTimeToLive };
+        options.httpProxy.staleWhileRevalidate = std::chrono::seconds{ httpStaleWhileRevalidate };
+        options.peerchat.idleTimeout = std::chrono::seconds{ peerchatIdleTimeout };
+        options.natNeg.relayLimits.burst = std::chrono::milliseconds{ relayBurst };
+        options.natNeg.idleTimeouts.handshake = std::chrono::seconds{ std::max<std::uint32_t>(handshakeTimeout, 1) };
+        options.natNeg.idleTimeouts.relay = std::chrono::seconds{ std::max<std::uint32_t>(relayTimeout, 1) };
+        options.natNeg.idleTimeouts.minimum = std::chrono::seconds{ minimumIdleTimeout };
+        options.natNeg.budget.maxMemory = std::uint64_t{ sessionMemory } * 1024 * 1024;
+        options.natNeg.socketBuffers.minimum = std::max<std::uint32_t>(socketBufferMinimum, 4) * 1024;
+        options.natNeg.socketBuffers.maximum = 
+            std::max<std::uint32_t>(socketBufferMaximum * 1024, options.natNeg.socketBuffers.minimum);
+        options.natNeg.cluster.entryLifetime = std::chrono::seconds{ std::max<std::uint32_t>(clusterEntryLifetime, 1) };
+        options.natNeg.cluster.gossipInterval = 
+            std::chrono::milliseconds{ std::max<std::uint32_t>(clusterGossipInterval, 10) };
+        options.natNeg.directPath.memory = std::chrono::seconds{ directPathMemory };
+        options.natNeg.floodProtection.badSourceMemory = std::chrono::seconds{ badSourceMemory };
+        options.selfProbe.interval = std::chrono::seconds{ selfProbeInterval };
+        options.selfProbe.timeout = std::chrono::milliseconds{ std::max<std::uint32_t>(selfProbeTimeout, 1) };
+        options.loadShedding.interval = std::chrono::milliseconds{ lagInterval };
+        options.loadShedding.newSessionsLag = std::chrono::milliseconds{ shedSessionsLag };
+        options.loadShedding.infoLoggingLag = std::chrono::milliseconds{ shedInfoLoggingLag };
+        options.loadShedding.addressRefreshLag = std::chrono::milliseconds{ shedAddressRefreshLag };
+        options.profiling.budget = std::chrono::microseconds{ std::max<std::uint32_t>(handlerBudget, 1) };
+        options.drain.timeout = std::chrono::seconds{ drainTimeout };
+        options.drain.reportInterval = std::chrono::seconds{ std::max<std::uint32_t>(drainReportInterval, 1) };
+        options.metrics.reportInterval = std::chrono::seconds{ metricsReportInterval };
+        options.capture.fileSize = std::uint64_t{ std::max<std::uint32_t>(captureFileSize, 1) } * 1024 * 1024;
+        options.benchmark.duration = std::chrono::seconds{ std::max<std::uint32_t>(benchmarkDuration, 1) };
+        options.benchmark.packetRate = std::max<std::uint32_t>(options.benchmark.packetRate, 1);
+        options.natNeg.socketBusyPoll = std::chrono::microseconds{ socketBusyPoll };
+        options.executor.threads = std::max<std::size_t>(options.executor.threads, 1);
+        if (executor == "shared")
+        {
+            options.executor.type = ExecutorOptions::Type::shared;
+        }
+        else if (executor == "work-stealing")
+        {
+            options.executor.type = ExecutorOptions::Type::workStealing;
+        }
+        else
+        {
+            throw std::invalid_argument{ "Unknown executor " + executor };
+        }
+        for (auto cpus = std::istringstream{ relayCpus }; cpus.good();)
+        {
+            auto cpu = std::string{};
+            std::getline(cpus, cpu, ',');
+            if (!cpu.empty())
+            {
+                options.relayThreads.cpus.push_back(std::stoi(cpu));
+            }
+        }
+        for (auto peers = std::istringstream{ clusterPeers }; peers.good();)
+        {
+            auto peer = std::string{};
+            std::getline(peers, peer, ',');
+            if (!peer.empty())
+            {
+                options.natNeg.cluster.peers.push_back(peer);
+            }
+        }
+        return options;
+    }
+}
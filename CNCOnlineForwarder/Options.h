@@ -0,0 +1,258 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace CNCOnlineForwarder
+{
+    struct HTTPProxyOptions
+    {
+        // 0 means the local HTTP server is disabled
+        std::uint16_t port;
+        std::string upstreamHostName;
+        std::uint16_t upstreamPort;
+        std::size_t maxUpstreamConnections;
+        std::size_t cacheCapacity;
+        std::chrono::seconds defaultTimeToLive;
+        std::chrono::seconds staleWhileRevalidate;
+    };
+
+    struct TCPForwarderOptions
+    {
+        // 0 means the forwarder is disabled
+        std::uint16_t port;
+        std::string upstreamHostName;
+        std::uint16_t upstreamPort;
+        std::chrono::seconds idleTimeout;
+        // Use splice() to forward data when it's supported by the platform
+        bool useSplice;
+    };
+
+    struct RelayLimitOptions
+    {
+        // 0 means unlimited
+        std::uint32_t sessionPacketsPerSecond;
+        std::uint32_t sessionBytesPerSecond;
+        std::uint32_t sourcePacketsPerSecond;
+        std::uint32_t sourceBytesPerSecond;
+        // How long a flow may exceed its rate before being throttled
+        std::chrono::milliseconds burst;
+    };
+
+    struct IdleTimeoutOptions
+    {
+        // Sessions still doing the NatNeg handshake
+        std::chrono::seconds handshake;
+        // Sessions relaying game traffic
+        std::chrono::seconds relay;
+        // Timeouts are never shortened below this under load
+        std::chrono::seconds minimum;
+    };
+
+    struct SessionBudgetOptions
+    {
+        // 0 means it's derived from the file descriptor limit
+        std::size_t maxSessions;
+        // Bytes of memory used by NatNeg sessions, 0 means unlimited
+        std::uint64_t maxMemory;
+    };
+
+    struct SocketBufferOptions
+    {
+        // Bounds in bytes of automatically sized socket buffers
+        std::uint32_t minimum;
+        std::uint32_t maximum;
+    };
+
+    struct ClusterOptions
+    {
+        // UDP port on which nodes gossip and forward packets, 0 means cluster mode is disabled
+        std::uint16_t port;
+        // Local address of the cluster socket
+        std::string bindAddress;
+        // Cluster addresses of every other node, as "address:port",
+        // messages from any other address are discarded
+        std::vector<std::string> peers;
+        // File holding the secret shared by every node, used to authenticate their messages
+        std::string secretFile;
+        // How long a NatNegID stays owned after its owner handled its last packet
+        std::chrono::milliseconds entryLifetime;
+        std::chrono::milliseconds gossipInterval;
+    };
+
+    struct DirectPathOptions
+    {
+        // Let clients which can reach each other talk directly instead of being relayed
+        bool enabled;
+        // How long the NAT behaviour of a client IP address is remembered
+        std::chrono::seconds memory;
+    };
+
+    struct FloodProtectionOptions
+    {
+        // Only create an InitialPhase once the source of a new NatNegPlayerID sent it a second packet
+        bool requireSecondPacket;
+        // InitialPhases created per second for a single IP address and in total, 0 means unlimited
+        std::uint32_t sourceCreationsPerSecond;
+        std::uint32_t creationsPerSecond;
+        // How long IP addresses exceeding their creation rate from a confirmed endpoint are ignored, 0 means never
+        std::chrono::seconds badSourceMemory;
+    };
+
+    struct NatNegOptions
+    {
+        // Port on which NatNeg packets from clients are received
+        std::uint16_t port;
+        RelayLimitOptions relayLimits;
+        IdleTimeoutOptions idleTimeouts;
+        SessionBudgetOptions budget;
+        SocketBufferOptions socketBuffers;
+        ClusterOptions cluster;
+        DirectPathOptions directPath;
+        FloodProtectionOptions floodProtection;
+        // Drop non-NatNeg datagrams inside the kernel when it's supported by the platform
+        bool socketFilter;
+        // Relay bursts of game packets with UDP GRO / GSO when it's supported by the platform
+        bool udpOffload;
+        // SO_BUSY_POLL of relay sockets, 0 means disabled
+        std::chrono::microseconds socketBusyPoll;
+    };
+
+    struct SelfProbeOptions
+    {
+        // Seconds between two synthetic handshakes, 0 means the self probe is disabled
+        std::chrono::seconds interval;
+        // A probe not done by then has failed
+        std::chrono::milliseconds timeout;
+    };
+
+    struct LoadSheddingOptions
+    {
+        // Milliseconds between two event loop lag measurements, 0 means lag isn't measured
+        std::chrono::milliseconds interval;
+        // Lag from which each kind of work is shed, 0 means never shed it
+        std::chrono::milliseconds newSessionsLag;
+        std::chrono::milliseconds infoLoggingLag;
+        std::chrono::milliseconds addressRefreshLag;
+    };
+
+    struct ProfilingOptions
+    {
+        // Record execution time, queueing delay and strand backlog of handlers
+        bool enabled;
+        // Handlers running longer than this are counted and logged
+        std::chrono::microseconds budget;
+    };
+
+    struct RelayThreadOptions
+    {
+        // 0 means relayed packets are handled by the shared threads
+        std::size_t threads;
+        // CPUs relay threads are pinned to, round robin, empty means not pinned
+        std::vector<int> cpus;
+        // Spin on io_context::poll() instead of sleeping when there's nothing to relay
+        bool spin;
+    };
+
+    struct ExecutorOptions
+    {
+        enum class Type
+        {
+            // Every thread runs handlers of a single shared io_context
+            shared,
+            // Every thread has its own io_context and steals work from the others when idle
+            workStealing,
+        };
+
+        Type type;
+        // Threads running the handlers of the forwarder, not counting relay threads
+        std::size_t threads;
+    };
+
+    struct HotRestartOptions
+    {
+        // Unix socket on which a newer process can take over this one,
+        // empty means hot restart is disabled
+        std::string socketPath;
+        // Unix socket of an older process whose state should be taken over,
+        // empty means starting from scratch
+        std::string takeOverFrom;
+    };
+
+    struct DrainOptions
+    {
+        // How long existing sessions may keep running after SIGINT / SIGTERM,
+        // 0 means stopping immediately
+        std::chrono::seconds timeout;
+        std::chrono::seconds reportInterval;
+    };
+
+    struct MetricsOptions
+    {
+        // 0 means metrics are not written to the log
+        std::chrono::seconds reportInterval;
+    };
+
+    struct CaptureOptions
+    {
+        // Base name of pcapng files, empty means capture is disabled
+        std::string path;
+        // A new file is started after this many bytes
+        std::uint64_t fileSize;
+        // Older files are deleted, 0 means all files are kept
+        std::uint32_t fileCount;
+    };
+
+    struct ReplayOptions
+    {
+        // pcapng file to replay instead of running the forwarder,
+        // empty means running normally
+        std::string path;
+        std::string target;
+        std::uint16_t targetPort;
+        // Only datagrams captured on this port are replayed
+        std::uint16_t capturedPort;
+        // Multiplier of the original timing, 0 means as fast as possible
+        double speed;
+    };
+
+    struct BenchmarkOptions
+    {
+        // Benchmark to run instead of the forwarder, empty means running normally
+        std::string name;
+        // Length of each run
+        std::chrono::seconds duration;
+        std::uint16_t packetSize;
+        // Datagrams sent back to back by the offload benchmark
+        std::uint16_t burstSize;
+        // Round trips per second of the relay thread benchmark
+        std::uint32_t packetRate;
+    };
+
+    struct Options
+    {
+        static constexpr auto description = "Options";
+
+        // Returns: parsed options,
+        // or nullopt if the program should exit immediately (i.e. --help)
+        static std::optional<Options> parse(int argc, char** argv);
+
+        HTTPProxyOptions httpProxy;
+        TCPForwarderOptions peerchat;
+        NatNegOptions natNeg;
+        SelfProbeOptions selfProbe;
+        LoadSheddingOptions loadShedding;
+        ProfilingOptions profiling;
+        RelayThreadOptions relayThreads;
+        ExecutorOptions executor;
+        HotRestartOptions hotRestart;
+        DrainOptions drain;
+        MetricsOptions metrics;
+        CaptureOptions capture;
+        ReplayOptions replay;
+        BenchmarkOptions benchmark;
+    };
+}
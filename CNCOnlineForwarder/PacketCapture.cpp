@@ -0,0 +1,215 @@
+#include "precompiled.h"
+#include "PacketCapture.h"
+#include <cstdio>
+#include <filesystem>
+#include <stdexcept>
+#include "Logging.h"
+#include "Metrics.h"
+
+using UDP = boost::asio::ip::udp;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Capture
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<Writer>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        std::atomic<Writer*> activeWriter{ nullptr };
+        auto& capturedPackets = Metrics::counter("packetCapture.packets");
+        auto& droppedPackets = Metrics::counter("packetCapture.dropped");
+
+        // capture.pcapng => capture_3.pcapng
+        std::string makeFileName(const std::string& path, const std::uint64_t sequence)
+        {
+            auto fileName = std::filesystem::path{ path };
+            const auto extension = fileName.extension().string();
+            const auto stem = fileName.stem().string();
+            fileName.replace_filename(stem + "_" + std::to_string(sequence) + extension);
+            return fileName.string();
+        }
+    }
+
+    Writer::Writer(const CaptureOptions& options) :
+        options{ options },
+        queuedBytes{ 0 },
+        stopping{ false },
+        fileSize{ 0 },
+        fileSequence{ 0 }
+    {
+        this->openNextFile();
+        if (!this->file)
+        {
+            throw std::runtime_error{ "Cannot open capture file " + makeFileName(options.path, 0) };
+        }
+
+        auto expected = static_cast<Writer*>(nullptr);
+        if (!activeWriter.compare_exchange_strong(expected, this))
+        {
+            throw std::logic_error{ "Another packet capture is already running" };
+        }
+        this->thread = std::thread{ [this] { this->run(); } };
+        logLine(LogLevel::info, "Capturing packets into ", options.path);
+    }
+
+    Writer::~Writer()
+    {
+        activeWriter.store(nullptr);
+        {
+            const auto lock = std::scoped_lock{ this->mutex };
+            this->stopping = true;
+        }
+        this->queueChanged.notify_one();
+        this->thread.join();
+    }
+
+    void Writer::push
+    (
+        const Direction direction,
+        const UDP::endpoint& source,
+        const UDP::endpoint& destination,
+        const std::string_view payload,
+        const std::chrono::system_clock::time_point time
+    )
+    {
+        const auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch());
+        {
+            const auto lock = std::scoped_lock{ this->mutex };
+            if (this->queuedBytes + payload.size() > maxQueuedBytes)
+            {
+                droppedPackets.add();
+                return;
+            }
+            this->queue.push_back
+            (
+                Record
+                {
+                    static_cast<std::uint64_t>(sinceEpoch.count()),
+                    direction,
+                    source,
+                    destination,
+                    std::string{ payload }
+                }
+            );
+            this->queuedBytes += payload.size();
+        }
+        this->queueChanged.notify_one();
+    }
+
+    void Writer::run()
+    {
+        auto records = std::vector<Record>{};
+        while (true)
+        {
+            {
+                auto lock = std::unique_lock{ this->mutex };
+                this->queueChanged.wait(lock, [this] { return this->stopping || !this->queue.empty(); });
+                if (this->queue.empty())
+                {
+                    // Stopping, and everything has been written
+                    return;
+                }
+                std::swap(records, this->queue);
+                this->queuedBytes = 0;
+            }
+
+            this->write(records);
+            records.clear();
+        }
+    }
+
+    void Writer::write(const std::vector<Record>& records)
+    {
+        auto output = std::string{};
+        for (const auto& record : records)
+        {
+            Pcapng::appendDatagram
+            (
+                output,
+                record.nanosecondsSinceEpoch,
+                record.direction,
+                record.source,
+                record.destination,
+                record.payload
+            );
+
+            if (this->fileSize + output.size() >= this->options.fileSize)
+            {
+                this->file.write(output.data(), output.size());
+                output.clear();
+                this->openNextFile();
+            }
+        }
+        this->file.write(output.data(), output.size());
+        this->file.flush();
+        this->fileSize += output.size();
+        capturedPackets.add(records.size());
+    }
+
+    void Writer::openNextFile()
+    {
+        if (this->file.is_open())
+        {
+            this->file.close();
+        }
+
+        const auto sequence = this->fileSequence;
+        ++this->fileSequence;
+        if ((this->options.fileCount > 0) && (sequence >= this->options.fileCount))
+        {
+            const auto oldFile = makeFileName(this->options.path, sequence - this->options.fileCount);
+            std::remove(oldFile.c_str());
+        }
+
+        const auto fileName = makeFileName(this->options.path, sequence);
+        this->file.open(fileName, std::ios::binary | std::ios::trunc);
+        if (!this->file)
+        {
+            logLine(LogLevel::error, "Cannot open capture file ", fileName);
+            return;
+        }
+
+        const auto header = Pcapng::makeFileHeader();
+        this->file.write(header.data(), header.size());
+        this->fileSize = header.size();
+    }
+
+    bool isEnabled() noexcept
+    {
+        return activeWriter.load(std::memory_order_relaxed) != nullptr;
+    }
+
+    void record
+    (
+        const Direction direction,
+        const WithStrand<UDP::socket>& socket,
+        const UDP::endpoint& remote,
+        const boost::asio::const_buffer& data,
+        const std::chrono::system_clock::time_point time
+    )
+    {
+        const auto writer = activeWriter.load(std::memory_order_acquire);
+        if (writer == nullptr)
+        {
+            return;
+        }
+
+        auto code = boost::system::error_code{};
+        const auto local = socket->local_endpoint(code);
+        if (code.failed())
+        {
+            return;
+        }
+
+        const auto payload = std::string_view{ static_cast<const char*>(data.data()), data.size() };
+        if (direction == Direction::inbound)
+        {
+            return writer->push(direction, remote, local, payload, time);
+        }
+        return writer->push(direction, local, remote, payload, time);
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include "IOManager.hpp"
+#include "Options.h"
+#include "Pcapng.h"
+
+namespace CNCOnlineForwarder::Capture
+{
+    using Direction = Pcapng::Direction;
+
+    // Writes datagrams passed to record() into rotated pcapng files.
+    // Files are written by a dedicated thread, record() only copies the datagram
+    // into a queue, and drops it if too much data is already waiting.
+    // Only one Writer may exist at a time, and it must outlive IOManager's threads.
+    class Writer
+    {
+    public:
+        static constexpr auto description = "PacketCapture";
+
+        // Datagrams are dropped once this many bytes are waiting to be written
+        static constexpr auto maxQueuedBytes = std::size_t{ 16 * 1024 * 1024 };
+
+        explicit Writer(const CaptureOptions& options);
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        // Writes everything still queued before returning
+        ~Writer();
+
+        void push
+        (
+            const Direction direction,
+            const boost::asio::ip::udp::endpoint& source,
+            const boost::asio::ip::udp::endpoint& destination,
+            const std::string_view payload,
+            const std::chrono::system_clock::time_point time
+        );
+
+    private:
+        struct Record
+        {
+            std::uint64_t nanosecondsSinceEpoch;
+            Direction direction;
+            boost::asio::ip::udp::endpoint source;
+            boost::asio::ip::udp::endpoint destination;
+            std::string payload;
+        };
+
+        void run();
+
+        void write(const std::vector<Record>& records);
+
+        void openNextFile();
+
+        CaptureOptions options;
+        std::mutex mutex;
+        std::condition_variable queueChanged;
+        std::vector<Record> queue;
+        std::size_t queuedBytes;
+        bool stopping;
+        // Only used by the writer thread
+        std::ofstream file;
+        std::uint64_t fileSize;
+        std::uint64_t fileSequence;
+        std::thread thread;
+    };
+
+    bool isEnabled() noexcept;
+
+    // Record a datagram received or sent by socket, if capture is enabled.
+    // Can be called from any thread.
+    void record
+    (
+        const Direction direction,
+        const WithStrand<boost::asio::ip::udp::socket>& socket,
+        const boost::asio::ip::udp::endpoint& remote,
+        const boost::asio::const_buffer& data,
+        const std::chrono::system_clock::time_point time = std::chrono::system_clock::now()
+    );
+}
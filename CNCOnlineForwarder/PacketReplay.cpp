@@ -0,0 +1,152 @@
+#include "precompiled.h"
+#include "PacketReplay.h"
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include "Histogram.hpp"
+#include "Logging.h"
+#include "Pcapng.h"
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Capture
+{
+    namespace
+    {
+        struct Replay
+        {
+            static constexpr auto description = "Replay";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<Replay>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        std::vector<Pcapng::Datagram> load(const ReplayOptions& options)
+        {
+            auto input = std::ifstream{ options.path, std::ios::binary };
+            if (!input)
+            {
+                throw std::runtime_error{ "Cannot open capture file " + options.path };
+            }
+
+            auto datagrams = std::vector<Pcapng::Datagram>{};
+            auto reader = Pcapng::Reader{ input };
+            while (auto datagram = reader.next())
+            {
+                if (datagram->direction == Pcapng::Direction::outbound)
+                {
+                    continue;
+                }
+                if (datagram->destination.port() != options.capturedPort)
+                {
+                    continue;
+                }
+                datagrams.push_back(std::move(datagram.value()));
+            }
+
+            // Datagrams captured by different threads may be slightly out of order
+            const auto byTime = [](const Pcapng::Datagram& a, const Pcapng::Datagram& b)
+            {
+                return a.nanosecondsSinceEpoch < b.nanosecondsSinceEpoch;
+            };
+            std::stable_sort(datagrams.begin(), datagrams.end(), byTime);
+            return datagrams;
+        }
+
+        // Count replies from the forwarder without blocking
+        std::size_t drainReplies(std::map<UDP::endpoint, UDP::socket>& sockets)
+        {
+            auto replies = std::size_t{ 0 };
+            char buffer[1024];
+            for (auto& [source, socket] : sockets)
+            {
+                socket.non_blocking(true);
+                auto code = ErrorCode{};
+                auto from = UDP::endpoint{};
+                while ((socket.receive_from(boost::asio::buffer(buffer), from, 0, code), !code.failed()))
+                {
+                    ++replies;
+                }
+            }
+            return replies;
+        }
+    }
+
+    void replay(const ReplayOptions& options)
+    {
+        const auto datagrams = load(options);
+        if (datagrams.empty())
+        {
+            logLine(LogLevel::warning, "No datagram to port ", options.capturedPort, " found in ", options.path);
+            return;
+        }
+
+        auto context = boost::asio::io_context{};
+        auto resolver = UDP::resolver{ context };
+        const auto target = resolver.resolve(UDP::v4(), options.target, std::to_string(options.targetPort))->endpoint();
+
+        const auto first = datagrams.front().nanosecondsSinceEpoch;
+        const auto capturedLength = std::chrono::nanoseconds{ datagrams.back().nanosecondsSinceEpoch - first };
+        logLine
+        (
+            LogLevel::info,
+            "Replaying ", datagrams.size(), " datagrams captured over ",
+            std::chrono::duration_cast<std::chrono::milliseconds>(capturedLength).count(), "ms to ", target,
+            ", speed ", options.speed
+        );
+
+        auto sockets = std::map<UDP::endpoint, UDP::socket>{};
+        // How late each datagram was sent compared to its scaled capture time
+        const auto lateness = std::make_unique<Metrics::Histogram>();
+        auto sent = std::size_t{ 0 };
+        auto failed = std::size_t{ 0 };
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& datagram : datagrams)
+        {
+            auto& socket = sockets.try_emplace(datagram.source, context, UDP::endpoint{ UDP::v4(), 0 }).first->second;
+
+            if (options.speed > 0)
+            {
+                const auto offset = std::chrono::duration<double, std::nano>
+                {
+                    static_cast<double>(datagram.nanosecondsSinceEpoch - first) / options.speed
+                };
+                const auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset);
+                std::this_thread::sleep_until(due);
+                const auto late = std::chrono::steady_clock::now() - due;
+                lateness->record(std::chrono::duration_cast<std::chrono::microseconds>(late).count());
+            }
+
+            auto code = ErrorCode{};
+            socket.send_to(boost::asio::buffer(datagram.payload), target, 0, code);
+            if (code.failed())
+            {
+                ++failed;
+                continue;
+            }
+            ++sent;
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        // Give the forwarder a moment to answer the last datagrams
+        std::this_thread::sleep_for(std::chrono::seconds{ 1 });
+        const auto replies = drainReplies(sockets);
+
+        const auto latenessSnapshot = lateness->snapshot();
+        auto summary = std::ostringstream{};
+        summary << "Replay finished: " << sent << " sent, " << failed << " failed, "
+            << replies << " replies, " << sockets.size() << " sources, "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() << "ms elapsed, "
+            << "lateness p50 " << latenessSnapshot.getQuantile(0.5) << "us"
+            << " p99 " << latenessSnapshot.getQuantile(0.99) << "us"
+            << " max " << latenessSnapshot.getMax() << "us";
+        logLine(LogLevel::info, summary.str());
+        std::cout << summary.str() << std::endl;
+    }
+}
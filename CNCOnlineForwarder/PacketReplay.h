@@ -0,0 +1,12 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Capture
+{
+    // Sends datagrams from a pcapng capture to a running forwarder, keeping
+    // their original timing scaled by options.speed. Only datagrams which were 
+    // received by the captured forwarder on options.capturedPort are replayed,
+    // each captured source gets its own local socket.
+    // Blocking, throws std::runtime_error if the capture cannot be read.
+    void replay(const ReplayOptions& options);
+}
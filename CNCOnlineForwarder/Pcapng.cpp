@@ -0,0 +1,372 @@
+#include "precompiled.h"
+#include "Pcapng.h"
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+using UDP = boost::asio::ip::udp;
+
+namespace CNCOnlineForwarder::Capture::Pcapng
+{
+    namespace
+    {
+        constexpr auto sectionHeaderType = std::uint32_t{ 0x0A0D0D0A };
+        constexpr auto interfaceDescriptionType = std::uint32_t{ 0x00000001 };
+        constexpr auto enhancedPacketType = std::uint32_t{ 0x00000006 };
+        constexpr auto byteOrderMagic = std::uint32_t{ 0x1A2B3C4D };
+
+        constexpr auto linkTypeEthernet = std::uint16_t{ 1 };
+        constexpr auto linkTypeRaw = std::uint16_t{ 101 };
+        constexpr auto linkTypeIPv4 = std::uint16_t{ 228 };
+
+        constexpr auto optionEnd = std::uint16_t{ 0 };
+        constexpr auto optionTimestampResolution = std::uint16_t{ 9 };
+        constexpr auto optionPacketFlags = std::uint16_t{ 2 };
+
+        constexpr auto ipv4HeaderSize = std::size_t{ 20 };
+        constexpr auto udpHeaderSize = std::size_t{ 8 };
+        constexpr auto udpProtocol = std::uint8_t{ 17 };
+        constexpr auto nanosecondsPerSecond = std::uint64_t{ 1'000'000'000 };
+
+        std::size_t paddedSize(const std::size_t size)
+        {
+            return (size + 3) & ~std::size_t{ 3 };
+        }
+
+        // pcapng blocks are written in native byte order
+        template<typename T>
+        void append(std::string& output, const T value)
+        {
+            char bytes[sizeof(T)];
+            std::memcpy(bytes, &value, sizeof(T));
+            output.append(bytes, sizeof(T));
+        }
+
+        template<typename T>
+        void appendBigEndian(std::string& output, const T value)
+        {
+            return append(output, boost::endian::native_to_big(value));
+        }
+
+        void appendPadding(std::string& output)
+        {
+            output.append(paddedSize(output.size()) - output.size(), '\0');
+        }
+
+        template<typename T>
+        T read(const std::string_view input, const std::size_t offset)
+        {
+            if (offset + sizeof(T) > input.size())
+            {
+                throw std::runtime_error{ "Truncated pcapng block" };
+            }
+            auto value = T{};
+            std::memcpy(&value, input.data() + offset, sizeof(T));
+            return value;
+        }
+
+        template<typename T>
+        T readBigEndian(const std::string_view input, const std::size_t offset)
+        {
+            return boost::endian::big_to_native(read<T>(input, offset));
+        }
+
+        // Calls handler(code, value) for every option starting at offset
+        template<typename Handler>
+        void forEachOption(const std::string_view body, std::size_t offset, Handler&& handler)
+        {
+            while (offset + 4 <= body.size())
+            {
+                const auto code = read<std::uint16_t>(body, offset);
+                const auto length = read<std::uint16_t>(body, offset + 2);
+                if (code == optionEnd)
+                {
+                    return;
+                }
+                const auto valueOffset = offset + 4;
+                if (valueOffset + length > body.size())
+                {
+                    throw std::runtime_error{ "Truncated pcapng option" };
+                }
+                handler(code, body.substr(valueOffset, length));
+                offset = valueOffset + paddedSize(length);
+            }
+        }
+
+        std::uint16_t checksum(const std::string_view header)
+        {
+            auto sum = std::uint32_t{ 0 };
+            for (auto i = std::size_t{ 0 }; i + 1 < header.size(); i += 2)
+            {
+                sum += readBigEndian<std::uint16_t>(header, i);
+            }
+            while ((sum >> 16) != 0)
+            {
+                sum = (sum & 0xFFFF) + (sum >> 16);
+            }
+            return static_cast<std::uint16_t>(~sum);
+        }
+    }
+
+    std::string makeFileHeader()
+    {
+        auto output = std::string{};
+
+        constexpr auto sectionHeaderLength = std::uint32_t{ 28 };
+        append(output, sectionHeaderType);
+        append(output, sectionHeaderLength);
+        append(output, byteOrderMagic);
+        append(output, std::uint16_t{ 1 });
+        append(output, std::uint16_t{ 0 });
+        // Section length is not specified
+        append(output, std::int64_t{ -1 });
+        append(output, sectionHeaderLength);
+
+        constexpr auto interfaceLength = std::uint32_t{ 32 };
+        append(output, interfaceDescriptionType);
+        append(output, interfaceLength);
+        append(output, linkTypeRaw);
+        append(output, std::uint16_t{ 0 });
+        // No snapshot length limit
+        append(output, std::uint32_t{ 0 });
+        append(output, optionTimestampResolution);
+        append(output, std::uint16_t{ 1 });
+        append(output, std::uint8_t{ 9 });
+        appendPadding(output);
+        append(output, optionEnd);
+        append(output, std::uint16_t{ 0 });
+        append(output, interfaceLength);
+
+        return output;
+    }
+
+    void appendDatagram
+    (
+        std::string& output,
+        const std::uint64_t nanosecondsSinceEpoch,
+        const Direction direction,
+        const UDP::endpoint& source,
+        const UDP::endpoint& destination,
+        const std::string_view payload
+    )
+    {
+        if (!source.address().is_v4() || !destination.address().is_v4())
+        {
+            return;
+        }
+
+        auto packet = std::string{};
+        const auto totalLength = ipv4HeaderSize + udpHeaderSize + payload.size();
+        packet.reserve(totalLength);
+        // Version 4, 20 bytes header
+        append(packet, std::uint8_t{ 0x45 });
+        append(packet, std::uint8_t{ 0 });
+        appendBigEndian(packet, static_cast<std::uint16_t>(totalLength));
+        appendBigEndian(packet, std::uint16_t{ 0 });
+        // Don't fragment
+        appendBigEndian(packet, std::uint16_t{ 0x4000 });
+        append(packet, std::uint8_t{ 64 });
+        append(packet, udpProtocol);
+        appendBigEndian(packet, std::uint16_t{ 0 });
+        appendBigEndian(packet, source.address().to_v4().to_uint());
+        appendBigEndian(packet, destination.address().to_v4().to_uint());
+        const auto headerChecksum = boost::endian::native_to_big(checksum(packet));
+        std::memcpy(packet.data() + 10, &headerChecksum, sizeof(headerChecksum));
+        appendBigEndian(packet, source.port());
+        appendBigEndian(packet, destination.port());
+        appendBigEndian(packet, static_cast<std::uint16_t>(udpHeaderSize + payload.size()));
+        // UDP checksum is optional over IPv4
+        appendBigEndian(packet, std::uint16_t{ 0 });
+        packet.append(payload);
+
+        const auto blockLength = static_cast<std::uint32_t>(28 + paddedSize(packet.size()) + 12 + 4);
+        const auto begin = output.size();
+        append(output, enhancedPacketType);
+        append(output, blockLength);
+        // Interface ID
+        append(output, std::uint32_t{ 0 });
+        append(output, static_cast<std::uint32_t>(nanosecondsSinceEpoch >> 32));
+        append(output, static_cast<std::uint32_t>(nanosecondsSinceEpoch));
+        append(output, static_cast<std::uint32_t>(packet.size()));
+        append(output, static_cast<std::uint32_t>(packet.size()));
+        output.append(packet);
+        output.append(paddedSize(packet.size()) - packet.size(), '\0');
+        append(output, optionPacketFlags);
+        append(output, std::uint16_t{ 4 });
+        append(output, static_cast<std::uint32_t>(direction));
+        append(output, optionEnd);
+        append(output, std::uint16_t{ 0 });
+        append(output, blockLength);
+        assert(output.size() - begin == blockLength);
+    }
+
+    Reader::Reader(std::istream& input) :
+        input{ input }
+    {}
+
+    std::optional<Datagram> Reader::next()
+    {
+        auto type = std::uint32_t{};
+        auto body = std::string{};
+        while (this->readBlock(type, body))
+        {
+            if (type == sectionHeaderType)
+            {
+                this->interfaces.clear();
+            }
+            else if (type == interfaceDescriptionType)
+            {
+                this->readInterface(body);
+            }
+            else if (type == enhancedPacketType)
+            {
+                if (auto datagram = this->readPacket(body); datagram.has_value())
+                {
+                    return datagram;
+                }
+            }
+        }
+        return std::nullopt;
+    }
+
+    bool Reader::readBlock(std::uint32_t& type, std::string& body)
+    {
+        char header[8];
+        if (!this->input.read(header, sizeof(header)))
+        {
+            if (this->input.gcount() == 0)
+            {
+                return false;
+            }
+            throw std::runtime_error{ "Truncated pcapng block header" };
+        }
+        type = read<std::uint32_t>({ header, sizeof(header) }, 0);
+        const auto length = read<std::uint32_t>({ header, sizeof(header) }, 4);
+        if (type == sectionHeaderType)
+        {
+            // Check the byte order before trusting the length
+            char magic[4];
+            if (!this->input.read(magic, sizeof(magic)))
+            {
+                throw std::runtime_error{ "Truncated pcapng section header" };
+            }
+            if (read<std::uint32_t>({ magic, sizeof(magic) }, 0) != byteOrderMagic)
+            {
+                throw std::runtime_error{ "pcapng file has a different byte order, which is not supported" };
+            }
+            this->input.seekg(-static_cast<std::streamoff>(sizeof(magic)), std::ios::cur);
+        }
+        if ((length < 12) || ((length % 4) != 0))
+        {
+            throw std::runtime_error{ "Invalid pcapng block length" };
+        }
+
+        body.resize(length - 12);
+        char trailer[4];
+        if (!this->input.read(body.data(), body.size()) || !this->input.read(trailer, sizeof(trailer)))
+        {
+            throw std::runtime_error{ "Truncated pcapng block" };
+        }
+        return true;
+    }
+
+    void Reader::readInterface(const std::string& body)
+    {
+        auto interface = Interface{ read<std::uint16_t>(body, 0), 1'000'000 };
+        const auto onOption = [&interface](const std::uint16_t code, const std::string_view value)
+        {
+            if ((code != optionTimestampResolution) || value.empty())
+            {
+                return;
+            }
+            const auto exponent = static_cast<std::uint8_t>(value.front());
+            const auto base = ((exponent & 0x80) != 0) ? std::uint64_t{ 2 } : std::uint64_t{ 10 };
+            interface.resolution = 1;
+            for (auto i = 0; i < (exponent & 0x7F); ++i)
+            {
+                interface.resolution *= base;
+            }
+        };
+        forEachOption(body, 8, onOption);
+        this->interfaces.push_back(interface);
+    }
+
+    std::optional<Datagram> Reader::readPacket(const std::string& body) const
+    {
+        const auto interfaceID = read<std::uint32_t>(body, 0);
+        if (interfaceID >= this->interfaces.size())
+        {
+            throw std::runtime_error{ "pcapng packet refers to an unknown interface" };
+        }
+        const auto& interface = this->interfaces[interfaceID];
+
+        const auto timestamp =
+            (std::uint64_t{ read<std::uint32_t>(body, 4) } << 32) | read<std::uint32_t>(body, 8);
+        const auto capturedLength = read<std::uint32_t>(body, 12);
+        constexpr auto dataOffset = std::size_t{ 20 };
+        if (dataOffset + capturedLength > body.size())
+        {
+            throw std::runtime_error{ "Truncated pcapng packet" };
+        }
+
+        auto datagram = Datagram{};
+        datagram.nanosecondsSinceEpoch =
+            (timestamp / interface.resolution) * nanosecondsPerSecond +
+            (timestamp % interface.resolution) * nanosecondsPerSecond / interface.resolution;
+        datagram.direction = Direction::unknown;
+        const auto onOption = [&datagram](const std::uint16_t code, const std::string_view value)
+        {
+            if ((code == optionPacketFlags) && (value.size() == 4))
+            {
+                datagram.direction = static_cast<Direction>(read<std::uint32_t>(value, 0) & 0x3);
+            }
+        };
+        forEachOption(body, dataOffset + paddedSize(capturedLength), onOption);
+
+        auto packet = std::string_view{ body }.substr(dataOffset, capturedLength);
+        if (interface.linkType == linkTypeEthernet)
+        {
+            constexpr auto ethernetHeaderSize = std::size_t{ 14 };
+            constexpr auto etherTypeIPv4 = std::uint16_t{ 0x0800 };
+            if ((packet.size() < ethernetHeaderSize) || (readBigEndian<std::uint16_t>(packet, 12) != etherTypeIPv4))
+            {
+                return std::nullopt;
+            }
+            packet.remove_prefix(ethernetHeaderSize);
+        }
+        else if ((interface.linkType != linkTypeRaw) && (interface.linkType != linkTypeIPv4))
+        {
+            return std::nullopt;
+        }
+
+        if ((packet.size() < ipv4HeaderSize) || ((packet.front() & 0xF0) != 0x40))
+        {
+            return std::nullopt;
+        }
+        const auto headerSize = static_cast<std::size_t>(packet.front() & 0x0F) * 4;
+        const auto fragment = readBigEndian<std::uint16_t>(packet, 6);
+        // Skip fragments, and anything which isn't UDP
+        if ((packet.size() < headerSize + udpHeaderSize) ||
+            ((fragment & 0x3FFF) != 0) ||
+            (read<std::uint8_t>(packet, 9) != udpProtocol))
+        {
+            return std::nullopt;
+        }
+
+        using AddressV4 = boost::asio::ip::address_v4;
+        const auto udp = packet.substr(headerSize);
+        datagram.source = UDP::endpoint
+        {
+            AddressV4{ readBigEndian<std::uint32_t>(packet, 12) },
+            readBigEndian<std::uint16_t>(udp, 0)
+        };
+        datagram.destination = UDP::endpoint
+        {
+            AddressV4{ readBigEndian<std::uint32_t>(packet, 16) },
+            readBigEndian<std::uint16_t>(udp, 2)
+        };
+        const auto udpLength = std::max<std::size_t>(readBigEndian<std::uint16_t>(udp, 4), udpHeaderSize);
+        datagram.payload = std::string{ udp.substr(udpHeaderSize, udpLength - udpHeaderSize) };
+        return datagram;
+    }
+}
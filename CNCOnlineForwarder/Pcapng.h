@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <boost/asio/ip/udp.hpp>
+
+namespace CNCOnlineForwarder::Capture::Pcapng
+{
+    enum class Direction
+    {
+        unknown,
+        inbound,
+        outbound,
+    };
+
+    // A UDP datagram as stored in a pcapng file
+    struct Datagram
+    {
+        std::uint64_t nanosecondsSinceEpoch;
+        Direction direction;
+        boost::asio::ip::udp::endpoint source;
+        boost::asio::ip::udp::endpoint destination;
+        std::string payload;
+    };
+
+    // Section header and a single raw IPv4 interface with nanosecond timestamps,
+    // must be written at the beginning of every file
+    std::string makeFileHeader();
+
+    // Append an Enhanced Packet Block containing the datagram wrapped in
+    // IPv4 and UDP headers. Only IPv4 endpoints are supported.
+    void appendDatagram
+    (
+        std::string& output,
+        const std::uint64_t nanosecondsSinceEpoch,
+        const Direction direction,
+        const boost::asio::ip::udp::endpoint& source,
+        const boost::asio::ip::udp::endpoint& destination,
+        const std::string_view payload
+    );
+
+    // Reads UDP over IPv4 datagrams from pcapng files, written either by
+    // this program or by tools like Wireshark on an Ethernet interface.
+    // Other packets are skipped. Throws std::runtime_error on malformed files.
+    class Reader
+    {
+    public:
+        static constexpr auto description = "PcapngReader";
+
+        explicit Reader(std::istream& input);
+
+        // Returns: the next datagram, or nullopt at the end of the file
+        std::optional<Datagram> next();
+
+    private:
+        struct Interface
+        {
+            std::uint16_t linkType;
+            // Timestamp units per second
+            std::uint64_t resolution;
+        };
+
+        bool readBlock(std::uint32_t& type, std::string& body);
+
+        void readInterface(const std::string& body);
+
+        std::optional<Datagram> readPacket(const std::string& body) const;
+
+        std::istream& input;
+        std::vector<Interface> interfaces;
+    };
+}
@@ -1,5 +1,6 @@
 #include "precompiled.h"
 #include "ProxyAddressTranslator.h"
+#include "LoadMonitor.h"
 #include "SimpleHTTPClient.h"
 #include "WeakRefHandler.hpp"
 #include "Logging.h"
@@ -29,6 +30,21 @@ namespace CNCOnlineForwarder
         return self;
     }
 
+    std::shared_ptr<ProxyAddressTranslator> ProxyAddressTranslator::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const AddressV4& fixedAddress
+    )
+    {
+        const auto self = std::make_shared<ProxyAddressTranslator>
+        (
+            PrivateConstructor{},
+            objectMaker
+        );
+        self->setPublicAddress(fixedAddress);
+        return self;
+    }
+
     ProxyAddressTranslator::ProxyAddressTranslator
     (
         PrivateConstructor,
@@ -76,21 +92,29 @@ namespace CNCOnlineForwarder
             return;
         }
 
-        log(LogLevel::info, "Will update public address now.");
-
-        const auto action = [](ProxyAddressTranslator& self, std::string newIP)
+        if (LoadMonitor::isShedding(LoadMonitor::SheddingLevel::addressRefresh))
         {
-            boost::algorithm::trim(newIP);
-            log(LogLevel::info, "Retrieved public IP address: ", newIP);
-            self.setPublicAddress(AddressV4::from_string(newIP));
-        };
-        Utility::asyncHttpGet
-        (
-            self->objectMaker,
-            "api.ipify.org",
-            "/",
-            Utility::makeWeakHandler(self, action)
-        );
+            // The current address is very likely still valid, try again next time
+            log(LogLevel::warning, "Overloaded, public address update postponed.");
+        }
+        else
+        {
+            log(LogLevel::info, "Will update public address now.");
+
+            const auto action = [](ProxyAddressTranslator& self, std::string newIP)
+            {
+                boost::algorithm::trim(newIP);
+                log(LogLevel::info, "Retrieved public IP address: ", newIP);
+                self.setPublicAddress(AddressV4::from_string(newIP));
+            };
+            Utility::asyncHttpGet
+            (
+                self->objectMaker,
+                "api.ipify.org",
+                "/",
+                Utility::makeWeakHandler(self, action)
+            );
+        }
 
         using Timer = boost::asio::steady_timer;
         const auto timer = std::make_shared<Timer>(self->objectMaker.make<Timer>());
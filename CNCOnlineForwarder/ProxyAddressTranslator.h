@@ -22,6 +22,13 @@ namespace CNCOnlineForwarder
             const IOManager::ObjectMaker& objectMaker
         );
 
+        // Always translates to fixedAddress, instead of periodically querying the public address
+        static std::shared_ptr<ProxyAddressTranslator> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const AddressV4& fixedAddress
+        );
+
         ProxyAddressTranslator
         (
             PrivateConstructor,
@@ -0,0 +1,125 @@
+#include "precompiled.h"
+#include "ReceiveBufferSizer.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace CNCOnlineForwarder::Utility
+{
+    namespace
+    {
+        std::uint32_t roundUpToPowerOfTwo(const std::uint64_t value) noexcept
+        {
+            auto result = std::uint64_t{ ReceiveBufferSizer::minimumSize };
+            while ((result < value) && (result < ReceiveBufferSizer::maximumSize))
+            {
+                result *= 2;
+            }
+            return static_cast<std::uint32_t>(result);
+        }
+
+        std::string makeName(const std::string_view role, const std::string_view suffix)
+        {
+            return "receiveSize." + std::string{ role } + std::string{ suffix };
+        }
+    }
+
+    ReceiveBufferSizer& ReceiveBufferSizer::forRole(const std::string_view role, const std::uint32_t initialSize)
+    {
+        static auto mutex = std::mutex{};
+        static auto sizers = std::map<std::string, std::unique_ptr<ReceiveBufferSizer>, std::less<>>{};
+
+        const auto lock = std::scoped_lock{ mutex };
+        if (const auto existing = sizers.find(role); existing != sizers.end())
+        {
+            return *existing->second;
+        }
+        auto sizer = std::make_unique<ReceiveBufferSizer>(role, initialSize);
+        return *sizers.emplace(std::string{ role }, std::move(sizer)).first->second;
+    }
+
+    ReceiveBufferSizer::ReceiveBufferSizer(const std::string_view role, const std::uint32_t initialSize) :
+        sizes{ Metrics::windowedHistogram(makeName(role, "")) },
+        bufferSizeGauge{ Metrics::gauge(makeName(role, ".bufferSize")) },
+        oversized{ Metrics::counter(makeName(role, ".oversized")) },
+        bufferSize{ roundUpToPowerOfTwo(initialSize) },
+        received{ 0 }
+    {
+        this->bufferSizeGauge.set(this->bufferSize.load());
+    }
+
+    std::uint32_t ReceiveBufferSizer::getBufferSize() const noexcept
+    {
+        return this->bufferSize.load(std::memory_order_relaxed);
+    }
+
+    void ReceiveBufferSizer::record(const std::size_t size) noexcept
+    {
+        this->sizes.record(size);
+
+        auto current = this->bufferSize.load(std::memory_order_relaxed);
+        if (size > current)
+        {
+            // Grow immediately, instead of waiting for the next update
+            this->oversized.add();
+            const auto grown = roundUpToPowerOfTwo(size);
+            if (this->bufferSize.compare_exchange_strong(current, grown))
+            {
+                this->bufferSizeGauge.set(grown);
+            }
+            return;
+        }
+
+        const auto count = this->received.fetch_add(1, std::memory_order_relaxed) + 1;
+        if ((count % updateInterval) != 0)
+        {
+            return;
+        }
+
+        // Shrink back once large datagrams become rare
+        const auto quantile = this->sizes.snapshot().getQuantile(coverage);
+        const auto learned = roundUpToPowerOfTwo(quantile);
+        this->bufferSize.store(learned, std::memory_order_relaxed);
+        this->bufferSizeGauge.set(learned);
+    }
+
+    boost::asio::mutable_buffer ReceiveBufferSizer::getOverflowBuffer()
+    {
+        thread_local const auto overflow = std::make_unique<char[]>(maximumSize);
+        return boost::asio::buffer(overflow.get(), maximumSize);
+    }
+
+    void ReceiveBufferSizer::merge(std::unique_ptr<char[]>& buffer, std::size_t& capacity, const std::size_t size)
+    {
+        if (size <= capacity)
+        {
+            return;
+        }
+
+        const auto overflow = getOverflowBuffer();
+        const auto overflowSize = std::min(size - capacity, overflow.size());
+        auto merged = std::make_unique<char[]>(capacity + overflowSize);
+        std::memcpy(merged.get(), buffer.get(), capacity);
+        std::memcpy(merged.get() + capacity, overflow.data(), overflowSize);
+        buffer = std::move(merged);
+        capacity += overflowSize;
+    }
+
+    void ReceiveBufferSizer::merge(BufferPool::Buffer& buffer, std::size_t& capacity, const std::size_t size)
+    {
+        if (size <= capacity)
+        {
+            return;
+        }
+
+        const auto overflow = getOverflowBuffer();
+        const auto overflowSize = std::min(size - capacity, overflow.size());
+        auto merged = BufferPool::acquire(capacity + overflowSize);
+        std::memcpy(merged.get(), buffer.get(), capacity);
+        std::memcpy(merged.get() + capacity, overflow.data(), overflowSize);
+        buffer = std::move(merged);
+        capacity += overflowSize;
+    }
+}
\ No newline at end of file
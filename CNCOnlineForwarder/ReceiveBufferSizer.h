@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <boost/asio/buffer.hpp>
+#include "BufferPool.hpp"
+#include "Metrics.h"
+
+namespace CNCOnlineForwarder::Utility
+{
+    // Learns how large the buffers posted to a kind of socket should be,
+    // from the sizes of datagrams recently received by sockets of that kind.
+    // Sizes are exported as the receiveSize.<role> histogram,
+    // and the current buffer size as the receiveSize.<role>.bufferSize gauge.
+    // Can be used from any thread.
+    class ReceiveBufferSizer
+    {
+    public:
+        static constexpr auto description = "ReceiveBufferSizer";
+
+        // Buffer sizes are powers of two between these bounds
+        static constexpr auto minimumSize = std::uint32_t{ 64 };
+        static constexpr auto maximumSize = std::uint32_t{ 64 * 1024 };
+        // Fraction of datagrams which should fit into their buffers
+        static constexpr auto coverage = 0.999;
+        // Received datagrams between updates of the buffer size
+        static constexpr auto updateInterval = std::uint32_t{ 256 };
+
+        // Returns: the sizer shared by all sockets of role,
+        // starting with initialSize if it doesn't exist yet
+        static ReceiveBufferSizer& forRole(const std::string_view role, const std::uint32_t initialSize);
+
+        ReceiveBufferSizer(const std::string_view role, const std::uint32_t initialSize);
+
+        std::uint32_t getBufferSize() const noexcept;
+
+        // Record the true size of a received datagram, which may be larger than its buffer
+        void record(const std::size_t size) noexcept;
+
+        // Space receiving the part of a datagram which doesn't fit into its buffer,
+        // large enough for any UDP datagram. Each thread has its own,
+        // so it must be consumed by merge() before the thread does anything else.
+        static boost::asio::mutable_buffer getOverflowBuffer();
+
+        // If a datagram of size bytes didn't fit into buffer, replace buffer
+        // with a new one containing the whole datagram, taking the rest from
+        // the overflow buffer, and update capacity.
+        static void merge(std::unique_ptr<char[]>& buffer, std::size_t& capacity, const std::size_t size);
+
+        static void merge(BufferPool::Buffer& buffer, std::size_t& capacity, const std::size_t size);
+
+    private:
+        Metrics::WindowedHistogram& sizes;
+        Metrics::Gauge& bufferSizeGauge;
+        Metrics::Counter& oversized;
+        std::atomic<std::uint32_t> bufferSize;
+        std::atomic<std::uint32_t> received;
+    };
+}
@@ -0,0 +1,198 @@
+#include "precompiled.h"
+#include "RelayRateLimiter.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "ReceiveBufferSizer.h"
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<RelayRateLimiter>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& droppedBySession = Metrics::counter("relayRateLimiter.droppedBySession");
+        auto& droppedBySource = Metrics::counter("relayRateLimiter.droppedBySource");
+        auto& throttledSessions = Metrics::counter("relayRateLimiter.throttledSessions");
+        auto& throttledSources = Metrics::counter("relayRateLimiter.throttledSources");
+
+        // A bucket must be able to hold at least one packet / one full sized datagram,
+        // otherwise a short burst would drop every datagram larger than it
+        constexpr auto minimumPacketBurst = 1.0;
+        constexpr auto minimumByteBurst = static_cast<double>(Utility::ReceiveBufferSizer::maximumSize);
+
+        double burstOf
+        (
+            const std::uint32_t ratePerSecond, 
+            const std::chrono::milliseconds burst, 
+            const double minimum
+        )
+        {
+            const auto tokens = ratePerSecond * std::chrono::duration<double>{ burst }.count();
+            return std::max(tokens, minimum);
+        }
+
+        Utility::TokenBucket makeBucket
+        (
+            const std::uint32_t ratePerSecond, 
+            const std::chrono::milliseconds burst, 
+            const double minimum
+        )
+        {
+            return Utility::TokenBucket{ static_cast<double>(ratePerSecond), burstOf(ratePerSecond, burst, minimum) };
+        }
+
+        // Throttled state is kept until the buckets are full again,
+        // so a flow hovering around the limit is only counted once
+        bool tryConsume
+        (
+            Utility::TokenBucket& packets,
+            Utility::TokenBucket& bytes,
+            bool& throttled,
+            Metrics::Counter& throttledCounter,
+            const std::size_t size,
+            const std::size_t packetCount,
+            const Utility::TokenBucket::Clock::time_point now
+        ) noexcept
+        {
+            packets.refill(now);
+            bytes.refill(now);
+            if (packets.isFull() && bytes.isFull())
+            {
+                throttled = false;
+            }
+
+            if (!packets.hasTokens(static_cast<double>(packetCount)) || !bytes.hasTokens(static_cast<double>(size)))
+            {
+                if (!throttled)
+                {
+                    throttled = true;
+                    throttledCounter.add();
+                }
+                return false;
+            }
+            packets.consume(static_cast<double>(packetCount));
+            bytes.consume(static_cast<double>(size));
+            return true;
+        }
+    }
+
+    std::shared_ptr<RelayRateLimiter> RelayRateLimiter::create(const RelayLimitOptions& options)
+    {
+        return std::make_shared<RelayRateLimiter>(options);
+    }
+
+    RelayRateLimiter::RelayRateLimiter(const RelayLimitOptions& options) :
+        options{ options },
+        sources{ std::make_unique<std::array<SourceSlot, sourceSlotCount>>() }
+    {
+        for (auto& slot : *this->sources)
+        {
+            slot.packets = makeBucket(options.sourcePacketsPerSecond, options.burst, minimumPacketBurst);
+            slot.bytes = makeBucket(options.sourceBytesPerSecond, options.burst, minimumByteBurst);
+        }
+    }
+
+    RelayRateLimiter::SessionLimits RelayRateLimiter::makeSessionLimits() const noexcept
+    {
+        auto limits = SessionLimits{};
+        limits.packets = makeBucket(this->options.sessionPacketsPerSecond, this->options.burst, minimumPacketBurst);
+        limits.bytes = makeBucket(this->options.sessionBytesPerSecond, this->options.burst, minimumByteBurst);
+        return limits;
+    }
+
+    bool RelayRateLimiter::allow
+    (
+        SessionLimits& session, 
+        const EndPoint& source, 
+        const std::size_t size, 
+        const std::size_t packets
+    )
+    {
+        const auto now = Clock::now();
+
+        const auto sessionAllowed = tryConsume
+        (
+            session.packets, 
+            session.bytes, 
+            session.throttled, 
+            throttledSessions, 
+            size, 
+            packets,
+            now
+        );
+        if (!sessionAllowed)
+        {
+            droppedBySession.add();
+            return false;
+        }
+
+        if (!this->allowSource(source, size, packets, now))
+        {
+            droppedBySource.add();
+            return false;
+        }
+        return true;
+    }
+
+    bool RelayRateLimiter::allowSource
+    (
+        const EndPoint& source, 
+        const std::size_t size, 
+        const std::size_t packets, 
+        const Clock::time_point now
+    )
+    {
+        if (!source.address().is_v4())
+        {
+            return true;
+        }
+
+        // Fibonacci hashing of the IPv4 address
+        const auto address = source.address().to_v4().to_uint();
+        const auto hash = static_cast<std::uint32_t>(address * 2654435769u);
+        auto& slot = (*this->sources)[hash >> 20];
+        static_assert(sourceSlotCount == (std::size_t{ 1 } << 12));
+
+        auto allowed = false;
+        auto startedThrottling = false;
+        {
+            const auto lock = std::scoped_lock{ slot.mutex };
+            if (slot.address != address)
+            {
+                slot.packets.refill(now);
+                slot.bytes.refill(now);
+                // Previous owner of the slot is idle, let the new source take it
+                if (slot.packets.isFull() && slot.bytes.isFull())
+                {
+                    slot.address = address;
+                }
+            }
+
+            const auto wasThrottled = slot.throttled;
+            allowed = tryConsume
+            (
+                slot.packets, 
+                slot.bytes, 
+                slot.throttled, 
+                throttledSources, 
+                size, 
+                packets,
+                now
+            );
+            startedThrottling = slot.throttled && !wasThrottled;
+        }
+
+        // Logged outside of the lock, so other relays hashed to this slot don't wait for it
+        if (startedThrottling)
+        {
+            logLine(LogLevel::warning, "Source ", source.address(), " exceeded its rate limit, throttling.");
+        }
+        return allowed;
+    }
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <boost/asio/ip/udp.hpp>
+#include "Options.h"
+#include "TokenBucket.hpp"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    // Limits packets and bytes per second relayed by GameConnections,
+    // both per session and per source IP address.
+    // Every check is constant time and never allocates.
+    class RelayRateLimiter
+    {
+    public:
+        using Clock = Utility::TokenBucket::Clock;
+        using EndPoint = boost::asio::ip::udp::endpoint;
+
+        // Owned by a single session, so it doesn't need any locking
+        class SessionLimits
+        {
+        public:
+            SessionLimits() = default;
+
+        private:
+            friend class RelayRateLimiter;
+
+            Utility::TokenBucket packets;
+            Utility::TokenBucket bytes;
+            bool throttled = false;
+        };
+
+        static constexpr auto description = "RelayRateLimiter";
+
+        static std::shared_ptr<RelayRateLimiter> create(const RelayLimitOptions& options);
+
+        explicit RelayRateLimiter(const RelayLimitOptions& options);
+
+        SessionLimits makeSessionLimits() const noexcept;
+
+        // Returns: whether packets of given total size from source should be relayed
+        bool allow
+        (
+            SessionLimits& session, 
+            const EndPoint& source, 
+            const std::size_t size, 
+            const std::size_t packets = 1
+        );
+
+    private:
+        // Sources are hashed into a fixed number of slots, so the table never grows.
+        // When two active sources collide they share the same slot.
+        struct SourceSlot
+        {
+            std::mutex mutex;
+            std::uint32_t address = 0;
+            Utility::TokenBucket packets;
+            Utility::TokenBucket bytes;
+            bool throttled = false;
+        };
+
+        static constexpr auto sourceSlotCount = std::size_t{ 4096 };
+
+        bool allowSource
+        (
+            const EndPoint& source, 
+            const std::size_t size, 
+            const std::size_t packets, 
+            const Clock::time_point now
+        );
+
+        RelayLimitOptions options;
+        std::unique_ptr<std::array<SourceSlot, sourceSlotCount>> sources;
+    };
+}
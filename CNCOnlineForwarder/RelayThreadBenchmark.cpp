@@ -0,0 +1,212 @@
+#include "precompiled.h"
+#include "RelayThreadBenchmark.h"
+#include <thread>
+#include "Histogram.hpp"
+#include "IOManager.hpp"
+#include "Logging.h"
+#include "SocketMessage.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/resource.h>
+#endif
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct RelayThreadBenchmark
+        {
+            static constexpr auto description = "RelayThreadBenchmark";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<RelayThreadBenchmark>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        struct Mode
+        {
+            const char* name;
+            std::size_t relayThreads;
+            bool spin;
+            std::chrono::microseconds busyPoll;
+        };
+
+        // Sends every datagram received by inbound back to its sender from outbound,
+        // with the same asynchronous operations as GameConnection
+        class EchoRelay
+        {
+        public:
+            EchoRelay(const IOManager::ObjectMaker& objectMaker, const std::chrono::microseconds busyPoll) :
+                strand{ objectMaker.makeRelayStrand() },
+                inbound{ strand, UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 0 } },
+                outbound{ strand, UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 0 } },
+                buffer{}
+            {
+                if (busyPoll.count() > 0)
+                {
+                    for (auto* socket : { &this->inbound, &this->outbound })
+                    {
+                        if (const auto code = Utility::enableBusyPoll(*socket->operator->(), busyPoll); code.failed())
+                        {
+                            logLine(LogLevel::warning, "Cannot enable busy polling: ", code);
+                        }
+                    }
+                }
+            }
+
+            UDP::endpoint getAddress() const
+            {
+                return this->inbound->local_endpoint();
+            }
+
+            void receive()
+            {
+                const auto then = [this](const ErrorCode& code, const std::size_t bytesReceived)
+                {
+                    if (code.failed())
+                    {
+                        return;
+                    }
+                    const auto reply = boost::asio::buffer(this->buffer.data(), bytesReceived);
+                    const auto sent = [this](const ErrorCode&, const std::size_t) { this->receive(); };
+                    this->outbound.asyncSendTo(reply, this->from, sent);
+                };
+                this->inbound.asyncReceiveFrom(boost::asio::buffer(this->buffer), this->from, then);
+            }
+
+        private:
+            IOManager::StrandType strand;
+            WithStrand<UDP::socket> inbound;
+            WithStrand<UDP::socket> outbound;
+            std::array<char, 2048> buffer;
+            UDP::endpoint from;
+        };
+
+#ifdef __linux__
+        std::chrono::microseconds getProcessCpuTime()
+        {
+            auto usage = ::rusage{};
+            ::getrusage(RUSAGE_SELF, &usage);
+            const auto toDuration = [](const ::timeval& time)
+            {
+                return std::chrono::seconds{ time.tv_sec } + std::chrono::microseconds{ time.tv_usec };
+            };
+            return toDuration(usage.ru_utime) + toDuration(usage.ru_stime);
+        }
+
+        bool waitReadable(UDP::socket& socket, const std::chrono::milliseconds timeout)
+        {
+            auto descriptor = ::pollfd{ socket.native_handle(), POLLIN, 0 };
+            return ::poll(&descriptor, 1, static_cast<int>(timeout.count())) > 0;
+        }
+
+        std::string run(const BenchmarkOptions& options, const RelayThreadOptions& relayThreads, const Mode& mode)
+        {
+            const auto ioManager = IOManager::create(mode.relayThreads);
+            auto relay = EchoRelay{ IOManager::ObjectMaker{ ioManager }, mode.busyPoll };
+            relay.receive();
+
+            auto threads = std::vector<std::thread>{};
+            threads.emplace_back([ioManager] { ioManager->run(); });
+            threads.emplace_back([ioManager] { ioManager->run(); });
+            for (auto i = std::size_t{ 0 }; i < mode.relayThreads; ++i)
+            {
+                const auto& cpus = relayThreads.cpus;
+                const auto cpu = cpus.empty() ? std::optional<int>{} : cpus[i % cpus.size()];
+                threads.emplace_back([ioManager, i, mode, cpu] { ioManager->runRelay(i, mode.spin, cpu); });
+            }
+
+            auto context = boost::asio::io_context{};
+            auto client = UDP::socket{ context, UDP::endpoint{ boost::asio::ip::address_v4::loopback(), 0 } };
+            client.non_blocking(true);
+            const auto relayAddress = relay.getAddress();
+            const auto payload = std::string(std::max<std::size_t>(options.packetSize, 1), 'x');
+            auto reply = std::array<char, 2048>{};
+            const auto latencies = std::make_unique<Metrics::Histogram>();
+            auto lost = std::uint64_t{ 0 };
+
+            const auto interval = std::chrono::nanoseconds{ std::chrono::seconds{ 1 } } / options.packetRate;
+            const auto cpuBefore = getProcessCpuTime();
+            const auto start = std::chrono::steady_clock::now();
+            auto next = start;
+            while (next - start < options.duration)
+            {
+                std::this_thread::sleep_until(next);
+                next += interval;
+
+                auto code = ErrorCode{};
+                const auto sentAt = std::chrono::steady_clock::now();
+                client.send_to(boost::asio::buffer(payload), relayAddress, 0, code);
+                if (code.failed() || !waitReadable(client, std::chrono::milliseconds{ 100 }))
+                {
+                    ++lost;
+                    continue;
+                }
+                auto from = UDP::endpoint{};
+                client.receive_from(boost::asio::buffer(reply), from, 0, code);
+                const auto latency = std::chrono::steady_clock::now() - sentAt;
+                latencies->record(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+            }
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            const auto cpuUsed = getProcessCpuTime() - cpuBefore;
+
+            ioManager->stop();
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            const auto snapshot = latencies->snapshot();
+            const auto toMicroseconds = [](const std::uint64_t nanoseconds) { return nanoseconds / 1000.0; };
+            const auto cores = std::chrono::duration<double>{ cpuUsed } / std::chrono::duration<double>{ elapsed };
+            auto summary = std::ostringstream{};
+            summary << mode.name << ": " << snapshot.getCount() << " round trips, " << lost << " lost, "
+                << "latency p50 " << toMicroseconds(snapshot.getQuantile(0.5)) << "us"
+                << " p99 " << toMicroseconds(snapshot.getQuantile(0.99)) << "us"
+                << " p99.9 " << toMicroseconds(snapshot.getQuantile(0.999)) << "us"
+                << " max " << toMicroseconds(snapshot.getMax()) << "us, "
+                << "process CPU " << cores << " cores, "
+                << (snapshot.getCount() > 0 ? cpuUsed.count() / static_cast<double>(snapshot.getCount()) : 0.0)
+                << "us per round trip";
+            return summary.str();
+        }
+#endif
+    }
+
+#ifdef __linux__
+    void runRelayThreadBenchmark(const BenchmarkOptions& options, const RelayThreadOptions& relayThreads)
+    {
+        logLine
+        (
+            LogLevel::info,
+            "Echoing ", options.packetRate, " datagrams of ", options.packetSize,
+            " bytes per second for ", options.duration.count(), "s in each relay thread mode"
+        );
+        const Mode modes[] =
+        {
+            { "Shared threads", 0, false, std::chrono::microseconds{ 0 } },
+            { "Relay thread", 1, false, std::chrono::microseconds{ 0 } },
+            { "Spinning relay thread", 1, true, std::chrono::microseconds{ 0 } },
+            { "Spinning relay thread with SO_BUSY_POLL", 1, true, std::chrono::microseconds{ 50 } },
+        };
+        for (const auto& mode : modes)
+        {
+            const auto summary = run(options, relayThreads, mode);
+            logLine(LogLevel::info, summary);
+            std::cout << summary << std::endl;
+        }
+    }
+#else
+    void runRelayThreadBenchmark(const BenchmarkOptions&, const RelayThreadOptions&)
+    {
+        throw std::runtime_error{ "The relay thread benchmark is only supported on Linux" };
+    }
+#endif
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Echoes datagrams through a relay running on the shared threads, on a relay thread,
+    // on a spinning relay thread, and on a spinning relay thread with SO_BUSY_POLL sockets,
+    // and reports the round trip latency and the CPU usage of each mode.
+    // Relay threads are pinned to relayThreads.cpus if any. Blocking.
+    void runRelayThreadBenchmark(const BenchmarkOptions& options, const RelayThreadOptions& relayThreads);
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    struct RoundTripStatistics
+    {
+        std::chrono::microseconds smoothed;
+        std::chrono::microseconds jitter;
+        std::uint32_t samples;
+    };
+
+    inline std::ostream& operator<<(std::ostream& out, const RoundTripStatistics& statistics)
+    {
+        if (statistics.samples == 0)
+        {
+            return out << "n/a";
+        }
+        return out 
+            << statistics.smoothed.count() << "us +- " 
+            << statistics.jitter.count() << "us (" 
+            << statistics.samples << " samples)";
+    }
+
+    // Round trip between the relay and each of the two players of a GameConnection
+    struct RelayRoundTrip
+    {
+        RoundTripStatistics client;
+        RoundTripStatistics remote;
+    };
+
+    inline std::ostream& operator<<(std::ostream& out, const RelayRoundTrip& roundTrip)
+    {
+        return out << "client " << roundTrip.client << ", remote " << roundTrip.remote;
+    }
+
+    // Passively estimates round trip time between the relay and one player:
+    // a probe is started when a packet is relayed to the player,
+    // and completed by the next packet received from that player.
+    // Smoothing follows RFC 6298 (SRTT / RTTVAR).
+    class RoundTripEstimator
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        // Responses arriving later than this are not considered as replies
+        static constexpr auto maxSample = std::chrono::seconds{ 2 };
+
+        // Start a probe, unless there's already one outstanding.
+        // If restart is true, any outstanding probe is replaced,
+        // which is used for exact request / reply pairs like connectPing.
+        void startProbe(const Clock::time_point now, const bool restart = false) noexcept
+        {
+            if (restart || !this->probeStarted.has_value())
+            {
+                this->probeStarted = now;
+            }
+        }
+
+        // Returns: the new sample if there was an outstanding probe
+        std::optional<std::chrono::microseconds> completeProbe(const Clock::time_point now) noexcept
+        {
+            if (!this->probeStarted.has_value())
+            {
+                return std::nullopt;
+            }
+
+            const auto elapsed = now - this->probeStarted.value();
+            this->probeStarted.reset();
+            if (elapsed > maxSample)
+            {
+                return std::nullopt;
+            }
+
+            const auto sample = std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+            this->addSample(sample);
+            return sample;
+        }
+
+        RoundTripStatistics getStatistics() const noexcept
+        {
+            return RoundTripStatistics
+            {
+                std::chrono::microseconds{ this->smoothed },
+                std::chrono::microseconds{ this->variation },
+                this->samples
+            };
+        }
+
+    private:
+        void addSample(const std::chrono::microseconds sample) noexcept
+        {
+            const auto value = static_cast<std::int32_t>(sample.count());
+            if (this->samples == 0)
+            {
+                this->smoothed = value;
+                this->variation = value / 2;
+            }
+            else
+            {
+                const auto difference = (this->smoothed > value) ? (this->smoothed - value) : (value - this->smoothed);
+                this->variation = this->variation - this->variation / 4 + difference / 4;
+                this->smoothed = this->smoothed - this->smoothed / 8 + value / 8;
+            }
+            ++this->samples;
+        }
+
+        std::optional<Clock::time_point> probeStarted;
+        std::int32_t smoothed = 0;
+        std::int32_t variation = 0;
+        std::uint32_t samples = 0;
+    };
+}
@@ -0,0 +1,180 @@
+#include "precompiled.h"
+#include "SchedulerBenchmark.h"
+#include <thread>
+#include "Histogram.hpp"
+#include "IOManager.hpp"
+#include "Logging.h"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct SchedulerBenchmark
+        {
+            static constexpr auto description = "SchedulerBenchmark";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<SchedulerBenchmark>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        // Roughly one NatNeg session per strand
+        constexpr auto strandCount = std::size_t{ 256 };
+        // Cross-strand calls in flight at any time
+        constexpr auto tokenCount = std::size_t{ 1024 };
+        // Simulated work of each handler
+        constexpr auto handlerWork = std::chrono::nanoseconds{ 500 };
+
+        struct ContextSwitches
+        {
+            std::uint64_t voluntary;
+            std::uint64_t involuntary;
+        };
+
+        ContextSwitches getContextSwitches()
+        {
+#ifdef __linux__
+            auto usage = ::rusage{};
+            ::getrusage(RUSAGE_SELF, &usage);
+            return ContextSwitches
+            {
+                static_cast<std::uint64_t>(usage.ru_nvcsw),
+                static_cast<std::uint64_t>(usage.ru_nivcsw)
+            };
+#else
+            return ContextSwitches{ 0, 0 };
+#endif
+        }
+
+        class Ring
+        {
+        public:
+            Ring(const std::shared_ptr<IOManager>& ioManager) :
+                handled{ 0 },
+                running{ true }
+            {
+                const auto objectMaker = IOManager::ObjectMaker{ ioManager };
+                for (auto i = std::size_t{ 0 }; i < strandCount; ++i)
+                {
+                    this->strands.push_back(objectMaker.makeStrand());
+                }
+            }
+
+            void start()
+            {
+                for (auto i = std::size_t{ 0 }; i < tokenCount; ++i)
+                {
+                    // Tokens start on different strands, and hop with different strides
+                    this->pass(i % strandCount, 1 + (i % 7));
+                }
+            }
+
+            void stop()
+            {
+                this->running.store(false, std::memory_order_relaxed);
+            }
+
+            std::uint64_t getHandled() const noexcept
+            {
+                return this->handled.load(std::memory_order_relaxed);
+            }
+
+            const Metrics::Histogram& getDelays() const noexcept
+            {
+                return this->delays;
+            }
+
+        private:
+            void pass(const std::size_t to, const std::size_t stride)
+            {
+                const auto postedAt = std::chrono::steady_clock::now();
+                boost::asio::defer(this->strands[to], [this, to, stride, postedAt]
+                {
+                    const auto now = std::chrono::steady_clock::now();
+                    const auto delay = std::chrono::duration_cast<std::chrono::nanoseconds>(now - postedAt);
+                    this->delays.record(delay.count());
+                    while (std::chrono::steady_clock::now() - now < handlerWork)
+                    {
+                    }
+                    this->handled.fetch_add(1, std::memory_order_relaxed);
+                    if (this->running.load(std::memory_order_relaxed))
+                    {
+                        this->pass((to + stride) % strandCount, stride);
+                    }
+                });
+            }
+
+            std::vector<IOManager::StrandType> strands;
+            Metrics::Histogram delays;
+            std::atomic<std::uint64_t> handled;
+            std::atomic<bool> running;
+        };
+
+        std::string run(const BenchmarkOptions& options, const ExecutorOptions& executor, const char* name)
+        {
+            const auto ioManager = IOManager::create(0, executor);
+            const auto ring = std::make_unique<Ring>(ioManager);
+            ring->start();
+
+            const auto switchesBefore = getContextSwitches();
+            const auto start = std::chrono::steady_clock::now();
+            auto threads = std::vector<std::thread>{};
+            for (auto i = std::size_t{ 0 }; i < ioManager->getWorkerCount(); ++i)
+            {
+                threads.emplace_back([ioManager, i] { ioManager->runWorker(i); });
+            }
+
+            std::this_thread::sleep_for(options.duration);
+            const auto handled = ring->getHandled();
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            const auto switchesAfter = getContextSwitches();
+            const auto steals = ioManager->getStealCount();
+            ring->stop();
+            ioManager->stop();
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            const auto snapshot = ring->getDelays().snapshot();
+            const auto seconds = std::chrono::duration<double>{ elapsed }.count();
+            const auto toMicroseconds = [](const std::uint64_t nanoseconds) { return nanoseconds / 1000.0; };
+            auto summary = std::ostringstream{};
+            summary << name << " (" << ioManager->getWorkerCount() << " threads): "
+                << static_cast<std::uint64_t>(handled / seconds) << " handlers/s, "
+                << "queueing delay p50 " << toMicroseconds(snapshot.getQuantile(0.5)) << "us"
+                << " p99 " << toMicroseconds(snapshot.getQuantile(0.99)) << "us"
+                << " max " << toMicroseconds(snapshot.getMax()) << "us, "
+                << steals << " steals, "
+                << (switchesAfter.voluntary - switchesBefore.voluntary) << " voluntary and "
+                << (switchesAfter.involuntary - switchesBefore.involuntary) << " involuntary context switches";
+            return summary.str();
+        }
+    }
+
+    void runSchedulerBenchmark(const BenchmarkOptions& options, const ExecutorOptions& executor)
+    {
+        logLine
+        (
+            LogLevel::info,
+            "Passing ", tokenCount, " tokens around ", strandCount, " strands for ", 
+            options.duration.count(), "s with each executor"
+        );
+        const auto shared = ExecutorOptions{ ExecutorOptions::Type::shared, executor.threads };
+        const auto workStealing = ExecutorOptions{ ExecutorOptions::Type::workStealing, executor.threads };
+        for (const auto& [mode, name] : { std::pair{ shared, "Shared" }, std::pair{ workStealing, "Work stealing" } })
+        {
+            const auto summary = run(options, mode, name);
+            logLine(LogLevel::info, summary);
+            std::cout << summary << std::endl;
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Passes tokens around a ring of strands with boost::asio::defer(), like the
+    // cross-strand calls between NatNegProxy and GameConnections, once with the shared
+    // io_context and once with the work stealing executor, and reports the handler
+    // throughput, the queueing delay, the steals and the context switches of each.
+    // Both use executor.threads threads. Blocking.
+    void runSchedulerBenchmark(const BenchmarkOptions& options, const ExecutorOptions& executor);
+}
@@ -0,0 +1,460 @@
+#include "precompiled.h"
+#include "SelfProbe.h"
+#include <cstring>
+#include <boost/endian/conversion.hpp>
+#include "Logging.h"
+#include "Metrics.h"
+#include "NatNegProxy.h"
+#include "SimpleWriteHandler.hpp"
+#include "WeakRefHandler.hpp"
+
+using UDP = boost::asio::ip::udp;
+using AddressV4 = boost::asio::ip::address_v4;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+using WriteHandler = CNCOnlineForwarder::Utility::SimpleWriteHandler<CNCOnlineForwarder::NatNeg::SelfProbe>;
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    namespace
+    {
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<SelfProbe>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        auto& succeeded = Metrics::counter("selfProbe.succeeded");
+        auto& failed = Metrics::counter("selfProbe.failed");
+        auto& readiness = Metrics::gauge("selfProbe.ready");
+        auto& setupTimes = Metrics::windowedHistogram("selfProbe.setupTime");
+        auto& relayRoundTrips = Metrics::windowedHistogram("selfProbe.relayRoundTrip");
+
+        constexpr auto natNegMagic = std::string_view{ "\xFD\xFC\x1E\x66\x6A\xB2" };
+        constexpr auto natNegVersion = char{ 3 };
+        constexpr auto stepOffset = std::size_t{ 7 };
+        constexpr auto sequenceNumberOffset = std::size_t{ 12 };
+        constexpr auto playerIDOffset = std::size_t{ 13 };
+        constexpr auto initSize = std::size_t{ 18 };
+        // Address and port of the other player in connect packets
+        constexpr auto connectAddressOffset = std::size_t{ 12 };
+        constexpr auto connectSize = std::size_t{ 20 };
+        // Relayed game datagrams: magic, then the round of the probe
+        constexpr auto gameMagic = std::string_view{ "CNCP" };
+        // The first probe runs soon after starting, so readiness is known early
+        constexpr auto firstProbeDelay = std::chrono::seconds{ 1 };
+        constexpr auto drainCheckInterval = std::chrono::seconds{ 1 };
+
+        std::string makeInit(const NatNegID natNegID, const std::uint8_t playerID, const std::uint8_t sequenceNumber)
+        {
+            auto packet = std::string{ natNegMagic };
+            packet.push_back(natNegVersion);
+            packet.push_back(static_cast<char>(NatNegStep::init));
+            packet.append(reinterpret_cast<const char*>(&natNegID), sizeof(natNegID));
+            packet.push_back(static_cast<char>(sequenceNumber));
+            packet.push_back(static_cast<char>(playerID));
+            packet.append(initSize - packet.size(), '\0');
+            return packet;
+        }
+
+        std::string makeConnect(const std::string_view init, const SelfProbe::EndPoint& peer)
+        {
+            auto packet = std::string{ init.substr(0, stepOffset) };
+            packet.push_back(static_cast<char>(NatNegStep::connect));
+            packet.append(init.substr(stepOffset + 1, sizeof(NatNegID)));
+            const auto address = boost::endian::native_to_big(peer.address().to_v4().to_uint());
+            const auto port = boost::endian::native_to_big(peer.port());
+            packet.append(reinterpret_cast<const char*>(&address), sizeof(address));
+            packet.append(reinterpret_cast<const char*>(&port), sizeof(port));
+            packet.append(connectSize - packet.size(), '\0');
+            return packet;
+        }
+
+        std::string makeGamePacket(const std::uint32_t round)
+        {
+            auto packet = std::string{ gameMagic };
+            packet.append(reinterpret_cast<const char*>(&round), sizeof(round));
+            return packet;
+        }
+
+        std::uint64_t toNanoseconds(const SelfProbe::Clock::duration duration)
+        {
+            const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+            return static_cast<std::uint64_t>(std::max<decltype(nanoseconds)>(nanoseconds, 0));
+        }
+
+        void openOnLoopback(SelfProbe::Socket& socket)
+        {
+            socket->open(UDP::v4());
+            socket->bind(SelfProbe::EndPoint{ AddressV4::loopback(), 0 });
+        }
+    }
+
+    std::shared_ptr<SelfProbe> SelfProbe::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const SelfProbeOptions& options
+    )
+    {
+        const auto self = std::make_shared<SelfProbe>(PrivateConstructor{}, objectMaker, proxy, options);
+
+        const auto action = [](SelfProbe& self)
+        {
+            logLine
+            (
+                LogLevel::info,
+                "Probing ", self.proxyEndPoint, " every ", self.options.interval.count(),
+                "s, mock upstream on ", self.upstreamSocket->local_endpoint()
+            );
+            self.receiveUpstream();
+            for (auto i = std::size_t{ 0 }; i < self.players.size(); ++i)
+            {
+                self.receiveNatNeg(i);
+                self.receiveGame(i);
+            }
+            self.prepareForNextProbe(firstProbeDelay);
+            self.prepareForNextDrainCheck();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    SelfProbe::SelfProbe
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const std::weak_ptr<NatNegProxy>& proxy,
+        const SelfProbeOptions& options
+    ) :
+        strand{ objectMaker.makeStrand() },
+        probeTimer{ strand },
+        timeoutTimer{ strand },
+        drainCheckTimer{ strand },
+        upstreamSocket{ strand },
+        players{ { Player{ strand }, Player{ strand } } },
+        proxy{ proxy },
+        options{ options },
+        round{ 0 },
+        running{ false },
+        ready{ false },
+        natNegID{ 0 },
+        random{ std::random_device{}() }
+    {
+        Profiling::nameStrand(&this->strand, description);
+        openOnLoopback(this->upstreamSocket);
+        for (auto& player : this->players)
+        {
+            openOnLoopback(player.gameSocket);
+            openOnLoopback(player.communicationSocket);
+        }
+
+        if (const auto locked = proxy.lock(); locked)
+        {
+            this->proxyEndPoint = EndPoint{ AddressV4::loopback(), locked->getLocalEndPoint().port() };
+        }
+    }
+
+    void SelfProbe::prepareForNextProbe(const Clock::duration delay)
+    {
+        const auto action = [](SelfProbe& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+            self.startProbe();
+        };
+
+        this->probeTimer.asyncWait(delay, boost::asio::bind_executor(this->strand, makeWeakHandler(this, action)));
+    }
+
+    void SelfProbe::prepareForNextDrainCheck()
+    {
+        const auto action = [](SelfProbe& self, const ErrorCode& code)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async wait failed: ", code);
+            }
+
+            const auto proxy = self.proxy.lock();
+            if (self.ready && (!proxy || proxy->isDraining()))
+            {
+                logLine(LogLevel::info, "Proxy is draining, not ready.");
+                self.ready = false;
+                readiness.set(0);
+            }
+            self.prepareForNextDrainCheck();
+        };
+
+        this->drainCheckTimer.asyncWait
+        (
+            drainCheckInterval,
+            boost::asio::bind_executor(this->strand, makeWeakHandler(this, action))
+        );
+    }
+
+    void SelfProbe::startProbe()
+    {
+        ++this->round;
+        this->running = true;
+        this->natNegID = static_cast<NatNegID>(this->random());
+        this->startedAt = Clock::now();
+        this->upstreamPlayers = {};
+
+        const auto proxy = this->proxy.lock();
+        if (!proxy || proxy->isDraining())
+        {
+            // New sessions are rejected anyway, load balancers should stop sending players now
+            this->finishProbe(false, proxy ? "proxy is draining" : "proxy is gone");
+            return;
+        }
+        proxy->registerProbe(this->natNegID, this->upstreamSocket->local_endpoint());
+
+        for (auto i = std::size_t{ 0 }; i < this->players.size(); ++i)
+        {
+            auto& player = this->players[i];
+            player.target.reset();
+            const auto playerID = static_cast<std::uint8_t>(i);
+            this->send(player.gameSocket, makeInit(this->natNegID, playerID, 0), this->proxyEndPoint);
+            this->send(player.communicationSocket, makeInit(this->natNegID, playerID, 1), this->proxyEndPoint);
+        }
+
+        const auto action = [round = this->round](SelfProbe& self, const ErrorCode& code)
+        {
+            if ((code == boost::asio::error::operation_aborted) || !self.running || (self.round != round))
+            {
+                return;
+            }
+
+            const auto connected = self.players[0].target.has_value() && self.players[1].target.has_value();
+            self.finishProbe(false, connected ? "relayed datagram never came back" : "no connect packet received");
+        };
+        this->timeoutTimer.asyncWait
+        (
+            this->options.timeout,
+            boost::asio::bind_executor(this->strand, makeWeakHandler(this, action))
+        );
+    }
+
+    void SelfProbe::finishProbe(const bool hasSucceeded, const std::string_view reason)
+    {
+        this->running = false;
+        this->timeoutTimer->cancel();
+        (hasSucceeded ? succeeded : failed).add();
+        if (!hasSucceeded)
+        {
+            logLine(LogLevel::warning, "Probe of NatNegID ", this->natNegID, " failed: ", reason);
+        }
+        else if (!this->ready)
+        {
+            logLine(LogLevel::info, "Probe succeeded, ready.");
+        }
+        this->ready = hasSucceeded;
+        readiness.set(hasSucceeded ? 1 : 0);
+        this->prepareForNextProbe(this->options.interval);
+    }
+
+    void SelfProbe::receiveNatNeg(const std::size_t playerIndex)
+    {
+        const auto action = [playerIndex](SelfProbe& self, const ErrorCode& code, const std::size_t bytesReceived)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async receive failed: ", code);
+            }
+            else
+            {
+                const auto& buffer = self.players[playerIndex].buffer;
+                self.handleNatNeg(playerIndex, NatNegPacketView{ { buffer.data(), bytesReceived } });
+            }
+            self.receiveNatNeg(playerIndex);
+        };
+
+        auto& player = this->players[playerIndex];
+        player.communicationSocket.asyncReceiveFrom
+        (
+            boost::asio::buffer(player.buffer),
+            player.from,
+            makeWeakHandler(this, action)
+        );
+    }
+
+    void SelfProbe::handleNatNeg(const std::size_t playerIndex, const NatNegPacketView packet)
+    {
+        if (!this->running || !packet.isNatNeg() || (packet.getStep() != NatNegStep::connect))
+        {
+            // Init acks aren't needed by the probe
+            return;
+        }
+        if ((packet.natNegPacket.size() < connectSize) || (packet.getNatNegID() != this->natNegID))
+        {
+            return;
+        }
+
+        auto& player = this->players[playerIndex];
+        if (player.target.has_value())
+        {
+            return;
+        }
+
+        // The address is the public one of the proxy, but relay sockets listen on every interface
+        auto port = std::uint16_t{};
+        std::memcpy(&port, packet.natNegPacket.data() + connectAddressOffset + sizeof(std::uint32_t), sizeof(port));
+        player.target = EndPoint{ AddressV4::loopback(), boost::endian::big_to_native(port) };
+
+        if (!this->players[0].target.has_value() || !this->players[1].target.has_value())
+        {
+            return;
+        }
+
+        // Both clients know where to send their game traffic, handshake is done
+        this->relayStartedAt = Clock::now();
+        setupTimes.record(toNanoseconds(this->relayStartedAt - this->startedAt));
+        this->send(this->players[0].gameSocket, makeGamePacket(this->round), this->players[0].target.value());
+    }
+
+    void SelfProbe::receiveGame(const std::size_t playerIndex)
+    {
+        const auto action = [playerIndex](SelfProbe& self, const ErrorCode& code, const std::size_t bytesReceived)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async receive failed: ", code);
+            }
+            else
+            {
+                const auto& buffer = self.players[playerIndex].gameBuffer;
+                self.handleGame(playerIndex, { buffer.data(), bytesReceived });
+            }
+            self.receiveGame(playerIndex);
+        };
+
+        auto& player = this->players[playerIndex];
+        player.gameSocket.asyncReceiveFrom
+        (
+            boost::asio::buffer(player.gameBuffer),
+            player.gameFrom,
+            makeWeakHandler(this, action)
+        );
+    }
+
+    void SelfProbe::handleGame(const std::size_t playerIndex, const std::string_view data)
+    {
+        if (!this->running || (data != makeGamePacket(this->round)))
+        {
+            return;
+        }
+
+        if (playerIndex == 1)
+        {
+            // Second player echoes the datagram back through the relay
+            auto& player = this->players[1];
+            if (player.target.has_value())
+            {
+                this->send(player.gameSocket, std::string{ data }, player.target.value());
+            }
+            return;
+        }
+
+        relayRoundTrips.record(toNanoseconds(Clock::now() - this->relayStartedAt));
+        this->finishProbe(true, {});
+    }
+
+    void SelfProbe::receiveUpstream()
+    {
+        const auto action = [](SelfProbe& self, const ErrorCode& code, const std::size_t bytesReceived)
+        {
+            if (code == boost::asio::error::operation_aborted)
+            {
+                return;
+            }
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async receive failed: ", code);
+            }
+            else
+            {
+                const auto packet = NatNegPacketView{ { self.upstreamBuffer.data(), bytesReceived } };
+                self.handleUpstream(packet, self.upstreamFrom);
+            }
+            self.receiveUpstream();
+        };
+
+        this->upstreamSocket.asyncReceiveFrom
+        (
+            boost::asio::buffer(this->upstreamBuffer),
+            this->upstreamFrom,
+            makeWeakHandler(this, action)
+        );
+    }
+
+    void SelfProbe::handleUpstream(const NatNegPacketView packet, const EndPoint& from)
+    {
+        const auto& data = packet.natNegPacket;
+        if (!packet.isNatNeg() || (data.size() < initSize) || (packet.getStep() != NatNegStep::init))
+        {
+            return;
+        }
+
+        auto ack = std::string{ data };
+        ack[stepOffset] = static_cast<char>(NatNegStep::initAck);
+        this->send(this->upstreamSocket, std::move(ack), from);
+
+        const auto sequenceNumber = static_cast<std::size_t>(data[sequenceNumberOffset]);
+        const auto playerID = static_cast<std::size_t>(data[playerIDOffset]);
+        if ((packet.getNatNegID() != this->natNegID) || (sequenceNumber > 1) || (playerID > 1))
+        {
+            return;
+        }
+        this->upstreamPlayers[playerID][sequenceNumber] = from;
+
+        for (const auto& player : this->upstreamPlayers)
+        {
+            if (!player[0].has_value() || !player[1].has_value())
+            {
+                return;
+            }
+        }
+
+        // Like the real server: sent to the NatNeg address of a player,
+        // with the game address of the other one
+        for (auto i = std::size_t{ 0 }; i < this->upstreamPlayers.size(); ++i)
+        {
+            const auto& player = this->upstreamPlayers[i];
+            const auto& peer = this->upstreamPlayers[1 - i];
+            this->send(this->upstreamSocket, makeConnect(data, peer[0].value()), player[1].value());
+        }
+    }
+
+    void SelfProbe::send(Socket& socket, std::string data, const EndPoint& to)
+    {
+        auto handler = WriteHandler{ std::move(data) };
+        const auto buffer = handler.getData();
+        socket.asyncSendTo(buffer, to, std::move(handler));
+    }
+}
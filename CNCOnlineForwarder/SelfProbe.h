@@ -0,0 +1,122 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "IOManager.hpp"
+#include "NatNegPacket.hpp"
+#include "Options.h"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    class NatNegProxy;
+
+    // Periodically runs a whole NatNeg handshake on loopback, as two fake clients
+    // talking to the real NatNegProxy, whose upstream server is a built-in mock
+    // for the NatNegID of the probe, then relays a datagram between them.
+    // Probes are real sessions, so stalls of the event loop, a dead proxy socket
+    // or shed sessions show up as slow or failed probes.
+    // Setup times and relay round trips are recorded as selfProbe.* metrics,
+    // and selfProbe.ready is 1 while the last probe succeeded and the proxy isn't draining.
+    class SelfProbe : public std::enable_shared_from_this<SelfProbe>
+    {
+    private:
+        struct PrivateConstructor{};
+    public:
+        using Strand = IOManager::StrandType;
+        using EndPoint = boost::asio::ip::udp::endpoint;
+        using Socket = WithStrand<boost::asio::ip::udp::socket>;
+        using Timer = WithStrand<boost::asio::steady_timer>;
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr auto description = "SelfProbe";
+
+        static std::shared_ptr<SelfProbe> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<NatNegProxy>& proxy,
+            const SelfProbeOptions& options
+        );
+
+        SelfProbe
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const std::weak_ptr<NatNegProxy>& proxy,
+            const SelfProbeOptions& options
+        );
+
+    private:
+        // A fake client, sending NatNeg packets from communicationSocket
+        // and game traffic from gameSocket, like the game does
+        struct Player
+        {
+            explicit Player(Strand& strand) :
+                gameSocket{ strand },
+                communicationSocket{ strand }
+            {}
+
+            Socket gameSocket;
+            Socket communicationSocket;
+            // Relay address received in the connect packet
+            std::optional<EndPoint> target;
+            std::array<char, 256> buffer;
+            EndPoint from;
+            std::array<char, 256> gameBuffer;
+            EndPoint gameFrom;
+        };
+
+        void prepareForNextProbe(const Clock::duration delay);
+
+        void startProbe();
+
+        // Draining may start long before the next probe, so it's checked more often
+        void prepareForNextDrainCheck();
+
+        void finishProbe(const bool succeeded, const std::string_view reason);
+
+        void receiveNatNeg(const std::size_t playerIndex);
+
+        void handleNatNeg(const std::size_t playerIndex, const NatNegPacketView packet);
+
+        void receiveGame(const std::size_t playerIndex);
+
+        void handleGame(const std::size_t playerIndex, const std::string_view data);
+
+        void receiveUpstream();
+
+        // The mock upstream server: acknowledges inits, and sends connect packets
+        // once both players of the current NatNegID sent both of their inits
+        void handleUpstream(const NatNegPacketView packet, const EndPoint& from);
+
+        void send(Socket& socket, std::string data, const EndPoint& to);
+
+        Strand strand;
+        Timer probeTimer;
+        Timer timeoutTimer;
+        Timer drainCheckTimer;
+        Socket upstreamSocket;
+        std::array<Player, 2> players;
+        std::array<char, 256> upstreamBuffer;
+        EndPoint upstreamFrom;
+        std::weak_ptr<NatNegProxy> proxy;
+        EndPoint proxyEndPoint;
+        SelfProbeOptions options;
+        // Incremented by every probe, so late packets of older ones are ignored
+        std::uint32_t round;
+        bool running;
+        bool ready;
+        NatNegID natNegID;
+        std::mt19937 random;
+        Clock::time_point startedAt;
+        Clock::time_point relayStartedAt;
+        // Endpoints of [player][sequence number] inits seen by the mock upstream
+        std::array<std::array<std::optional<EndPoint>, 2>, 2> upstreamPlayers;
+    };
+}
@@ -0,0 +1,128 @@
+#include "precompiled.h"
+#include "SessionBudget.h"
+#include <limits>
+#include "Logging.h"
+#include "Metrics.h"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<SessionBudget>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& liveSessions = Metrics::gauge("sessionBudget.sessions");
+        auto& sessionMemory = Metrics::gauge("sessionBudget.memoryBytes");
+        auto& rejectedSessions = Metrics::counter("sessionBudget.rejected");
+
+        std::size_t getAutomaticSessionLimit()
+        {
+#ifdef __linux__
+            auto limit = ::rlimit{};
+            if ((::getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur != RLIM_INFINITY))
+            {
+                const auto available = static_cast<std::size_t>(limit.rlim_cur);
+                if (available <= SessionBudget::reservedFileDescriptors)
+                {
+                    return 1;
+                }
+                return (available - SessionBudget::reservedFileDescriptors) / SessionBudget::socketsPerSession;
+            }
+#endif
+            return std::numeric_limits<std::size_t>::max();
+        }
+    }
+
+    SessionBudget::Ticket::Ticket(const std::shared_ptr<SessionBudget>& budget) :
+        budget{ budget },
+        bytes{ 0 }
+    {
+        this->budget->sessions.fetch_add(1, std::memory_order_relaxed);
+        liveSessions.add();
+    }
+
+    SessionBudget::Ticket::~Ticket()
+    {
+        this->refund(this->bytes.load(std::memory_order_relaxed));
+        this->budget->sessions.fetch_sub(1, std::memory_order_relaxed);
+        liveSessions.subtract();
+    }
+
+    void SessionBudget::Ticket::charge(const std::size_t bytes) noexcept
+    {
+        this->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        this->budget->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        sessionMemory.add(static_cast<std::int64_t>(bytes));
+    }
+
+    void SessionBudget::Ticket::refund(const std::size_t bytes) noexcept
+    {
+        this->bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        this->budget->bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        sessionMemory.subtract(static_cast<std::int64_t>(bytes));
+    }
+
+    std::size_t SessionBudget::Ticket::getBytes() const noexcept
+    {
+        return this->bytes.load(std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<SessionBudget> SessionBudget::create(const SessionBudgetOptions& options)
+    {
+        return std::make_shared<SessionBudget>(PrivateConstructor{}, options);
+    }
+
+    SessionBudget::SessionBudget(PrivateConstructor, const SessionBudgetOptions& options) :
+        maxSessions{ (options.maxSessions > 0) ? options.maxSessions : getAutomaticSessionLimit() },
+        maxBytes{ (options.maxMemory > 0) ? options.maxMemory : std::numeric_limits<std::uint64_t>::max() },
+        sessions{ 0 },
+        bytes{ 0 },
+        exhausted{ false }
+    {
+        logLine(LogLevel::info, "At most ", this->maxSessions, " sessions, ", this->maxBytes, " bytes");
+    }
+
+    std::shared_ptr<SessionBudget::Ticket> SessionBudget::tryAdmit()
+    {
+        if (this->isExhausted())
+        {
+            rejectedSessions.add();
+            if (!this->exhausted.exchange(true))
+            {
+                logLine
+                (
+                    LogLevel::warning, 
+                    "Budget exhausted, rejecting new sessions: ", 
+                    this->sessions.load(), " sessions, ", this->bytes.load(), " bytes"
+                );
+            }
+            return nullptr;
+        }
+
+        if (this->exhausted.exchange(false))
+        {
+            logLine(LogLevel::info, "Budget available again, accepting new sessions");
+        }
+        return this->admit();
+    }
+
+    std::shared_ptr<SessionBudget::Ticket> SessionBudget::admit()
+    {
+        return std::make_shared<Ticket>(this->shared_from_this());
+    }
+
+    bool SessionBudget::isExhausted() const noexcept
+    {
+        return (this->sessions.load(std::memory_order_relaxed) >= this->maxSessions) ||
+            (this->bytes.load(std::memory_order_relaxed) >= this->maxBytes);
+    }
+}
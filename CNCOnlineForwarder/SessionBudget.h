@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "Options.h"
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    // Limits the number of NatNeg sessions and the memory they use,
+    // so new NatNegPlayerIDs are rejected before running out of memory
+    // or file descriptors. Can be used from any thread.
+    class SessionBudget : public std::enable_shared_from_this<SessionBudget>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        // Shared by InitialPhase and GameConnection of the same session,
+        // the session ends when the last of them is destroyed.
+        class Ticket
+        {
+        public:
+            explicit Ticket(const std::shared_ptr<SessionBudget>& budget);
+
+            Ticket(const Ticket&) = delete;
+            Ticket& operator=(const Ticket&) = delete;
+            ~Ticket();
+
+            // Account memory used by an object of this session
+            void charge(const std::size_t bytes) noexcept;
+
+            void refund(const std::size_t bytes) noexcept;
+
+            std::size_t getBytes() const noexcept;
+
+        private:
+            std::shared_ptr<SessionBudget> budget;
+            std::atomic<std::size_t> bytes;
+        };
+
+        static constexpr auto description = "SessionBudget";
+
+        // Sockets used by a session: InitialPhase's one and GameConnection's two
+        static constexpr auto socketsPerSession = std::size_t{ 3 };
+        // File descriptors kept for everything else when the session limit is automatic
+        static constexpr auto reservedFileDescriptors = std::size_t{ 64 };
+
+        static std::shared_ptr<SessionBudget> create(const SessionBudgetOptions& options);
+
+        SessionBudget(PrivateConstructor, const SessionBudgetOptions& options);
+
+        // Returns: a ticket for a new session, or nullptr if the budget is exhausted
+        std::shared_ptr<Ticket> tryAdmit();
+
+        // Always returns a ticket, for sessions which already exist (i.e. restored ones)
+        std::shared_ptr<Ticket> admit();
+
+    private:
+        bool isExhausted() const noexcept;
+
+        std::size_t maxSessions;
+        std::uint64_t maxBytes;
+        std::atomic<std::size_t> sessions;
+        std::atomic<std::uint64_t> bytes;
+        std::atomic<bool> exhausted;
+    };
+}
@@ -0,0 +1,167 @@
+#include "precompiled.h"
+#include "SocketFilter.h"
+#include "NatNegPacket.hpp"
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#include <sys/socket.h>
+#endif
+
+using ErrorCode = boost::system::error_code;
+
+namespace CNCOnlineForwarder::NatNeg
+{
+#ifdef __linux__
+    namespace
+    {
+        // Socket filters of UDP sockets see the UDP header before the payload
+        constexpr auto payloadOffset = std::uint32_t{ 8 };
+        constexpr auto stepPosition = std::uint32_t{ 7 };
+
+        struct StepRule
+        {
+            NatNegStep step;
+            std::uint32_t minimumSize;
+        };
+
+        // Steps containing NatNegPlayerID need 14 bytes (player ID at 13),
+        // steps containing an address need 18 bytes (address at 12).
+        constexpr StepRule proxyRules[] =
+        {
+            { NatNegStep::init, 14 },
+            { NatNegStep::initAck, 14 },
+            { NatNegStep::connectAck, 14 },
+            { NatNegStep::report, 14 },
+            { NatNegStep::reportAck, 14 },
+        };
+
+        constexpr StepRule communicationRules[] =
+        {
+            { NatNegStep::init, 14 },
+            { NatNegStep::initAck, 14 },
+            { NatNegStep::connect, 18 },
+            { NatNegStep::connectAck, 14 },
+            { NatNegStep::connectPing, 18 },
+            { NatNegStep::report, 14 },
+            { NatNegStep::reportAck, 14 },
+            { NatNegStep::preInit, 13 },
+            { NatNegStep::preInitAck, 13 },
+        };
+
+        ::sock_filter statement(const std::uint16_t code, const std::uint32_t k)
+        {
+            return ::sock_filter{ code, 0, 0, k };
+        }
+
+        // Classic BPF only allows forward jumps, relative to the next instruction
+        ::sock_filter jump(const std::uint16_t code, const std::uint32_t k, const std::size_t from, const std::size_t ifTrue, const std::size_t ifFalse)
+        {
+            return ::sock_filter
+            {
+                static_cast<std::uint16_t>(BPF_JMP | code | BPF_K),
+                static_cast<std::uint8_t>(ifTrue - from - 1),
+                static_cast<std::uint8_t>(ifFalse - from - 1),
+                k
+            };
+        }
+
+        // Layout:
+        // [header checks] [one jump per known step] drop-unknown-step
+        // [one length check per distinct minimum size] drop accept
+        template<std::size_t ruleCount>
+        std::vector<::sock_filter> buildProgram(const StepRule (&rules)[ruleCount])
+        {
+            auto sizes = std::vector<std::uint32_t>{};
+            for (const auto& rule : rules)
+            {
+                if (std::find(sizes.begin(), sizes.end(), rule.minimumSize) == sizes.end())
+                {
+                    sizes.push_back(rule.minimumSize);
+                }
+            }
+
+            constexpr auto firstStepJump = std::size_t{ 8 };
+            const auto firstLengthCheck = firstStepJump + ruleCount + 1;
+            const auto drop = firstLengthCheck + sizes.size() * 2;
+            const auto accept = drop + 1;
+            const auto lengthCheckOf = [&sizes, firstLengthCheck](const std::uint32_t size)
+            {
+                const auto index = std::find(sizes.begin(), sizes.end(), size) - sizes.begin();
+                return firstLengthCheck + static_cast<std::size_t>(index) * 2;
+            };
+
+            auto program = std::vector<::sock_filter>{};
+            // X = A = datagram length, which must contain at least magic, version and step
+            program.push_back(statement(BPF_LD | BPF_W | BPF_LEN, 0));
+            program.push_back(statement(BPF_MISC | BPF_TAX, 0));
+            program.push_back(jump(BPF_JGE, payloadOffset + stepPosition + 1, program.size(), program.size() + 1, drop));
+            // NatNeg magic: FD FC 1E 66 6A B2
+            program.push_back(statement(BPF_LD | BPF_W | BPF_ABS, payloadOffset));
+            program.push_back(jump(BPF_JEQ, 0xFDFC1E66, program.size(), program.size() + 1, drop));
+            program.push_back(statement(BPF_LD | BPF_H | BPF_ABS, payloadOffset + 4));
+            program.push_back(jump(BPF_JEQ, 0x6AB2, program.size(), program.size() + 1, drop));
+            program.push_back(statement(BPF_LD | BPF_B | BPF_ABS, payloadOffset + stepPosition));
+
+            for (const auto& rule : rules)
+            {
+                const auto step = static_cast<std::uint32_t>(rule.step);
+                program.push_back(jump(BPF_JEQ, step, program.size(), lengthCheckOf(rule.minimumSize), program.size() + 1));
+            }
+            program.push_back(statement(BPF_RET | BPF_K, 0));
+
+            for (const auto size : sizes)
+            {
+                program.push_back(statement(BPF_MISC | BPF_TXA, 0));
+                program.push_back(jump(BPF_JGE, payloadOffset + size, program.size(), accept, drop));
+            }
+            program.push_back(statement(BPF_RET | BPF_K, 0));
+            program.push_back(statement(BPF_RET | BPF_K, 0xFFFFFFFF));
+            return program;
+        }
+    }
+
+    ErrorCode attachSocketFilter(const NativeSocket socket, const SocketFilterRole role)
+    {
+        static const auto proxyProgram = buildProgram(proxyRules);
+        static const auto communicationProgram = buildProgram(communicationRules);
+
+        const auto& program = (role == SocketFilterRole::proxy) ? proxyProgram : communicationProgram;
+        const auto filter = ::sock_fprog
+        {
+            static_cast<unsigned short>(program.size()),
+            const_cast<::sock_filter*>(program.data())
+        };
+        if (::setsockopt(socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0)
+        {
+            return ErrorCode{ errno, boost::system::system_category() };
+        }
+        return {};
+    }
+
+    std::optional<std::uint32_t> getKernelDropCount(const NativeSocket socket)
+    {
+        std::uint32_t memoryInfo[SK_MEMINFO_VARS] = {};
+        auto size = static_cast<::socklen_t>(sizeof(memoryInfo));
+        if (::getsockopt(socket, SOL_SOCKET, SO_MEMINFO, memoryInfo, &size) != 0)
+        {
+            return std::nullopt;
+        }
+        if (size <= (SK_MEMINFO_DROPS * sizeof(std::uint32_t)))
+        {
+            return std::nullopt;
+        }
+        return memoryInfo[SK_MEMINFO_DROPS];
+    }
+#else
+    ErrorCode attachSocketFilter(const NativeSocket, const SocketFilterRole)
+    {
+        return boost::asio::error::operation_not_supported;
+    }
+
+    std::optional<std::uint32_t> getKernelDropCount(const NativeSocket)
+    {
+        return std::nullopt;
+    }
+#endif
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <optional>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace CNCOnlineForwarder::NatNeg
+{
+    using NativeSocket = boost::asio::ip::udp::socket::native_handle_type;
+
+    enum class SocketFilterRole
+    {
+        // NatNegProxy's listening socket, only packets carrying a NatNegPlayerID are useful
+        proxy,
+        // InitialPhase's socket talking to the NatNeg server, any known step is accepted
+        communication,
+    };
+
+    // Attach a classic BPF filter to the socket, so datagrams which don't start
+    // with NatNeg magic, have an unknown step or are too short for their step
+    // are dropped inside the kernel instead of waking up an I/O thread.
+    // Returns: operation_not_supported on platforms without socket filters.
+    boost::system::error_code attachSocketFilter
+    (
+        const NativeSocket socket, 
+        const SocketFilterRole role
+    );
+
+    // Returns: number of datagrams the kernel dropped for this socket, 
+    // either by the socket filter or because the receive buffer was full,
+    // or nullopt if it's not supported by the platform.
+    std::optional<std::uint32_t> getKernelDropCount(const NativeSocket socket);
+}
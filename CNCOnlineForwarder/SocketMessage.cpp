@@ -0,0 +1,241 @@
+#include "precompiled.h"
+#include "SocketMessage.h"
+#include <array>
+
+#ifdef __linux__
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#endif
+
+using UDP = boost::asio::ip::udp;
+using ErrorCode = boost::system::error_code;
+
+namespace CNCOnlineForwarder::Utility
+{
+#ifdef __linux__
+    namespace
+    {
+        ErrorCode lastError()
+        {
+            return ErrorCode{ errno, boost::system::system_category() };
+        }
+
+        std::chrono::system_clock::time_point toTimePoint(const ::timespec& time)
+        {
+            const auto sinceEpoch = 
+                std::chrono::seconds{ time.tv_sec } + std::chrono::nanoseconds{ time.tv_nsec };
+            return std::chrono::system_clock::time_point
+            { 
+                std::chrono::duration_cast<std::chrono::system_clock::duration>(sinceEpoch) 
+            };
+        }
+    }
+
+    ErrorCode enableMessageInfo(UDP::socket& socket)
+    {
+        // Callers read with receiveMessage() even if the options below are not supported,
+        // so the socket must not block whatever happens next
+        auto code = ErrorCode{};
+        socket.non_blocking(true, code);
+        if (code.failed())
+        {
+            return code;
+        }
+
+        const auto enabled = int{ 1 };
+        const auto handle = socket.native_handle();
+        if (::setsockopt(handle, SOL_SOCKET, SO_TIMESTAMPNS, &enabled, sizeof(enabled)) != 0)
+        {
+            return lastError();
+        }
+        if (::setsockopt(handle, SOL_SOCKET, SO_RXQ_OVFL, &enabled, sizeof(enabled)) != 0)
+        {
+            return lastError();
+        }
+        return {};
+    }
+
+    std::size_t receiveMessage
+    (
+        UDP::socket& socket,
+        const boost::asio::mutable_buffer& buffer,
+        const boost::asio::mutable_buffer& overflow,
+        UDP::endpoint& from,
+        MessageInfo& info,
+        ErrorCode& code
+    )
+    {
+        ::iovec vectors[] = { { buffer.data(), buffer.size() }, { overflow.data(), overflow.size() } };
+        alignas(::cmsghdr) char control
+        [
+            CMSG_SPACE(sizeof(::timespec)) + CMSG_SPACE(sizeof(std::uint32_t)) + CMSG_SPACE(sizeof(int))
+        ];
+        auto message = ::msghdr{};
+        message.msg_name = from.data();
+        message.msg_namelen = static_cast<::socklen_t>(from.capacity());
+        message.msg_iov = vectors;
+        message.msg_iovlen = 2;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        // With MSG_TRUNC, the size of the whole datagram is returned even if it doesn't fit.
+        // MSG_DONTWAIT in case the socket has been left blocking.
+        const auto size = ::recvmsg(socket.native_handle(), &message, MSG_TRUNC | MSG_DONTWAIT);
+        if (size < 0)
+        {
+            code = lastError();
+            if ((code == boost::asio::error::try_again) || (code == boost::asio::error::would_block))
+            {
+                code = boost::asio::error::would_block;
+            }
+            return 0;
+        }
+        from.resize(message.msg_namelen);
+
+        info.receivedAt = std::chrono::system_clock::now();
+        info.dropCount = std::nullopt;
+        info.segmentSize = 0;
+        for (auto header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+        {
+            if ((header->cmsg_level == IPPROTO_UDP) && (header->cmsg_type == UDP_GRO))
+            {
+                auto segmentSize = int{};
+                std::memcpy(&segmentSize, CMSG_DATA(header), sizeof(segmentSize));
+                info.segmentSize = static_cast<std::uint16_t>(segmentSize);
+                continue;
+            }
+
+            if (header->cmsg_level != SOL_SOCKET)
+            {
+                continue;
+            }
+
+            if (header->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                auto time = ::timespec{};
+                std::memcpy(&time, CMSG_DATA(header), sizeof(time));
+                info.receivedAt = toTimePoint(time);
+            }
+            else if (header->cmsg_type == SO_RXQ_OVFL)
+            {
+                auto dropCount = std::uint32_t{};
+                std::memcpy(&dropCount, CMSG_DATA(header), sizeof(dropCount));
+                info.dropCount = dropCount;
+            }
+        }
+
+        code = {};
+        if ((message.msg_flags & MSG_TRUNC) != 0)
+        {
+            code = boost::asio::error::message_size;
+        }
+        return static_cast<std::size_t>(size);
+    }
+
+    ErrorCode enableReceiveOffload(UDP::socket& socket)
+    {
+        const auto enabled = int{ 1 };
+        if (::setsockopt(socket.native_handle(), IPPROTO_UDP, UDP_GRO, &enabled, sizeof(enabled)) != 0)
+        {
+            return lastError();
+        }
+        return {};
+    }
+
+    ErrorCode enableBusyPoll(UDP::socket& socket, const std::chrono::microseconds timeout)
+    {
+        const auto value = static_cast<int>(timeout.count());
+        if (::setsockopt(socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value)) != 0)
+        {
+            return lastError();
+        }
+        return {};
+    }
+
+    std::size_t sendSegments
+    (
+        UDP::socket& socket,
+        const boost::asio::const_buffer& data,
+        const UDP::endpoint& to,
+        const std::uint16_t segmentSize,
+        ErrorCode& code
+    )
+    {
+        auto vector = ::iovec{ const_cast<void*>(data.data()), data.size() };
+        alignas(::cmsghdr) char control[CMSG_SPACE(sizeof(std::uint16_t))] = {};
+        auto message = ::msghdr{};
+        message.msg_name = const_cast<void*>(static_cast<const void*>(to.data()));
+        message.msg_namelen = static_cast<::socklen_t>(to.size());
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        const auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = IPPROTO_UDP;
+        header->cmsg_type = UDP_SEGMENT;
+        header->cmsg_len = CMSG_LEN(sizeof(segmentSize));
+        std::memcpy(CMSG_DATA(header), &segmentSize, sizeof(segmentSize));
+
+        const auto size = ::sendmsg(socket.native_handle(), &message, MSG_DONTWAIT);
+        if (size < 0)
+        {
+            code = lastError();
+            if ((code == boost::asio::error::try_again) || (code == boost::asio::error::would_block))
+            {
+                code = boost::asio::error::would_block;
+            }
+            return 0;
+        }
+        code = {};
+        return static_cast<std::size_t>(size);
+    }
+#else
+    ErrorCode enableMessageInfo(UDP::socket&)
+    {
+        return boost::asio::error::operation_not_supported;
+    }
+
+    std::size_t receiveMessage
+    (
+        UDP::socket& socket,
+        const boost::asio::mutable_buffer& buffer,
+        const boost::asio::mutable_buffer& overflow,
+        UDP::endpoint& from,
+        MessageInfo& info,
+        ErrorCode& code
+    )
+    {
+        const auto buffers = std::array<boost::asio::mutable_buffer, 2>{ buffer, overflow };
+        const auto size = socket.receive_from(buffers, from, 0, code);
+        info.receivedAt = std::chrono::system_clock::now();
+        info.segmentSize = 0;
+        return size;
+    }
+
+    ErrorCode enableReceiveOffload(UDP::socket&)
+    {
+        return boost::asio::error::operation_not_supported;
+    }
+
+    ErrorCode enableBusyPoll(UDP::socket&, const std::chrono::microseconds)
+    {
+        return boost::asio::error::operation_not_supported;
+    }
+
+    std::size_t sendSegments
+    (
+        UDP::socket&,
+        const boost::asio::const_buffer&,
+        const UDP::endpoint&,
+        const std::uint16_t,
+        ErrorCode& code
+    )
+    {
+        code = boost::asio::error::operation_not_supported;
+        return 0;
+    }
+#endif
+}
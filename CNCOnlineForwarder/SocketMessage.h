@@ -0,0 +1,73 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/system/error_code.hpp>
+
+namespace CNCOnlineForwarder::Utility
+{
+    // Extra information about a datagram received by receiveMessage()
+    struct MessageInfo
+    {
+        // When the datagram was received by the kernel,
+        // or by this process if kernel timestamps are not available
+        std::chrono::system_clock::time_point receivedAt;
+        // Datagrams the kernel has dropped on this socket so far,
+        // nullopt if nothing has been dropped yet or SO_RXQ_OVFL is not supported
+        std::optional<std::uint32_t> dropCount;
+        // Size of each datagram if several datagrams have been coalesced 
+        // into this one by UDP_GRO (the last one may be shorter), otherwise 0
+        std::uint16_t segmentSize;
+    };
+
+    // Make socket non blocking, and ask the kernel to attach information 
+    // used by MessageInfo to received datagrams. receiveMessage() can be used 
+    // even if it fails, MessageInfo will just lack the kernel's information.
+    // Returns: operation_not_supported on platforms without recvmsg().
+    boost::system::error_code enableMessageInfo(boost::asio::ip::udp::socket& socket);
+
+    // Let the kernel coalesce bursts of same sized datagrams from the same source
+    // into a single datagram (UDP_GRO). Such datagrams are reported by MessageInfo::segmentSize.
+    // Returns: operation_not_supported on platforms without UDP_GRO.
+    boost::system::error_code enableReceiveOffload(boost::asio::ip::udp::socket& socket);
+
+    // Let the kernel busy poll the device queue for up to timeout 
+    // when there's nothing to receive (SO_BUSY_POLL).
+    // Returns: operation_not_supported on platforms without SO_BUSY_POLL.
+    boost::system::error_code enableBusyPoll
+    (
+        boost::asio::ip::udp::socket& socket, 
+        const std::chrono::microseconds timeout
+    );
+
+    // Send data as datagrams of segmentSize bytes each (the last one may be shorter)
+    // with a single system call (UDP_SEGMENT), without blocking.
+    // Returns: bytes sent. Sets code to would_block if the send buffer is full,
+    // and to operation_not_supported on platforms without UDP_SEGMENT.
+    std::size_t sendSegments
+    (
+        boost::asio::ip::udp::socket& socket,
+        const boost::asio::const_buffer& data,
+        const boost::asio::ip::udp::endpoint& to,
+        const std::uint16_t segmentSize,
+        boost::system::error_code& code
+    );
+
+    // Receive one datagram without blocking, together with its MessageInfo.
+    // The part of the datagram which doesn't fit into buffer is written into overflow.
+    // Returns: the size of the whole datagram, which is larger than buffer
+    // if overflow has been used. Sets code to message_size if the datagram
+    // didn't fit into overflow either, and to would_block if there's nothing to receive.
+    std::size_t receiveMessage
+    (
+        boost::asio::ip::udp::socket& socket,
+        const boost::asio::mutable_buffer& buffer,
+        const boost::asio::mutable_buffer& overflow,
+        boost::asio::ip::udp::endpoint& from,
+        MessageInfo& info,
+        boost::system::error_code& code
+    );
+}
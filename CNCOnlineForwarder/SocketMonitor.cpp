@@ -0,0 +1,174 @@
+#include "precompiled.h"
+#include "SocketMonitor.h"
+#include "Logging.h"
+
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#include <sys/socket.h>
+#endif
+
+using UDP = boost::asio::ip::udp;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Utility
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<SocketMonitor>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& resizes = Metrics::counter("socketMonitor.resizes");
+
+#ifdef __linux__
+        // Returns: bytes waiting in the receive queue
+        std::uint32_t getQueuedBytes(UDP::socket& socket)
+        {
+            std::uint32_t memoryInfo[SK_MEMINFO_VARS] = {};
+            auto size = static_cast<::socklen_t>(sizeof(memoryInfo));
+            if (::getsockopt(socket.native_handle(), SOL_SOCKET, SO_MEMINFO, memoryInfo, &size) != 0)
+            {
+                return 0;
+            }
+            return memoryInfo[SK_MEMINFO_RMEM_ALLOC];
+        }
+
+        // Returns: the buffer size requested by setsockopt(), 
+        // which is half of the value reported by Linux
+        std::uint32_t getBufferSize(UDP::socket& socket)
+        {
+            auto value = int{};
+            auto size = static_cast<::socklen_t>(sizeof(value));
+            if (::getsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVBUF, &value, &size) != 0)
+            {
+                return 0;
+            }
+            return static_cast<std::uint32_t>(value / 2);
+        }
+
+        void setBufferSize(UDP::socket& socket, const int option, const int forceOption, const std::uint32_t size)
+        {
+            const auto value = static_cast<int>(size);
+            // Forcing exceeds net.core.[rw]mem_max, but requires CAP_NET_ADMIN
+            if (::setsockopt(socket.native_handle(), SOL_SOCKET, forceOption, &value, sizeof(value)) == 0)
+            {
+                return;
+            }
+            ::setsockopt(socket.native_handle(), SOL_SOCKET, option, &value, sizeof(value));
+        }
+#endif
+    }
+
+#ifdef __linux__
+    void SocketMonitor::attach
+    (
+        UDP::socket& socket,
+        const SocketBufferOptions& options,
+        const std::string_view role,
+        const bool filtered
+    )
+    {
+        this->options = options;
+        this->drops = &Metrics::counter("socketMonitor." + std::string{ role } + ".drops");
+        if (filtered)
+        {
+            this->filteredDrops = &Metrics::counter("socketMonitor." + std::string{ role } + ".filtered");
+        }
+
+        this->bufferSize = getBufferSize(socket);
+        const auto clamped = std::clamp(this->bufferSize, options.minimum, options.maximum);
+        if (clamped != this->bufferSize)
+        {
+            this->resize(socket, clamped);
+        }
+    }
+
+    void SocketMonitor::update(UDP::socket& socket, const MessageInfo& info)
+    {
+        if (this->drops == nullptr)
+        {
+            return;
+        }
+
+        ++this->received;
+        if (info.dropCount.has_value() && (info.dropCount.value() != this->lastDropCount))
+        {
+            const auto newDrops = info.dropCount.value() - this->lastDropCount;
+            this->lastDropCount = info.dropCount.value();
+
+            // Drops by the socket filter are counted by the kernel as well,
+            // so they are only overflows if the receive queue is actually filling up
+            const auto queued = getQueuedBytes(socket);
+            const auto overflowing = queued >= this->bufferSize / 2;
+            if ((this->filteredDrops != nullptr) && !overflowing)
+            {
+                this->filteredDrops->add(newDrops);
+            }
+            else
+            {
+                this->drops->add(newDrops);
+                this->droppedSinceShrinkCheck = true;
+            }
+
+            if (overflowing && (this->bufferSize < this->options.maximum))
+            {
+                const auto newSize = std::min(this->bufferSize * 2, this->options.maximum);
+                logLine(LogLevel::info, newDrops, " datagrams dropped, growing buffers to ", newSize, " bytes");
+                this->resize(socket, newSize);
+            }
+        }
+
+        if ((this->received % sampleInterval) == 0)
+        {
+            this->peakQueued = std::max(this->peakQueued, getQueuedBytes(socket));
+        }
+
+        if ((this->received % shrinkInterval) == 0)
+        {
+            const auto mostlyEmpty = this->peakQueued < (this->bufferSize / 8);
+            if (!this->droppedSinceShrinkCheck && mostlyEmpty && (this->bufferSize > this->options.minimum))
+            {
+                this->resize(socket, std::max(this->bufferSize / 2, this->options.minimum));
+            }
+            this->peakQueued = 0;
+            this->droppedSinceShrinkCheck = false;
+        }
+    }
+
+    void SocketMonitor::resize(UDP::socket& socket, const std::uint32_t size)
+    {
+        // The same socket sends what the other relay socket receives,
+        // so both directions are kept equally sized
+        setBufferSize(socket, SO_RCVBUF, SO_RCVBUFFORCE, size);
+        setBufferSize(socket, SO_SNDBUF, SO_SNDBUFFORCE, size);
+        this->bufferSize = size;
+        resizes.add();
+    }
+#else
+    void SocketMonitor::attach
+    (
+        UDP::socket&,
+        const SocketBufferOptions& options,
+        const std::string_view,
+        const bool
+    )
+    {
+        this->options = options;
+    }
+
+    void SocketMonitor::update(UDP::socket&, const MessageInfo&)
+    {
+    }
+
+    void SocketMonitor::resize(UDP::socket&, const std::uint32_t)
+    {
+    }
+#endif
+
+    std::uint32_t SocketMonitor::getDropCount() const noexcept
+    {
+        return this->lastDropCount;
+    }
+}
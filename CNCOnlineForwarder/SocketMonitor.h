@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include <boost/asio/ip/udp.hpp>
+#include "Metrics.h"
+#include "Options.h"
+#include "SocketMessage.h"
+
+namespace CNCOnlineForwarder::Utility
+{
+    // Counts datagrams dropped by the kernel on a socket, using the drop count
+    // attached to received datagrams, and resizes the socket's buffers:
+    // they are doubled when datagrams are dropped because the receive queue is full,
+    // and halved when the queue stays mostly empty, within the configured bounds.
+    // Not thread safe, should be used in the strand of its socket.
+    class SocketMonitor
+    {
+    public:
+        static constexpr auto description = "SocketMonitor";
+
+        // Received datagrams between samples of the receive queue length
+        static constexpr auto sampleInterval = std::uint32_t{ 64 };
+        // Received datagrams between checks whether the buffers can be shrunk
+        static constexpr auto shrinkInterval = std::uint32_t{ 1024 };
+
+        // Clamp buffer sizes of socket into bounds, and start counting its drops 
+        // into the socketMonitor.<role>.drops counter. 
+        // The kernel's drop count includes datagrams rejected by a socket filter:
+        // if filtered, drops seen while the receive queue is not filling up 
+        // are attributed to the filter and counted into socketMonitor.<role>.filtered instead.
+        // Drop counts are only available after enableMessageInfo().
+        void attach
+        (
+            boost::asio::ip::udp::socket& socket,
+            const SocketBufferOptions& options,
+            const std::string_view role,
+            const bool filtered
+        );
+
+        // Must be called with the MessageInfo of every datagram received from socket
+        void update(boost::asio::ip::udp::socket& socket, const MessageInfo& info);
+
+        std::uint32_t getDropCount() const noexcept;
+
+    private:
+        void resize(boost::asio::ip::udp::socket& socket, const std::uint32_t size);
+
+        SocketBufferOptions options{};
+        Metrics::Counter* drops = nullptr;
+        // nullptr if the socket has no filter
+        Metrics::Counter* filteredDrops = nullptr;
+        std::uint32_t lastDropCount = 0;
+        std::uint32_t bufferSize = 0;
+        std::uint32_t received = 0;
+        std::uint32_t peakQueued = 0;
+        bool droppedSinceShrinkCheck = false;
+    };
+}
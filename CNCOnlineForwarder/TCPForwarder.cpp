@@ -0,0 +1,524 @@
+#include "precompiled.h"
+#include "TCPForwarder.h"
+#include "Logging.h"
+#include "Metrics.h"
+#include "WeakRefHandler.hpp"
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using TCP = boost::asio::ip::tcp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+using CNCOnlineForwarder::Utility::makeWeakHandler;
+
+namespace CNCOnlineForwarder
+{
+    template<typename... Arguments>
+    void logLine(LogLevel level, Arguments&&... arguments)
+    {
+        return Logging::logLine<TCPForwarder>(level, std::forward<Arguments>(arguments)...);
+    }
+
+    namespace
+    {
+        auto& liveConnections = Metrics::gauge("tcpForwarder.connections");
+    }
+
+#ifdef __linux__
+    // A kernel pipe, used as the intermediate buffer of splice()
+    class KernelPipe
+    {
+    public:
+        KernelPipe() : readEnd{ -1 }, writeEnd{ -1 } {}
+        KernelPipe(const KernelPipe&) = delete;
+        KernelPipe& operator=(const KernelPipe&) = delete;
+
+        ~KernelPipe()
+        {
+            this->close();
+        }
+
+        ErrorCode open()
+        {
+            int ends[2];
+            if (::pipe2(ends, O_NONBLOCK | O_CLOEXEC) != 0)
+            {
+                return ErrorCode{ errno, boost::system::system_category() };
+            }
+            this->readEnd = ends[0];
+            this->writeEnd = ends[1];
+            return {};
+        }
+
+        void close()
+        {
+            for (auto* end : { &this->readEnd, &this->writeEnd })
+            {
+                if (*end >= 0)
+                {
+                    ::close(*end);
+                    *end = -1;
+                }
+            }
+        }
+
+        int readEnd;
+        int writeEnd;
+    };
+#endif
+
+    class TCPForwarder::Connection : public std::enable_shared_from_this<Connection>
+    {
+    private:
+        struct PrivateConstructor {};
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Resolver = WithStrand<TCP::resolver>;
+        using ResolvedHostName = TCP::resolver::results_type;
+        using Timer = boost::asio::steady_timer;
+
+        static constexpr auto description = "TCPForwarderConnection";
+
+        static void start
+        (
+            const Strand& strand,
+            TCP::socket client,
+            const TCPForwarderOptions& options
+        )
+        {
+            const auto self = std::make_shared<Connection>
+            (
+                PrivateConstructor{},
+                strand,
+                std::move(client),
+                options
+            );
+
+            boost::asio::defer(self->strand, [self] { self->connect(); });
+        }
+
+        Connection
+        (
+            PrivateConstructor,
+            const Strand& strand,
+            TCP::socket client,
+            const TCPForwarderOptions& options
+        ) :
+            strand{ strand },
+            resolver{ this->strand },
+            client{ std::move(client) },
+            upstream{ strand },
+            idleTimer{ strand },
+            options{ options },
+            lastActivity{ Clock::now() },
+            closed{ false },
+            toUpstream{ this->client, this->upstream, "client -> upstream" },
+            toClient{ this->upstream, this->client, "upstream -> client" }
+        {
+            liveConnections.add();
+        }
+
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+
+        ~Connection()
+        {
+            liveConnections.subtract();
+        }
+
+    private:
+        struct Direction
+        {
+            Direction(TCP::socket& source, TCP::socket& sink, const char* name) :
+                source{ source },
+                sink{ sink },
+                name{ name },
+                buffer{},
+                bytesForwarded{ 0 },
+                finished{ false }
+#ifdef __linux__
+                , pipe{}
+                , bytesInPipe{ 0 }
+#endif
+            {}
+
+            TCP::socket& source;
+            TCP::socket& sink;
+            const char* name;
+            std::vector<char> buffer;
+            std::uint64_t bytesForwarded;
+            bool finished;
+#ifdef __linux__
+            KernelPipe pipe;
+            std::size_t bytesInPipe;
+#endif
+        };
+
+        static constexpr auto bufferSize = std::size_t{ 16 * 1024 };
+        static constexpr auto spliceChunkSize = std::size_t{ 64 * 1024 };
+        // Maximum splice rounds before yielding to other handlers
+        static constexpr auto maxSpliceRounds = 16;
+
+        template<typename... Arguments>
+        static void log(const LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<Connection>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        void connect()
+        {
+            log(LogLevel::info, "Resolving upstream ", this->options.upstreamHostName);
+            auto onResolve = [self = this->shared_from_this()]
+            (
+                const ErrorCode& code,
+                const ResolvedHostName& results
+            )
+            {
+                if (code.failed())
+                {
+                    return self->close("Failed to resolve upstream", code);
+                }
+
+                boost::asio::async_connect
+                (
+                    self->upstream,
+                    results,
+                    [self](const ErrorCode& code, const TCP::endpoint& endPoint)
+                    {
+                        if (code.failed())
+                        {
+                            return self->close("Failed to connect to upstream", code);
+                        }
+                        log(LogLevel::info, "Connected to upstream ", endPoint);
+                        self->startForwarding();
+                    }
+                );
+            };
+
+            this->resolver.asyncResolve
+            (
+                this->options.upstreamHostName,
+                std::to_string(this->options.upstreamPort),
+                boost::asio::bind_executor(this->strand, std::move(onResolve))
+            );
+        }
+
+        void startForwarding()
+        {
+            this->lastActivity = Clock::now();
+            this->waitForIdleTimeout();
+
+            for (auto* direction : { &this->toUpstream, &this->toClient })
+            {
+#ifdef __linux__
+                if (this->options.useSplice)
+                {
+                    auto code = direction->pipe.open();
+                    if (!code.failed())
+                    {
+                        direction->source.non_blocking(true, code);
+                        direction->sink.non_blocking(true, code);
+                    }
+
+                    if (!code.failed())
+                    {
+                        this->spliceForward(*direction);
+                        continue;
+                    }
+
+                    log(LogLevel::warning, "Cannot use splice, fallback to buffered forwarding: ", code);
+                    direction->pipe.close();
+                }
+#endif
+                direction->buffer.resize(bufferSize);
+                this->readForward(*direction);
+            }
+        }
+
+        void readForward(Direction& direction)
+        {
+            direction.source.async_read_some
+            (
+                boost::asio::buffer(direction.buffer),
+                [self = this->shared_from_this(), &direction](const ErrorCode& code, const std::size_t bytesRead)
+                {
+                    if (code == boost::asio::error::eof)
+                    {
+                        return self->finish(direction);
+                    }
+
+                    if (code.failed())
+                    {
+                        return self->close("Read failed", code);
+                    }
+
+                    self->lastActivity = Clock::now();
+                    boost::asio::async_write
+                    (
+                        direction.sink,
+                        boost::asio::buffer(direction.buffer.data(), bytesRead),
+                        [self, &direction](const ErrorCode& code, const std::size_t bytesWritten)
+                        {
+                            if (code.failed())
+                            {
+                                return self->close("Write failed", code);
+                            }
+
+                            direction.bytesForwarded += bytesWritten;
+                            self->readForward(direction);
+                        }
+                    );
+                }
+            );
+        }
+
+#ifdef __linux__
+        void spliceForward(Direction& direction)
+        {
+            if (this->closed)
+            {
+                return;
+            }
+
+            constexpr auto flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+            for (auto round = 0; round < maxSpliceRounds; ++round)
+            {
+                // Drain the pipe first, so next splice from source always has room
+                if (direction.bytesInPipe > 0)
+                {
+                    const auto moved = ::splice
+                    (
+                        direction.pipe.readEnd,
+                        nullptr,
+                        direction.sink.native_handle(),
+                        nullptr,
+                        direction.bytesInPipe,
+                        flags
+                    );
+                    if (moved < 0)
+                    {
+                        if (errno == EAGAIN)
+                        {
+                            return this->waitForSplice(direction, TCP::socket::wait_write);
+                        }
+                        return this->close("Splice to sink failed", ErrorCode{ errno, boost::system::system_category() });
+                    }
+
+                    direction.bytesInPipe -= static_cast<std::size_t>(moved);
+                    direction.bytesForwarded += static_cast<std::uint64_t>(moved);
+                    continue;
+                }
+
+                const auto received = ::splice
+                (
+                    direction.source.native_handle(),
+                    nullptr,
+                    direction.pipe.writeEnd,
+                    nullptr,
+                    spliceChunkSize,
+                    flags
+                );
+                if (received == 0)
+                {
+                    return this->finish(direction);
+                }
+
+                if (received < 0)
+                {
+                    if (errno == EAGAIN)
+                    {
+                        return this->waitForSplice(direction, TCP::socket::wait_read);
+                    }
+                    return this->close("Splice from source failed", ErrorCode{ errno, boost::system::system_category() });
+                }
+
+                direction.bytesInPipe += static_cast<std::size_t>(received);
+                this->lastActivity = Clock::now();
+            }
+
+            // Let other handlers run before continuing
+            boost::asio::defer
+            (
+                this->strand,
+                [self = this->shared_from_this(), &direction] { self->spliceForward(direction); }
+            );
+        }
+
+        void waitForSplice(Direction& direction, const TCP::socket::wait_type type)
+        {
+            auto& socket = (type == TCP::socket::wait_read) ? direction.source : direction.sink;
+            socket.async_wait
+            (
+                type,
+                [self = this->shared_from_this(), &direction](const ErrorCode& code)
+                {
+                    if (code.failed())
+                    {
+                        return self->close("Async wait failed", code);
+                    }
+
+                    self->spliceForward(direction);
+                }
+            );
+        }
+#endif
+
+        void finish(Direction& direction)
+        {
+            log(LogLevel::info, direction.name, " finished after ", direction.bytesForwarded, " bytes");
+            direction.finished = true;
+            auto ignored = ErrorCode{};
+            direction.sink.shutdown(TCP::socket::shutdown_send, ignored);
+
+            if (this->toUpstream.finished && this->toClient.finished)
+            {
+                this->close("Both sides closed", {});
+            }
+        }
+
+        void waitForIdleTimeout()
+        {
+            this->idleTimer.expires_at(this->lastActivity + this->options.idleTimeout);
+            this->idleTimer.async_wait([self = this->shared_from_this()](const ErrorCode& code)
+            {
+                if (code == boost::asio::error::operation_aborted || self->closed)
+                {
+                    return;
+                }
+
+                if (Clock::now() - self->lastActivity >= self->options.idleTimeout)
+                {
+                    return self->close("Idle timeout reached", code);
+                }
+
+                self->waitForIdleTimeout();
+            });
+        }
+
+        void close(const std::string_view reason, const ErrorCode& code)
+        {
+            if (this->closed)
+            {
+                return;
+            }
+            this->closed = true;
+
+            if (code.failed())
+            {
+                log(LogLevel::warning, reason, ": ", code);
+            }
+            log
+            (
+                LogLevel::info,
+                "Closing connection (", reason, "), forwarded ",
+                this->toUpstream.bytesForwarded, " bytes to upstream, ",
+                this->toClient.bytesForwarded, " bytes to client"
+            );
+
+            auto ignored = ErrorCode{};
+            this->idleTimer.cancel(ignored);
+            this->resolver->cancel();
+            this->client.close(ignored);
+            this->upstream.close(ignored);
+        }
+
+        Strand strand;
+        Resolver resolver;
+        TCP::socket client;
+        TCP::socket upstream;
+        Timer idleTimer;
+        TCPForwarderOptions options;
+        Clock::time_point lastActivity;
+        bool closed;
+        Direction toUpstream;
+        Direction toClient;
+    };
+
+    std::shared_ptr<TCPForwarder> TCPForwarder::create
+    (
+        const IOManager::ObjectMaker& objectMaker,
+        const TCPForwarderOptions& options
+    )
+    {
+        const auto self = std::make_shared<TCPForwarder>
+        (
+            PrivateConstructor{},
+            objectMaker,
+            options
+        );
+
+        const auto action = [](TCPForwarder& self)
+        {
+            logLine
+            (
+                LogLevel::info,
+                "TCPForwarder created, forwarding port ", self.options.port,
+                " to ", self.options.upstreamHostName, ":", self.options.upstreamPort
+            );
+            self.prepareForNextConnection();
+        };
+        boost::asio::defer(self->strand, makeWeakHandler(self, action));
+
+        return self;
+    }
+
+    TCPForwarder::TCPForwarder
+    (
+        PrivateConstructor,
+        const IOManager::ObjectMaker& objectMaker,
+        const TCPForwarderOptions& options
+    ) :
+        objectMaker{ objectMaker },
+        options{ options },
+        strand{ objectMaker.makeStrand() },
+        acceptor{ strand, TCP::endpoint{ TCP::v4(), options.port } }
+    {
+        Profiling::nameStrand(&this->strand, description);
+    }
+
+    std::future<void> TCPForwarder::stopAccepting()
+    {
+        auto closed = std::make_shared<std::promise<void>>();
+        auto future = closed->get_future();
+        auto action = [closed](TCPForwarder& self)
+        {
+            logLine(LogLevel::info, "No longer accepting connections on port ", self.options.port);
+            auto ignored = ErrorCode{};
+            self.acceptor->close(ignored);
+            closed->set_value();
+        };
+
+        boost::asio::defer(this->strand, makeWeakHandler(this, std::move(action)));
+        return future;
+    }
+
+    void TCPForwarder::prepareForNextConnection()
+    {
+        const auto connectionStrand = this->objectMaker.makeStrand();
+        auto onAccept = [connectionStrand](TCPForwarder& self, const ErrorCode& code, TCP::socket socket)
+        {
+            if (!self.acceptor->is_open())
+            {
+                // Closed by stopAccepting()
+                return;
+            }
+            self.prepareForNextConnection();
+
+            if (code.failed())
+            {
+                logLine(LogLevel::error, "Async accept failed: ", code);
+                return;
+            }
+
+            auto endPointCode = ErrorCode{};
+            logLine(LogLevel::info, "New client: ", socket.remote_endpoint(endPointCode));
+            Connection::start(connectionStrand, std::move(socket), self.options);
+        };
+
+        this->acceptor.asyncAccept(connectionStrand, makeWeakHandler(this, std::move(onAccept)));
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <future>
+#include <memory>
+#include <boost/asio/ip/tcp.hpp>
+#include "IOManager.hpp"
+#include "Options.h"
+
+namespace CNCOnlineForwarder
+{
+    // Accepts TCP connections and pipes each of them to the upstream server.
+    // On Linux, data is moved with splice() so it never enters user space.
+    class TCPForwarder : public std::enable_shared_from_this<TCPForwarder>
+    {
+    private:
+        struct PrivateConstructor {};
+        class Connection;
+    public:
+        using Strand = IOManager::StrandType;
+        using Acceptor = WithStrand<boost::asio::ip::tcp::acceptor>;
+
+        static constexpr auto description = "TCPForwarder";
+
+        static std::shared_ptr<TCPForwarder> create
+        (
+            const IOManager::ObjectMaker& objectMaker,
+            const TCPForwarderOptions& options
+        );
+
+        TCPForwarder
+        (
+            PrivateConstructor,
+            const IOManager::ObjectMaker& objectMaker,
+            const TCPForwarderOptions& options
+        );
+
+        // Close the listening socket, established connections keep being forwarded.
+        // The future is ready once the port is released.
+        std::future<void> stopAccepting();
+
+    private:
+        void prepareForNextConnection();
+
+        IOManager::ObjectMaker objectMaker;
+        TCPForwarderOptions options;
+        Strand strand;
+        Acceptor acceptor;
+    };
+}
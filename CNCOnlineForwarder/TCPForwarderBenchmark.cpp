@@ -0,0 +1,217 @@
+#include "precompiled.h"
+#include "TCPForwarderBenchmark.h"
+#include <thread>
+#include "IOManager.hpp"
+#include "Logging.h"
+#include "TCPForwarder.h"
+
+#ifdef __linux__
+#include <time.h>
+#endif
+
+using TCP = boost::asio::ip::tcp;
+using ErrorCode = boost::system::error_code;
+using LogLevel = CNCOnlineForwarder::Logging::Level;
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    namespace
+    {
+        struct TCPForwarderBenchmark
+        {
+            static constexpr auto description = "TCPForwarderBenchmark";
+        };
+
+        template<typename... Arguments>
+        void logLine(LogLevel level, Arguments&&... arguments)
+        {
+            return Logging::logLine<TCPForwarderBenchmark>(level, std::forward<Arguments>(arguments)...);
+        }
+
+        // Connections streaming data at the same time
+        constexpr auto clientCount = std::size_t{ 4 };
+        constexpr auto chunkSize = std::size_t{ 64 * 1024 };
+
+        const auto loopback = boost::asio::ip::address_v4::loopback();
+
+        std::chrono::nanoseconds getThreadCpuTime()
+        {
+#ifdef __linux__
+            auto time = ::timespec{};
+            ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+            return std::chrono::seconds{ time.tv_sec } + std::chrono::nanoseconds{ time.tv_nsec };
+#else
+            return std::chrono::nanoseconds{ 0 };
+#endif
+        }
+
+        std::uint16_t findFreePort(boost::asio::io_context& context)
+        {
+            auto acceptor = TCP::acceptor{ context, TCP::endpoint{ loopback, 0 } };
+            return acceptor.local_endpoint().port();
+        }
+
+        // Stand-in of peerchat.server.cnc-online.net, reads and counts everything it receives
+        class Upstream
+        {
+        public:
+            Upstream(boost::asio::io_context& context) :
+                acceptor{ context, TCP::endpoint{ loopback, 0 } },
+                bytes{ 0 }
+            {
+                this->accept();
+            }
+
+            std::uint16_t getPort() const
+            {
+                return this->acceptor.local_endpoint().port();
+            }
+
+            std::uint64_t getBytes() const noexcept
+            {
+                return this->bytes.load(std::memory_order_relaxed);
+            }
+
+        private:
+            struct Session
+            {
+                Session(TCP::socket socket) : socket{ std::move(socket) }, buffer(chunkSize) {}
+
+                TCP::socket socket;
+                std::vector<char> buffer;
+            };
+
+            void accept()
+            {
+                this->acceptor.async_accept([this](const ErrorCode& code, TCP::socket socket)
+                {
+                    if (code.failed())
+                    {
+                        return;
+                    }
+                    this->read(std::make_shared<Session>(std::move(socket)));
+                    this->accept();
+                });
+            }
+
+            void read(const std::shared_ptr<Session>& session)
+            {
+                session->socket.async_read_some
+                (
+                    boost::asio::buffer(session->buffer),
+                    [this, session](const ErrorCode& code, const std::size_t bytesRead)
+                    {
+                        if (code.failed())
+                        {
+                            return;
+                        }
+                        this->bytes.fetch_add(bytesRead, std::memory_order_relaxed);
+                        this->read(session);
+                    }
+                );
+            }
+
+            TCP::acceptor acceptor;
+            std::atomic<std::uint64_t> bytes;
+        };
+
+        std::string run(const BenchmarkOptions& options, const bool useSplice)
+        {
+            auto upstreamContext = boost::asio::io_context{};
+            auto upstream = Upstream{ upstreamContext };
+            const auto forwarderOptions = TCPForwarderOptions
+            {
+                findFreePort(upstreamContext),
+                loopback.to_string(),
+                upstream.getPort(),
+                std::chrono::seconds{ 600 },
+                useSplice
+            };
+            auto upstreamThread = std::thread{ [&upstreamContext] { upstreamContext.run(); } };
+
+            const auto ioManager = IOManager::create();
+            const auto forwarder = TCPForwarder::create(IOManager::ObjectMaker{ ioManager }, forwarderOptions);
+            auto forwarderCpuTime = std::atomic<std::int64_t>{ 0 };
+            auto workers = std::vector<std::thread>{};
+            for (auto i = std::size_t{ 0 }; i < ioManager->getWorkerCount(); ++i)
+            {
+                workers.emplace_back([ioManager, i, &forwarderCpuTime]
+                {
+                    const auto start = getThreadCpuTime();
+                    ioManager->runWorker(i);
+                    forwarderCpuTime += (getThreadCpuTime() - start).count();
+                });
+            }
+
+            auto stopping = std::atomic<bool>{ false };
+            auto failures = std::atomic<std::size_t>{ 0 };
+            const auto client = [&stopping, &failures, port = forwarderOptions.port]
+            {
+                auto context = boost::asio::io_context{};
+                auto socket = TCP::socket{ context };
+                const auto chunk = std::vector<char>(chunkSize, 'x');
+                auto code = ErrorCode{};
+                socket.connect(TCP::endpoint{ loopback, port }, code);
+                while (!code.failed() && !stopping.load(std::memory_order_relaxed))
+                {
+                    boost::asio::write(socket, boost::asio::buffer(chunk), code);
+                }
+                if (code.failed())
+                {
+                    failures.fetch_add(1, std::memory_order_relaxed);
+                }
+            };
+
+            const auto start = std::chrono::steady_clock::now();
+            auto clients = std::vector<std::thread>{};
+            for (auto i = std::size_t{ 0 }; i < clientCount; ++i)
+            {
+                clients.emplace_back(client);
+            }
+
+            std::this_thread::sleep_for(options.duration);
+            const auto forwarded = upstream.getBytes();
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            stopping.store(true, std::memory_order_relaxed);
+            for (auto& thread : clients)
+            {
+                thread.join();
+            }
+
+            ioManager->stop();
+            for (auto& thread : workers)
+            {
+                thread.join();
+            }
+            upstreamContext.stop();
+            upstreamThread.join();
+
+            const auto seconds = std::chrono::duration<double>{ elapsed }.count();
+            const auto cpuSeconds = std::chrono::duration<double>{ std::chrono::nanoseconds{ forwarderCpuTime.load() } }.count();
+            const auto megabytes = forwarded / (1024.0 * 1024.0);
+            auto summary = std::ostringstream{};
+            summary << (useSplice ? "splice()" : "Buffered") << ": "
+                << static_cast<std::uint64_t>(megabytes / seconds) << " MiB/s over " << clientCount << " connections, "
+                << "forwarder threads used " << cpuSeconds << "s of CPU, "
+                << static_cast<std::uint64_t>(cpuSeconds > 0 ? megabytes / cpuSeconds : 0.0) << " MiB per CPU second, "
+                << failures.load() << " of " << clientCount << " connections failed";
+            return summary.str();
+        }
+    }
+
+    void runTCPForwarderBenchmark(const BenchmarkOptions& options)
+    {
+        logLine
+        (
+            LogLevel::info,
+            "Streaming chunks of ", chunkSize, " bytes over ", clientCount,
+            " connections for ", options.duration.count(), "s, with and without splice()"
+        );
+        for (const auto useSplice : { false, true })
+        {
+            const auto summary = run(options, useSplice);
+            logLine(LogLevel::info, summary);
+            std::cout << summary << std::endl;
+        }
+    }
+}
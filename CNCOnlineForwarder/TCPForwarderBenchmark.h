@@ -0,0 +1,11 @@
+#pragma once
+#include "Options.h"
+
+namespace CNCOnlineForwarder::Benchmark
+{
+    // Streams data through a TCPForwarder to a stand-in upstream server on loopback,
+    // once with buffered forwarding and once with splice() where it's supported,
+    // and reports the throughput and the CPU time used by the forwarder's threads.
+    // Blocking.
+    void runTCPForwarderBenchmark(const BenchmarkOptions& options);
+}
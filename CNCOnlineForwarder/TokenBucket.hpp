@@ -0,0 +1,75 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+
+namespace CNCOnlineForwarder::Utility
+{
+    // Classic token bucket: tokens are refilled at a constant rate,
+    // up to a maximum burst. A rate of 0 means unlimited.
+    // Not thread safe, every operation is constant time and never allocates.
+    class TokenBucket
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        TokenBucket() noexcept : TokenBucket{ 0, 0 } {}
+
+        TokenBucket(const double ratePerSecond, const double burst) noexcept :
+            ratePerSecond{ ratePerSecond },
+            burst{ burst },
+            tokens{ burst },
+            lastRefill{}
+        {}
+
+        bool isUnlimited() const noexcept
+        {
+            return this->ratePerSecond <= 0;
+        }
+
+        void refill(const Clock::time_point now) noexcept
+        {
+            if (now <= this->lastRefill)
+            {
+                return;
+            }
+
+            const auto elapsed = std::chrono::duration<double>{ now - this->lastRefill }.count();
+            this->tokens = std::min(this->burst, this->tokens + elapsed * this->ratePerSecond);
+            this->lastRefill = now;
+        }
+
+        // Should only be called after refill()
+        bool hasTokens(const double amount) const noexcept
+        {
+            return this->isUnlimited() || (this->tokens >= amount);
+        }
+
+        // Should only be called after hasTokens() returned true
+        void consume(const double amount) noexcept
+        {
+            this->tokens -= amount;
+        }
+
+        bool tryConsume(const double amount, const Clock::time_point now) noexcept
+        {
+            this->refill(now);
+            if (!this->hasTokens(amount))
+            {
+                return false;
+            }
+            this->consume(amount);
+            return true;
+        }
+
+        bool isFull() const noexcept
+        {
+            return this->isUnlimited() || (this->tokens >= this->burst);
+        }
+
+    private:
+        double ratePerSecond;
+        double burst;
+        double tokens;
+        Clock::time_point lastRefill;
+    };
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <utility>
 #include <memory>
+#include "HandlerProfiler.h"
 #include "Logging.h"
 
 namespace CNCOnlineForwarder::Utility
@@ -27,6 +28,14 @@ namespace CNCOnlineForwarder::Utility
                 return;
             }
 
+            if (Profiling::isEnabled())
+            {
+                const auto startedAt = Profiling::Clock::now();
+                std::invoke(this->handler, *self, std::forward<Arguments>(arguments)...);
+                Profiling::recordExecution(Profiling::profileOf<WeakRefHandler>(), Profiling::Clock::now() - startedAt);
+                return;
+            }
+
             std::invoke(this->handler, *self, std::forward<Arguments>(arguments)...);
         }
 
@@ -1,7 +1,25 @@
 #include "precompiled.h"
+#include "AllocationTest.h"
+#include "DrainController.h"
+#include "HandlerProfiler.h"
+#include "HotRestart.h"
+#include "HTTPProxy.h"
+#include "HTTPProxyBenchmark.h"
 #include "IOManager.hpp"
+#include "LoadMonitor.h"
 #include "NatNegProxy.h"
 #include "Logging.h"
+#include "Metrics.h"
+#include "MicroBenchmark.h"
+#include "Options.h"
+#include "PacketCapture.h"
+#include "OffloadBenchmark.h"
+#include "PacketReplay.h"
+#include "RelayThreadBenchmark.h"
+#include "SchedulerBenchmark.h"
+#include "SelfProbe.h"
+#include "TCPForwarder.h"
+#include "TCPForwarderBenchmark.h"
 #include "WeakRefHandler.hpp"
 
 using AddressV4 = boost::asio::ip::address_v4;
@@ -27,7 +45,28 @@ namespace CNCOnlineForwarder
         manager.stop();
     }
 
-    void run()
+    void waitForStatisticsSignal
+    (
+        boost::asio::signal_set& signals, 
+        const std::weak_ptr<NatNeg::NatNegProxy>& proxy
+    )
+    {
+        signals.async_wait([&signals, proxy](const ErrorCode& errorCode, const int)
+        {
+            if (errorCode.failed())
+            {
+                return;
+            }
+
+            if (const auto proxyRef = proxy.lock())
+            {
+                proxyRef->logRoundTrips();
+            }
+            waitForStatisticsSignal(signals, proxy);
+        });
+    }
+
+    void run(const Options& options)
     {
         using namespace Logging;
         using namespace Utility;
@@ -35,29 +74,153 @@ namespace CNCOnlineForwarder
         log(Level::info) << "Begin!";
         try
         {
-            const auto ioManager = IOManager::create();
+            // Before any handler is started, so every one of them is profiled
+            Profiling::enable(options.profiling);
+
+            const auto ioManager = IOManager::create(options.relayThreads.threads, options.executor);
             auto objectMaker = IOManager::ObjectMaker{ ioManager };
 
-            auto signals = objectMaker.make<boost::asio::signal_set>(SIGINT, SIGTERM);
-            signals.async_wait(makeWeakHandler(ioManager.get(), &signalHandler));
+            auto packetCapture = std::unique_ptr<Capture::Writer>{};
+            if (!options.capture.path.empty())
+            {
+                packetCapture = std::make_unique<Capture::Writer>(options.capture);
+            }
 
             const auto addressTranslator = ProxyAddressTranslator::create(objectMaker);
 
-            const auto natNegProxy = NatNeg::NatNegProxy::create
-            (
-                objectMaker,
-                "natneg.server.cnc-online.net",
-                27901,
-                addressTranslator
-            );
+            auto natNegProxy = std::shared_ptr<NatNeg::NatNegProxy>{};
+            if (options.hotRestart.takeOverFrom.empty())
+            {
+                natNegProxy = NatNeg::NatNegProxy::create
+                (
+                    objectMaker,
+                    "natneg.server.cnc-online.net",
+                    27901,
+                    addressTranslator,
+                    options.natNeg
+                );
+            }
+            else
+            {
+                natNegProxy = NatNeg::NatNegProxy::restore
+                (
+                    objectMaker,
+                    "natneg.server.cnc-online.net",
+                    27901,
+                    addressTranslator,
+                    options.natNeg,
+                    HotRestart::takeOver(options.hotRestart.takeOverFrom)
+                );
+            }
 
+            auto signals = objectMaker.make<boost::asio::signal_set>();
+            auto drainController = std::shared_ptr<DrainController>{};
+            if (options.drain.timeout.count() > 0)
+            {
+                drainController = DrainController::create
+                (
+                    objectMaker,
+                    ioManager,
+                    natNegProxy,
+                    options.drain
+                );
+            }
+            else
             {
-                const auto runner = [ioManager] { ioManager->run(); };
-                auto f1 = std::async(std::launch::async, runner);
-                auto f2 = std::async(std::launch::async, runner);
+                signals.add(SIGINT);
+                signals.add(SIGTERM);
+                signals.async_wait(makeWeakHandler(ioManager.get(), &signalHandler));
+            }
+
+            // Dump per session statistics on demand
+            auto statisticsSignals = objectMaker.make<boost::asio::signal_set>();
+#ifdef SIGUSR1
+            statisticsSignals.add(SIGUSR1);
+            waitForStatisticsSignal(statisticsSignals, natNegProxy);
+#endif
+
+            const auto metricsReporter = Metrics::Reporter::create(objectMaker, options.metrics.reportInterval);
 
-                f1.get();
-                f2.get();
+            auto loadMonitor = std::shared_ptr<LoadMonitor>{};
+            if (options.loadShedding.interval.count() > 0)
+            {
+                loadMonitor = LoadMonitor::create(ioManager, objectMaker, options.loadShedding);
+                loadMonitor->watch("natNegProxy", natNegProxy->getStrand());
+            }
+
+            auto selfProbe = std::shared_ptr<NatNeg::SelfProbe>{};
+            if (options.selfProbe.interval.count() > 0)
+            {
+                selfProbe = NatNeg::SelfProbe::create(objectMaker, natNegProxy, options.selfProbe);
+            }
+
+            auto httpProxy = std::shared_ptr<HTTP::HTTPProxy>{};
+            if (options.httpProxy.port != 0)
+            {
+                httpProxy = HTTP::HTTPProxy::create(objectMaker, options.httpProxy);
+            }
+
+            auto peerchatProxy = std::shared_ptr<TCPForwarder>{};
+            if (options.peerchat.port != 0)
+            {
+                peerchatProxy = TCPForwarder::create(objectMaker, options.peerchat);
+            }
+
+            auto takeoverListener = std::shared_ptr<HotRestart::TakeoverListener>{};
+            if (!options.hotRestart.socketPath.empty())
+            {
+                // Called on the handoff thread, while IOManager keeps running
+                const auto stopAccepting = [httpProxy, peerchatProxy]
+                {
+                    auto closed = std::vector<std::future<void>>{};
+                    if (httpProxy)
+                    {
+                        closed.push_back(httpProxy->stopAccepting());
+                    }
+                    if (peerchatProxy)
+                    {
+                        closed.push_back(peerchatProxy->stopAccepting());
+                    }
+                    for (auto& future : closed)
+                    {
+                        future.wait_for(std::chrono::seconds{ 5 });
+                    }
+                };
+                takeoverListener = HotRestart::TakeoverListener::create
+                (
+                    objectMaker,
+                    ioManager,
+                    natNegProxy,
+                    options.hotRestart.socketPath,
+                    options.drain.timeout,
+                    stopAccepting
+                );
+            }
+
+            auto workers = std::vector<std::future<void>>{};
+            for (auto i = std::size_t{ 0 }; i < ioManager->getWorkerCount(); ++i)
+            {
+                const auto runner = [ioManager, i] { ioManager->runWorker(i); };
+                workers.push_back(std::async(std::launch::async, runner));
+            }
+
+            auto relayThreads = std::vector<std::future<void>>{};
+            const auto& cpus = options.relayThreads.cpus;
+            for (auto i = std::size_t{ 0 }; i < ioManager->getRelayThreadCount(); ++i)
+            {
+                const auto cpu = cpus.empty() ? std::optional<int>{} : cpus[i % cpus.size()];
+                const auto spin = options.relayThreads.spin;
+                const auto relayRunner = [ioManager, i, spin, cpu] { ioManager->runRelay(i, spin, cpu); };
+                relayThreads.push_back(std::async(std::launch::async, relayRunner));
+            }
+
+            for (auto& worker : workers)
+            {
+                worker.get();
+            }
+            for (auto& relayThread : relayThreads)
+            {
+                relayThread.get();
             }
         }
         catch (const std::exception& error)
@@ -73,7 +236,62 @@ int main(int argc, char** argv)
 {
     try
     {
-        CNCOnlineForwarder::run();
+        const auto options = CNCOnlineForwarder::Options::parse(argc, argv);
+        if (!options.has_value())
+        {
+            return 0;
+        }
+        if (!options->replay.path.empty())
+        {
+            CNCOnlineForwarder::Capture::replay(options->replay);
+            return 0;
+        }
+        if (options->benchmark.name == "offload")
+        {
+            CNCOnlineForwarder::Benchmark::runOffloadBenchmark(options->benchmark);
+            return 0;
+        }
+        if (options->benchmark.name == "relay-threads")
+        {
+            CNCOnlineForwarder::Benchmark::runRelayThreadBenchmark(options->benchmark, options->relayThreads);
+            return 0;
+        }
+        if (options->benchmark.name == "allocations")
+        {
+            return CNCOnlineForwarder::Benchmark::runAllocationTest(options->benchmark, options->relayThreads) ? 0 : 1;
+        }
+        if (options->benchmark.name == "micro")
+        {
+            CNCOnlineForwarder::Benchmark::runMicroBenchmark(options->benchmark);
+            return 0;
+        }
+        if (options->benchmark.name == "http")
+        {
+            CNCOnlineForwarder::Benchmark::runHTTPProxyBenchmark(options->benchmark);
+            return 0;
+        }
+        if (options->benchmark.name == "peerchat")
+        {
+            CNCOnlineForwarder::Benchmark::runTCPForwarderBenchmark(options->benchmark);
+            return 0;
+        }
+        if (options->benchmark.name == "scheduler")
+        {
+            CNCOnlineForwarder::Benchmark::runSchedulerBenchmark(options->benchmark, options->executor);
+            return 0;
+        }
+        if (!options->benchmark.name.empty())
+        {
+            throw std::invalid_argument{ "Unknown benchmark " + options->benchmark.name };
+        }
+        CNCOnlineForwarder::run(options.value());
+    }
+    catch (const std::exception& error)
+    {
+        using namespace CNCOnlineForwarder::Logging;
+        std::cerr << error.what() << std::endl;
+        log(Level::fatal) << "Exception: " << error.what();
+        return 1;
     }
     catch (...)
     {
@@ -11,6 +11,9 @@
 #include <array>
 #include <chrono>
 #include <cstdint>
+#include <deque>
+#include <iostream>
+#include <list>
 #include <memory>
 #include <ostream>
 #include <sstream>
@@ -20,6 +23,7 @@
 #include <unordered_set>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 #include <boost/system/error_code.hpp>
 
@@ -38,6 +42,11 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/trim.hpp>
 
+#include <boost/program_options.hpp>
+
 #endif
\ No newline at end of file